@@ -0,0 +1,39 @@
+#ifndef __CHECKSUM_H_
+#define __CHECKSUM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_LEN 32
+
+/* Incremental SHA-256 */
+typedef struct {
+	uint32_t h[8];
+	uint64_t len;
+	uint8_t buf[64];
+} sha256_t;
+
+void sha256_init(sha256_t *ctx);
+void sha256_update(sha256_t *ctx, const void *data, size_t len);
+void sha256_final(sha256_t *ctx, uint8_t digest[SHA256_LEN]);
+
+/* rsync-like rolling checksum of a block of data */
+typedef struct {
+	uint32_t a;
+	uint32_t b;
+	size_t len;
+} rsum_t;
+
+void rsum_init(rsum_t *sum, const uint8_t *data, size_t len);
+/* Slide the block by one byte: drop out, append in */
+static inline void rsum_roll(rsum_t *sum, uint8_t out, uint8_t in)
+{
+	sum->a += in - out;
+	sum->b += sum->a - sum->len * out;
+}
+static inline uint32_t rsum_digest(const rsum_t *sum)
+{
+	return (sum->a & 0xffff) | (sum->b << 16);
+}
+
+#endif /* __CHECKSUM_H_ */
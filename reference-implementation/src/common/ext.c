@@ -0,0 +1,59 @@
+#include "ext.h"
+
+#include <string.h>
+#include <endian.h>
+
+#include "macros.h"
+
+
+int ext_rec_put(char *buf, size_t len, size_t *off, uint8_t type,
+		const void *value, uint8_t vlen)
+{
+	PRECONDITION(*off + 2 + vlen <= len, -1);
+	buf[(*off)++] = type;
+	buf[(*off)++] = vlen;
+	memcpy(&buf[*off], value, vlen);
+	*off += vlen;
+	return 0;
+}
+
+int ext_rec_next(const char *buf, size_t len, size_t *off, ext_rec_t *rec)
+{
+	if (*off >= len)
+		return 0;
+	PRECONDITION(*off + 2 <= len, -1);
+	rec->type = buf[*off];
+	rec->len = buf[*off + 1];
+	PRECONDITION(*off + 2 + rec->len <= len, -1);
+	rec->value = &buf[*off + 2];
+	*off += 2 + rec->len;
+	return 1;
+}
+
+void ext_put_u64(char *buf, uint64_t v)
+{
+	v = htobe64(v);
+	memcpy(buf, &v, sizeof(v));
+}
+
+uint64_t ext_get_u64(const char *buf)
+{
+	uint64_t v;
+
+	memcpy(&v, buf, sizeof(v));
+	return be64toh(v);
+}
+
+void ext_put_u32(char *buf, uint32_t v)
+{
+	v = htobe32(v);
+	memcpy(buf, &v, sizeof(v));
+}
+
+uint32_t ext_get_u32(const char *buf)
+{
+	uint32_t v;
+
+	memcpy(&v, buf, sizeof(v));
+	return be32toh(v);
+}
@@ -0,0 +1,164 @@
+#ifndef __EXT_H_
+#define __EXT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Reference implementation extensions to TRTP.
+ *
+ * Extensions never add metadata to plain TRTP packets. They are negotiated
+ * through the opaque Timestamp field:
+ * - the first DATA packet (#0) of a sender wishing to use some extensions
+ *   carries EXT_OFFER(features) as timestamp;
+ * - a receiver supporting extensions replies with EXT_ACCEPT(features) as
+ *   timestamp of its ACKs, until it receives a packet sent after the offer;
+ * - a plain receiver simply echoes the offer back, in which case the sender
+ *   falls back to plain TRTP.
+ * Once negotiated, the timestamps of DATA packets follow the EXT_DATA_TS
+ * layout, and ACKs echo them back following the EXT_ACK_TS layout. ACKs can
+ * then also carry control records in their payload.
+ *
+ * Plain senders fill their timestamps as they like, so that the magic alone
+ * would be found in one of every 65536 of them. The offers and acceptances
+ * are thus: | magic (16b) | check (5b) | features (11b) |, the check being
+ * derived from the features, and only timestamps matching all of it are taken
+ * for them.
+ */
+
+#define EXT_OFFER_MAGIC 0xf17eU
+#define EXT_ACCEPT_MAGIC 0xac5eU
+
+#define EXT_FEATURE_MASK 0x7ffU
+#define EXT_CHECK(feat) ((((feat) & EXT_FEATURE_MASK) * 0x9e3779b1U) >> 27)
+#define EXT_NEGOTIATION_TS(magic, feat) ((uint32_t)(magic) << 16 |\
+		EXT_CHECK(feat) << 11 | ((feat) & EXT_FEATURE_MASK))
+
+#define EXT_OFFER(feat) EXT_NEGOTIATION_TS(EXT_OFFER_MAGIC, feat)
+#define EXT_ACCEPT(feat) EXT_NEGOTIATION_TS(EXT_ACCEPT_MAGIC, feat)
+#define EXT_FEATURES(ts) ((ts) & EXT_FEATURE_MASK)
+#define EXT_IS_OFFER(ts) ((ts) == EXT_OFFER(EXT_FEATURES(ts)))
+#define EXT_IS_ACCEPT(ts) ((ts) == EXT_ACCEPT(EXT_FEATURES(ts)))
+
+/* Negotiable features */
+#define EXT_DEFLATE (1 << 0) /* Payloads can be part of a deflate stream */
+#define EXT_SPARSE (1 << 1) /* Zero-filled regions are sent as holes */
+#define EXT_DELTA (1 << 2) /* Only send what the receiver's copy lacks */
+#define EXT_RESUME (1 << 3) /* Continue an interrupted transfer */
+#define EXT_PULL (1 << 4) /* The receiver paces the sender with credits */
+#define EXT_ECN (1 << 5) /* ECN congestion marks are echoed in ACK's */
+#define EXT_MUX (1 << 6) /* Several streams share the connection */
+#define EXT_TREE (1 << 7) /* The input is a serialized directory tree */
+#define EXT_SHM (1 << 8) /* The data goes through memory, on the same host */
+#define EXT_STRIPE (1 << 9) /* The input is one stripe of a larger one */
+#define EXT_SIZE (1 << 10) /* The sender tells how large the output will be */
+/* No more features fit in the negotiation timestamps */
+
+/* Features supported by this implementation */
+#define EXT_SUPPORTED (EXT_DEFLATE | EXT_SPARSE | EXT_DELTA | EXT_RESUME |\
+		EXT_PULL | EXT_ECN | EXT_MUX | EXT_TREE | EXT_SHM | EXT_STRIPE |\
+		EXT_SIZE)
+
+/* DATA timestamp: | kind (2b) | stream (6b) | clock (24b) |
+ * Kind 3 is reserved, hence offers can never be mistaken for it. */
+#define EXT_KIND_RAW 0 /* Plain file data */
+#define EXT_KIND_DEFLATE 1 /* Next bytes of the deflate stream */
+#define EXT_KIND_CTRL 2 /* Sequence of control records */
+
+#define EXT_DATA_TS(kind, stream, clock) ((uint32_t)(kind) << 30 |\
+		((uint32_t)(stream) & 0x3f) << 24 | ((clock) & 0xffffff))
+#define EXT_TS_KIND(ts) ((ts) >> 30)
+#define EXT_TS_STREAM(ts) (((ts) >> 24) & 0x3f)
+#define EXT_TS_CLOCK(ts) ((ts) & 0xffffff)
+/* Stream 0 carries the main input, the others have to be opened first */
+#define EXT_MAX_STREAMS 64
+/* With EXT_MUX, the otherwise unused window of DATA packets is the distance
+ * back to the previous packet of the same stream, or 0 if there is none in
+ * the last MAX_WINDOW_SIZE packets. The receiver can write a packet out as
+ * soon as that one is, instead of waiting for the packets of other streams
+ * missing before it. */
+
+/* ACK timestamp: | flags (8b) | echoed clock (24b) |
+ * Flag bit 7 is reserved, hence accepts can never be mistaken for it. */
+#define EXT_ACK_TS(flags, clock) ((uint32_t)((flags) & 0x7f) << 24 |\
+		((clock) & 0xffffff))
+#define EXT_TS_FLAGS(ts) ((ts) >> 24)
+
+/* ACK flags */
+/* The clock is replaced by the number of DATA packets the sender may have
+ * sent so far, #0 included but not counting retransmissions, modulo 2^24.
+ * Until the first such ACK, that number is EXT_PULL_INITIAL. */
+#define EXT_ACK_PULL (1 << 0)
+#define EXT_PULL_INITIAL 8
+/* Bits 1-3: number of received packets marked as congestion experienced,
+ * modulo 8 */
+#define EXT_ACK_CE(count) (((count) & 0x7) << 1)
+#define EXT_ACK_CE_COUNT(flags) (((flags) >> 1) & 0x7)
+/* NACK'ed because of a corrupted payload, rather than truncated */
+#define EXT_ACK_CORRUPT (1 << 4)
+
+/* Control records: | type (1B) | length (1B) | value (length B) |
+ * Integers in values are in network byte-order. */
+#define EXT_REC_HOLE 1 /* u64: skip that many zero bytes of output */
+#define EXT_REC_SIGREQ 2 /* u32: first block whose signature is requested */
+#define EXT_REC_SIGINFO 3 /* u32 block size, u32 block count (in ACK's) */
+#define EXT_REC_SIGS 4 /* u32 first block, then its signatures (in ACK's) */
+#define EXT_REC_COPY 5 /* u32 first block, u32 count: copy receiver blocks */
+#define EXT_REC_DIGEST 6 /* SHA-256 of the whole output */
+/* u64 offset the output resumes from, followed in ACK's by the SHA-256 of the
+ * output up to it */
+#define EXT_REC_RESUME 7
+/* Name of the file the stream of the packet is written to, opening it */
+#define EXT_REC_OPEN 8
+#define EXT_REC_END 9 /* The stream of the packet is complete */
+/* u32 pid, u32 fd, u64 token: memfd of the sender holding the ring which the
+ * rest of the input goes through, see shm.h. In ACK's, u8: whether the
+ * receiver attached to it, the input going on in packets otherwise. */
+#define EXT_REC_SHM 10
+/* u64: bytes of output still to come after the data sent before it */
+#define EXT_REC_SIZE 11
+
+/* Directory tree entry: | type (1B) | mode (4B) | size (8B) |
+ *                       | path length (4B) | path | content (size B) |
+ * Paths are relative to the root of the tree, and directories come before
+ * their entries. Files of all sizes follow each other in the data, hence
+ * small files share packets. */
+#define EXT_TREE_DIR 1
+#define EXT_TREE_FILE 2
+#define EXT_TREE_HDRLEN (1 + 4 + 8 + 4)
+
+/* Stripe header, at the start of the input of each of the connections a
+ * striped transfer is spread over:
+ * | magic (4B) | token (8B) | index (2B) | count (2B) | block size (4B) |
+ * The token is shared by the stripes of the same transfer. Block k of stripe
+ * index holds block k * count + index of the whole input, only the last block
+ * of the whole input being shorter. */
+#define EXT_STRIPE_MAGIC 0x73747270U
+#define EXT_STRIPE_HDRLEN (4 + 8 + 2 + 2 + 4)
+#define EXT_MAX_STRIPES 64
+
+/* Block signature: u32 rolling checksum, truncated SHA-256 */
+#define EXT_STRONG_LEN 8
+#define EXT_SIG_LEN (sizeof(uint32_t) + EXT_STRONG_LEN)
+#define EXT_SIGS_PER_REC ((255 - sizeof(uint32_t)) / EXT_SIG_LEN)
+
+typedef struct {
+	uint8_t type;
+	uint8_t len;
+	const char *value;
+} ext_rec_t;
+
+/* Append a record to buf, of size len, at offset *off, advancing it.
+ * @return: 0 on success, -1 if it does not fit */
+int ext_rec_put(char *buf, size_t len, size_t *off, uint8_t type,
+		const void *value, uint8_t vlen);
+/* Read the record of buf, of size len, at offset *off, advancing it.
+ * @return: 1 if a record was read, 0 at the end of buf, -1 if malformed */
+int ext_rec_next(const char *buf, size_t len, size_t *off, ext_rec_t *rec);
+
+/* Accessors for the integers stored in record values */
+void ext_put_u64(char *buf, uint64_t v);
+uint64_t ext_get_u64(const char *buf);
+void ext_put_u32(char *buf, uint32_t v);
+uint32_t ext_get_u32(const char *buf);
+
+#endif /* __EXT_H_ */
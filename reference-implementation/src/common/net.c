@@ -1,24 +1,36 @@
 #include "net.h"
 
 #include <string.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "macros.h"
 
 
-int net_fd = -1;
+int net_reuseport = 0;
 
-#define MAX_RETRIES 5
+/* ECN codepoints, in the low bits of the traffic class */
+#define ECN_MASK 0x3
+#define ECN_ECT0 0x2
+#define ECN_CE 0x3
 
+/* Datagram handed over by net_accept(), after the address of its sender */
+typedef struct {
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	char data[PKT_MAX_LEN];
+} handoff_t;
 
 net_status_t net_open_socket(const char *__restrict hostname,
-		const char *__restrict port, net_try_addr_cb test_addr)
+		const char *__restrict port, net_try_addr_cb test_addr, int *fd)
 {
-    int fd, err;
+    int sock, err;
     struct addrinfo hints, *addrlist, *addr;
     int enable = 1;
 
@@ -33,23 +45,29 @@ net_status_t net_open_socket(const char *__restrict hostname,
         goto_trace(error, "%s", gai_strerror(err));
     /* Attempt to bind on the first working interface */
     for (addr = addrlist; addr != NULL; addr = addr->ai_next) {
-        fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
-        if (fd == -1)
+        sock = socket(addr->ai_family, addr->ai_socktype,
+                addr->ai_protocol);
+        if (sock == -1)
             continue;
-        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)))
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable,
+                    sizeof(enable)))
             goto_trace(close, "Couldn't enable the re-use of the address ...");
-        if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &enable, sizeof(enable)))
+        if (net_reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable,
+                    sizeof(enable)))
+            goto_trace(close, "Cannot share the port with other sockets");
+        if (setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &enable,
+                    sizeof(enable)))
             goto_trace(close, "Cannot force the socket to IPv6");
-        if (test_addr(fd, addr->ai_addr, addr->ai_addrlen) != -1)
+        if (test_addr(sock, addr->ai_addr, addr->ai_addrlen) != -1)
             break; /* Success ! */
 close:
-            close(fd); /* Try another one*/
+            close(sock); /* Try another one*/
     }
     freeaddrinfo(addrlist);
     if (!addr)
         goto_trace(error, "Could find any address for the given hostname!");
 
-	net_fd = fd;
+    *fd = sock;
     return NET_OK;
 
 error:
@@ -57,19 +75,91 @@ error:
 
 }
 
-void net_close_socket()
+int net_peer_is_local(int fd)
 {
-	if (net_fd >= 0)
-		close(net_fd);
+	struct sockaddr_in6 self, peer;
+	socklen_t len = sizeof(self), plen = sizeof(peer);
+
+	if (getsockname(fd, (struct sockaddr*)&self, &len) ||
+			getpeername(fd, (struct sockaddr*)&peer, &plen) ||
+			peer.sin6_family != AF_INET6)
+		return 0;
+	/* Packets to one of our own addresses leave from it */
+	return IN6_IS_ADDR_LOOPBACK(&peer.sin6_addr) ||
+		!memcmp(&self.sin6_addr, &peer.sin6_addr, sizeof(peer.sin6_addr));
+}
+
+net_status_t net_ecn_mark(int fd)
+{
+	int tclass = ECN_ECT0;
+
+	if (setsockopt(fd, IPPROTO_IPV6, IPV6_TCLASS, &tclass, sizeof(tclass)))
+		goto_trace(fail, "Cannot mark the packets as ECN-capable: %s",
+				strerror(errno));
+	return NET_OK;
+
+fail:
+	return NET_ERROR;
+}
+
+net_status_t net_ecn_watch(int fd)
+{
+	int enable = 1;
+
+	if (setsockopt(fd, IPPROTO_IPV6, IPV6_RECVTCLASS, &enable,
+				sizeof(enable)))
+		goto_trace(fail, "Cannot receive the traffic class of the packets: %s",
+				strerror(errno));
+	return NET_OK;
+
+fail:
+	return NET_ERROR;
 }
 
-PRIVATE net_status_t net_recvfrom(pkt_t *rbuf, void *addr, socklen_t *addrlen)
+/* Count the packet in ce_count if the network marked it as congestion
+ * experienced */
+PRIVATE void net_check_ecn(struct msghdr *msg, unsigned int *ce_count)
 {
+	struct cmsghdr *cmsg;
+	int tclass;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != IPPROTO_IPV6 || cmsg->cmsg_type != IPV6_TCLASS)
+			continue;
+		memcpy(&tclass, CMSG_DATA(cmsg), sizeof(tclass));
+		if ((tclass & ECN_MASK) == ECN_CE)
+			++*ce_count;
+	}
+}
+
+PRIVATE net_status_t net_recvfrom(int fd, pkt_t *rbuf, void *addr,
+		socklen_t *addrlen, unsigned int *ce_count)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = {
+		.iov_base = rbuf,
+		.iov_len = sizeof(*rbuf),
+	};
+	struct msghdr msg = {
+		.msg_name = addr,
+		.msg_namelen = addrlen ? *addrlen : 0,
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
 	ssize_t rlen;
+	int err;
 
-	if ((rlen = recvfrom(net_fd, rbuf, sizeof(*rbuf), 0, addr, addrlen)) == -1)
+	if ((rlen = recvmsg(fd, &msg, 0)) == -1)
 		goto_trace(rx_err, "Failed to receive a packet: %s", strerror(errno));
-	if (pkt_decode_inline(rbuf, rlen) != PKT_OK)
+	if (addrlen)
+		*addrlen = msg.msg_namelen;
+	if (ce_count)
+		net_check_ecn(&msg, ce_count);
+	if ((err = pkt_decode_inline(rbuf, rlen)) == E_CRC2)
+		return NET_CORRUPT;
+	if (err != PKT_OK)
 		goto drop;
 	return NET_OK;
 
@@ -79,59 +169,116 @@ drop:
 	return NET_DROP;
 }
 
-net_status_t net_recv_pkt(pkt_t *rbuf, uint8_t expected_seq,
-		uint8_t win_size)
+net_status_t net_recv_from(int fd, pkt_t *rbuf, struct sockaddr *addr,
+		socklen_t *addrlen)
+{
+	return net_recvfrom(fd, rbuf, addr, addrlen, NULL);
+}
+
+/* Send the packets waiting on the socket fd to handoff, but for the ones of
+ * the peer at addr */
+PRIVATE void hand_over(int fd, int handoff, const struct sockaddr *addr,
+		socklen_t addrlen)
+{
+	handoff_t h;
+	ssize_t len;
+
+	for (;;) {
+		h.addrlen = sizeof(h.addr);
+		if ((len = recvfrom(fd, h.data, sizeof(h.data), MSG_DONTWAIT,
+						(struct sockaddr*)&h.addr, &h.addrlen)) == -1)
+			break;
+		/* Ours only sends its first packet again until answered */
+		if ((h.addrlen == addrlen && !memcmp(&h.addr, addr, addrlen)) ||
+				handoff == -1)
+			continue;
+		if (send(handoff, &h, offsetof(handoff_t, data) + len,
+					MSG_DONTWAIT) == -1)
+			ERROR("Cannot hand over the packet of another peer: %s",
+					strerror(errno));
+	}
+}
+
+net_status_t net_accept(const char *hostname, const char *port,
+		const struct sockaddr *addr, socklen_t addrlen, int handoff, int *fd)
+{
+	/* Get our own socket, which receives the packets of the peer once
+	 * connected to it */
+	close(*fd);
+	*fd = -1;
+	if (net_open_socket(hostname, port, &bind, fd) != NET_OK)
+		goto fail;
+	if (connect(*fd, addr, addrlen))
+		goto_trace(fail, "Could not connect the socket to the remote "
+				"endpoint: %s", strerror(errno));
+	/* Until then, the socket received the packets of any peer */
+	hand_over(*fd, handoff, addr, addrlen);
+	return NET_OK;
+
+fail:
+	return NET_ERROR;
+}
+
+net_status_t net_recv_pkt(int fd, pkt_t *rbuf, uint8_t expected_seq,
+		uint8_t win_size, unsigned int *ce_count)
 {
 	int err;
 
-	if ((err = net_recvfrom(rbuf, NULL, NULL)) != NET_OK)
+	if ((err = net_recvfrom(fd, rbuf, NULL, NULL, ce_count)) != NET_OK &&
+			err != NET_CORRUPT)
 		return err;
     if ((uint8_t)(rbuf->seq - expected_seq) > win_size)
         goto_trace(drop, "Dropping out of window packet [rcv: %u, expect: %u"
 				", winsize: %u]", rbuf->seq, expected_seq, win_size);
-    LOG("< #%u", rbuf->seq);
-    return NET_OK;
+    LOG("< #%u%s", rbuf->seq, err == NET_CORRUPT ? " [corrupted]" : "");
+    return err;
 
 drop:
     return NET_DROP;
 }
-/* Wait to receive a packet with the given expected sequence number,
- * and connect to it */
-net_status_t net_wait_and_connect(pkt_t *rbuf, uint8_t expect_seq)
+
+net_status_t net_recv_handoff(int fd, pkt_t *rbuf, struct sockaddr *addr,
+		socklen_t *addrlen)
 {
-	struct sockaddr_storage addr = {0};
-	socklen_t addr_len = sizeof(addr_len);
-	int retry_count = 0, err;
+	handoff_t h;
+	ssize_t len;
+	int err;
 
-	LOG("Waiting to receive data #%u from the remote endpoint", expect_seq);
-	for (;;) {
-		++retry_count;
-		if (retry_count > MAX_RETRIES)
-			goto_trace(fail, "Giving up after %d retries", MAX_RETRIES);
-		if ((err = net_recvfrom(rbuf, &addr, &addr_len)) != NET_OK)
-			if (err == NET_DROP)
-				continue; /* retry ... */
-			else
-				goto_trace(fail, "I/O error");
-		else if (rbuf->seq != expect_seq)
-			trace_error("Ignoring packet with seqnum #%u != expected:%u",
-					rbuf->seq, expect_seq);
-		else {
-			char host[NI_MAXHOST], port[NI_MAXSERV];
-			const struct sockaddr *sock_addr = (const struct sockaddr*)&addr;
-			/* We ignore the return value as we're fine with numeric hostname
-			 * if the reverse-dns query fails */
-			if ((err = getnameinfo(sock_addr, addr_len, host, sizeof(host),
-							port, sizeof(port), NI_NUMERICSERV)))
-				ERROR("Could not resolve the peer address: %s",
-						gai_strerror(err));
-			LOG("Received data #%u from [%s]:%s", expect_seq, host, port);
-			if (connect(net_fd, sock_addr, addr_len))
-				goto_trace(fail, "Could not connect the socket to the remote "
-						"endpoint: %s", strerror(errno));
-			break;
-		}
-	}
+	if ((len = recv(fd, &h, sizeof(h), 0)) == -1)
+		goto_trace(fail, "Failed to receive a packet: %s", strerror(errno));
+	if ((size_t)len < offsetof(handoff_t, data) || h.addrlen > *addrlen)
+		goto drop;
+	memcpy(addr, &h.addr, h.addrlen);
+	*addrlen = h.addrlen;
+	len -= offsetof(handoff_t, data);
+	memcpy(rbuf, h.data, len);
+	if ((err = pkt_decode_inline(rbuf, len)) == E_CRC2)
+		return NET_CORRUPT;
+	if (err != PKT_OK)
+		goto drop;
+	return NET_OK;
+
+fail:
+	return NET_ERROR;
+drop:
+	return NET_DROP;
+}
+net_status_t net_connect_peer(int fd, const struct sockaddr *addr,
+		socklen_t addrlen)
+{
+	char host[NI_MAXHOST], port[NI_MAXSERV];
+	int err;
+
+	/* Stick to the numeric address, as a reverse-dns query could block for
+	 * seconds */
+	if ((err = getnameinfo(addr, addrlen, host, sizeof(host), port,
+					sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV)))
+		ERROR("Could not resolve the peer address: %s", gai_strerror(err));
+	else
+		LOG("Received data from [%s]:%s", host, port);
+	if (connect(fd, addr, addrlen))
+		goto_trace(fail, "Could not connect the socket to the remote "
+				"endpoint: %s", strerror(errno));
 	return NET_OK;
 
 fail:
@@ -146,12 +293,35 @@ static inline size_t pkt_len_serial(const pkt_t *pkt)
 	return PKT_HEADERLEN;
 }
 
-net_status_t net_send(const pkt_t *pkt)
+net_status_t net_send(int fd, const pkt_t *pkt)
 {
 	/* Recover the serialized packet length */
 	int plen = pkt_len_serial(pkt);
 	/* Assumes we called a connect on the socket at some point */
-	if (write(net_fd, pkt, plen) != plen) {
+	if (write(fd, pkt, plen) != plen) {
+		trace_error("Cannot send packet #%u: %s", pkt->seq, strerror(errno));
+		return NET_ERROR;
+	}
+	LOG("> #%u", pkt->seq);
+	return NET_OK;
+}
+
+net_status_t net_send_external(int fd, const pkt_t *pkt, const char *payload)
+{
+	size_t len = ntohs(pkt->length);
+	struct iovec iov[] = {
+		{ .iov_base = (void*)pkt, .iov_len = PKT_HEADERLEN },
+		{ .iov_base = (void*)payload, .iov_len = len },
+		{ .iov_base = (char*)pkt + PKT_HEADERLEN + len,
+			.iov_len = PKT_FOOTERLEN },
+	};
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = len ? 3 : 1 };
+	ssize_t plen = pkt_len_serial(pkt);
+
+	/* The payload is only copied once, into the socket buffer. Not even
+	 * that with MSG_ZEROCOPY, but its completions cost more than copying
+	 * payloads this small. */
+	if (sendmsg(fd, &msg, 0) != plen) {
 		trace_error("Cannot send packet #%u: %s", pkt->seq, strerror(errno));
 		return NET_ERROR;
 	}
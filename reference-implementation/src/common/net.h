@@ -6,12 +6,15 @@
 
 #include "packet_interface.h"
 
-extern int net_fd;
+/* Whether the sockets opened share their port with the other ones doing so,
+ * the kernel spreading the peers among them */
+extern int net_reuseport;
 
 typedef enum {
 	NET_OK,
 	NET_ERROR,
-	NET_DROP
+	NET_DROP,
+	NET_CORRUPT /* Only the header of the packet is valid */
 } net_status_t;
 
 /* return -1 if the combination of socket/address is not suited for the task */
@@ -21,23 +24,48 @@ typedef int (*net_try_addr_cb)(int socket,
 /* Typical examples: bind, connect */
 
 /* Open a socket for the desired hostname and port, calls test_addr to check if
- * the current address is suited for the usage of the socket */
+ * the current address is suited for the usage of the socket, and store it in
+ * fd */
 net_status_t net_open_socket(const char *__restrict hostname,
-		const char *__restrict port, net_try_addr_cb test_addr);
+		const char *__restrict port, net_try_addr_cb test_addr, int *fd);
 
-/* Cleanup the net subsystem */
-void net_close_socket();
+/* Receive a packet on fd, checking if its in window, non-corrupted. In-window
+ * DATA packets with a corrupted payload are reported as NET_CORRUPT.
+ * ce_count, if not NULL, counts the packets the network marked as congestion
+ * experienced, once net_ecn_watch() has been called. */
+net_status_t net_recv_pkt(int fd, pkt_t *, uint8_t expected_seq,
+		uint8_t win_size, unsigned int *ce_count);
+/* Connect fd to the peer at addr, which sent us its first packet */
+net_status_t net_connect_peer(int fd, const struct sockaddr *addr,
+		socklen_t addrlen);
 
-/* Receive a packet, checking if its in window, non-corrupted
- */
-net_status_t net_recv_pkt(pkt_t *, uint8_t expected_seq,
-		uint8_t win_size);
-/* Wait to receive a packet with the given expected sequence number,
- * and connect to it */
-net_status_t net_wait_and_connect(pkt_t*, uint8_t);
+/* Receive a packet on fd from any peer, whose address is stored in addr */
+net_status_t net_recv_from(int fd, pkt_t *, struct sockaddr *addr,
+		socklen_t *addrlen);
+/* Replace the socket fd by a new one, bound to the same hostname and port,
+ * and connected to the peer at addr. The packets of other peers the new
+ * socket received before it was connected are sent to the datagram socket
+ * handoff, if not -1, instead of being lost. */
+net_status_t net_accept(const char *hostname, const char *port,
+		const struct sockaddr *addr, socklen_t addrlen, int handoff, int *fd);
+/* Receive a packet handed over to fd by net_accept(), from the peer whose
+ * address is stored in addr */
+net_status_t net_recv_handoff(int fd, pkt_t *rbuf, struct sockaddr *addr,
+		socklen_t *addrlen);
+
+/* Whether the peer the socket fd is connected to is on this host */
+int net_peer_is_local(int fd);
+
+/* Mark the packets we send on fd as ECN-capable */
+net_status_t net_ecn_mark(int fd);
+/* Start watching the ECN marks of the packets we receive on fd */
+net_status_t net_ecn_watch(int fd);
 
 /* Send a packet through the given file descriptor -- The packet must be
  * in wire format */
-net_status_t net_send(const pkt_t *pkt);
+net_status_t net_send(int fd, const pkt_t *pkt);
+/* Send a packet encoded with pkt_encode_external(), gathering its payload
+ * from where it lies */
+net_status_t net_send_external(int fd, const pkt_t *pkt, const char *payload);
 
 #endif
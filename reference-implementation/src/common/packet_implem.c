@@ -88,13 +88,27 @@ pkt_status_code pkt_decode_inline(pkt_t *pkt, size_t rlen)
 					/* Check CRC2 */
 					crc2 = ntohl(*(uint32_t*)&((char *)pkt)[rlen - PKT_FOOTERLEN]);
 					computed_crc2 = crc_of((const char *)pkt->payload, payload_len);
-					VALIDIF(crc2 == computed_crc2, E_CRC, "[CRC2: computed: %u, found: %u]",
+					/* The header can still be trusted */
+					VALIDIF(crc2 == computed_crc2, E_CRC2,
+							"[CRC2: computed: %u, found: %u]",
 							computed_crc2, crc2);
 					pkt->crc2 = crc2;
 				}
 				break;
 			}
 		case PTYPE_ACK:
+			/* Extended receivers can send control records in their ACK's */
+			if (payload_len || plen) {
+				VALIDIF(plen == payload_len, E_UNCONSISTENT,
+						"[PTYPE_ACK, computed length: %lu, found: %lu, "
+						"read: %lu]", payload_len, plen, rlen);
+				crc2 = ntohl(*(uint32_t*)&((char *)pkt)[rlen - PKT_FOOTERLEN]);
+				computed_crc2 = crc_of((const char *)pkt->payload, payload_len);
+				VALIDIF(crc2 == computed_crc2, E_CRC,
+						"[CRC2: computed: %u, found: %u]", computed_crc2, crc2);
+				pkt->crc2 = crc2;
+				break;
+			}
 			/* Fallthrough */
 		case PTYPE_NACK:
 			/* Fallthrough */
@@ -123,10 +137,28 @@ pkt_status_code pkt_encode(const pkt_t* pkt, char *buf, size_t *len)
 
 pkt_status_code pkt_encode_inline(pkt_t* pkt)
 {
-	uint32_t *crc1, *crc2;
+	return pkt_encode_external(pkt, pkt->payload);
+}
+
+pkt_status_code pkt_encode_external(pkt_t* pkt, const char *payload)
+{
+	uint32_t *crc2;
 	size_t plen = pkt->length;
-	int offset1 = PKT_HEADERLEN - PKT_CRC1LEN;
 	int offset2 = PKT_HEADERLEN + pkt->length;
+
+	pkt_encode_header(pkt);
+	if (plen) {
+		/* Set CRC2 value */
+		crc2 = (uint32_t*)&((char *)pkt)[offset2];
+		*crc2 = htonl(crc_of(payload, plen));
+	}
+	return PKT_OK;
+}
+
+pkt_status_code pkt_encode_header(pkt_t* pkt)
+{
+	uint32_t *crc1;
+	int offset1 = PKT_HEADERLEN - PKT_CRC1LEN;
 	/* Correct endianness of the length field */
 	pkt->length = htons(pkt->length);
 	/* Set CRC1 value on pseudo-header */
@@ -135,11 +167,6 @@ pkt_status_code pkt_encode_inline(pkt_t* pkt)
 	crc1 = (uint32_t*)&((char *)pkt)[offset1];
 	*crc1 = htonl(crc_of((const char *)pkt, offset1));
 	pkt->tr = tr;
-	if (plen) {
-		/* Set CRC2 value */
-		crc2 = (uint32_t*)&((char *)pkt)[offset2];
-		*crc2 = htonl(crc_of((const char *)pkt->payload, plen));
-	}
 	return PKT_OK;
 }
 
@@ -239,6 +266,8 @@ const char* pkt_err_code(pkt_status_code code)
 			return "[E_NOHEADER] Packet has no header";
 		case E_UNCONSISTENT:
 			return "[E_UNCONSISTENT] Packet is unconsistent";
+		case E_CRC2:
+			return "[E_CRC2] Invalid payload crc";
 		default:
 			return "Unknown Error ...";
 	}
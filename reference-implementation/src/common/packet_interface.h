@@ -39,6 +39,7 @@ typedef enum {
 	E_NOMEM,        /* Pas assez de mémoire */
 	E_NOHEADER,     /* Le paquet n'a pas de header (trop court) */
 	E_UNCONSISTENT, /* Le paquet est incohérent */
+	E_CRC2,         /* Payload corrompu, mais en-tête valide */
 } pkt_status_code;
 
 /* Alloue et initialise une struct pkt
@@ -147,6 +148,11 @@ struct __attribute__((__packed__)) pkt {
 pkt_status_code pkt_decode_inline(pkt_t *pkt, size_t rlen);
 /* Encode the packet, i.e. set all fields to their wire values */
 pkt_status_code pkt_encode_inline(pkt_t *pkt);
+/* Encode the packet whose payload lies at payload instead of in pkt. CRC2 is
+ * still stored in pkt, right after the length of the payload. */
+pkt_status_code pkt_encode_external(pkt_t *pkt, const char *payload);
+/* Encode the header of the packet, leaving its CRC2 as it is */
+pkt_status_code pkt_encode_header(pkt_t *pkt);
 
 /* Translates a status code to an human-readable string */
 const char* pkt_err_code(pkt_status_code code);
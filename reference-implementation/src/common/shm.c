@@ -0,0 +1,220 @@
+#include "shm.h"
+
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "macros.h"
+#include "ext.h"
+
+#define SHM_MAGIC 0x7472747073686d31ULL
+/* The data starts on the page following the header */
+#define RING_OFFSET 4096
+#define RING_DATA (4 << 20)
+#define RING_LEN (RING_OFFSET + RING_DATA)
+/* Largest read or write at once, so that the other side starts early */
+#define MAX_IO (256 << 10)
+/* How long to sleep before checking that the other side is alive (ms) */
+#define WAIT_INTERVAL 100
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_SEQ_CST)
+
+
+typedef struct {
+	uint64_t magic;
+	uint64_t token;
+	uint64_t head; /* Bytes written by the sender */
+	uint64_t tail; /* Bytes consumed by the receiver */
+	int32_t sender;
+	int32_t receiver; /* 0 until it attached */
+	uint32_t eof; /* Whether head covers the whole input */
+	uint32_t written; /* Futex, bumped when head or eof change */
+	uint32_t consumed; /* Futex, bumped when tail changes */
+} ring_t;
+
+PRIVATE ring_t *ring;
+PRIVATE int ring_fd = -1;
+
+PRIVATE char *ring_data()
+{
+	return (char*)ring + RING_OFFSET;
+}
+
+PRIVATE void shm_wake(uint32_t *futex)
+{
+	__atomic_add_fetch(futex, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Sleep until futex is no longer val, or for a while.
+ * @return: 0 on success, -1 if the process peer is gone */
+PRIVATE int shm_sleep(uint32_t *futex, uint32_t val, pid_t peer)
+{
+	struct timespec ts = {
+		.tv_sec = 0,
+		.tv_nsec = WAIT_INTERVAL * 1000000L,
+	};
+
+	if (syscall(SYS_futex, futex, FUTEX_WAIT, val, &ts, NULL, 0) == -1 &&
+			errno == ETIMEDOUT && kill(peer, 0) == -1 && errno == ESRCH)
+		goto_trace(fail, "The other end of the shared memory is gone");
+	return 0;
+
+fail:
+	return -1;
+}
+
+int shm_create(char *rec)
+{
+	if ((ring_fd = memfd_create("trtp", MFD_CLOEXEC)) == -1 ||
+			ftruncate(ring_fd, RING_LEN))
+		goto_errno(fail);
+	if ((ring = mmap(NULL, RING_LEN, PROT_READ | PROT_WRITE, MAP_SHARED,
+					ring_fd, 0)) == MAP_FAILED) {
+		ring = NULL;
+		goto_errno(fail);
+	}
+	/* Only the receiver may attach, not whoever reuses our pid */
+	if (getrandom(&ring->token, sizeof(ring->token), 0) !=
+			sizeof(ring->token))
+		goto_errno(fail);
+	ring->magic = SHM_MAGIC;
+	ring->sender = getpid();
+	ext_put_u32(rec, ring->sender);
+	ext_put_u32(rec + sizeof(uint32_t), ring_fd);
+	ext_put_u64(rec + 2 * sizeof(uint32_t), ring->token);
+	return 0;
+
+fail:
+	shm_free();
+	return -1;
+}
+
+int shm_attach(const char *rec, size_t len)
+{
+	char path[sizeof("/proc//fd/") + 2 * 10];
+	struct stat st;
+
+	if (len != SHM_RECLEN)
+		goto_trace(fail, "Malformed shared memory record");
+	sprintf(path, "/proc/%u/fd/%u", ext_get_u32(rec),
+			ext_get_u32(rec + sizeof(uint32_t)));
+	if ((ring_fd = open(path, O_RDWR | O_CLOEXEC)) == -1 || fstat(ring_fd, &st))
+		goto_trace(fail, "Cannot open the memory of the sender: %s",
+				strerror(errno));
+	if (st.st_size != RING_LEN)
+		goto_trace(fail, "%s is not the memory of the sender", path);
+	if ((ring = mmap(NULL, RING_LEN, PROT_READ | PROT_WRITE, MAP_SHARED,
+					ring_fd, 0)) == MAP_FAILED) {
+		ring = NULL;
+		goto_errno(fail);
+	}
+	if (ring->magic != SHM_MAGIC ||
+			ring->token != ext_get_u64(rec + 2 * sizeof(uint32_t)))
+		goto_trace(fail, "%s is not the memory of the sender", path);
+	STORE(ring->receiver, getpid());
+	LOG("Receiving the rest of the input through shared memory");
+	return 0;
+
+fail:
+	shm_free();
+	return -1;
+}
+
+int shm_attached()
+{
+	return ring && LOAD(ring->receiver) != 0;
+}
+
+void shm_free()
+{
+	if (ring)
+		munmap(ring, RING_LEN);
+	if (ring_fd != -1)
+		close(ring_fd);
+	ring = NULL;
+	ring_fd = -1;
+}
+
+int shm_send(ssize_t (*rd)(int fd, void *buf, size_t len), int fd)
+{
+	uint64_t head = ring->head, room, off;
+	uint32_t seq;
+	ssize_t len;
+
+	LOG("Sending the rest of the input through shared memory");
+	for (;;) {
+		seq = LOAD(ring->consumed);
+		if (!(room = RING_DATA - (head - LOAD(ring->tail)))) {
+			if (shm_sleep(&ring->consumed, seq, ring->receiver))
+				goto fail;
+			continue;
+		}
+		/* Read straight into the ring */
+		off = head % RING_DATA;
+		if (room > RING_DATA - off)
+			room = RING_DATA - off;
+		if (room > MAX_IO)
+			room = MAX_IO;
+		if ((len = rd(fd, ring_data() + off, room)) == -1)
+			goto_trace(fail, "Cannot read the input: %s", strerror(errno));
+		if (!len)
+			break;
+		head += len;
+		STORE(ring->head, head);
+		shm_wake(&ring->written);
+	}
+	STORE(ring->eof, 1);
+	shm_wake(&ring->written);
+	/* The end of the transfer is sent in a packet, after all the data */
+	while (seq = LOAD(ring->consumed), LOAD(ring->tail) != head)
+		if (shm_sleep(&ring->consumed, seq, ring->receiver))
+			goto fail;
+	LOG("Sent %lub through shared memory", head);
+	return 0;
+
+fail:
+	return -1;
+}
+
+int shm_receive(int (*wr)(int fd, const void *buf, size_t len), int fd)
+{
+	uint64_t tail = ring->tail, avail, off;
+	uint32_t seq, eof;
+
+	for (;;) {
+		seq = LOAD(ring->written);
+		/* head is final once eof is set */
+		eof = LOAD(ring->eof);
+		if (!(avail = LOAD(ring->head) - tail)) {
+			if (eof)
+				break;
+			if (shm_sleep(&ring->written, seq, ring->sender))
+				goto fail;
+			continue;
+		}
+		off = tail % RING_DATA;
+		if (avail > RING_DATA - off)
+			avail = RING_DATA - off;
+		if (avail > MAX_IO)
+			avail = MAX_IO;
+		if (wr(fd, ring_data() + off, avail))
+			goto_trace(fail, "Cannot write the output: %s", strerror(errno));
+		tail += avail;
+		STORE(ring->tail, tail);
+		shm_wake(&ring->consumed);
+	}
+	LOG("Received %lub through shared memory", tail);
+	return 0;
+
+fail:
+	return -1;
+}
@@ -0,0 +1,38 @@
+#ifndef __SHM_H_
+#define __SHM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Ring of bytes in memory shared by a sender and a receiver on the same host,
+ * through which the rest of the input goes once both agreed on EXT_SHM. The
+ * sender creates it in a memfd, and the receiver maps that memfd through
+ * /proc/<pid>/fd/<fd>, checking that it holds the token announced in the
+ * EXT_REC_SHM record. Each side sleeps on a futex in the ring while the other
+ * one has yet to write or consume data, checking that it is still alive.
+ * Memory being reliable, nothing is acknowledged or retransmitted. */
+
+/* Length of the value of EXT_REC_SHM records in DATA packets */
+#define SHM_RECLEN (2 * sizeof(uint32_t) + sizeof(uint64_t))
+
+/* Create the ring, writing the value of the record announcing it to rec.
+ * @return: 0 on success, -1 on error */
+int shm_create(char *rec);
+/* Map the ring announced by the len bytes of rec.
+ * @return: 0 on success, -1 on error */
+int shm_attach(const char *rec, size_t len);
+/* Whether the receiver mapped the ring */
+int shm_attached();
+void shm_free();
+
+/* Write the input read from fd by rd to the ring, until its end, then wait
+ * for the receiver to consume all of it.
+ * @return: 0 on success, -1 on error */
+int shm_send(ssize_t (*rd)(int fd, void *buf, size_t len), int fd);
+/* Consume the ring, writing its data to fd with wr, until the sender reaches
+ * the end of its input.
+ * @return: 0 on success, -1 on error */
+int shm_receive(int (*wr)(int fd, const void *buf, size_t len), int fd);
+
+#endif /* __SHM_H_ */
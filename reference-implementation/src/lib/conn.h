@@ -0,0 +1,55 @@
+#ifndef __CONN_H_
+#define __CONN_H_
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "trtp.h"
+
+/* How trtp.c drives either side of a connection, which only the sides know
+ * the state of. The side not matching the direction leaves send() and
+ * shutdown(), or recv(), NULL. */
+typedef struct {
+	/* Same semantics as trtp_send(), trtp_shutdown() and trtp_recv() */
+	ssize_t (*send)(void *side, const void *buf, size_t len);
+	void (*shutdown)(void *side);
+	ssize_t (*recv)(void *side, void *buf, size_t len);
+	/* Socket of the connection */
+	int (*fd)(const void *side);
+	/* Process the packets waiting on the socket */
+	void (*socket)(void *side);
+	/* Fire the timers which expired, and the time left until the next one,
+	 * in ms, or -1 */
+	void (*timeout)(void *side);
+	int (*deadline)(const void *side);
+	/* TRTP_RUNNING, 0 or -1 */
+	int (*result)(const void *side);
+	void (*free)(void *side);
+} conn_ops_t;
+
+struct trtp {
+	const conn_ops_t *ops;
+	void *side;
+	/* Whether the data is complete, after trtp_shutdown(), or trtp_recv()
+	 * returned 0 */
+	int done;
+};
+
+/* Wrap side into a connection, for trtp_connect() and trtp_accept(). The
+ * sides are linked on their own, and cannot call into trtp.c.
+ * @return: the connection, NULL on error, side being freed */
+static inline trtp_t *conn_new(const conn_ops_t *ops, void *side)
+{
+	trtp_t *conn;
+
+	if (!(conn = malloc(sizeof(*conn)))) {
+		ops->free(side);
+		return NULL;
+	}
+	conn->ops = ops;
+	conn->side = side;
+	conn->done = 0;
+	return conn;
+}
+
+#endif /* __CONN_H_ */
@@ -0,0 +1,87 @@
+#include "trtp.h"
+
+#include <stdlib.h>
+#include <poll.h>
+
+#include "../common/macros.h"
+#include "conn.h"
+
+/* trtp_connect() and trtp_accept() are defined by each side, with the rest
+ * of its state */
+
+ssize_t trtp_send(trtp_t *conn, const void *buf, size_t len)
+{
+	if (!conn->ops->send || conn->done) {
+		errno = EBADF;
+		return -1;
+	}
+	/* The ACK's waiting may have made room */
+	conn->ops->socket(conn->side);
+	return conn->ops->send(conn->side, buf, len);
+}
+
+int trtp_shutdown(trtp_t *conn)
+{
+	if (!conn->ops->shutdown || conn->done) {
+		errno = EBADF;
+		return -1;
+	}
+	conn->ops->shutdown(conn->side);
+	conn->done = 1;
+	return 0;
+}
+
+ssize_t trtp_recv(trtp_t *conn, void *buf, size_t len)
+{
+	ssize_t n;
+
+	if (!conn->ops->recv) {
+		errno = EBADF;
+		return -1;
+	}
+	/* The packets waiting may hold more data */
+	conn->ops->socket(conn->side);
+	if (!(n = conn->ops->recv(conn->side, buf, len)) && len)
+		conn->done = 1;
+	return n;
+}
+
+int trtp_fd(const trtp_t *conn)
+{
+	return conn->ops->fd(conn->side);
+}
+
+int trtp_deadline(const trtp_t *conn)
+{
+	return conn->ops->deadline(conn->side);
+}
+
+void trtp_timeout(trtp_t *conn)
+{
+	conn->ops->socket(conn->side);
+	conn->ops->timeout(conn->side);
+}
+
+int trtp_result(const trtp_t *conn)
+{
+	return conn->ops->result(conn->side);
+}
+
+int trtp_close(trtp_t *conn)
+{
+	struct pollfd pfd = { .fd = trtp_fd(conn), .events = POLLIN };
+	int result = -1;
+
+	/* Only wait for the transfer once its data is complete, otherwise it is
+	 * aborted */
+	while (conn->done && (result = trtp_result(conn)) == TRTP_RUNNING) {
+		if (poll(&pfd, 1, trtp_deadline(conn)) == -1 && errno != EINTR)
+			break;
+		trtp_timeout(conn);
+	}
+	if (result == TRTP_RUNNING)
+		result = -1;
+	conn->ops->free(conn->side);
+	free(conn);
+	return result;
+}
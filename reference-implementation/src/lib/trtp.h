@@ -0,0 +1,112 @@
+#ifndef __TRTP_H_
+#define __TRTP_H_
+
+#include <sys/types.h>
+
+/* Library to embed TRTP transfers in a program, built as libtrtp.a and
+ * libtrtp.so.
+ * Each connection is an object holding the socket, the windows and the timers
+ * of its transfer, so that any number of them can run at once. None of the
+ * calls on a connection block, but for trtp_close(): the program drives the
+ * protocol from its own event loop, polling trtp_fd() for POLLIN with
+ * trtp_deadline() as timeout, and calling trtp_timeout() whenever either
+ * fires. trtp_send() and trtp_recv() also process the packets waiting on the
+ * socket. The data only goes through the buffers of the program: the options
+ * acting on files, like sparse or local transfers, are ignored.
+ * The timeouts of the protocol are fixed: the sender gives up after 20s
+ * without news from the receiver, the receiver after 10s of silence from its
+ * sender, but trtp_accept() waits for a sender for as long as it takes.
+ * Programs bound any wait with timers of their own, and abort the transfer
+ * with trtp_close(). */
+
+#define TRTP_COMPRESS_OFF (-2)
+
+typedef struct {
+	/* zlib compression level of the data sent, or TRTP_COMPRESS_OFF */
+	int compress;
+	/* Whether to send the zero-filled regions of the data as holes */
+	int sparse;
+	/* Whether to let the receiver pace the transfer */
+	int pull;
+	/* Whether to slow down on ECN congestion marks */
+	int ecn;
+	/* Whether to pass the data through shared memory to a receiver on the
+	 * same host */
+	int local;
+	/* Whether to send a regular input straight from its pages in the page
+	 * cache. It must then be neither truncated nor rewritten until the
+	 * transfer is over. */
+	int mapped;
+	/* Slots of the send buffer, or largest window announced by the receiver,
+	 * 0 for the default */
+	unsigned int window;
+	/* File caching the parameters of the paths towards the receivers, or
+	 * NULL */
+	const char *path_cache;
+} trtp_options_t;
+
+/* Defaults of the options, as used by the sender and receiver */
+#define TRTP_OPTIONS_INIT { .compress = TRTP_COMPRESS_OFF, .local = 1 }
+
+typedef struct trtp trtp_t;
+
+/* The transfers of the sender and receiver, which block the calling process
+ * until they are over. The features of the binaries acting on the files,
+ * like delta transfers or multiplexed streams, keep their state in globals,
+ * so that only one transfer using them may run at a time in a process. */
+
+/* Send the data read from input to the receiver at host:port.
+ * @return: 0 on success */
+int trtp_send_fd(const char *host, const char *port,
+		const trtp_options_t *opts, int input);
+/* Receive one transfer on the socket bound to host:port and write it to
+ * output.
+ * @return: 0 on success */
+int trtp_recv_fd(const char *host, const char *port,
+		const trtp_options_t *opts, int output);
+
+/* Start a transfer to the receiver at host:port, whose data is given with
+ * trtp_send(). opts may be NULL for the defaults.
+ * @return: the connection, NULL on error */
+trtp_t *trtp_connect(const char *host, const char *port,
+		const trtp_options_t *opts);
+/* Wait for a transfer on the socket bound to host:port, whose data is read
+ * with trtp_recv(). opts may be NULL for the defaults.
+ * @return: the connection, NULL on error */
+trtp_t *trtp_accept(const char *host, const char *port,
+		const trtp_options_t *opts);
+
+/* Queue up to len bytes of buf, without blocking.
+ * @return: the number of bytes queued, -1 with errno EAGAIN if none can be
+ *         right now, or another errno on error */
+ssize_t trtp_send(trtp_t *conn, const void *buf, size_t len);
+/* Mark the end of the data sent. From then on, trtp_result() tells when the
+ * transfer is over. */
+int trtp_shutdown(trtp_t *conn);
+/* Read up to len bytes of the data received, without blocking.
+ * @return: the number of bytes read, 0 at the end of the transfer, -1 with
+ *         errno EAGAIN if none is available right now, or another errno on
+ *         error */
+ssize_t trtp_recv(trtp_t *conn, void *buf, size_t len);
+
+/* UDP socket of the connection, to poll for POLLIN. Once readable, call
+ * trtp_timeout(), or trtp_send() or trtp_recv(). */
+int trtp_fd(const trtp_t *conn);
+/* Time left until trtp_timeout() is due, in ms, or -1 if it is not */
+int trtp_deadline(const trtp_t *conn);
+/* Process the packets waiting on trtp_fd(), and fire the timers which
+ * expired */
+void trtp_timeout(trtp_t *conn);
+
+#define TRTP_RUNNING 1
+/* Check the outcome of the transfer, without blocking.
+ * @return: TRTP_RUNNING while it goes on, 0 if all the data went through, -1
+ *         otherwise */
+int trtp_result(const trtp_t *conn);
+/* Release the connection, waiting for the end of the transfer once its data
+ * is complete: after trtp_shutdown(), or trtp_recv() returned 0. Otherwise,
+ * the transfer is aborted.
+ * @return: 0 if all the data went through, -1 otherwise */
+int trtp_close(trtp_t *conn);
+
+#endif /* __TRTP_H_ */
@@ -0,0 +1,228 @@
+#include "checkpoint.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "../common/macros.h"
+#include "../common/ext.h"
+#include "../common/checksum.h"
+
+/* Amount of output between two checkpoints */
+#define CHECKPOINT_INTERVAL (16 * 1024 * 1024)
+#define CHECKPOINT_MAGIC 0x54525450434b5054ULL /* "TRTPCKPT" */
+/* The first checkpoints were a raw dump of ckpt_t, starting with "TRTPCKP1"
+ * in the byte order of the host */
+#define CHECKPOINT_VERSION 2
+#define ZERO_CHUNK (64 * 1024)
+
+/* On-disk layout, in network byte order: the magic, the version, the offset,
+ * then the state of the running SHA-256 of the output up to that offset, i.e.
+ * its hash values, its length and its last partial block, zero-padded */
+#define CKPT_HEADER_LEN (8 + 4 + 8)
+#define CKPT_LEN (CKPT_HEADER_LEN + 8 * 4 + 8 + 64)
+
+typedef struct {
+	uint64_t offset;
+	sha256_t digest;
+} ckpt_t;
+
+/* Path of the checkpoint file, NULL if checkpoints are disabled */
+PRIVATE char *path;
+/* Checkpoint found on disk */
+PRIVATE ckpt_t saved;
+/* Current state of the output */
+PRIVATE ckpt_t cur;
+/* Offset of the last checkpoint we wrote */
+PRIVATE uint64_t last_save;
+
+PRIVATE void ckpt_encode(const ckpt_t *ckpt, char buf[CKPT_LEN])
+{
+	size_t partial = ckpt->digest.len % sizeof(ckpt->digest.buf);
+	char *p = buf + CKPT_HEADER_LEN;
+	int i;
+
+	ext_put_u64(buf, CHECKPOINT_MAGIC);
+	ext_put_u32(buf + 8, CHECKPOINT_VERSION);
+	ext_put_u64(buf + 12, ckpt->offset);
+	for (i = 0; i < 8; ++i, p += 4)
+		ext_put_u32(p, ckpt->digest.h[i]);
+	ext_put_u64(p, ckpt->digest.len);
+	p += 8;
+	memset(p, 0, sizeof(ckpt->digest.buf));
+	memcpy(p, ckpt->digest.buf, partial);
+}
+
+/* @return: 0 if buf, of len bytes, held a valid checkpoint, -1 otherwise */
+PRIVATE int ckpt_decode(ckpt_t *ckpt, const char *buf, size_t len)
+{
+	const char *p = buf + CKPT_HEADER_LEN;
+	int i;
+
+	if (len != CKPT_LEN || ext_get_u64(buf) != CHECKPOINT_MAGIC ||
+			ext_get_u32(buf + 8) != CHECKPOINT_VERSION)
+		return -1;
+	memset(ckpt, 0, sizeof(*ckpt));
+	ckpt->offset = ext_get_u64(buf + 12);
+	for (i = 0; i < 8; ++i, p += 4)
+		ckpt->digest.h[i] = ext_get_u32(p);
+	ckpt->digest.len = ext_get_u64(p);
+	memcpy(ckpt->digest.buf, p + 8,
+			ckpt->digest.len % sizeof(ckpt->digest.buf));
+	/* The digest covers exactly the data up to the offset */
+	return ckpt->offset == ckpt->digest.len ? 0 : -1;
+}
+
+int checkpoint_load(const char *fname, int fd)
+{
+	char buf[CKPT_LEN + 1];
+	struct stat st;
+	ssize_t len;
+	int cfd;
+
+	if (!(path = malloc(strlen(fname) + sizeof(".ckpt"))))
+		goto_trace(fail, "Cannot allocate the checkpoint path");
+	sprintf(path, "%s.ckpt", fname);
+	memset(&saved, 0, sizeof(saved));
+	sha256_init(&saved.digest);
+	if ((cfd = open(path, O_RDONLY)) == -1) {
+		if (errno != ENOENT)
+			goto_errno(fail);
+	} else {
+		len = read(cfd, buf, sizeof(buf));
+		close(cfd);
+		if (fstat(fd, &st))
+			goto_errno(fail);
+		/* Ignore stale, corrupted or older checkpoints */
+		if (len > 0 && !ckpt_decode(&cur, buf, len) &&
+				cur.offset <= (uint64_t)st.st_size)
+			saved = cur;
+		else
+			ERROR("Ignoring the invalid checkpoint %s", path);
+	}
+	cur = saved;
+	cur.offset = 0;
+	sha256_init(&cur.digest);
+	last_save = 0;
+	LOG("The output can be resumed from %lub", saved.offset);
+	return 0;
+
+fail:
+	return -1;
+}
+
+void checkpoint_free()
+{
+	free(path);
+	path = NULL;
+}
+
+uint64_t checkpoint_offset()
+{
+	return path ? saved.offset : 0;
+}
+
+int checkpoint_reply(char *buf, size_t len, size_t *off)
+{
+	char value[sizeof(uint64_t) + SHA256_LEN];
+	sha256_t ctx = saved.digest;
+
+	ext_put_u64(value, saved.offset);
+	sha256_final(&ctx, (uint8_t*)&value[sizeof(uint64_t)]);
+	return ext_rec_put(buf, len, off, EXT_REC_RESUME, value, sizeof(value));
+}
+
+int checkpoint_resume(int fd, uint64_t offset)
+{
+	if (!path)
+		return 0;
+	PRECONDITION(offset == 0 || offset == saved.offset, -1);
+	if (offset)
+		cur = saved;
+	/* The output is rewritten, the checkpoint becomes meaningless */
+	else if (unlink(path) && errno != ENOENT)
+		goto_errno(fail);
+	last_save = offset;
+	/* Drop whatever was written after the checkpoint */
+	if (ftruncate(fd, offset) || lseek(fd, offset, SEEK_SET) == -1)
+		goto_errno(fail);
+	LOG("Writing the output from %lub", offset);
+	return 0;
+
+fail:
+	return -1;
+}
+
+void checkpoint_update(const void *data, size_t len)
+{
+	if (!path)
+		return;
+	sha256_update(&cur.digest, data, len);
+	cur.offset += len;
+}
+
+void checkpoint_update_zeroes(uint64_t len)
+{
+	static const char zeroes[ZERO_CHUNK];
+	size_t n;
+
+	for (; path && len; len -= n) {
+		n = len < sizeof(zeroes) ? len : sizeof(zeroes);
+		checkpoint_update(zeroes, n);
+	}
+}
+
+int checkpoint_save(int fd, int force)
+{
+	char buf[CKPT_LEN], *tmp;
+	int cfd = -1;
+
+	if (!path || cur.offset == last_save ||
+			(!force && cur.offset - last_save < CHECKPOINT_INTERVAL))
+		return 0;
+	if (!(tmp = malloc(strlen(path) + sizeof(".tmp"))))
+		goto_trace(fail, "Cannot allocate the checkpoint path");
+	sprintf(tmp, "%s.tmp", path);
+	/* The output has to cover the checkpoint, including its trailing holes,
+	 * before we can record it */
+	if (ftruncate(fd, cur.offset) || fdatasync(fd))
+		goto_errno(fail_tmp);
+	/* Atomically replace the previous checkpoint */
+	ckpt_encode(&cur, buf);
+	if ((cfd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 ||
+			write(cfd, buf, sizeof(buf)) != sizeof(buf) || fdatasync(cfd) ||
+			rename(tmp, path))
+		goto_errno(fail_tmp);
+	close(cfd);
+	free(tmp);
+	last_save = cur.offset;
+	DEBUG("Saved a checkpoint at %lub", last_save);
+	return 0;
+
+fail_tmp:
+	if (cfd != -1) {
+		close(cfd);
+		unlink(tmp);
+	}
+	free(tmp);
+fail:
+	return -1;
+}
+
+int checkpoint_finish(int fd)
+{
+	if (!path)
+		return 0;
+	/* The output might have been longer before */
+	if (ftruncate(fd, cur.offset))
+		goto_errno(fail);
+	if (unlink(path) && errno != ENOENT)
+		goto_errno(fail);
+	return 0;
+
+fail:
+	return -1;
+}
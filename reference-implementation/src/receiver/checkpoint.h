@@ -0,0 +1,36 @@
+#ifndef __CHECKPOINT_H_
+#define __CHECKPOINT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Checkpoints of the output, allowing an interrupted transfer to be resumed.
+ * A checkpoint records how much of the output is on disk, as well as the
+ * running SHA-256 of that data. It is stored next to the output, in
+ * <output>.ckpt, and only removed once the transfer completes. */
+
+/* Load the checkpoint of the output file fname, if any.
+ * @return: 0 on success, -1 on error */
+int checkpoint_load(const char *fname, int fd);
+void checkpoint_free();
+
+/* Offset from which the output can be resumed, 0 if there is nothing to
+ * resume */
+uint64_t checkpoint_offset();
+/* Append the record announcing where the output can resume to buf, of size
+ * len, at *off */
+int checkpoint_reply(char *buf, size_t len, size_t *off);
+/* Continue the output from offset, which is either 0 or checkpoint_offset() */
+int checkpoint_resume(int fd, uint64_t offset);
+
+/* Account for data, or zeroes, added to the output */
+void checkpoint_update(const void *data, size_t len);
+void checkpoint_update_zeroes(uint64_t len);
+
+/* Save a new checkpoint if enough data has been written since the last one,
+ * or unconditionally if force is set */
+int checkpoint_save(int fd, int force);
+/* The output is complete, the checkpoint can be discarded */
+int checkpoint_finish(int fd);
+
+#endif /* __CHECKPOINT_H_ */
@@ -0,0 +1,282 @@
+#include "daemon.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+#include "pull.h"
+
+#include "../common/macros.h"
+#include "../common/net.h"
+#include "../common/packet_interface.h"
+
+#define MAX_TRANSFERS DAEMON_MAX_TRANSFERS
+/* How often to check for complete transfers (ms) */
+#define REAP_INTERVAL 1000
+#define INITIAL_SEQNUM 0
+
+
+typedef struct {
+	pid_t pid;
+	struct sockaddr_storage addr; /* Sender it serves */
+	socklen_t addrlen;
+	unsigned int slot; /* Of its pulled packets */
+} transfer_t;
+
+PRIVATE transfer_t transfers[MAX_TRANSFERS];
+PRIVATE unsigned int ntransfers;
+/* Datagram sockets through which the transfers hand us the packets of new
+ * senders their own socket received before it was connected */
+PRIVATE int handoff[2] = { -1, -1 };
+/* Shard served by this process, out of nshards */
+PRIVATE unsigned int shard, nshards = 1;
+
+/* Write to buf the name of transfer n, from the sender at host:port */
+PRIVATE int expand(const char *template, char *buf, size_t len,
+		unsigned long n, const char *host, const char *port)
+{
+	size_t off = 0;
+	int w;
+
+	for (; *template; ++template) {
+		if (*template != '%' || !template[1]) {
+			w = snprintf(&buf[off], len - off, "%c", *template);
+		} else {
+			switch (*++template) {
+				case 'a':
+					w = snprintf(&buf[off], len - off, "%s", host);
+					break;
+				case 'p':
+					w = snprintf(&buf[off], len - off, "%s", port);
+					break;
+				case 'n':
+					w = snprintf(&buf[off], len - off, "%lu", n);
+					break;
+				case '%':
+					w = snprintf(&buf[off], len - off, "%%");
+					break;
+				default:
+					w = snprintf(&buf[off], len - off, "%%%c", *template);
+					break;
+			}
+		}
+		if (w < 0 || (size_t)w >= len - off)
+			goto_trace(fail, "The name of the output of transfer %lu is too "
+					"long", n);
+		off += w;
+	}
+	return 0;
+
+fail:
+	return -1;
+}
+
+PRIVATE transfer_t *find_transfer(const struct sockaddr_storage *addr,
+		socklen_t addrlen)
+{
+	unsigned int i;
+
+	for (i = 0; i < ntransfers; ++i)
+		if (transfers[i].addrlen == addrlen &&
+				!memcmp(&transfers[i].addr, addr, addrlen))
+			return &transfers[i];
+	return NULL;
+}
+
+/* Forget the transfers which are complete */
+PRIVATE void reap()
+{
+	unsigned int i;
+	pid_t pid;
+	int status;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (i = 0; i < ntransfers && transfers[i].pid != pid; ++i);
+		if (i == ntransfers)
+			continue;
+		if (WIFEXITED(status) && !WEXITSTATUS(status))
+			LOG("Transfer handled by process %d is complete", pid);
+		else
+			ERROR("Transfer handled by process %d failed", pid);
+		pull_leave(shard * MAX_TRANSFERS + transfers[i].slot);
+		transfers[i] = transfers[--ntransfers];
+	}
+}
+
+/* @return: the first slot no transfer uses */
+PRIVATE unsigned int free_slot()
+{
+	unsigned int slot, i;
+
+	for (slot = 0;; ++slot) {
+		for (i = 0; i < ntransfers && transfers[i].slot != slot; ++i);
+		if (i == ntransfers)
+			return slot;
+	}
+}
+
+/* Start serving the sender at addr, which sent the first packet pkt to the
+ * listening socket sock */
+PRIVATE int spawn(const char *hostname, const char *port, const char *template,
+		daemon_transfer transfer, int sock, const pkt_t *pkt,
+		const struct sockaddr_storage *addr, socklen_t addrlen)
+{
+	/* Unique across the shards */
+	static unsigned long count = 0;
+	unsigned long n = count++ * nshards + shard + 1;
+	char host[NI_MAXHOST], serv[NI_MAXSERV], fname[PATH_MAX];
+	transfer_t *t = &transfers[ntransfers];
+	unsigned int slot = free_slot();
+	pid_t pid;
+	int err;
+
+	if ((err = getnameinfo((const struct sockaddr*)addr, addrlen, host,
+					sizeof(host), serv, sizeof(serv),
+					NI_NUMERICHOST | NI_NUMERICSERV)))
+		goto_trace(fail, "Could not resolve the peer address: %s",
+				gai_strerror(err));
+	if (expand(template, fname, sizeof(fname), n, host, serv))
+		goto fail;
+	if ((pid = fork()) == -1)
+		goto_errno(fail);
+	if (!pid) {
+		pull_join(shard * MAX_TRANSFERS + slot);
+		close(handoff[0]);
+		if (net_accept(hostname, port, (const struct sockaddr*)addr,
+					addrlen, handoff[1], &sock) != NET_OK)
+			exit(EXIT_FAILURE);
+		close(handoff[1]);
+		exit(transfer(sock, pkt, fname) ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+	LOG("Receiving transfer %lu from [%s]:%s to %s in process %d", n,
+			host, serv, fname, pid);
+	t->pid = pid;
+	memcpy(&t->addr, addr, addrlen);
+	t->addrlen = addrlen;
+	t->slot = slot;
+	++ntransfers;
+	return 0;
+
+fail:
+	return -1;
+}
+
+/* Serve the senders reaching the socket sock */
+PRIVATE int serve(const char *hostname, const char *port, const char *template,
+		daemon_transfer transfer, int sock)
+{
+	struct pollfd pfds[2];
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	net_status_t status;
+	pkt_t pkt;
+	int err;
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, handoff))
+		goto_errno(fail);
+	pfds[0].fd = sock;
+	pfds[1].fd = handoff[0];
+	pfds[0].events = pfds[1].events = POLLIN;
+	for (;;) {
+		reap();
+		if ((err = poll(pfds, 2, REAP_INTERVAL)) == -1 && errno != EINTR)
+			goto_errno(fail);
+		if (err <= 0)
+			continue;
+		memset(&addr, 0, sizeof(addr));
+		addrlen = sizeof(addr);
+		if ((status = pfds[1].revents & POLLIN ?
+					net_recv_handoff(handoff[0], &pkt, (struct sockaddr*)&addr,
+						&addrlen) :
+					net_recv_from(sock, &pkt, (struct sockaddr*)&addr,
+						&addrlen)) ==
+				NET_ERROR)
+			goto_trace(fail, "I/O error");
+		/* Transfers only start with their first packet, the ones of the
+		 * senders we serve were received before their socket was
+		 * connected */
+		if (status != NET_OK || pkt.seq != INITIAL_SEQNUM ||
+				find_transfer(&addr, addrlen))
+			continue;
+		if (ntransfers == MAX_TRANSFERS) {
+			ERROR("Already serving %d transfers, ignoring a new sender",
+					MAX_TRANSFERS);
+			continue;
+		}
+		/* The sender sends its first packet again if this fails */
+		spawn(hostname, port, template, transfer, sock, &pkt, &addr,
+				addrlen);
+	}
+
+fail:
+	return -1;
+}
+
+/* Pin the process to the n-th CPU it may run on */
+PRIVATE void pin(unsigned int n)
+{
+	cpu_set_t set;
+	int cpu;
+
+	if (sched_getaffinity(0, sizeof(set), &set))
+		goto_errno(fail);
+	n %= CPU_COUNT(&set);
+	for (cpu = 0; !CPU_ISSET(cpu, &set) || n--; ++cpu);
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set))
+		goto_errno(fail);
+	LOG("Shard %u runs on CPU %d", shard, cpu);
+	return;
+
+fail:
+	ERROR("Cannot pin shard %u to a CPU", shard);
+}
+
+int daemon_serve(const char *hostname, const char *port, const char *template,
+		daemon_transfer transfer, unsigned int shards)
+{
+	unsigned int i;
+	pid_t pid;
+	int sock, status, err = 0;
+
+	LOG("Serving the senders reaching [%s]:%s", hostname, port);
+	if (shards == 1) {
+		if (net_open_socket(hostname, port, &bind, &sock))
+			goto_trace(fail, "Cannot open socket for the specified "
+					"hostname/port");
+		return serve(hostname, port, template, transfer, sock);
+	}
+	net_reuseport = 1;
+	nshards = shards;
+	for (shard = 0; shard < nshards; ++shard) {
+		if ((pid = fork()) == -1)
+			goto_errno(fail);
+		if (pid)
+			continue;
+		/* Do not outlive the daemon */
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		pin(shard);
+		if (net_open_socket(hostname, port, &bind, &sock))
+			goto_trace(fail, "Cannot open socket for the specified "
+					"hostname/port");
+		exit(serve(hostname, port, template, transfer, sock) ?
+				EXIT_FAILURE : EXIT_SUCCESS);
+	}
+	/* The shards only stop on error */
+	for (i = 0; i < nshards && wait(&status) != -1; ++i)
+		err = -1;
+	return err;
+
+fail:
+	return -1;
+}
@@ -0,0 +1,34 @@
+#ifndef __RECEIVER_DAEMON_H_
+#define __RECEIVER_DAEMON_H_
+
+#include "../common/packet_interface.h"
+
+/* Serve any number of senders on the same port. Each transfer runs in a
+ * process of its own, with a socket bound to the same port but connected to
+ * its sender, so that the kernel hands it the packets of that sender while
+ * the others keep reaching the listening socket.
+ * Many senders can be spread over several shards, each a process pinned to a
+ * CPU, with its own listening socket sharing the port with SO_REUSEPORT. The
+ * kernel hashes the address of each sender to pick the shard it reaches.
+ * Transfer n of shard s accounts for its pulled packets in the slot
+ * s * DAEMON_MAX_TRANSFERS + n of pull_share(). */
+
+#define DAEMON_MAX_SHARDS 256
+/* Transfers served concurrently by a shard, new senders wait for a slot */
+#define DAEMON_MAX_TRANSFERS 256
+
+/* Receive one transfer on the socket sock, connected to its sender which
+ * sent the first packet first, and write it to fname.
+ * @return: 0 on success */
+typedef int (*daemon_transfer)(int sock, const pkt_t *first,
+		const char *fname);
+
+/* Serve the senders reaching the socket bound to hostname:port, writing each
+ * transfer to the file named after template, where %a stands for the address
+ * of the sender, %p for its port, %n for the number of the transfer, unique
+ * across shards, and %% for a percent sign.
+ * @return: -1 on error, it does not return otherwise */
+int daemon_serve(const char *hostname, const char *port, const char *template,
+		daemon_transfer transfer, unsigned int shards);
+
+#endif /* __RECEIVER_DAEMON_H_ */
@@ -0,0 +1,92 @@
+#include "decompress.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "../common/macros.h"
+#include "output.h"
+
+/* Size of the inflated output written at once */
+#define ZCHUNK (32 * 1024)
+
+
+struct decompress {
+	z_stream zs;
+};
+
+decompress_t *decompress_new()
+{
+	decompress_t *d;
+
+	if (!(d = calloc(1, sizeof(*d))))
+		goto_errno(fail);
+	if (inflateInit2(&d->zs, -MAX_WBITS) != Z_OK)
+		goto_trace(fail_free, "Cannot initialize the inflate stream: %s",
+				d->zs.msg);
+	return d;
+
+fail_free:
+	free(d);
+fail:
+	return NULL;
+}
+
+void decompress_free(decompress_t *d)
+{
+	if (!d)
+		return;
+	inflateEnd(&d->zs);
+	free(d);
+}
+
+/* Inflate what is left of the input of the stream into out.
+ * @return: the number of bytes inflated, -1 on error */
+PRIVATE ssize_t inflate_into(decompress_t *d, char *out, size_t outlen)
+{
+	int err;
+
+	d->zs.next_out = (Bytef*)out;
+	d->zs.avail_out = outlen;
+	err = inflate(&d->zs, Z_SYNC_FLUSH);
+	/* Z_BUF_ERROR only tells that there was nothing to do */
+	if (err != Z_OK && err != Z_BUF_ERROR && err != Z_STREAM_END)
+		goto_trace(fail, "Cannot inflate the received data: %s", d->zs.msg);
+	return outlen - d->zs.avail_out;
+
+fail:
+	return -1;
+}
+
+int decompress_write(decompress_t *d, output_writer wr, int fd,
+		const char *data, size_t len)
+{
+	char out[ZCHUNK];
+	ssize_t n;
+
+	d->zs.next_in = (Bytef*)data;
+	d->zs.avail_in = len;
+	do {
+		if ((n = inflate_into(d, out, sizeof(out))) == -1 ||
+				wr(fd, out, n))
+			goto fail;
+	} while (d->zs.avail_out == 0);
+	return 0;
+
+fail:
+	return -1;
+}
+
+ssize_t decompress_read(decompress_t *d, const char **data, size_t *len,
+		char *out, size_t outlen)
+{
+	ssize_t n;
+
+	d->zs.next_in = (Bytef*)*data;
+	d->zs.avail_in = *len;
+	if ((n = inflate_into(d, out, outlen)) == -1)
+		return -1;
+	*data += *len - d->zs.avail_in;
+	*len = d->zs.avail_in;
+	return n;
+}
@@ -0,0 +1,28 @@
+#ifndef __DECOMPRESS_H_
+#define __DECOMPRESS_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "output.h"
+
+/* Inflate the deflate stream produced by a compressing sender */
+typedef struct decompress decompress_t;
+
+/* @return: the stream, NULL on error */
+decompress_t *decompress_new();
+void decompress_free(decompress_t *d);
+
+/* Inflate the next len bytes of the stream and write the result to fd with
+ * wr.
+ * @return: 0 on success, -1 on error */
+int decompress_write(decompress_t *d, output_writer wr, int fd,
+		const char *data, size_t len);
+/* Inflate up to the *len bytes of the stream at *data into the outlen bytes
+ * of out, advancing *data and *len past what was consumed. The output left
+ * once out is full comes with the next call, even if *len is 0 by then.
+ * @return: the number of bytes written to out, -1 on error */
+ssize_t decompress_read(decompress_t *d, const char **data, size_t *len,
+		char *out, size_t outlen);
+
+#endif /* __DECOMPRESS_H_ */
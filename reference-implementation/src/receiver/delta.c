@@ -0,0 +1,133 @@
+#include "delta.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../common/macros.h"
+#include "../common/ext.h"
+#include "../common/checksum.h"
+#include "../common/packet_interface.h"
+#include "output.h"
+
+/* Bounds of the block size, which otherwise grows with the square root of the
+ * basis size as rsync does */
+#define MIN_BLOCK (4 * MAX_PAYLOAD_SIZE)
+#define MAX_BLOCK (256 * MAX_PAYLOAD_SIZE)
+
+
+PRIVATE int basis = -1;
+PRIVATE uint32_t block_size;
+PRIVATE uint32_t nblocks;
+PRIVATE char *block;
+PRIVATE sha256_t digest;
+
+int delta_init(int basis_fd)
+{
+	struct stat st;
+	uint64_t size;
+
+	if (fstat(basis_fd, &st))
+		goto_errno(fail);
+	size = st.st_size;
+	for (block_size = MIN_BLOCK; block_size < MAX_BLOCK &&
+			(uint64_t)block_size * block_size < size; block_size <<= 1);
+	nblocks = size / block_size;
+	if (!(block = malloc(block_size)))
+		goto_trace(fail, "Cannot allocate a block of %u bytes", block_size);
+	basis = basis_fd;
+	sha256_init(&digest);
+	LOG("Basis has %u blocks of %u bytes", nblocks, block_size);
+	return 0;
+
+fail:
+	return -1;
+}
+
+void delta_free()
+{
+	free(block);
+	block = NULL;
+	basis = -1;
+}
+
+PRIVATE int read_block(uint32_t idx)
+{
+	ssize_t err;
+
+	err = pread(basis, block, block_size, (off_t)idx * block_size);
+	if (err != (ssize_t)block_size)
+		goto_trace(fail, "Cannot read block %u of the basis: %s", idx,
+				err < 0 ? strerror(errno) : "file truncated");
+	return 0;
+
+fail:
+	return -1;
+}
+
+int delta_reply(uint32_t first, char *buf, size_t len, size_t *off)
+{
+	char value[sizeof(uint32_t) + EXT_SIGS_PER_REC * EXT_SIG_LEN];
+	uint8_t hash[SHA256_LEN];
+	sha256_t ctx;
+	rsum_t sum;
+	size_t vlen;
+
+	ext_put_u32(value, block_size);
+	ext_put_u32(value + sizeof(uint32_t), nblocks);
+	if (ext_rec_put(buf, len, off, EXT_REC_SIGINFO, value,
+				2 * sizeof(uint32_t)))
+		return -1;
+	/* Fill as many records as the ACK can carry */
+	while (first < nblocks &&
+			*off + 2 + sizeof(uint32_t) + EXT_SIG_LEN <= len) {
+		ext_put_u32(value, first);
+		for (vlen = sizeof(uint32_t); first < nblocks &&
+				vlen < sizeof(value) && *off + 2 + vlen < len;
+				vlen += EXT_SIG_LEN, ++first) {
+			if (read_block(first))
+				return -1;
+			rsum_init(&sum, (uint8_t*)block, block_size);
+			sha256_init(&ctx);
+			sha256_update(&ctx, block, block_size);
+			sha256_final(&ctx, hash);
+			ext_put_u32(&value[vlen], rsum_digest(&sum));
+			memcpy(&value[vlen + sizeof(uint32_t)], hash, EXT_STRONG_LEN);
+		}
+		if (ext_rec_put(buf, len, off, EXT_REC_SIGS, value, vlen))
+			return -1;
+	}
+	return 0;
+}
+
+int delta_copy(int fd, uint32_t first, uint32_t count)
+{
+	PRECONDITION(first < nblocks && count <= nblocks - first, -1);
+	for (; count; --count, ++first) {
+		if (read_block(first) || write_all(fd, block, block_size))
+			return -1;
+		delta_update(block, block_size);
+	}
+	return 0;
+}
+
+void delta_update(const void *data, size_t len)
+{
+	sha256_update(&digest, data, len);
+}
+
+int delta_check(const char *expected, size_t len)
+{
+	uint8_t hash[SHA256_LEN];
+
+	PRECONDITION(len == SHA256_LEN, -1);
+	sha256_final(&digest, hash);
+	if (memcmp(hash, expected, SHA256_LEN))
+		goto_trace(fail, "The digest of the output does not match the input!");
+	LOG("The output matches the digest of the input");
+	return 0;
+
+fail:
+	return -1;
+}
@@ -0,0 +1,26 @@
+#ifndef __RECEIVER_DELTA_H_
+#define __RECEIVER_DELTA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Receiving side of delta transfers: the blocks of the previous copy of the
+ * output (the basis) are described to the sender, which then only sends the
+ * data we do not already have. */
+int delta_init(int basis_fd);
+void delta_free();
+
+/* Append the answer to a signature request to buf, of size len, at *off */
+int delta_reply(uint32_t first, char *buf, size_t len, size_t *off);
+
+/* Write count blocks of the basis, starting at first, to fd */
+int delta_copy(int fd, uint32_t first, uint32_t count);
+
+/* Account for data written to the output */
+void delta_update(const void *data, size_t len);
+
+/* Check the digest of the whole output sent by the sender.
+ * @return: 0 if it matches ours, -1 otherwise */
+int delta_check(const char *digest, size_t len);
+
+#endif /* __RECEIVER_DELTA_H_ */
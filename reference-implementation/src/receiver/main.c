@@ -2,11 +2,19 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "receive.h"
+#include "daemon.h"
+#include "session.h"
+#include "stripe.h"
+#include "stage.h"
+#include "output.h"
+#include "prealloc.h"
+#include "pull.h"
 
 #include "../common/macros.h"
-#include "../common/pktbuf.h"
 #include "../common/net.h"
 
 PRIVATE void usage(const char* argv)
@@ -15,40 +23,149 @@ PRIVATE void usage(const char* argv)
 		"Where OPTIONS are:\n"
 		"\t--buf, -b, [BUFSIZE] Limit the receive buffer to [BUFSIZE] slots.\n"
 		"\t--filename, -f, [FILE] Write the received data to [FILE], otherwise"
-		" use stdout.\n", argv);
+		" use stdout.\n"
+		"\t--delta, -d Only fetch the differences with the current content of"
+		" the file given with --filename, if the sender supports it.\n"
+		"\t--resume, -r Checkpoint the file given with --filename, and resume"
+		" the previous transfer to it if it was interrupted.\n"
+		"\t--mux, -m, [DIR] Write the other files sent over the connection, if"
+		" any, to [DIR].\n"
+		"\t--tree, -t, [DIR] Recreate the tree of files and directories sent"
+		" instead of a single file in [DIR], if the sender supports it.\n"
+		"\t--serve, -s, [TEMPLATE] Keep serving senders, concurrently, writing"
+		" each transfer to the file named after [TEMPLATE], where %%a is"
+		" replaced by the address of the sender, %%p by its port and %%n by"
+		" the number of the transfer.\n"
+		"\t--workers, -w, [N] Spread the senders served with --serve over [N]"
+		" processes, each on its own CPU.\n"
+		"\t--pull-limit, -L, [PACKETS] Let the senders served with --serve in"
+		" pull mode have at most [PACKETS] packets in flight altogether"
+		" (default: %d, 0 for no limit).\n"
+		"\t--parallel, -P Receive an input striped over many connections by"
+		" the sender.\n"
+		"\t--offset, -o, [OFFSET] Write the received data from byte [OFFSET]"
+		" on in the file given with --filename, keeping the rest of it, so"
+		" that several receivers can each write their own range of it.\n"
+		"\t--queue, -Q, [KB] Write the output in a process of its own, queueing"
+		" up to [KB] kilobytes of received data for it, so that a slow output"
+		" does not hold back the acknowledgements.\n"
+		"\t--batch, -B, [KB] Gather [KB] kilobytes of received data before"
+		" writing them out (default: %d, 0 writes each packet right away).\n"
+		"\t--direct, -D Write the output with O_DIRECT, bypassing the page"
+		" cache.\n"
+		"\t--sync, -y Wait for the output to reach the disk before"
+		" acknowledging the end of the transfer.\n"
+		"\t--map, -M Copy the received data straight into a mapping of the"
+		" file given with --filename, once the sender told its size.\n",
+		argv, PULL_HOST_DEFAULT, BATCH_DEFAULT >> 10);
     exit(EXIT_SUCCESS);
 }
 
 PRIVATE struct option long_opts[] = {
     {"filename", required_argument, 0, 'f'},
     {"buf", required_argument, 0, 'b'},
+    {"delta", no_argument, 0, 'd'},
+    {"resume", no_argument, 0, 'r'},
+    {"mux", required_argument, 0, 'm'},
+    {"tree", required_argument, 0, 't'},
+    {"serve", required_argument, 0, 's'},
+    {"workers", required_argument, 0, 'w'},
+    {"pull-limit", required_argument, 0, 'L'},
+    {"parallel", no_argument, 0, 'P'},
+    {"offset", required_argument, 0, 'o'},
+    {"queue", required_argument, 0, 'Q'},
+    {"batch", required_argument, 0, 'B'},
+    {"direct", no_argument, 0, 'D'},
+    {"sync", no_argument, 0, 'y'},
+    {"map", no_argument, 0, 'M'},
     {0, 0, 0, 0}
 };
 
-PRIVATE int parse_options(int argc, char** argv, FILE **f,
-        char **host, char **port, const char* fmask)
+/* Whether to use the current content of the output file as delta basis */
+PRIVATE int delta = 0;
+/* Whether to checkpoint the output file */
+PRIVATE int resume = 0;
+/* Temporary file receiving the new content in delta mode */
+PRIVATE char *tmp_name;
+/* Names of the outputs when serving many senders, or NULL */
+PRIVATE char *template;
+/* Processes sharing the senders served */
+PRIVATE unsigned int workers = 1;
+/* Packets the senders served may have in flight in pull mode, 0 if
+ * unlimited */
+PRIVATE unsigned int pull_limit = PULL_HOST_DEFAULT;
+/* Options of the transfers */
+PRIVATE trtp_options_t options = TRTP_OPTIONS_INIT;
+/* Whether to receive a striped input */
+PRIVATE int parallel = 0;
+/* Where to write the received data in the output file, or -1 to replace
+ * it */
+PRIVATE long long offset = -1;
+/* Whether the output is written in a process of its own */
+PRIVATE int staged = 0;
+
+PRIVATE int parse_options(int argc, char** argv, char **fname,
+        char **host, char **port)
 {
     int c, option_index;
     option_index = 0;
     while (1) {
-        c = getopt_long(argc, argv, "f:b:", long_opts, &option_index);
+        c = getopt_long(argc, argv, "f:b:drm:t:s:w:L:Po:Q:B:DyM", long_opts,
+                &option_index);
         if (c == -1)
             break;
         switch (c) {
             case 'f':
-                *f = fopen(optarg, fmask);
-                if (!*f) {
-                    ERROR("Cannot read the content of %s: %s", optarg,
-							strerror(errno));
-                    return errno;
-                }
-                LOG("Sending the content of %s\n", optarg);
+                *fname = optarg;
+                break;
+            case 'd':
+                delta = 1;
+                break;
+            case 'r':
+                resume = 1;
+                break;
+            case 'm':
+                mux_dir = optarg;
+                break;
+            case 't':
+                tree_dir = optarg;
+                break;
+            case 's':
+                template = optarg;
+                break;
+            case 'w':
+                workers = atoi(optarg);
+                break;
+            case 'L':
+                pull_limit = atoi(optarg);
+                break;
+            case 'P':
+                parallel = 1;
+                break;
+            case 'o':
+                offset = atoll(optarg);
+                break;
+            case 'Q':
+                stage_size = atoll(optarg) * 1024;
+                staged = 1;
+                break;
+            case 'B':
+                batch_size = atoll(optarg) * 1024;
+                break;
+            case 'D':
+                direct_output = 1;
+                break;
+            case 'y':
+                sync_output = 1;
+                break;
+            case 'M':
+                map_output = 1;
                 break;
 			case 'b':
-				max_window = atoi(optarg);
-				if (max_window> MAX_WINDOW_SIZE)
-					max_window = MAX_WINDOW_SIZE;
-				LOG("Setting receive buffer size to %u", max_window);
+				options.window = atoi(optarg);
+				if (options.window > MAX_WINDOW_SIZE)
+					options.window = MAX_WINDOW_SIZE;
+				LOG("Setting receive buffer size to %u", options.window);
 				break;
             default:
                 usage(argv[0]);
@@ -61,36 +178,220 @@ PRIVATE int parse_options(int argc, char** argv, FILE **f,
 		*port = argv[optind + 1];
 	}
 
+    if (!workers || workers > DAEMON_MAX_SHARDS) {
+        ERROR("There must be between 1 and %d workers", DAEMON_MAX_SHARDS);
+        return EINVAL;
+    }
+    if (workers > 1 && !template) {
+        ERROR("Workers are only used to serve many senders");
+        return EINVAL;
+    }
+    if (template && *fname) {
+        ERROR("The outputs of the transfers are named after the template");
+        return EINVAL;
+    }
+    if ((delta || resume) && !*fname && !template) {
+        ERROR("Delta and resumable transfers need an output file");
+        return EINVAL;
+    }
+    if (delta && resume) {
+        ERROR("Delta transfers cannot be resumed");
+        return EINVAL;
+    }
+    if (resume && (mux_dir || tree_dir)) {
+        ERROR("Multiplexed streams and trees cannot be resumed");
+        return EINVAL;
+    }
+    if (parallel && (template || delta || resume || mux_dir || tree_dir)) {
+        ERROR("Striped inputs are received on their own, as a single file");
+        return EINVAL;
+    }
+    if (offset != -1 && (!*fname || offset < 0 || template || delta ||
+                resume || tree_dir)) {
+        ERROR("Ranges are written to the file given with --filename, without"
+                " delta or checkpoints");
+        return EINVAL;
+    }
+    if (staged && (stage_size < MAX_PAYLOAD_SIZE ||
+                stage_size > STAGE_MAX_SIZE)) {
+        ERROR("Between 1 and %d kilobytes can be queued for the writer",
+                STAGE_MAX_SIZE >> 10);
+        return EINVAL;
+    }
+    if (batch_size > BATCH_MAX) {
+        ERROR("Up to %d kilobytes can be gathered before writing them",
+                BATCH_MAX >> 10);
+        return EINVAL;
+    }
+    if (direct_output && !batch_size) {
+        ERROR("O_DIRECT needs the data to be gathered in whole blocks");
+        return EINVAL;
+    }
+    if (staged && (delta || resume || mux_dir || tree_dir)) {
+        ERROR("Queued data is written as is to the output, without delta,"
+                " checkpoints, streams or trees");
+        return EINVAL;
+    }
+    if (map_output && (!*fname || resume || staged || direct_output)) {
+        ERROR("Only the file given with --filename can be mapped, without"
+                " checkpoints, queue or O_DIRECT");
+        return EINVAL;
+    }
     return 0;
 }
 
-int main(int argc, char** argv)
+/* Open the output file, or a temporary file next to it if its current content
+ * is used as delta basis */
+PRIVATE int open_output(const char *fname, FILE **f)
+{
+    struct stat st;
+    int fd;
+
+    if (!fname)
+        return 0;
+    if (delta && (delta_basis = open(fname, O_RDONLY)) == -1 &&
+            errno != ENOENT) {
+        ERROR("Cannot read the content of %s: %s", fname, strerror(errno));
+        return errno;
+    }
+    if (offset != -1) {
+        /* The other ranges of the file are written by other receivers */
+        if ((fd = open(fname, (map_output ? O_RDWR : O_WRONLY) | O_CREAT,
+                        0666)) == -1 ||
+                lseek(fd, offset, SEEK_SET) == -1 ||
+                !(*f = fdopen(fd, "w"))) {
+            ERROR("Cannot open %s at %lldb: %s", fname, offset,
+                    strerror(errno));
+            if (fd != -1)
+                close(fd);
+            return errno;
+        }
+        LOG("Writing the received data to %s from %lldb", fname, offset);
+        return 0;
+    }
+    if (resume) {
+        /* Keep the current content until we know where to resume */
+        if ((fd = open(fname, O_WRONLY | O_CREAT, 0666)) == -1 ||
+                !(*f = fdopen(fd, "w"))) {
+            ERROR("Cannot open %s: %s", fname, strerror(errno));
+            if (fd != -1)
+                close(fd);
+            return errno;
+        }
+        resume_file = fname;
+        LOG("Writing the received data to %s, with checkpoints", fname);
+        return 0;
+    }
+    if (delta_basis == -1) {
+        /* Mappings of the file have to be able to read it as well */
+        if (!(*f = fopen(fname, map_output ? "w+" : "w"))) {
+            ERROR("Cannot open %s: %s", fname, strerror(errno));
+            return errno;
+        }
+        LOG("Writing the received data to %s", fname);
+        return 0;
+    }
+    if (!(tmp_name = malloc(strlen(fname) + sizeof(".XXXXXX"))))
+        return ENOMEM;
+    sprintf(tmp_name, "%s.XXXXXX", fname);
+    if ((fd = mkstemp(tmp_name)) == -1 || fstat(delta_basis, &st) ||
+            fchmod(fd, st.st_mode & 07777) || !(*f = fdopen(fd, "w"))) {
+        ERROR("Cannot create the temporary file %s: %s", tmp_name,
+                strerror(errno));
+        if (fd != -1) {
+            close(fd);
+            unlink(tmp_name);
+        }
+        return errno;
+    }
+    LOG("Writing the received data to %s, using %s as delta basis",
+            tmp_name, fname);
+    return 0;
+}
+
+/* Replace the delta basis by the received file, or discard the latter */
+PRIVATE int close_output(const char *fname, FILE *f, int err)
+{
+    if (f != stdout && fclose(f) && !err) {
+        ERROR("Cannot write %s: %s", fname, strerror(errno));
+        err = errno;
+    }
+    if (delta_basis != -1)
+        close(delta_basis);
+    if (!tmp_name)
+        return err;
+    if (err)
+        unlink(tmp_name);
+    else if (rename(tmp_name, fname)) {
+        ERROR("Cannot replace %s: %s", fname, strerror(errno));
+        err = errno;
+    }
+    free(tmp_name);
+    return err;
+}
+
+/* Receive a transfer on sock and write it to fname, or stdout if NULL */
+PRIVATE int transfer(int sock, const pkt_t *first, const char *fname)
 {
-	pktbuf_t *buf;
-    char *host = "::", *port = "1341";
     FILE *out = stdout;
-    int err = -ENOMEM;
+    int err;
 
-    if ((err = parse_options(argc, argv, &out, &host, &port, "w")))
+    if ((err = open_output(fname, &out))) {
+        close(sock);
         return err;
+    }
 
-    if (!(buf = pktbuf_new(32)))
-        goto_trace(err_file, "Cannot allocate the receive buffer");
+    err = session_receive(sock, first, &options, fileno(out));
 
-    if (net_open_socket(host, port, &bind))
-        goto_trace(err_buf, "Cannot open socket for the specified "
-                "hostname/port");
+    return close_output(fname, out, err);
+}
 
-    if ((err = receive(fileno(out), buf)))
-		ERROR("A transmission error occured!");
+/* Receive one stripe on sock and write it to fd */
+PRIVATE int transfer_stripe(int sock, const pkt_t *first, int fd)
+{
+    return session_receive(sock, first, &options, fd);
+}
 
-	net_close_socket();
-err_buf:
-    pktbuf_free(buf);
-err_file:
-    if (out != stdout)
-        fclose(out);
+/* Receive a striped input on the socket bound to host:port, and write it to
+ * fname, or stdout if NULL */
+PRIVATE int receive_striped(const char *host, const char *port,
+        const char *fname)
+{
+    FILE *out = stdout;
+    int err;
 
-    return err;
+    if ((err = open_output(fname, &out)))
+        return err;
+
+    err = stripe_receive(host, port, fileno(out), &transfer_stripe);
+
+    return close_output(fname, out, err);
 }
 
+int main(int argc, char** argv)
+{
+    char *host = "::", *port = "1341";
+    char *fname = NULL;
+    int sock, err;
+
+    if ((err = parse_options(argc, argv, &fname, &host, &port)))
+        return err;
+
+    if (template) {
+        if (pull_share(pull_limit, workers * DAEMON_MAX_TRANSFERS))
+            return -1;
+        return daemon_serve(host, port, template, &transfer, workers);
+    }
+
+    if (parallel)
+        return receive_striped(host, port, fname);
+
+    if (net_open_socket(host, port, &bind, &sock))
+        goto_trace(fail, "Cannot open socket for the specified "
+                "hostname/port");
+
+    return transfer(sock, NULL, fname);
+
+fail:
+    return -1;
+}
@@ -0,0 +1,92 @@
+#include "mux.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "../common/macros.h"
+#include "../common/ext.h"
+
+
+/* Directory containing the files of the streams */
+PRIVATE int dir_fd = -1;
+/* Their file descriptors, or -1 */
+PRIVATE int fds[EXT_MAX_STREAMS];
+
+int mux_init(const char *dir)
+{
+	unsigned int i;
+
+	if ((dir_fd = open(dir, O_RDONLY | O_DIRECTORY)) == -1)
+		goto_trace(fail, "Cannot open the directory %s: %s", dir,
+				strerror(errno));
+	for (i = 0; i < EXT_MAX_STREAMS; ++i)
+		fds[i] = -1;
+	return 0;
+
+fail:
+	return -1;
+}
+
+void mux_free()
+{
+	unsigned int i;
+
+	if (dir_fd == -1)
+		return;
+	for (i = 1; i < EXT_MAX_STREAMS; ++i)
+		if (fds[i] != -1)
+			close(fds[i]);
+	close(dir_fd);
+	dir_fd = -1;
+}
+
+int mux_open(uint8_t stream, const char *name, uint8_t len)
+{
+	char fname[256];
+
+	PRECONDITION(dir_fd != -1 && stream && stream < EXT_MAX_STREAMS, -1);
+	if (fds[stream] != -1)
+		goto_trace(fail, "Stream %u is already open", stream);
+	memcpy(fname, name, len);
+	fname[len] = '\0';
+	/* Never write outside of the directory */
+	if (!len || strlen(fname) != len || strchr(fname, '/') ||
+			!strcmp(fname, ".") || !strcmp(fname, ".."))
+		goto_trace(fail, "Invalid name for stream %u", stream);
+	if ((fds[stream] = openat(dir_fd, fname, O_WRONLY | O_CREAT | O_TRUNC,
+					0666)) == -1)
+		goto_trace(fail, "Cannot open %s: %s", fname, strerror(errno));
+	LOG("Writing stream %u to %s", stream, fname);
+	return 0;
+
+fail:
+	return -1;
+}
+
+int mux_close(uint8_t stream)
+{
+	int err;
+
+	/* The main output is closed with the connection */
+	if (!stream)
+		return 0;
+	PRECONDITION(dir_fd != -1 && stream < EXT_MAX_STREAMS &&
+			fds[stream] != -1, -1);
+	err = close(fds[stream]);
+	fds[stream] = -1;
+	if (err)
+		goto_errno(fail);
+	LOG("Stream %u is complete", stream);
+	return 0;
+
+fail:
+	return -1;
+}
+
+int mux_fd(uint8_t stream)
+{
+	if (dir_fd == -1 || stream >= EXT_MAX_STREAMS)
+		return -1;
+	return fds[stream];
+}
@@ -0,0 +1,22 @@
+#ifndef __RECEIVER_MUX_H_
+#define __RECEIVER_MUX_H_
+
+#include <stdint.h>
+
+/* Files receiving the streams multiplexed over the connection, besides the
+ * main output which receives stream 0. Each is created in a directory, under
+ * the name given by the sender when opening the stream. */
+int mux_init(const char *dir);
+void mux_free();
+
+/* Create the file named by the len bytes of name for stream.
+ * @return: 0 on success, -1 on error */
+int mux_open(uint8_t stream, const char *name, uint8_t len);
+/* Close the file of stream, which is complete.
+ * @return: 0 on success, -1 on error */
+int mux_close(uint8_t stream);
+
+/* File descriptor of the file of stream, -1 if it is not open */
+int mux_fd(uint8_t stream);
+
+#endif /* __RECEIVER_MUX_H_ */
@@ -0,0 +1,197 @@
+#include "output.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "../common/macros.h"
+#include "checkpoint.h"
+
+/* O_DIRECT transfers start on, and cover, whole blocks */
+#define DIRECT_ALIGN 4096
+
+
+PUBLIC size_t batch_size = BATCH_DEFAULT;
+PUBLIC int direct_output = 0;
+PUBLIC int sync_output = 0;
+
+/* Buffer the data is gathered in */
+PRIVATE char *batch = NULL;
+/* Bytes gathered in it */
+PRIVATE size_t batch_len = 0;
+/* Output it is written to */
+PRIVATE int batch_fd = -1;
+/* Whether that output is opened with O_DIRECT */
+PRIVATE int direct = 0;
+
+int write_all(int fd, const void *buf, size_t len)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+	const char *p = buf;
+	ssize_t err;
+
+	while (len) {
+		if ((err = write(fd, p, len)) < 0) {
+			if (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR)
+				goto_errno(fail);
+			if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+				goto_errno(fail);
+			continue;
+		}
+		checkpoint_update(p, err);
+		p += err;
+		len -= err;
+	}
+	return 0;
+
+fail:
+	return -1;
+}
+
+/* Write the rest of the output through the page cache */
+PRIVATE void direct_off(int fd)
+{
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL)) == -1 ||
+			fcntl(fd, F_SETFL, flags & ~O_DIRECT) == -1)
+		ERROR("Cannot clear O_DIRECT on the output: %s", strerror(errno));
+	direct = 0;
+}
+
+int output_open(int fd)
+{
+	struct stat st;
+	int flags;
+
+	if (!batch_size)
+		return 0;
+	/* O_DIRECT buffers have to be aligned as well */
+	batch_size = (batch_size + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1);
+	if (fstat(fd, &st))
+		goto_errno(fail);
+	if (posix_memalign((void**)&batch, DIRECT_ALIGN, batch_size)) {
+		batch = NULL;
+		goto_trace(fail, "Cannot allocate the output buffer");
+	}
+	batch_fd = fd;
+	batch_len = 0;
+	if (!direct_output)
+		return 0;
+	/* Pipes would switch to their packet mode instead */
+	if (!S_ISREG(st.st_mode)) {
+		ERROR("Only regular files can be written with O_DIRECT");
+		return 0;
+	}
+	if ((flags = fcntl(fd, F_GETFL)) == -1 ||
+			fcntl(fd, F_SETFL, flags | O_DIRECT) == -1) {
+		ERROR("Cannot write the output with O_DIRECT: %s", strerror(errno));
+		return 0;
+	}
+	direct = 1;
+	LOG("Writing the output with O_DIRECT, by %lub", batch_size);
+	return 0;
+
+fail:
+	return -1;
+}
+
+/* Write out the first len bytes gathered */
+PRIVATE int write_batch(int fd, size_t len)
+{
+	/* Only whole blocks can bypass the page cache */
+	if (direct && len % DIRECT_ALIGN)
+		direct_off(fd);
+	if (write_all(fd, batch, len)) {
+		/* The output does not support it, or is not aligned anymore */
+		if (!direct || errno != EINVAL)
+			goto fail;
+		direct_off(fd);
+		if (write_all(fd, batch, len))
+			goto fail;
+	}
+	memmove(batch, batch + len, batch_len - len);
+	batch_len -= len;
+	return 0;
+
+fail:
+	return -1;
+}
+
+int output_flush(int fd)
+{
+	if (!batch_len || fd != batch_fd)
+		return 0;
+	return write_batch(fd, batch_len);
+}
+
+/* Bytes of the batch worth writing out before it is full */
+PRIVATE size_t idle_len()
+{
+	/* Keep O_DIRECT for the rest of the output */
+	return direct ? batch_len & ~(size_t)(DIRECT_ALIGN - 1) : batch_len;
+}
+
+int output_pending()
+{
+	return idle_len() != 0;
+}
+
+int output_idle(int fd)
+{
+	if (!idle_len() || fd != batch_fd)
+		return 0;
+	return write_batch(fd, idle_len());
+}
+
+int output_write(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	size_t n;
+
+	if (!batch)
+		return write_all(fd, buf, len);
+	/* Another stream goes after the data gathered for the output */
+	if (fd != batch_fd)
+		return output_flush(batch_fd) || write_all(fd, buf, len) ? -1 : 0;
+	/* Large writes are not worth a copy */
+	if (!batch_len && len >= batch_size && !direct)
+		return write_all(fd, buf, len);
+	while (len) {
+		n = batch_size - batch_len;
+		if (n > len)
+			n = len;
+		memcpy(batch + batch_len, p, n);
+		batch_len += n;
+		p += n;
+		len -= n;
+		if (batch_len == batch_size && output_flush(fd))
+			return -1;
+	}
+	return 0;
+}
+
+int output_finish(int fd)
+{
+	if (output_flush(fd))
+		return -1;
+	/* Pipes and sockets do not keep anything */
+	if (sync_output && fdatasync(fd) && errno != EINVAL)
+		goto_errno(fail);
+	return 0;
+
+fail:
+	return -1;
+}
+
+void output_free()
+{
+	free(batch);
+	batch = NULL;
+	batch_len = 0;
+	batch_fd = -1;
+	direct = 0;
+}
@@ -0,0 +1,47 @@
+#ifndef __OUTPUT_H_
+#define __OUTPUT_H_
+
+#include <stddef.h>
+
+/* How to write the output, e.g. write_all() */
+typedef int (*output_writer)(int fd, const void *buf, size_t len);
+
+/* Write the complete buffer to fd, waiting for it if it would block. All the
+ * output goes through it to be accounted for in its checkpoints.
+ * @return: 0 on success, -1 on error */
+int write_all(int fd, const void *buf, size_t len);
+
+/* The data written with output_write() is gathered in a buffer, and only
+ * written out once it is full, to spare a system call per packet, or once no
+ * more data is coming for now, not to hold it back from a streaming
+ * reader. */
+
+#define BATCH_DEFAULT (64 << 10)
+#define BATCH_MAX (64 << 20)
+/* Size of the buffer, 0 to write the data right away */
+extern size_t batch_size;
+/* Whether to write the buffer with O_DIRECT, bypassing the page cache */
+extern int direct_output;
+/* Whether to wait for the output to reach the disk at the end */
+extern int sync_output;
+
+/* Start gathering the data written to fd.
+ * @return: 0 on success, -1 on error */
+int output_open(int fd);
+/* output_writer gathering the data, and writing it out with write_all() */
+int output_write(int fd, const void *buf, size_t len);
+/* Write out the data gathered so far, before acting on the output otherwise.
+ * @return: 0 on success, -1 on error */
+int output_flush(int fd);
+/* Whether some of the data gathered would be written by output_idle() */
+int output_pending();
+/* No more data is coming for now, write out the data gathered so far, but
+ * for a partial block when writing with O_DIRECT.
+ * @return: 0 on success, -1 on error */
+int output_idle(int fd);
+/* Write out the data gathered and, if asked, wait for it to reach the disk.
+ * @return: 0 on success, -1 on error */
+int output_finish(int fd);
+void output_free();
+
+#endif /* __OUTPUT_H_ */
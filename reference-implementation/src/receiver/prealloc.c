@@ -0,0 +1,142 @@
+#include "prealloc.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "output.h"
+#include "checkpoint.h"
+
+#include "../common/macros.h"
+
+/* How often the mapped data is handed over to the disk */
+#define MSYNC_INTERVAL (16 << 20)
+
+
+PUBLIC int map_output = 0;
+
+/* Output whose space is reserved, or -1 */
+PRIVATE int reserved_fd = -1;
+/* Its size before, and the end of the space reserved */
+PRIVATE off_t reserved_size, reserved_end;
+/* Mapping of the output, from the page holding its offset on */
+PRIVATE char *out_map = NULL;
+PRIVATE off_t out_map_start;
+/* Size of the mapping, next byte to write, and page up to which it was
+ * handed over to the disk */
+PRIVATE size_t out_map_len, out_map_pos, out_map_synced;
+
+int prealloc_start(int fd, uint64_t len)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	struct stat st;
+	off_t pos;
+
+	if (!len || reserved_fd != -1 || fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+			(pos = lseek(fd, 0, SEEK_CUR)) == -1)
+		return 0;
+	/* Only the data grows the file */
+	if (fallocate(fd, FALLOC_FL_KEEP_SIZE, pos, len))
+		ERROR("Cannot reserve %lub for the output: %s", len, strerror(errno));
+	reserved_fd = fd;
+	reserved_size = st.st_size;
+	reserved_end = pos + len;
+	LOG("Reserved %lub for the output", len);
+	if (!map_output)
+		return 0;
+	/* The mapping has to be backed by the file */
+	if (reserved_end > st.st_size && ftruncate(fd, reserved_end))
+		goto_errno(fail);
+	out_map_start = pos & ~(off_t)(page - 1);
+	out_map_len = reserved_end - out_map_start;
+	if ((out_map = mmap(NULL, out_map_len, PROT_WRITE, MAP_SHARED, fd,
+					out_map_start)) == MAP_FAILED) {
+		out_map = NULL;
+		goto_errno(fail);
+	}
+	out_map_pos = pos - out_map_start;
+	out_map_synced = 0;
+	madvise(out_map, out_map_len, MADV_SEQUENTIAL);
+	LOG("Writing the output through its mapping");
+	return 0;
+
+fail:
+	return -1;
+}
+
+int prealloc_write(int fd, const void *buf, size_t len)
+{
+	size_t n, page;
+
+	if (!out_map || fd != reserved_fd)
+		return output_write(fd, buf, len);
+	n = out_map_len - out_map_pos;
+	if (n > len)
+		n = len;
+	memcpy(out_map + out_map_pos, buf, n);
+	checkpoint_update(buf, n);
+	out_map_pos += n;
+	if (out_map_pos - out_map_synced >= MSYNC_INTERVAL) {
+		/* Start writing it out, rather than all of it at the end. Linux
+		 * ignores msync(MS_ASYNC), the pages are shared with the file. */
+		page = out_map_pos & ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+		if (sync_file_range(fd, out_map_start + out_map_synced,
+					page - out_map_synced, SYNC_FILE_RANGE_WRITE))
+			goto_errno(fail);
+		out_map_synced = page;
+	}
+	if (n == len)
+		return 0;
+	/* The output is larger than announced */
+	if (prealloc_stop(fd))
+		goto fail;
+	return output_write(fd, (const char*)buf + n, len - n);
+
+fail:
+	return -1;
+}
+
+int prealloc_stop(int fd)
+{
+	if (!out_map || fd != reserved_fd)
+		return 0;
+	munmap(out_map, out_map_len);
+	out_map = NULL;
+	if (lseek(fd, out_map_start + out_map_pos, SEEK_SET) == -1)
+		goto_errno(fail);
+	return 0;
+
+fail:
+	return -1;
+}
+
+int prealloc_finish(int fd)
+{
+	off_t end;
+
+	if (output_flush(fd) || prealloc_stop(fd))
+		goto fail;
+	if (fd != reserved_fd)
+		return 0;
+	reserved_fd = -1;
+	if ((end = lseek(fd, 0, SEEK_CUR)) == -1)
+		goto_errno(fail);
+	/* Keep whatever the output held past the data */
+	if (end < reserved_size)
+		end = reserved_size;
+	if (end < reserved_end && ftruncate(fd, end))
+		goto_errno(fail);
+	return 0;
+
+fail:
+	return -1;
+}
+
+void prealloc_free()
+{
+	if (out_map)
+		munmap(out_map, out_map_len);
+	out_map = NULL;
+	reserved_fd = -1;
+}
@@ -0,0 +1,32 @@
+#ifndef __PREALLOC_H_
+#define __PREALLOC_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Reserving the space of a regular output once the sender told how large it
+ * will be, so that it is laid out in few extents instead of growing one
+ * write at a time. The data can then be copied straight into a mapping of
+ * the output, which only ends where the data does. Truncating the output
+ * during the transfer kills the receiver with SIGBUS, as for any mapping. */
+
+/* Whether to write the reserved output through a mapping of it */
+extern int map_output;
+
+/* Reserve len bytes of fd from its current offset on, and map them if asked.
+ * Outputs which are not regular files are left alone.
+ * @return: 0 on success, -1 on error */
+int prealloc_start(int fd, uint64_t len);
+/* output_writer copying the data to the mapping, or passing it on to
+ * output_write() if there is none */
+int prealloc_write(int fd, const void *buf, size_t len);
+/* Write the output from where the mapping stopped on, before acting on it
+ * otherwise.
+ * @return: 0 on success, -1 on error */
+int prealloc_stop(int fd);
+/* Write out the output, and release the space reserved past its end.
+ * @return: 0 on success, -1 on error */
+int prealloc_finish(int fd);
+void prealloc_free();
+
+#endif /* __PREALLOC_H_ */
@@ -0,0 +1,147 @@
+#include "pull.h"
+
+#include <sys/mman.h>
+
+#include "../common/macros.h"
+#include "../common/ext.h"
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define ADD(x, v) __atomic_add_fetch(&(x), (v), __ATOMIC_SEQ_CST)
+#define SUB(x, v) __atomic_sub_fetch(&(x), (v), __ATOMIC_SEQ_CST)
+
+/* Packets in flight towards the transfers of the host, shared between their
+ * processes: in total, and per transfer */
+typedef struct {
+	uint32_t total;
+	uint32_t held[];
+} host_t;
+
+/* Shared accounting, NULL without a limit */
+PRIVATE host_t *host;
+PRIVATE unsigned int host_limit, host_slots;
+/* Slot of the transfers we start */
+PRIVATE unsigned int slot;
+
+void pull_init(pull_t *p, unsigned int max)
+{
+	p->max_target = max;
+	p->target = EXT_PULL_INITIAL < max ? EXT_PULL_INITIAL : max;
+	p->target_acc = 0;
+	p->drained = 0;
+	p->pulled = EXT_PULL_INITIAL;
+	p->slot = slot;
+	/* The sender starts with that much credit, whatever the limit */
+	if (host) {
+		ADD(host->held[p->slot], EXT_PULL_INITIAL);
+		ADD(host->total, EXT_PULL_INITIAL);
+	}
+}
+
+int pull_share(unsigned int limit, unsigned int slots)
+{
+	if (host)
+		munmap(host, sizeof(*host) + host_slots * sizeof(*host->held));
+	host = NULL;
+	if (!limit)
+		return 0;
+	if ((host = mmap(NULL, sizeof(*host) + slots * sizeof(*host->held),
+					PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+					-1, 0)) == MAP_FAILED) {
+		host = NULL;
+		goto_errno(fail);
+	}
+	host_limit = limit;
+	host_slots = slots;
+	LOG("Pulling at most %u packets in flight for all the transfers", limit);
+	return 0;
+
+fail:
+	return -1;
+}
+
+void pull_join(unsigned int s)
+{
+	slot = s;
+}
+
+void pull_leave(unsigned int s)
+{
+	uint32_t held;
+
+	if (!host || s >= host_slots)
+		return;
+	held = __atomic_exchange_n(&host->held[s], 0, __ATOMIC_SEQ_CST);
+	SUB(host->total, held);
+}
+
+/* Packets p may pull on top of the ones it holds, out of count */
+PRIVATE uint32_t host_grant(const pull_t *p, uint32_t count)
+{
+	uint32_t total, room;
+
+	if (!host)
+		return count;
+	total = LOAD(host->total);
+	room = total < host_limit ? host_limit - total : 0;
+	/* Every transfer keeps going, however many they are */
+	if (!room && !LOAD(host->held[p->slot]))
+		room = 1;
+	if (count > room)
+		count = room;
+	/* Concurrent grants may overshoot the limit by a few packets */
+	ADD(host->held[p->slot], count);
+	ADD(host->total, count);
+	return count;
+}
+
+/* count packets p pulled have been written out */
+PRIVATE void host_release(const pull_t *p, uint32_t count)
+{
+	uint32_t held;
+
+	if (!host)
+		return;
+	held = LOAD(host->held[p->slot]);
+	if (count > held)
+		count = held;
+	SUB(host->held[p->slot], count);
+	SUB(host->total, count);
+}
+
+PRIVATE void update_pulled(pull_t *p)
+{
+	int32_t want = p->drained + p->target - p->pulled;
+
+	if (want > 0)
+		p->pulled += host_grant(p, want);
+}
+
+void pull_drained(pull_t *p, unsigned int count)
+{
+	p->drained += count;
+	host_release(p, count);
+	/* Additive increase, by one packet per target packets drained */
+	p->target_acc += count;
+	while (p->target_acc >= p->target) {
+		p->target_acc -= p->target;
+		if (p->target < p->max_target)
+			++p->target;
+	}
+	update_pulled(p);
+}
+
+void pull_truncated(pull_t *p)
+{
+	/* Multiplicative decrease, the packets already pulled remain */
+	p->target = p->target / 2 > 1 ? p->target / 2 : 1;
+	p->target_acc = 0;
+	DEBUG("Reduced the pull target to %u", p->target);
+}
+
+uint32_t pull_credit(pull_t *p)
+{
+	/* Others may have made room meanwhile */
+	if (host)
+		update_pulled(p);
+	return p->pulled;
+}
@@ -0,0 +1,49 @@
+#ifndef __PULL_H_
+#define __PULL_H_
+
+#include <stdint.h>
+
+/* Receiver-driven pacing of the sender, in the spirit of NDP: the sender may
+ * only send new packets once pulled. We keep a target number of packets in
+ * flight, pulling one more for each packet written out, and shrink it when
+ * the network truncates packets. */
+typedef struct {
+	/* Upper bound of the target */
+	unsigned int max_target;
+	/* Packets we want in flight, and the progress towards increasing it */
+	unsigned int target, target_acc;
+	/* Packets written out so far */
+	uint32_t drained;
+	/* Packets pulled so far, never decreasing */
+	uint32_t pulled;
+	/* Slot of the transfer in the accounting of the host */
+	unsigned int slot;
+} pull_t;
+
+void pull_init(pull_t *p, unsigned int max);
+
+/* Default of the packets in flight towards all the transfers of the host */
+#define PULL_HOST_DEFAULT 256
+
+/* Let the transfers of the processes forked afterwards pull at most limit
+ * packets in flight altogether, so that many senders do not overflow the
+ * buffers in front of the host. Each transfer accounts for its packets in
+ * one of slots slots, and always keeps at least one in flight. This replaces
+ * the previous limit, if any, and nothing is shared with a limit of 0.
+ * @return: 0 on success, -1 on error */
+int pull_share(unsigned int limit, unsigned int slots);
+/* The transfers this process starts from then on account for their packets
+ * in slot */
+void pull_join(unsigned int slot);
+/* The transfer of slot is over, whether it completed or not */
+void pull_leave(unsigned int slot);
+
+/* count packets have been written out */
+void pull_drained(pull_t *p, unsigned int count);
+/* A truncated packet was received */
+void pull_truncated(pull_t *p);
+
+/* Number of packets the sender may have sent so far, see EXT_ACK_PULL */
+uint32_t pull_credit(pull_t *p);
+
+#endif /* __PULL_H_ */
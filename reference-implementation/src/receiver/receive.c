@@ -2,102 +2,149 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <poll.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
 
 #include "../common/macros.h"
 #include "../common/pktbuf.h"
 #include "../common/packet_interface.h"
 #include "../common/net.h"
+#include "../common/ext.h"
+#include "decompress.h"
+#include "sparse.h"
+#include "delta.h"
+#include "output.h"
+#include "checkpoint.h"
+#include "pull.h"
+#include "mux.h"
+#include "tree.h"
+#include "stripe.h"
+#include "stage.h"
+#include "prealloc.h"
+#include "../common/shm.h"
 
 #define IDLE_TIME 10000
 #define INITIAL_SEQNUM 0
+/* Packets which may reach a listening socket before a first one */
+#define MAX_RETRIES 5
+/* Slots holding the out-of-order packets */
+#define RBUF_SIZE 32
 #define LINGER 3000
 #define MAX_LINGER_RETRY 5
 
 
-PUBLIC unsigned int max_window = MAX_WINDOW_SIZE;
-
-/* Output file descriptor */
-PRIVATE int out_fd;
-/* Paquet buffer */
-PRIVATE pktbuf_t *recv_buf;
-/* Bitfield of out-of-sequence paquets relative to current buffer start */
-PRIVATE uint32_t oos_mask = 0;
-/* Next in-order sequence number */
-PRIVATE uint8_t expected_seq = 0;
-/* Last received timestamp */
-PRIVATE uint32_t last_ts;
-/* Whether we need to send an ACK or not */
-PRIVATE int need_ack;
-/* Whether we need to send an NACK or not */
-PRIVATE int need_nack = 0;
-/* The sequence number to be sent in the NACK */
-PRIVATE uint8_t nack_seq;
-/* Last written data on the disk */
-PRIVATE int last_written_len = -1;
-
-PRIVATE int rbuf_full()
+PUBLIC int delta_basis = -1;
+PUBLIC const char *resume_file = NULL;
+PUBLIC const char *mux_dir = NULL;
+PUBLIC const char *tree_dir = NULL;
+
+
+PRIVATE uint64_t monotonic_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* (Re)start the idle or linger timer, expiring in ms */
+PRIVATE void timer_restart(receive_t *rx, unsigned int ms)
+{
+	rx->timer_at = monotonic_us() + ms * 1000ULL;
+}
+
+PRIVATE int rbuf_full(const receive_t *rx)
 {
 	/* Could also be window_size() == 0 (albeit slower) */
-	return __builtin_popcount(oos_mask) >= max_window;
+	return __builtin_popcount(rx->oos_mask) >= rx->max_window;
 }
 
-PRIVATE int can_empty_rbuf()
+PRIVATE int can_empty_rbuf(const receive_t *rx)
 {
 	/* We can start emptying the receive buffer iff not empty and have a first
 	 * packet in-sequence */
-	return !pktbuf_empty(recv_buf) && (oos_mask & 1);
+	return !pktbuf_empty(rx->recv_buf) && (rx->oos_mask & 1);
 }
 
-PRIVATE unsigned int window_size() {
+PRIVATE unsigned int window_size(const receive_t *rx) {
 	unsigned int in_seq_count = 0;
-	uint32_t mask = oos_mask;
+	uint32_t mask = rx->oos_mask;
 
 	/* Count the number of consecutive in-sequence packet */
 	for (; mask & 1; mask >>= 1)
 		++in_seq_count;
 
-	return max_window - in_seq_count;
+	return rx->max_window - in_seq_count;
 }
 
-PRIVATE int send_ack()
+/* The timestamp to put in our ACK's and NACK's */
+PRIVATE uint32_t ack_timestamp(receive_t *rx)
 {
-	static pkt_t pkt = {
+	uint8_t flags = 0;
+
+	if (!rx->ext_enabled)
+		return rx->last_ts;
+	if (!rx->ext_confirmed)
+		return EXT_ACCEPT(rx->ext_features);
+	if (rx->ext_features & EXT_ECN)
+		flags |= EXT_ACK_CE(rx->ce_count);
+	/* Pulling packets matters more than echoing the clock */
+	if (rx->ext_features & EXT_PULL)
+		return EXT_ACK_TS(flags | EXT_ACK_PULL, pull_credit(&rx->pull));
+	return EXT_ACK_TS(flags, EXT_TS_CLOCK(rx->last_ts));
+}
+
+PRIVATE int send_ack(receive_t *rx)
+{
+	pkt_t pkt = {
 		.type = PTYPE_ACK,
 		.length = 0,
 		.payload = {0},
 	};
 
-	pkt.seq = expected_seq;
-	pkt.ts = last_ts;
-	pkt.window = window_size();
+	pkt.seq = rx->expected_seq;
+	pkt.ts = ack_timestamp(rx);
+	pkt.window = window_size(rx);
+	/* The pending records are only sent once, the sender asks again if
+	 * they get lost */
+	memcpy(pkt.payload, rx->ack_payload, rx->ack_len);
+	/* Tell where we can resume along with our acceptance */
+	if (rx->resume_pending && !rx->ext_confirmed &&
+			checkpoint_reply(pkt.payload, sizeof(pkt.payload), &rx->ack_len))
+		return -1;
+	pkt.length = rx->ack_len;
+	rx->ack_len = 0;
 	pkt_encode_inline(&pkt);
-	return net_send(&pkt);
+	return net_send(rx->sock, &pkt);
 }
 
-PRIVATE int send_nack(uint8_t seq)
+PRIVATE int send_nack(receive_t *rx, uint8_t seq)
 {
-	static pkt_t pkt = {
+	pkt_t pkt = {
 		.type = PTYPE_NACK,
 		.length = 0,
 		.payload = {0},
 	};
 
 	pkt.seq = seq;
-	pkt.ts = last_ts;
-	pkt.window = window_size();
+	pkt.ts = ack_timestamp(rx);
+	if (rx->nack_corrupt)
+		pkt.ts |= EXT_ACK_TS(EXT_ACK_CORRUPT, 0);
+	pkt.window = window_size(rx);
 	pkt_encode_inline(&pkt);
-	return net_send(&pkt);
+	return net_send(rx->sock, &pkt);
 }
 
-PRIVATE int discard_incoming_data()
+PRIVATE int discard_incoming_data(const receive_t *rx)
 {
 	char buf[PKT_MAX_LEN];
 	/* Discard data from the socket buffer but report errors */
-	if (read(net_fd, buf, sizeof(buf)) == - 1) {
+	if (read(rx->sock, buf, sizeof(buf)) == - 1) {
 		perror("Cannot process incoming data");
 		return -1;
 	}
@@ -105,61 +152,101 @@ PRIVATE int discard_incoming_data()
 	return 0;
 }
 
-PRIVATE int process_incoming_pkt(pkt_t *pkt, unsigned int win)
+PRIVATE int process_incoming_pkt(receive_t *rx, pkt_t *pkt,
+		unsigned int win)
 {
 	uint8_t gap, distance, received_seq;
 	pkt_t *stored_pkt;
 
 	DEBUG("Processing incoming packet #%u in window of %u", pkt->seq, win);
-	last_ts = pkt->ts;
+	rx->last_ts = pkt->ts;
+	/* Any packet but the first one follows the extended layout */
+	if (rx->ext_enabled && !rx->ext_confirmed && !EXT_IS_OFFER(pkt->ts))
+		rx->ext_confirmed = 1;
 	/* Distance from the start of the buffer, to the expected one */
-	distance = (oos_mask & 1) ? /* Do we have any packet in sequence? */
-		(expected_seq - pktbuf_first(recv_buf)->seq - 1) : 0;
+	distance = (rx->oos_mask & 1) ? /* Do we have any packet in sequence? */
+		(rx->expected_seq - pktbuf_first(rx->recv_buf)->seq) : 0;
 	/* Gap between the expected next sequence number, and the received one. */
-	gap = pkt->seq - expected_seq;
+	gap = pkt->seq - rx->expected_seq;
 	if (pkt->tr) {
 		LOG("Packet #%u is truncated!", pkt->seq);
-		need_nack = 1;
-		nack_seq = pkt->seq;
+		/* The path is congested, slow down */
+		if (rx->ext_features & EXT_PULL)
+			pull_truncated(&rx->pull);
+		rx->need_nack = 1;
+		rx->nack_seq = pkt->seq;
+		rx->nack_corrupt = 0;
 		if (gap > 0) {
 			/* Restore the seqnum on the first slot as its been erased */
-			pkt->seq = expected_seq;
+			pkt->seq = rx->expected_seq;
 		}
 		return 0;
 	}
-	oos_mask |= 1 << (distance + gap);
+	/* The end of the data, but for the empty main input of streams */
+	if (!pkt->length && !(EXT_IS_OFFER(pkt->ts) &&
+				(rx->ext_features & EXT_MUX))) {
+		rx->eof_seen = 1;
+		rx->eof_seq = pkt->seq;
+	}
+	rx->oos_mask |= 1 << (distance + gap);
 	if (gap > 0) {
 		LOG("Received an out-of-sequence packet "
-				"[#: %u, expected: %u, win: %d]", pkt->seq, expected_seq, win);
+				"[#: %u, expected: %u, win: %d]", pkt->seq, rx->expected_seq,
+				win);
 		received_seq = pkt->seq;
 		/* Restore the seqnum on the first slot as its been erased */
-		pkt->seq = expected_seq;
+		pkt->seq = rx->expected_seq;
 		/* Copy the packet further down in the buffer, the current copy will
 		 * be overwritten when we receive the missing in-sequence packet */
-		stored_pkt = pktbuf_slotfor_seq(recv_buf, received_seq);
+		stored_pkt = pktbuf_slotfor_seq(rx->recv_buf, received_seq);
 		memcpy(stored_pkt, pkt, sizeof(*pkt));
 		stored_pkt->seq = received_seq;
 	} else {
 		/* Increase the expected next sequence number taking into account
 		 * possible out-of-order packets received earlier, as well as already
 		 * ack'ed packets still present in the buffer. */
-		expected_seq += max_window - window_size();
+		rx->expected_seq += rx->max_window - window_size(rx) - distance;
 	}
-	DEBUG("New expected seq: %u, new oos_mask: %u", expected_seq, oos_mask);
+	DEBUG("New expected seq: %u, new oos_mask: %u", rx->expected_seq,
+			rx->oos_mask);
 	return 0;
 }
 
-PRIVATE int do_receive_data()
+/* The sender closed the connection, once it had all the data
+ * acknowledged */
+PRIVATE int handle_close(receive_t *rx)
+{
+	++rx->expected_seq;
+	rx->closed = 1;
+	LOG("The sender closed the connection");
+	if (send_ack(rx))
+		goto_trace(fail, "Could not acknowledge the close");
+	return 0;
+
+fail:
+	return -1;
+}
+
+PRIVATE int do_receive_data(receive_t *rx)
 {
 	pkt_t *pkt;
 	int err;
 	unsigned int win;
 
-	win = window_size();
-	pkt = pktbuf_slotfor_seq(recv_buf, expected_seq);
-	if ((err = net_recv_pkt(pkt, expected_seq, win)) != NET_OK) {
+	win = window_size(rx);
+	pkt = pktbuf_slotfor_seq(rx->recv_buf, rx->expected_seq);
+	if ((err = net_recv_pkt(rx->sock, pkt, rx->expected_seq, win,
+					&rx->ce_count)) == NET_CORRUPT &&
+			rx->ext_confirmed && pkt->type == PTYPE_DATA) {
+		/* Have it sent again right away, instead of waiting for the
+		 * retransmission timer of the sender */
+		rx->need_nack = 1;
+		rx->nack_seq = pkt->seq;
+		rx->nack_corrupt = 1;
+	}
+	if (err != NET_OK) {
 		/* Restore the buffer space seqnum */
-		pkt->seq = expected_seq;
+		pkt->seq = rx->expected_seq;
 		/* Propagate any I/O error, ignore drops */
 		return err == NET_ERROR;
 	}
@@ -167,62 +254,323 @@ PRIVATE int do_receive_data()
 		ERROR("Dropping wrong packet type [%u instead of %u]",
 		pkt->type, PTYPE_DATA);
 		/* Restore the buffer space seqnum */
-		pkt->seq = expected_seq;
+		pkt->seq = rx->expected_seq;
 		/* Do not propagate the error */
 		return 0;
 	}
-	return process_incoming_pkt(pkt, win);
+	/* An empty chunk past the EOF one closes the connection, even if the
+	 * EOF has yet to be written out */
+	if (rx->eof_seen && !pkt->length && pkt->seq == rx->expected_seq &&
+			pkt->seq == (uint8_t)(rx->eof_seq + 1)) {
+		pkt->seq = rx->expected_seq;
+		return handle_close(rx);
+	}
+	/* The network is about to drop packets, pull less of them */
+	if (rx->ce_seen != rx->ce_count) {
+		rx->ce_seen = rx->ce_count;
+		if (rx->ext_features & EXT_PULL)
+			pull_truncated(&rx->pull);
+	}
+	return process_incoming_pkt(rx, pkt, win);
+}
+
+/* How to interpret the payload of a packet */
+PRIVATE int payload_kind(const receive_t *rx, const pkt_t *pkt)
+{
+	return rx->ext_confirmed ? EXT_TS_KIND(pkt->ts) : EXT_KIND_RAW;
+}
+
+/* Where to write the data of a packet */
+PRIVATE int output_fd(const receive_t *rx, const pkt_t *pkt)
+{
+	/* The first packet carries the offer instead of its stream */
+	if (!(rx->ext_features & EXT_MUX) || EXT_IS_OFFER(pkt->ts) ||
+			!EXT_TS_STREAM(pkt->ts))
+		return rx->out_fd;
+	return mux_fd(EXT_TS_STREAM(pkt->ts));
+}
+
+/* Writer of the output of the transfer consuming the ring, only one doing so
+ * at a time */
+PRIVATE output_writer shm_writer;
+
+/* Writer of the data passed through shared memory, checkpointing it as
+ * do_empty_rbuf() does. The sender writes its input to the ring as it comes,
+ * it is written out as it is consumed. */
+PRIVATE int write_checkpointed(int fd, const void *buf, size_t len)
+{
+	return shm_writer(fd, buf, len) || output_idle(fd) ||
+		checkpoint_save(fd, 0) ? -1 : 0;
+}
+
+/* The sender announced the ring the rest of its input goes through */
+PRIVATE int receive_shm(receive_t *rx, const char *rec, uint8_t len)
+{
+	char reply = !shm_attach(rec, len);
+	int err = 0;
+
+	/* Answer before the sender waits for us to consume the ring */
+	if (rx->ack_len && send_ack(rx))
+		goto fail;
+	ext_rec_put(rx->ack_payload, sizeof(rx->ack_payload), &rx->ack_len,
+			EXT_REC_SHM, &reply, sizeof(reply));
+	if (send_ack(rx))
+		goto fail;
+	shm_writer = rx->out_writer;
+	if (reply)
+		err = shm_receive(write_checkpointed, rx->out_fd);
+	shm_free();
+	return err;
+
+fail:
+	shm_free();
+	return -1;
+}
+
+/* Process the control records of a packet */
+PRIVATE int handle_ctrl(receive_t *rx, const pkt_t *pkt)
+{
+	ext_rec_t rec;
+	size_t off = 0;
+	int err;
+
+	/* The records act on the output directly */
+	if (output_flush(rx->out_fd) || prealloc_stop(rx->out_fd))
+		goto_trace(fail, "Cannot write the output: %s", strerror(errno));
+	while ((err = ext_rec_next(pkt->payload, pkt->length, &off, &rec)) > 0) {
+		switch (rec.type) {
+			case EXT_REC_HOLE:
+				if (!(rx->ext_features & EXT_SPARSE) ||
+						rec.len != sizeof(uint64_t))
+					goto_trace(fail, "Unexpected hole record");
+				if (sparse_write_hole(rx->out_fd, ext_get_u64(rec.value)))
+					goto fail;
+				break;
+			case EXT_REC_SIGREQ:
+				if (!(rx->ext_features & EXT_DELTA) ||
+						rec.len != sizeof(uint32_t))
+					goto_trace(fail, "Unexpected signature request");
+				/* Each answer fills most of an ACK */
+				if (rx->ack_len && send_ack(rx))
+					goto fail;
+				if (delta_reply(ext_get_u32(rec.value), rx->ack_payload,
+							sizeof(rx->ack_payload), &rx->ack_len))
+					goto fail;
+				rx->need_ack = 1;
+				break;
+			case EXT_REC_COPY:
+				if (!(rx->ext_features & EXT_DELTA) ||
+						rec.len != 2 * sizeof(uint32_t))
+					goto_trace(fail, "Unexpected block reference");
+				if (delta_copy(rx->out_fd, ext_get_u32(rec.value),
+							ext_get_u32(rec.value + sizeof(uint32_t))))
+					goto fail;
+				break;
+			case EXT_REC_RESUME:
+				if (!rx->resume_pending || rec.len != sizeof(uint64_t))
+					goto_trace(fail, "Unexpected resume record");
+				if (checkpoint_resume(rx->out_fd, ext_get_u64(rec.value)))
+					goto fail;
+				rx->resume_pending = 0;
+				break;
+			case EXT_REC_DIGEST:
+				if (!(rx->ext_features & EXT_DELTA) ||
+						delta_check(rec.value, rec.len))
+					goto fail;
+				break;
+			case EXT_REC_OPEN:
+				if (!(rx->ext_features & EXT_MUX))
+					goto_trace(fail, "Unexpected stream");
+				if (mux_open(EXT_TS_STREAM(pkt->ts), rec.value, rec.len))
+					goto fail;
+				break;
+			case EXT_REC_SHM:
+				if (!(rx->ext_features & EXT_SHM))
+					goto_trace(fail, "Unexpected shared memory");
+				if (receive_shm(rx, rec.value, rec.len))
+					goto fail;
+				break;
+			case EXT_REC_SIZE:
+				if (!(rx->ext_features & EXT_SIZE) ||
+						rec.len != sizeof(uint64_t))
+					goto_trace(fail, "Unexpected size record");
+				if (prealloc_start(rx->out_fd, ext_get_u64(rec.value)))
+					goto_trace(fail, "Cannot map the output: %s",
+							strerror(errno));
+				if (rx->out_writer == output_write)
+					rx->out_writer = prealloc_write;
+				break;
+			case EXT_REC_END:
+				if (!(rx->ext_features & EXT_MUX) || rec.len)
+					goto_trace(fail, "Unexpected end of stream");
+				if (mux_close(EXT_TS_STREAM(pkt->ts)))
+					goto fail;
+				break;
+			default:
+				ERROR("Ignoring unknown control record %u", rec.type);
+				break;
+		}
+	}
+	if (err < 0)
+		goto_trace(fail, "Malformed control record in packet #%u", pkt->seq);
+	return 0;
+
+fail:
+	return -1;
+}
+
+/* Write out the packets of other streams than the missing ones, once the
+ * previous packet of their stream is, see EXT_MUX.
+ * @return: the number of packets written, -1 on error */
+PRIVATE int write_early(receive_t *rx)
+{
+	unsigned int i, distance, written = 0;
+	pkt_t *pkt;
+	int fd;
+
+	for (i = 1; i < rx->max_window; ++i) {
+		if (stage_active() && !stage_room())
+			break;
+		if (!(rx->oos_mask & (1U << i)) || (rx->early_mask & (1U << i)))
+			continue;
+		pkt = pktbuf_slotfor_seq(rx->recv_buf, rx->expected_seq + i);
+		distance = pkt->window;
+		/* The end of the transfer, and the records acting on the main
+		 * output, stay in order */
+		if (!pkt->length || payload_kind(rx, pkt) == EXT_KIND_DEFLATE ||
+				(payload_kind(rx, pkt) == EXT_KIND_CTRL &&
+				 !EXT_TS_STREAM(pkt->ts)))
+			continue;
+		/* The previous packet of its stream has yet to be written */
+		if (distance && distance <= i &&
+				!(rx->early_mask & (1U << (i - distance))))
+			continue;
+		if (payload_kind(rx, pkt) == EXT_KIND_CTRL) {
+			if (handle_ctrl(rx, pkt))
+				goto_trace(fail, "Failed to process the control packet #%u",
+						pkt->seq);
+		} else {
+			if ((fd = output_fd(rx, pkt)) == -1)
+				goto_trace(fail, "Chunk #%u belongs to a closed stream",
+						pkt->seq);
+			if (rx->out_writer(fd, pkt->payload, pkt->length))
+				goto_trace(fail, "Error when writing the output file: %s",
+						strerror(errno));
+		}
+		LOG("Wrote chunk #%u ahead of #%u", pkt->seq, rx->expected_seq);
+		rx->early_mask |= 1U << i;
+		++written;
+	}
+	return written;
+
+fail:
+	return -1;
 }
 
-PRIVATE int do_empty_rbuf()
+PRIVATE int do_empty_rbuf(receive_t *rx)
 {
-	ssize_t err;
+	unsigned int drained = 0;
 	pkt_t *pkt;
+	int fd, early;
 
-	while (oos_mask & 1) {
-		ASSERT(!pktbuf_empty(recv_buf), "OOS mask cannot be full if the buffer "
-				" is empty!");
+	while (rx->oos_mask & 1) {
+		/* Keep the packets until the writer catches up, closing the
+		 * window */
+		if (stage_active() && !stage_room())
+			break;
+		ASSERT(!pktbuf_empty(rx->recv_buf), "OOS mask cannot be full if the "
+				"buffer is empty!");
 		/* Get the first packet of the buffer */
-		pkt = pktbuf_first(recv_buf);
+		pkt = pktbuf_first(rx->recv_buf);
 		/* Track the payload len, as it indicates the end of the transfert
 		 * if it is equals to 0 */
-		if ((last_written_len = pkt->length) != 0) {
+		if (rx->early_mask & 1) {
+			LOG("Chunk #%u was written ahead", pkt->seq);
+			rx->last_written_len = pkt->length;
+		} else if (!pkt->length && EXT_IS_OFFER(pkt->ts) &&
+				(rx->ext_features & EXT_MUX)) {
+			/* Only the main input is empty, not the other streams */
+			LOG("Chunk #%u is empty", pkt->seq);
+		} else if ((rx->last_written_len = pkt->length) != 0 &&
+				payload_kind(rx, pkt) == EXT_KIND_DEFLATE) {
+			/* Inflate it to disk */
+			if (decompress_write(rx->decompress, rx->out_writer, rx->out_fd,
+						pkt->payload, pkt->length))
+				goto_trace(fail, "Failed to decompress packet #%u", pkt->seq);
+			LOG("Inflated chunk #%u", pkt->seq);
+		} else if (rx->last_written_len != 0 &&
+				payload_kind(rx, pkt) == EXT_KIND_CTRL) {
+			if (handle_ctrl(rx, pkt))
+				goto_trace(fail, "Failed to process the control packet #%u",
+						pkt->seq);
+		} else if (rx->last_written_len != 0 && rx->resume_pending) {
+			LOG("Chunk #%u is already in the output", pkt->seq);
+		} else if (rx->last_written_len != 0) {
+			if ((fd = output_fd(rx, pkt)) == -1)
+				goto_trace(fail, "Chunk #%u belongs to a closed stream",
+						pkt->seq);
 			/* Write it to disk */
-			if ((err = write(out_fd, pkt->payload, pkt->length)) < 0) {
-				if (errno == EWOULDBLOCK || errno == EAGAIN) {
-					LOG("Cannot empty the receive buffer further as the output"
-							" stream would block");
-					return 0;
-				}
+			if (rx->out_writer(fd, pkt->payload, pkt->length))
 				goto_trace(fail, "Error when writing the output file: %s",
 						strerror(errno));
-			} else if (err != pkt->length)
-				goto_trace(fail, "Failed to write the complete packet #%u out "
-						"[%ld vs %u]", pkt->seq, err, pkt->length);
+			if (rx->ext_features & EXT_DELTA)
+				delta_update(pkt->payload, pkt->length);
 			LOG("Wrote chunk #%u", pkt->seq);
-		} else LOG("Chunk #%u indicates the end of the transfert.", pkt->seq);
-		pktbuf_dequeue(recv_buf);
-		oos_mask >>= 1;
+		} else {
+			LOG("Chunk #%u indicates the end of the transfert.", pkt->seq);
+			/* Only acknowledge the end once it is written */
+			if (stage_active() ? stage_finish() :
+					prealloc_finish(rx->out_fd) || output_finish(rx->out_fd))
+				goto_trace(fail, "Cannot write the output");
+			if ((rx->ext_features & EXT_SPARSE) && sparse_finish(rx->out_fd))
+				goto_trace(fail, "Cannot extend the output over its last hole");
+			if ((rx->ext_features & EXT_TREE) && tree_finish())
+				goto_trace(fail, "Cannot complete the received tree");
+			/* An empty input never gets to tell where to resume */
+			if ((rx->resume_pending && checkpoint_resume(rx->out_fd, 0)) ||
+					checkpoint_finish(rx->out_fd))
+				goto_trace(fail, "Cannot discard the output checkpoint");
+			rx->resume_pending = 0;
+		}
+		/* Packets written ahead were pulled for already */
+		if (!(rx->early_mask & 1))
+			++drained;
+		pktbuf_dequeue(rx->recv_buf);
+		rx->oos_mask >>= 1;
+		rx->early_mask >>= 1;
 	}
+	/* Do not let a loss in one stream hold back the others */
+	if (!(rx->oos_mask & 1) && (rx->ext_features & EXT_MUX)) {
+		if ((early = write_early(rx)) == -1)
+			goto fail;
+		drained += early;
+	}
+	/* Pull as many packets as we wrote out */
+	if (drained && (rx->ext_features & EXT_PULL)) {
+		pull_drained(&rx->pull, drained);
+		rx->need_ack = 1;
+	}
+	if (checkpoint_save(rx->out_fd, 0))
+		goto_trace(fail, "Cannot save a checkpoint of the output");
 	return 0;
 
 fail:
 	return -1;
 }
 
-PRIVATE int do_read_sock()
+PRIVATE int do_read_sock(receive_t *rx)
 {
-	return !rbuf_full() ? do_receive_data() : discard_incoming_data();
+	return !rbuf_full(rx) ? do_receive_data(rx) : discard_incoming_data(rx);
 }
 
-PRIVATE int unblock_out_file()
+PRIVATE int unblock_out_file(const receive_t *rx)
 {
 	int flags;
 
-	if ((flags = fcntl(out_fd, F_GETFD)) == -1)
+	if ((flags = fcntl(rx->out_fd, F_GETFD)) == -1)
 		goto_errno(fail);
 	flags |= O_NONBLOCK;
-	if ((flags = fcntl(out_fd, F_SETFD, &flags)) == -1)
+	if ((flags = fcntl(rx->out_fd, F_SETFD, &flags)) == -1)
 		goto_errno(fail);
 	return 0;
 
@@ -230,15 +578,230 @@ fail:
 	return -1;
 }
 
-int receive(int fd, pktbuf_t *rbuf)
+/* The sender offered to use some extensions */
+PRIVATE void handle_ext_offer(receive_t *rx, uint16_t offer)
 {
-	int err, retry, pfds_count;
-	struct pollfd pfds[2];
-#define poll_file pfds[0]
-#define poll_socket pfds[1]
+	rx->ext_enabled = 1;
+	rx->ext_features = offer & EXT_SUPPORTED;
+	/* The program reading the data only gets its bytes, in order */
+	if (rx->out_fd == -1)
+		rx->ext_features &= EXT_DEFLATE | EXT_PULL | EXT_ECN;
+	if ((rx->ext_features & EXT_DEFLATE) &&
+			!(rx->decompress = decompress_new()))
+		rx->ext_features &= ~EXT_DEFLATE;
+	/* Delta transfers need a previous copy of the output */
+	if ((rx->ext_features & EXT_DELTA) &&
+			(delta_basis == -1 || delta_init(delta_basis)))
+		rx->ext_features &= ~EXT_DELTA;
+	if (!resume_file)
+		rx->ext_features &= ~EXT_RESUME;
+	if (rx->ext_features & EXT_PULL)
+		pull_init(&rx->pull, rx->max_window);
+	/* The sender only marks its packets once we accepted */
+	if ((rx->ext_features & EXT_ECN) && net_ecn_watch(rx->sock) != NET_OK)
+		rx->ext_features &= ~EXT_ECN;
+	/* The other streams need somewhere to go */
+	if ((rx->ext_features & EXT_MUX) && (!mux_dir || mux_init(mux_dir)))
+		rx->ext_features &= ~EXT_MUX;
+	/* Without a directory, the serialized tree goes to the output */
+	if ((rx->ext_features & EXT_TREE) && (!tree_dir || tree_init(tree_dir)))
+		rx->ext_features &= ~EXT_TREE;
+	if (rx->ext_features & EXT_TREE)
+		rx->out_writer = tree_write;
+	/* Holes would be made in the output behind the back of the writer */
+	if (stage_active())
+		rx->ext_features &= ~(EXT_SPARSE | EXT_SIZE);
+	/* Only processes on the same host can share memory */
+	if ((rx->ext_features & EXT_SHM) && !net_peer_is_local(rx->sock))
+		rx->ext_features &= ~EXT_SHM;
+	/* A stripe alone is not the whole input */
+	if (!stripe_attached())
+		rx->ext_features &= ~EXT_STRIPE;
+	LOG("Accepting extensions %#x [offered: %#x]", rx->ext_features, offer);
+}
+
+/* The transfer cannot go on */
+PRIVATE void abort_transfer(receive_t *rx)
+{
+	if (rx->state == RECEIVE_FAILED)
+		return;
+	rx->state = RECEIVE_FAILED;
+	rx->timer_at = 0;
+	if (rx->out_fd == -1)
+		return;
+	/* Keep what we have for a later attempt, without the space reserved
+	 * past it */
+	if (prealloc_finish(rx->out_fd))
+		ERROR("Cannot write the output: %s", strerror(errno));
+	if (!rx->resume_pending && checkpoint_save(rx->out_fd, 1))
+		ERROR("Cannot save a checkpoint of the output");
+}
+
+/* All the data was received, answer the sender until it closes */
+PRIVATE void end_of_data(receive_t *rx)
+{
+	if (rx->closed) {
+		rx->state = RECEIVE_DONE;
+		rx->timer_at = 0;
+		return;
+	}
+	LOG("Sending last ACK #%u", rx->expected_seq);
+	rx->state = RECEIVE_LINGER;
+	rx->retry = 0;
+	timer_restart(rx, LINGER);
+}
+
+/* Start the transfer with the first packet of the sender */
+PRIVATE int start_transfer(receive_t *rx, const pkt_t *first)
+{
+	pkt_t *slot = pktbuf_enqueue(rx->recv_buf);
+
+	memcpy(slot, first, sizeof(*slot));
+	rx->state = RECEIVE_RUNNING;
+	timer_restart(rx, IDLE_TIME);
+	if (EXT_IS_OFFER(slot->ts))
+		handle_ext_offer(rx, EXT_FEATURES(slot->ts));
+	/* Either wait for the sender to confirm where to resume, or start over */
+	if ((rx->ext_features & EXT_RESUME) && checkpoint_offset())
+		rx->resume_pending = 1;
+	else if (rx->out_fd != -1 && checkpoint_resume(rx->out_fd, 0))
+		goto_trace(fail, "Cannot reset the output");
+	process_incoming_pkt(rx, slot, window_size(rx));
+	rx->need_ack = 1;
+	return 0;
+
+fail:
+	return -1;
+}
+
+/* Take the first packet of a sender reaching the socket, and connect to it */
+PRIVATE int handle_listen(receive_t *rx)
+{
+	struct sockaddr_storage addr = {0};
+	socklen_t addrlen = sizeof(addr);
+	pkt_t pkt;
+	int err;
+
+	if (++rx->retry > MAX_RETRIES)
+		goto_trace(fail, "Giving up after %d retries", MAX_RETRIES);
+	if ((err = net_recv_from(rx->sock, &pkt, (struct sockaddr*)&addr,
+					&addrlen)) == NET_ERROR)
+		goto_trace(fail, "I/O error");
+	if (err != NET_OK)
+		return 0;
+	if (pkt.seq != INITIAL_SEQNUM) {
+		trace_error("Ignoring packet with seqnum #%u != expected:%u",
+				pkt.seq, INITIAL_SEQNUM);
+		return 0;
+	}
+	if (net_connect_peer(rx->sock, (struct sockaddr*)&addr, addrlen) !=
+			NET_OK)
+		goto fail;
+	return start_transfer(rx, &pkt);
+
+fail:
+	return -1;
+}
+
+PRIVATE int handle_data(receive_t *rx)
+{
+	timer_restart(rx, IDLE_TIME);
+	if (do_read_sock(rx))
+		goto_trace(fail, "Cannot read the socket");
+	/* Schedule an ACK to help to resync the sender, if the packet was not
+	 * truncated */
+	if (!rx->need_nack)
+		rx->need_ack = 1;
+	return 0;
+
+fail:
+	return -1;
+}
 
-	recv_buf = rbuf;
-	out_fd = fd;
+/* Answer the sender, which missed our last ACK, or closes the connection */
+PRIVATE int handle_linger(receive_t *rx)
+{
+	pkt_t pkt;
+	int err;
+
+	timer_restart(rx, LINGER);
+	/* An error means that the sender is already gone */
+	if ((err = net_recv_pkt(rx->sock, &pkt, rx->expected_seq - 1, 1,
+					NULL)) == NET_ERROR) {
+		rx->state = RECEIVE_DONE;
+		return 0;
+	}
+	/* An empty chunk past the EOF one closes the connection */
+	if (err == NET_OK && pkt.type == PTYPE_DATA &&
+			pkt.seq == rx->expected_seq && !pkt.length) {
+		if (handle_close(rx))
+			goto fail;
+		rx->state = RECEIVE_DONE;
+		return 0;
+	}
+	if (send_ack(rx))
+		goto_trace(fail, "Could not send the final ACK packet");
+	if (++rx->retry == MAX_LINGER_RETRY) {
+		ERROR("Could not successfully send an ACK after %d tries!",
+				MAX_LINGER_RETRY);
+		rx->state = RECEIVE_DONE;
+	}
+	return 0;
+
+fail:
+	return -1;
+}
+
+/* Process a packet waiting on the socket */
+PRIVATE int handle_socket_read(receive_t *rx)
+{
+	switch (rx->state) {
+		case RECEIVE_LISTEN:
+			return handle_listen(rx);
+		case RECEIVE_RUNNING:
+			return handle_data(rx);
+		case RECEIVE_LINGER:
+			return handle_linger(rx);
+		default:
+			return 0;
+	}
+}
+
+/* Write what we can of the buffer to the output file */
+PRIVATE int flush_rbuf(receive_t *rx)
+{
+	if (do_empty_rbuf(rx))
+		goto_trace(fail, "Cannot write the received data");
+	if (!rx->last_written_len && pktbuf_empty(rx->recv_buf))
+		end_of_data(rx);
+	return 0;
+
+fail:
+	return -1;
+}
+
+/* Send the ACK and NACK called for since the last ones */
+PRIVATE int send_pending(receive_t *rx)
+{
+	/* Send an ACK with the updated window size */
+	if (rx->need_ack && send_ack(rx))
+		goto_trace(fail, "Could not send an ACK packet");
+	/* Send a NACK with the needed sequence number */
+	if (rx->need_nack && send_nack(rx, rx->nack_seq))
+		goto_trace(fail, "Could not send a NACK packet");
+	/* Don't send an ACK unless we received data */
+	rx->need_ack = 0;
+	/* Don't send a NACK unless we received truncated data */
+	rx->need_nack = 0;
+	return 0;
+
+fail:
+	return -1;
+}
+
+/* Get the output file ready for the transfer */
+PRIVATE int prepare_output(receive_t *rx)
+{
 	/* Because poll only tells us if the FD is in a ready state,
 	 * we also need to make sure that our calls when writing to it won't block
 	 * as well.
@@ -246,83 +809,281 @@ int receive(int fd, pktbuf_t *rbuf)
 	 * guaranteed to be delivered in a single packet (ii) read is specified
 	 * to return immediately if the FD is in a ready state, possibly returning
 	 * less data than requested.*/
-	if (unblock_out_file())
+	if (unblock_out_file(rx))
 		goto_trace(fail, "Cannot set the output file as non-blocking");
+	if (resume_file && checkpoint_load(resume_file, rx->out_fd))
+		goto_trace(fail, "Cannot load the checkpoint of the output");
+	if (output_open(rx->out_fd))
+		goto_trace(fail, "Cannot prepare the output");
+	if (stage_size) {
+		if (stage_start(rx->out_fd))
+			goto_trace(fail, "Cannot start the writer of the output");
+		rx->out_writer = stage_write;
+	}
+	return 0;
 
-	pkt_t *slot = pktbuf_enqueue(recv_buf);
-	if (net_wait_and_connect(slot, INITIAL_SEQNUM))
-		goto fail;
-	process_incoming_pkt(slot, window_size());
-	need_ack = 1;
+fail:
+	return -1;
+}
+
+receive_t *receive_new(int sock, const pkt_t *first, int output,
+		const trtp_options_t *opts)
+{
+	receive_t *rx;
+
+	if (!(rx = calloc(1, sizeof(*rx))))
+		goto_trace(fail, "Cannot allocate the transfer");
+	rx->sock = sock;
+	rx->out_fd = output;
+	rx->max_window = opts->window && opts->window < MAX_WINDOW_SIZE ?
+		opts->window : MAX_WINDOW_SIZE;
+	rx->last_written_len = -1;
+	rx->out_writer = output_write;
+	if (!(rx->recv_buf = pktbuf_new(RBUF_SIZE)))
+		goto_trace(fail_free, "Cannot allocate the receive buffer");
+	if (output != -1 && prepare_output(rx))
+		goto fail_free;
+	if (first) {
+		if (start_transfer(rx, first))
+			goto fail_free;
+	} else {
+		LOG("Waiting to receive data #%u from the remote endpoint",
+				INITIAL_SEQNUM);
+		rx->state = RECEIVE_LISTEN;
+	}
+	return rx;
+
+fail_free:
+	/* The socket stays with the caller */
+	rx->sock = -1;
+	abort_transfer(rx);
+	receive_free(rx);
+fail:
+	return NULL;
+}
+
+void receive_free(receive_t *rx)
+{
+	if (rx->out_fd != -1) {
+		delta_free();
+		checkpoint_free();
+		mux_free();
+		tree_free();
+		stage_free();
+		prealloc_free();
+		output_free();
+	}
+	decompress_free(rx->decompress);
+	pktbuf_free(rx->recv_buf);
+	if (rx->sock != -1)
+		close(rx->sock);
+	free(rx);
+}
+
+void receive_socket(receive_t *rx)
+{
+	struct pollfd pfd = { .fd = rx->sock, .events = POLLIN };
+
+	while (receive_result(rx) == TRTP_RUNNING && poll(&pfd, 1, 0) > 0) {
+		if (handle_socket_read(rx) ||
+				(rx->state == RECEIVE_RUNNING && rx->out_fd != -1 &&
+				 can_empty_rbuf(rx) && flush_rbuf(rx)) ||
+				send_pending(rx)) {
+			abort_transfer(rx);
+			return;
+		}
+	}
+}
+
+/* Done with the first packet of the buffer */
+PRIVATE void consume_first(receive_t *rx)
+{
+	pktbuf_dequeue(rx->recv_buf);
+	rx->oos_mask >>= 1;
+	rx->early_mask >>= 1;
+	rx->read_off = 0;
+}
+
+ssize_t receive_read(receive_t *rx, char *buf, size_t len)
+{
+	unsigned int drained = 0;
+	size_t copied = 0, left, room;
+	const char *data;
+	pkt_t *pkt;
+	ssize_t n;
+	int kind;
+
+	PRECONDITION(rx->out_fd == -1, -1);
+	if (rx->state == RECEIVE_FAILED) {
+		errno = ECONNABORTED;
+		return -1;
+	}
+	if (rx->state == RECEIVE_LINGER || rx->state == RECEIVE_DONE)
+		return 0;
+	while (copied < len && (rx->oos_mask & 1)) {
+		pkt = pktbuf_first(rx->recv_buf);
+		if (!pkt->length) {
+			LOG("Chunk #%u indicates the end of the transfert.", pkt->seq);
+			rx->last_written_len = 0;
+			consume_first(rx);
+			++drained;
+			end_of_data(rx);
+			break;
+		}
+		data = pkt->payload + rx->read_off;
+		left = pkt->length - rx->read_off;
+		room = len - copied;
+		/* The first packet carries the offer instead of its kind */
+		kind = EXT_IS_OFFER(pkt->ts) ? EXT_KIND_RAW : payload_kind(rx, pkt);
+		if (kind == EXT_KIND_RAW) {
+			n = left < room ? left : room;
+			memcpy(buf + copied, data, n);
+			left -= n;
+		} else if (kind == EXT_KIND_DEFLATE &&
+				(rx->ext_features & EXT_DEFLATE)) {
+			if ((n = decompress_read(rx->decompress, &data, &left,
+							buf + copied, room)) == -1)
+				goto_trace(fail, "Failed to decompress packet #%u", pkt->seq);
+		} else {
+			goto_trace(fail, "Unexpected payload in packet #%u", pkt->seq);
+		}
+		copied += n;
+		rx->read_off = pkt->length - left;
+		/* Inflating a packet may fill buf before its output is over */
+		if (left || (kind == EXT_KIND_DEFLATE && (size_t)n == room))
+			continue;
+		consume_first(rx);
+		++drained;
+	}
+	if (drained && rx->state == RECEIVE_RUNNING) {
+		timer_restart(rx, IDLE_TIME);
+		/* Pull as many packets as we read */
+		if (rx->ext_features & EXT_PULL)
+			pull_drained(&rx->pull, drained);
+		/* The sender waits for the window to reopen */
+		if (send_ack(rx))
+			goto_trace(fail, "Could not send an ACK packet");
+	}
+	if (!copied && rx->state == RECEIVE_RUNNING) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return copied;
+
+fail:
+	abort_transfer(rx);
+	errno = ECONNABORTED;
+	return -1;
+}
+
+void receive_timeout(receive_t *rx)
+{
+	if (!rx->timer_at || monotonic_us() < rx->timer_at)
+		return;
+	if (rx->state == RECEIVE_RUNNING) {
+		ERROR("No I/O acivity in the last %.1fs, aborting transfert!",
+				IDLE_TIME / 1000.0);
+		abort_transfer(rx);
+	} else if (rx->state == RECEIVE_LINGER) {
+		rx->state = RECEIVE_DONE;
+		rx->timer_at = 0;
+	}
+}
+
+int receive_deadline(const receive_t *rx)
+{
+	uint64_t now;
+
+	if (!rx->timer_at || receive_result(rx) != TRTP_RUNNING)
+		return -1;
+	now = monotonic_us();
+	return rx->timer_at > now ? (rx->timer_at - now + 999) / 1000 : 0;
+}
 
-	poll_file.fd = out_fd;
+int receive_result(const receive_t *rx)
+{
+	switch (rx->state) {
+		case RECEIVE_DONE:
+			return 0;
+		case RECEIVE_FAILED:
+			return -1;
+		default:
+			return TRTP_RUNNING;
+	}
+}
+
+int receive(receive_t *rx)
+{
+	struct pollfd pfds[2];
+	int err, pfds_count;
+#define poll_file pfds[0]
+#define poll_socket pfds[1]
+
+	poll_file.fd = rx->out_fd;
 	poll_file.events = POLLOUT;
-	poll_socket.fd = net_fd;
+	poll_file.revents = 0;
+	poll_socket.fd = rx->sock;
 	poll_socket.events = POLLIN;
-	pfds_count = 2;
-	do {
-        err = poll(&pfds[sizeof(pfds) / sizeof(struct pollfd) - pfds_count],
-				pfds_count, IDLE_TIME);
-		if (err < 0)
+	/* Only poll the output once there is something to write */
+	pfds_count = rx->state == RECEIVE_RUNNING ? 2 : 1;
+	while (receive_result(rx) == TRTP_RUNNING) {
+		/* Only wait for more packets once the data gathered for the output
+		 * is written out */
+		err = poll(&pfds[sizeof(pfds) / sizeof(struct pollfd) - pfds_count],
+				pfds_count, output_pending() ? 0 : receive_deadline(rx));
+		if (err < 0) {
+			if (errno == EINTR)
+				continue;
 			goto_errno(fail);
-		else if (err > 0) {
-			/* Process incoming data */
-			if ((poll_socket.revents & (POLLIN | POLLERR | POLLHUP))) {
-				if (do_read_sock())
-					goto_trace(fail, "Cannot read the socket");
-				/* Schedule an ACK to help to resync the sender, if the packet was not truncated */
-				if (!need_nack)
-					need_ack = 1;
-			}
+		} else if (!err && output_pending()) {
+			/* Nothing else arrived, do not hold the data back from a
+			 * reader streaming the output */
+			if (output_idle(rx->out_fd))
+				goto_trace(fail, "Cannot write the received data");
+			continue;
+		} else if (!err) {
+			receive_timeout(rx);
+			continue;
+		}
+		/* Process incoming data */
+		if ((poll_socket.revents & (POLLIN | POLLERR | POLLHUP)) &&
+				handle_socket_read(rx))
+			goto fail;
+		if (rx->state == RECEIVE_RUNNING) {
 			/* Free up buffer space as much as possible. Either because we
 			 * still had data to write after the last poll, or because the
 			 * received packet was in-sequence. */
-			if (((poll_file.revents & (POLLOUT | POLLERR | POLLHUP)) ||
-						can_empty_rbuf()) &&
-					do_empty_rbuf())
-				goto_trace(fail, "Cannot write the received data");
-			/* Send an ACK with the updated window size */
-			if (need_ack && send_ack())
-				goto_trace(fail, "Could not send an ACK packet");
-			/* Send a NACK with the needed sequence number */
-			if (need_nack && send_nack(nack_seq))
-				goto_trace(fail, "Could not send a NACK packet");
-			/* Poll the file for writing iff we have data to write */
-			if (can_empty_rbuf())
-				/* Poll all fd's */
-				pfds_count = 2;
-			else {
-				/* Only poll the socket fd */
-				pfds_count = 1;
-				poll_file.revents = 0;
+			if (((poll_file.revents & (POLLIN | POLLOUT | POLLERR |
+									POLLHUP)) || can_empty_rbuf(rx)) &&
+					flush_rbuf(rx))
+				goto fail;
+			/* The writer made room, the sender waits for the window to
+			 * reopen */
+			if (stage_active() && (poll_file.revents & POLLIN))
+				rx->need_ack = 1;
+		}
+		if (send_pending(rx))
+			goto fail;
+		/* Poll the file for writing iff we have data to write */
+		if (rx->state == RECEIVE_RUNNING && can_empty_rbuf(rx)) {
+			/* Poll all fd's */
+			pfds_count = 2;
+			/* The writer tells when it made room instead */
+			if (stage_active()) {
+				poll_file.fd = stage_fd();
+				poll_file.events = POLLIN;
 			}
-			/* We unconditionally check the socket to send 0-sized window
-			 * if the output file is blocking */
-		} else
-			goto_trace(fail, "No I/O acivity in the last %.1fs, aborting "
-					"transfert!", IDLE_TIME / 1000.0);
-		/* Don't send an ACK unless we received data */
-		need_ack = 0;
-		/* Don't send a NACK unless we received truncated data */
-		need_nack = 0;
-	} while (last_written_len != 0 || !pktbuf_empty(recv_buf));
-
-	LOG("Sending last ACK #%u", expected_seq);
-	retry = 0;
-	while ((err = poll(&poll_socket, 1, LINGER)) != 0 &&
-			retry < MAX_LINGER_RETRY) {
-		if (err < 0)
-			goto_errno(fail);
-		if (send_ack())
-			goto_trace(fail, "Could not send the final ACK packet");
-		++retry;
+		} else {
+			/* Only poll the socket fd */
+			pfds_count = 1;
+			poll_file.revents = 0;
+		}
+		/* We unconditionally check the socket to send 0-sized window
+		 * if the output file is blocking */
 	}
-	if (retry == MAX_LINGER_RETRY)
-		ERROR("Could not successfully send an ACK after %d tries!",
-				MAX_LINGER_RETRY);
-
-	return 0;
+	return receive_result(rx) ? -ECONNABORTED : 0;
 
 fail:
+	abort_transfer(rx);
 	return -ECONNABORTED;
 }
@@ -1,13 +1,116 @@
 #ifndef __SRC_RECEIVER_RECEIVE_H__
 #define __SRC_RECEIVER_RECEIVE_H__
 
+#include <stdint.h>
+#include <sys/types.h>
+
 #include "../common/pktbuf.h"
+#include "../common/packet_interface.h"
+#include "../lib/trtp.h"
+#include "decompress.h"
+#include "output.h"
+#include "pull.h"
+
+/* Options of the receiver binary, which only apply to the transfers written
+ * to an output file and keep their state in the modules implementing them */
+
+/* Previous copy of the output to use for delta transfers, or -1 */
+extern int delta_basis;
+/* Path of the output file, to checkpoint it and resume interrupted transfers,
+ * or NULL */
+extern const char *resume_file;
+/* Directory receiving the streams multiplexed with the main output, or NULL */
+extern const char *mux_dir;
+/* Directory receiving the tree sent instead of the output, or NULL */
+extern const char *tree_dir;
+
+/* Progress of a connection */
+typedef enum {
+	RECEIVE_LISTEN, /* Waiting for the first packet of a sender */
+	RECEIVE_RUNNING,
+	/* All the data was received, answering the sender until it closes */
+	RECEIVE_LINGER,
+	RECEIVE_DONE,
+	RECEIVE_FAILED
+} receive_state_t;
+
+/* State of the transfer from one sender. The data is either written to an
+ * output file, or read with receive_read(). */
+typedef struct receive {
+	int sock; /* Socket of the transfer, connected once a sender reached it */
+	int out_fd; /* Output file descriptor, or -1 */
+	receive_state_t state;
+	/* Maximal window size that can be announced */
+	unsigned int max_window;
+	pktbuf_t *recv_buf; /* Paquet buffer */
+	/* Bitfield of out-of-sequence paquets relative to current buffer
+	 * start */
+	uint32_t oos_mask;
+	/* Those of them already written out, ahead of the missing packets of
+	 * other streams */
+	uint32_t early_mask;
+	uint8_t expected_seq; /* Next in-order sequence number */
+	uint32_t last_ts; /* Last received timestamp */
+	int need_ack; /* Whether we need to send an ACK or not */
+	int need_nack; /* Whether we need to send an NACK or not */
+	uint8_t nack_seq; /* The sequence number to be sent in the NACK */
+	/* Whether its payload was corrupted, instead of truncated */
+	int nack_corrupt;
+	int last_written_len; /* Last written data on the disk */
+	/* Bytes of the first packet of the buffer already read with
+	 * receive_read() */
+	size_t read_off;
+	/* Whether the end of the data was received, and its seqnum */
+	int eof_seen;
+	uint8_t eof_seq;
+	/* Whether the sender closed the connection */
+	int closed;
+	/* When the idle or linger timer expires, in us */
+	uint64_t timer_at;
+	/* Packets which did not start a transfer, or answered in the linger */
+	int retry;
+	uint16_t ext_features; /* Extensions accepted for this transfer */
+	int ext_enabled; /* Whether the sender offered extensions */
+	/* Whether the sender has started to use the extended timestamps */
+	int ext_confirmed;
+	/* Control records to send in the next ACK */
+	char ack_payload[MAX_PAYLOAD_SIZE];
+	size_t ack_len;
+	/* Whether the sender has yet to tell where the output resumes */
+	int resume_pending;
+	/* Congestion marks received, and those already taken into account */
+	unsigned int ce_count, ce_seen;
+	decompress_t *decompress; /* Inflate stream of the data, or NULL */
+	pull_t pull;
+	output_writer out_writer; /* How to write the received data */
+} receive_t;
+
+/* Start a transfer on the socket sock, writing it to output, or keeping it
+ * for receive_read() if -1. first is the first packet of the sender the
+ * socket is connected to, or NULL to wait for a sender to reach it. The
+ * transfer owns the socket from then on, and closes it when freed.
+ * @return: the transfer, NULL on error */
+receive_t *receive_new(int sock, const pkt_t *first, int output,
+		const trtp_options_t *opts);
+void receive_free(receive_t *rx);
 
-/* Maximal window size that can be announced */
-extern unsigned int max_window;
+/* Process the packets waiting on the socket */
+void receive_socket(receive_t *rx);
+/* Read up to len bytes of the data received into buf.
+ * @return: the number of bytes read, 0 at the end of the data, -1 with
+ *         errno EAGAIN if none is available yet, or ECONNABORTED if the
+ *         transfer failed */
+ssize_t receive_read(receive_t *rx, char *buf, size_t len);
+/* Fire the timers which expired */
+void receive_timeout(receive_t *rx);
+/* Time left until the next timer expires, in ms, -1 if none is running */
+int receive_deadline(const receive_t *rx);
+/* @return: TRTP_RUNNING while the transfer goes on, 0 if all the data went
+ *          through, -1 otherwise */
+int receive_result(const receive_t *rx);
 
-/* Receive the file and write it to the given file descriptor, using
- * rbuf to store out-of-order packets. */
-int receive(int fd, pktbuf_t *rbuf);
+/* Receive the file and write it to the output of rx, waiting for its events.
+ * @return: 0 on success */
+int receive(receive_t *rx);
 
 #endif
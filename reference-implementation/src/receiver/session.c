@@ -0,0 +1,112 @@
+#include "session.h"
+#include "../lib/conn.h"
+
+#include "receive.h"
+
+#include <unistd.h>
+
+#include "../common/macros.h"
+#include "../common/net.h"
+
+PRIVATE const trtp_options_t defaults = TRTP_OPTIONS_INIT;
+
+int session_receive(int sock, const pkt_t *first, const trtp_options_t *opts,
+		int output)
+{
+	receive_t *rx;
+	int err;
+
+	if (!(rx = receive_new(sock, first, output, opts))) {
+		close(sock);
+		return -ECONNABORTED;
+	}
+
+	if ((err = receive(rx)))
+		ERROR("A transmission error occured!");
+
+	receive_free(rx);
+	return err;
+}
+
+int trtp_recv_fd(const char *host, const char *port,
+		const trtp_options_t *opts, int output)
+{
+	int sock;
+
+	if (net_open_socket(host, port, &bind, &sock))
+		goto_trace(fail, "Cannot open socket for the specified "
+				"hostname/port");
+
+	return session_receive(sock, NULL, opts, output);
+
+fail:
+	return -1;
+}
+
+/* The receiving side of a trtp_t */
+
+PRIVATE ssize_t rx_recv(void *side, void *buf, size_t len)
+{
+	return receive_read(side, buf, len);
+}
+
+PRIVATE int rx_fd(const void *side)
+{
+	return ((const receive_t*)side)->sock;
+}
+
+PRIVATE void rx_socket(void *side)
+{
+	receive_socket(side);
+}
+
+PRIVATE void rx_timeout(void *side)
+{
+	receive_timeout(side);
+}
+
+PRIVATE int rx_deadline(const void *side)
+{
+	return receive_deadline(side);
+}
+
+PRIVATE int rx_result(const void *side)
+{
+	return receive_result(side);
+}
+
+PRIVATE void rx_free(void *side)
+{
+	receive_free(side);
+}
+
+PRIVATE const conn_ops_t rx_ops = {
+	.recv = rx_recv,
+	.fd = rx_fd,
+	.socket = rx_socket,
+	.timeout = rx_timeout,
+	.deadline = rx_deadline,
+	.result = rx_result,
+	.free = rx_free
+};
+
+trtp_t *trtp_accept(const char *host, const char *port,
+		const trtp_options_t *opts)
+{
+	receive_t *rx;
+	int sock;
+
+	if (!opts)
+		opts = &defaults;
+	if (net_open_socket(host, port, &bind, &sock))
+		goto_trace(fail, "Cannot open socket for the specified "
+				"hostname/port");
+	if (!(rx = receive_new(sock, NULL, -1, opts))) {
+		close(sock);
+		goto fail;
+	}
+	return conn_new(&rx_ops, rx);
+
+fail:
+	return NULL;
+}
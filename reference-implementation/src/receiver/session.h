@@ -0,0 +1,14 @@
+#ifndef __RECEIVER_SESSION_H_
+#define __RECEIVER_SESSION_H_
+
+#include "../lib/trtp.h"
+#include "../common/packet_interface.h"
+
+/* Receive one transfer on the socket sock, and write it to output. first is
+ * the first packet of the sender the socket is connected to, or NULL to wait
+ * for a sender to reach it. The socket is closed once done.
+ * @return: 0 on success */
+int session_receive(int sock, const pkt_t *first, const trtp_options_t *opts,
+		int output);
+
+#endif /* __RECEIVER_SESSION_H_ */
@@ -0,0 +1,74 @@
+#include "sparse.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "../common/macros.h"
+#include "output.h"
+#include "checkpoint.h"
+
+#define ZERO_CHUNK (64 * 1024)
+
+
+/* Whether we skipped some part of the output with lseek() */
+PRIVATE int seeked = 0;
+
+/* Non-seekable outputs have to be fed the zeroes */
+PRIVATE int write_zeroes(int fd, uint64_t len)
+{
+	static const char zeroes[ZERO_CHUNK];
+	size_t n;
+
+	for (; len; len -= n) {
+		n = len < sizeof(zeroes) ? len : sizeof(zeroes);
+		if (write_all(fd, zeroes, n))
+			return -1;
+	}
+	return 0;
+}
+
+int sparse_write_hole(int fd, uint64_t len)
+{
+	struct stat st;
+	off_t pos;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+			(pos = lseek(fd, 0, SEEK_CUR)) == -1)
+		return write_zeroes(fd, len);
+	/* Deallocate whatever the output had there before */
+	if (pos < st.st_size && fallocate(fd, FALLOC_FL_PUNCH_HOLE |
+				FALLOC_FL_KEEP_SIZE, pos, len)) {
+		DEBUG("Cannot punch a hole in the output: %s", strerror(errno));
+		return write_zeroes(fd, len);
+	}
+	if (lseek(fd, len, SEEK_CUR) == -1)
+		goto_errno(fail);
+	seeked = 1;
+	checkpoint_update_zeroes(len);
+	LOG("Skipped a hole of %lub in the output", len);
+	return 0;
+
+fail:
+	return -1;
+}
+
+int sparse_finish(int fd)
+{
+	struct stat st;
+	off_t pos;
+
+	if (!seeked)
+		return 0;
+	/* The next output starts over */
+	seeked = 0;
+	if ((pos = lseek(fd, 0, SEEK_CUR)) == -1 || fstat(fd, &st))
+		goto_errno(fail);
+	/* Extend the file to cover its trailing hole */
+	if (pos > st.st_size && ftruncate(fd, pos))
+		goto_errno(fail);
+	return 0;
+
+fail:
+	return -1;
+}
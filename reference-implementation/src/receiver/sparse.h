@@ -0,0 +1,14 @@
+#ifndef __RECEIVER_SPARSE_H_
+#define __RECEIVER_SPARSE_H_
+
+#include <stdint.h>
+
+/* Materialize a hole of len zero bytes in the output, without writing them
+ * if the output is a regular file.
+ * @return: 0 on success, -1 on error */
+int sparse_write_hole(int fd, uint64_t len);
+
+/* Make sure that the output covers the holes at its end */
+int sparse_finish(int fd);
+
+#endif /* __RECEIVER_SPARSE_H_ */
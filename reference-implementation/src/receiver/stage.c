@@ -0,0 +1,250 @@
+#include "stage.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+
+#include "output.h"
+
+#include "../common/macros.h"
+#include "../common/packet_interface.h"
+
+/* The data starts on the page following the header */
+#define RING_OFFSET 4096
+/* Largest write at once, so that room is made early */
+#define MAX_IO (256 << 10)
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_SEQ_CST)
+#define EXCHANGE(x, v) __atomic_exchange_n(&(x), (v), __ATOMIC_SEQ_CST)
+
+
+/* Memory shared with the writer */
+typedef struct {
+	uint64_t head; /* Bytes queued */
+	uint64_t tail; /* Bytes written */
+	int eof; /* Whether head covers the whole output */
+	int failed; /* Whether the writer could not write the output */
+	int writer_waiting; /* Whether the writer waits for data */
+	int queue_waiting; /* Whether we wait for room */
+} ring_t;
+
+PUBLIC size_t stage_size = 0;
+
+PRIVATE ring_t *stage_ring = NULL;
+PRIVATE pid_t writer = 0;
+/* Readable when data was queued, and when room was made */
+PRIVATE int data_fd = -1, room_fd = -1;
+
+PRIVATE char *stage_data()
+{
+	return (char*)stage_ring + RING_OFFSET;
+}
+
+PRIVATE void stage_wake(int fd)
+{
+	uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) == -1)
+		ERROR("Cannot wake up a process: %s", strerror(errno));
+}
+
+PRIVATE void stage_drain(int fd)
+{
+	uint64_t count;
+
+	if (read(fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+		ERROR("Cannot clear an eventfd: %s", strerror(errno));
+}
+
+/* Sleep until fd is readable */
+PRIVATE int stage_sleep(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+		goto_errno(fail);
+	stage_drain(fd);
+	return 0;
+
+fail:
+	return -1;
+}
+
+/* Body of the writer: write what is queued to fd until the end of the
+ * output */
+PRIVATE int stage_run(int fd)
+{
+	uint64_t tail = 0, avail, off;
+	int eof;
+
+	for (;;) {
+		/* head is final once eof is set */
+		eof = LOAD(stage_ring->eof);
+		if (!(avail = LOAD(stage_ring->head) - tail)) {
+			if (eof)
+				break;
+			/* Nothing more is queued for now */
+			if (output_idle(fd))
+				goto_trace(fail, "Cannot write the output: %s",
+						strerror(errno));
+			STORE(stage_ring->writer_waiting, 1);
+			/* Data may have been queued before seeing the flag */
+			if (LOAD(stage_ring->head) != tail || LOAD(stage_ring->eof))
+				continue;
+			if (stage_sleep(data_fd))
+				goto fail;
+			continue;
+		}
+		off = tail % stage_size;
+		if (avail > stage_size - off)
+			avail = stage_size - off;
+		if (avail > MAX_IO)
+			avail = MAX_IO;
+		if (output_write(fd, stage_data() + off, avail))
+			goto_trace(fail, "Cannot write the output: %s", strerror(errno));
+		tail += avail;
+		STORE(stage_ring->tail, tail);
+		if (EXCHANGE(stage_ring->queue_waiting, 0))
+			stage_wake(room_fd);
+	}
+	if (output_finish(fd))
+		goto_trace(fail, "Cannot write the output: %s", strerror(errno));
+	LOG("The writer wrote %lub", tail);
+	return 0;
+
+fail:
+	STORE(stage_ring->failed, 1);
+	stage_wake(room_fd);
+	return -1;
+}
+
+int stage_start(int fd)
+{
+	if ((stage_ring = mmap(NULL, RING_OFFSET + stage_size,
+					PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+					-1, 0)) == MAP_FAILED) {
+		stage_ring = NULL;
+		goto_errno(fail);
+	}
+	if ((data_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+			(room_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+		goto_errno(fail);
+	if ((writer = fork()) == -1) {
+		writer = 0;
+		goto_errno(fail);
+	}
+	if (!writer) {
+		/* Nothing more to write without us */
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		/* Skip the atexit() handlers of an embedding program */
+		_exit(stage_run(fd) ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+	LOG("Writing the output in process %d, through %lub", writer,
+			stage_size);
+	return 0;
+
+fail:
+	stage_free();
+	return -1;
+}
+
+int stage_active()
+{
+	return writer != 0;
+}
+
+int stage_finish()
+{
+	int status;
+
+	STORE(stage_ring->eof, 1);
+	if (EXCHANGE(stage_ring->writer_waiting, 0))
+		stage_wake(data_fd);
+	while (waitpid(writer, &status, 0) == -1 && errno == EINTR);
+	writer = 0;
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		goto_trace(fail, "The writer of the output failed");
+	return 0;
+
+fail:
+	return -1;
+}
+
+void stage_free()
+{
+	if (writer) {
+		kill(writer, SIGTERM);
+		while (waitpid(writer, NULL, 0) == -1 && errno == EINTR);
+		writer = 0;
+	}
+	if (data_fd != -1)
+		close(data_fd);
+	if (room_fd != -1)
+		close(room_fd);
+	data_fd = room_fd = -1;
+	if (stage_ring)
+		munmap(stage_ring, RING_OFFSET + stage_size);
+	stage_ring = NULL;
+}
+
+/* Bytes that can be queued right now */
+PRIVATE uint64_t stage_avail()
+{
+	return stage_size - (stage_ring->head - LOAD(stage_ring->tail));
+}
+
+int stage_room()
+{
+	stage_drain(room_fd);
+	/* The next write reports the failure */
+	if (stage_avail() >= MAX_PAYLOAD_SIZE || LOAD(stage_ring->failed))
+		return 1;
+	STORE(stage_ring->queue_waiting, 1);
+	/* The writer may have made room before seeing the flag */
+	return stage_avail() >= MAX_PAYLOAD_SIZE;
+}
+
+int stage_fd()
+{
+	return room_fd;
+}
+
+int stage_write(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	uint64_t room, off;
+
+	(void)fd;
+	while (len) {
+		if (LOAD(stage_ring->failed)) {
+			errno = EIO;
+			return -1;
+		}
+		if (!(room = stage_avail())) {
+			STORE(stage_ring->queue_waiting, 1);
+			if (!stage_avail() && !LOAD(stage_ring->failed) &&
+					stage_sleep(room_fd))
+				return -1;
+			continue;
+		}
+		off = stage_ring->head % stage_size;
+		if (room > stage_size - off)
+			room = stage_size - off;
+		if (room > len)
+			room = len;
+		memcpy(stage_data() + off, p, room);
+		STORE(stage_ring->head, stage_ring->head + room);
+		if (EXCHANGE(stage_ring->writer_waiting, 0))
+			stage_wake(data_fd);
+		p += room;
+		len -= room;
+	}
+	return 0;
+}
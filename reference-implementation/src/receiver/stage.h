@@ -0,0 +1,37 @@
+#ifndef __STAGE_H_
+#define __STAGE_H_
+
+#include <stddef.h>
+
+/* Writing the output in a process of its own. The in-order data is copied to
+ * a ring shared with that writer, so that a slow or blocking output does not
+ * delay our ACK's. Once the ring is full, the received packets stay in the
+ * receive buffer, shrinking the window we announce until the writer catches
+ * up. */
+
+/* The end of the output is only acknowledged once written, the ring has to
+ * be written well before the sender gives up on us */
+#define STAGE_MAX_SIZE (64 << 20)
+/* Size of the ring, in bytes, or 0 to write the output right away */
+extern size_t stage_size;
+
+/* Start the writer of fd.
+ * @return: 0 on success, -1 on error */
+int stage_start(int fd);
+/* Whether the output goes through the writer */
+int stage_active();
+/* Wait for the writer to write all the data queued, and to exit.
+ * @return: 0 if it wrote everything, -1 otherwise */
+int stage_finish();
+/* Stop the writer, if it still runs */
+void stage_free();
+
+/* Whether the ring has room for a payload. If not, stage_fd() is readable
+ * once it has. */
+int stage_room();
+/* File descriptor to poll for POLLIN while the ring is full */
+int stage_fd();
+/* output_writer queueing buf for the writer, waiting for room if needed */
+int stage_write(int fd, const void *buf, size_t len);
+
+#endif /* __STAGE_H_ */
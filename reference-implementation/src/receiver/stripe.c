@@ -0,0 +1,368 @@
+#include "stripe.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+#include "output.h"
+
+#include "../common/macros.h"
+#include "../common/net.h"
+#include "../common/ext.h"
+#include "../common/packet_interface.h"
+
+#define INITIAL_SEQNUM 0
+/* Room of the pipe of a stripe, letting it run ahead of the slowest one */
+#define PIPE_SIZE (1 << 20)
+/* Largest read from a stripe */
+#define COPY_SIZE (64 << 10)
+
+
+typedef struct {
+	pid_t pid; /* Process receiving it, 0 once reaped */
+	struct sockaddr_storage addr; /* Sender of the connection */
+	socklen_t addrlen;
+	int fd; /* Read end of its pipe, -1 once at its end */
+	char hdr[EXT_STRIPE_HDRLEN];
+	size_t hdrlen; /* Bytes of hdr read so far */
+} conn_t;
+
+PRIVATE conn_t conns[EXT_MAX_STRIPES];
+PRIVATE unsigned int nconns;
+/* Connection of each stripe, once its header is read */
+PRIVATE conn_t *stripe_conns[EXT_MAX_STRIPES];
+/* As announced by the first header, 0 until then */
+PRIVATE unsigned int stripe_count;
+PRIVATE uint64_t stripe_token;
+PRIVATE uint32_t stripe_block;
+/* Stripes whose header was read */
+PRIVATE unsigned int stripes_known;
+/* Whether this process receives one stripe */
+PRIVATE int stripe_child = 0;
+/* Datagram sockets through which the stripes hand us the packets of new
+ * senders their own socket received before it was connected */
+PRIVATE int stripe_handoff[2] = { -1, -1 };
+/* Socket the senders reach first */
+PRIVATE int stripe_listener = -1;
+
+int stripe_attached()
+{
+	return stripe_child;
+}
+
+PRIVATE conn_t *find_conn(const struct sockaddr_storage *addr,
+		socklen_t addrlen)
+{
+	unsigned int i;
+
+	for (i = 0; i < nconns; ++i)
+		if (conns[i].addrlen == addrlen &&
+				!memcmp(&conns[i].addr, addr, addrlen))
+			return &conns[i];
+	return NULL;
+}
+
+/* Start receiving from the sender at addr, which sent the first packet pkt */
+PRIVATE int accept_conn(const char *hostname, const char *port,
+		stripe_transfer transfer, const pkt_t *pkt,
+		const struct sockaddr_storage *addr, socklen_t addrlen)
+{
+	conn_t *c = &conns[nconns];
+	int fds[2];
+	pid_t pid;
+
+	if (pipe2(fds, O_CLOEXEC))
+		goto_errno(fail);
+	/* The default room is less than a block */
+	fcntl(fds[1], F_SETPIPE_SZ, PIPE_SIZE);
+	if ((pid = fork()) == -1)
+		goto_errno(fail_pipe);
+	if (!pid) {
+		stripe_child = 1;
+		close(fds[0]);
+		close(stripe_handoff[0]);
+		/* Nobody would read the stripe anymore */
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		if (net_accept(hostname, port, (const struct sockaddr*)addr,
+					addrlen, stripe_handoff[1], &stripe_listener) != NET_OK)
+			exit(EXIT_FAILURE);
+		close(stripe_handoff[1]);
+		exit(transfer(stripe_listener, pkt, fds[1]) ? EXIT_FAILURE :
+				EXIT_SUCCESS);
+	}
+	close(fds[1]);
+	if (fcntl(fds[0], F_SETFL, O_NONBLOCK))
+		ERROR("Cannot make the pipe of a stripe non-blocking");
+	LOG("Receiving a connection in process %d", pid);
+	c->pid = pid;
+	c->fd = fds[0];
+	c->hdrlen = 0;
+	memcpy(&c->addr, addr, addrlen);
+	c->addrlen = addrlen;
+	++nconns;
+	return 0;
+
+fail_pipe:
+	close(fds[0]);
+	close(fds[1]);
+fail:
+	return -1;
+}
+
+/* Stop receiving a connection which is not part of the transfer */
+PRIVATE void drop_conn(conn_t *c)
+{
+	kill(c->pid, SIGTERM);
+	close(c->fd);
+	c->fd = -1;
+	while (waitpid(c->pid, NULL, 0) == -1 && errno == EINTR);
+	c->pid = 0;
+}
+
+/* Read more of the header of c, learning its stripe once complete.
+ * @return: 0 on success, -1 on error */
+PRIVATE int read_header(conn_t *c)
+{
+	unsigned int index, count;
+	ssize_t n;
+
+	if ((n = read(c->fd, c->hdr + c->hdrlen,
+					sizeof(c->hdr) - c->hdrlen)) == -1) {
+		if (errno == EAGAIN)
+			return 0;
+		goto_errno(fail);
+	}
+	if (!n) {
+		ERROR("Process %d ended before receiving a stripe", c->pid);
+		goto drop;
+	}
+	if ((c->hdrlen += n) < sizeof(c->hdr))
+		return 0;
+	index = (uint8_t)c->hdr[12] << 8 | (uint8_t)c->hdr[13];
+	count = (uint8_t)c->hdr[14] << 8 | (uint8_t)c->hdr[15];
+	if (ext_get_u32(c->hdr) != EXT_STRIPE_MAGIC || index >= count ||
+			count > EXT_MAX_STRIPES || !ext_get_u32(c->hdr + 16)) {
+		ERROR("Process %d does not receive a stripe", c->pid);
+		goto drop;
+	}
+	if (!stripe_count) {
+		stripe_count = count;
+		stripe_token = ext_get_u64(c->hdr + 4);
+		stripe_block = ext_get_u32(c->hdr + 16);
+		LOG("Receiving %u stripes of %ub blocks", count, stripe_block);
+	} else if (count != stripe_count ||
+			ext_get_u64(c->hdr + 4) != stripe_token ||
+			ext_get_u32(c->hdr + 16) != stripe_block ||
+			stripe_conns[index]) {
+		ERROR("Process %d receives a stripe of another transfer", c->pid);
+		goto drop;
+	}
+	LOG("Process %d receives stripe %u", c->pid, index);
+	stripe_conns[index] = c;
+	++stripes_known;
+	return 0;
+
+drop:
+	drop_conn(c);
+	return 0;
+fail:
+	return -1;
+}
+
+/* Handle the first packet of a new sender on the listening socket, or handed
+ * over to fd */
+PRIVATE int handle_listener(const char *hostname, const char *port,
+		stripe_transfer transfer, int fd)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	net_status_t status;
+	pkt_t pkt;
+
+	memset(&addr, 0, sizeof(addr));
+	if ((status = fd == stripe_listener ?
+				net_recv_from(fd, &pkt, (struct sockaddr*)&addr, &addrlen) :
+				net_recv_handoff(fd, &pkt, (struct sockaddr*)&addr,
+					&addrlen)) == NET_ERROR)
+		goto_trace(fail, "I/O error");
+	/* Connections only start with their first packet, the ones of the
+	 * stripes we receive were received before their socket was connected */
+	if (status != NET_OK || pkt.seq != INITIAL_SEQNUM ||
+			find_conn(&addr, addrlen))
+		return 0;
+	if (nconns == EXT_MAX_STRIPES) {
+		ERROR("Already received %d connections, ignoring a new sender",
+				EXT_MAX_STRIPES);
+		return 0;
+	}
+	/* The sender sends its first packet again if this fails */
+	accept_conn(hostname, port, transfer, &pkt, &addr, addrlen);
+	return 0;
+
+fail:
+	return -1;
+}
+
+/* Wait for the process of a stripe which reached its end.
+ * @return: 0 if it received the whole stripe, -1 otherwise */
+PRIVATE int wait_conn(conn_t *c)
+{
+	int status;
+
+	close(c->fd);
+	c->fd = -1;
+	while (waitpid(c->pid, &status, 0) == -1 && errno == EINTR);
+	c->pid = 0;
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		goto_trace(fail, "The connection of a stripe failed");
+	return 0;
+
+fail:
+	return -1;
+}
+
+/* Read the end of a stripe once the whole input was written.
+ * @return: 0 on success, -1 on error */
+PRIVATE int read_end(conn_t *c)
+{
+	char byte;
+	ssize_t n;
+
+	if ((n = read(c->fd, &byte, sizeof(byte))) == -1)
+		return errno == EAGAIN ? 0 : -1;
+	if (n)
+		goto_trace(fail, "A stripe holds more than the whole input");
+	return wait_conn(c);
+
+fail:
+	return -1;
+}
+
+/* Whether every stripe was read up to its end */
+PRIVATE int stripes_ended()
+{
+	unsigned int i;
+
+	if (!stripe_count || stripes_known < stripe_count)
+		return 0;
+	for (i = 0; i < stripe_count; ++i)
+		if (stripe_conns[i]->fd != -1)
+			return 0;
+	return 1;
+}
+
+int stripe_receive(const char *hostname, const char *port, int output,
+		stripe_transfer transfer)
+{
+	struct pollfd pfds[2 + EXT_MAX_STRIPES];
+	conn_t *polled[2 + EXT_MAX_STRIPES], *c;
+	char buf[COPY_SIZE];
+	/* Next block of the whole input, and how much of it was written */
+	uint64_t block = 0;
+	uint32_t written = 0;
+	/* Whether the whole input was written */
+	int complete = 0, err = -1;
+	unsigned int i, n;
+	ssize_t len;
+
+	if (net_open_socket(hostname, port, &bind, &stripe_listener))
+		goto_trace(out, "Cannot open socket for the specified "
+				"hostname/port");
+	if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, stripe_handoff))
+		goto_errno(out);
+	LOG("Waiting for the stripes on [%s]:%s", hostname, port);
+	while (!stripes_ended()) {
+		n = 0;
+		/* Until every stripe arrived */
+		if (!stripe_count || stripes_known < stripe_count) {
+			pfds[n].fd = stripe_listener;
+			polled[n++] = NULL;
+			pfds[n].fd = stripe_handoff[0];
+			polled[n++] = NULL;
+		}
+		for (i = 0; i < nconns; ++i) {
+			c = &conns[i];
+			if (c->fd == -1)
+				continue;
+			/* The stripes wait for their turn, keeping the others in their
+			 * pipes */
+			if (c->hdrlen == sizeof(c->hdr) && !complete &&
+					c != stripe_conns[block % stripe_count])
+				continue;
+			pfds[n].fd = c->fd;
+			polled[n++] = c;
+		}
+		for (i = 0; i < n; ++i)
+			pfds[i].events = POLLIN;
+		if (poll(pfds, n, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			goto_errno(out);
+		}
+		for (i = 0; i < n; ++i) {
+			if (!(pfds[i].revents & (POLLIN | POLLERR | POLLHUP)))
+				continue;
+			if (!(c = polled[i])) {
+				if (handle_listener(hostname, port, transfer, pfds[i].fd))
+					goto out;
+			} else if (c->hdrlen < sizeof(c->hdr)) {
+				if (read_header(c))
+					goto out;
+			} else if (complete) {
+				if (read_end(c))
+					goto out;
+			} else {
+				len = stripe_block - written;
+				if ((len = read(c->fd, buf, len < COPY_SIZE ?
+									len : COPY_SIZE)) == -1) {
+					if (errno == EAGAIN)
+						continue;
+					goto_errno(out);
+				}
+				/* The stripe of the last block ends with it */
+				if (!len) {
+					if (wait_conn(c))
+						goto out;
+					LOG("Received the whole input in %lu blocks",
+							block + !!written);
+					complete = 1;
+					continue;
+				}
+				if (write_all(output, buf, len))
+					goto_trace(out, "Cannot write the output: %s",
+							strerror(errno));
+				if ((written += len) == stripe_block) {
+					written = 0;
+					++block;
+				}
+			}
+		}
+	}
+	err = 0;
+
+out:
+	if (stripe_listener != -1)
+		close(stripe_listener);
+	stripe_listener = -1;
+	for (i = 0; i < 2; ++i)
+		if (stripe_handoff[i] != -1)
+			close(stripe_handoff[i]);
+	stripe_handoff[0] = stripe_handoff[1] = -1;
+	for (i = 0; i < nconns; ++i) {
+		c = &conns[i];
+		if (c->fd != -1)
+			close(c->fd);
+		if (!c->pid)
+			continue;
+		kill(c->pid, SIGTERM);
+		while (waitpid(c->pid, NULL, 0) == -1 && errno == EINTR);
+	}
+	return err;
+}
@@ -0,0 +1,27 @@
+#ifndef __RECEIVER_STRIPE_H_
+#define __RECEIVER_STRIPE_H_
+
+#include "../common/packet_interface.h"
+
+/* Receiving an input striped over several connections by the sender. Like
+ * the daemon, each connection is received in a process of its own, with a
+ * socket bound to the same port but connected to its sender. Each writes its
+ * stripe to a pipe, from which the calling process takes the blocks in turn
+ * to write the whole input, in order, to the output. The header starting each
+ * stripe tells where its blocks go (see ext.h). */
+
+/* Receive one stripe on the socket sock, connected to its sender which sent
+ * the first packet first, and write it to fd.
+ * @return: 0 on success */
+typedef int (*stripe_transfer)(int sock, const pkt_t *first, int fd);
+
+/* Receive the stripes reaching the socket bound to hostname:port, and write
+ * the whole input to output.
+ * @return: 0 if every stripe went through, -1 otherwise */
+int stripe_receive(const char *hostname, const char *port, int output,
+		stripe_transfer transfer);
+
+/* Whether this process receives one stripe of the input */
+int stripe_attached();
+
+#endif /* __RECEIVER_STRIPE_H_ */
@@ -0,0 +1,210 @@
+#include "tree.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "../common/macros.h"
+#include "../common/ext.h"
+#include "output.h"
+
+
+/* Directory containing the tree */
+PRIVATE int root_fd = -1;
+/* Header of the current entry, and how much of it we have */
+PRIVATE char hdr[EXT_TREE_HDRLEN + PATH_MAX];
+PRIVATE size_t hdr_len;
+/* File being written, and how much of its content is left */
+PRIVATE int file_fd = -1;
+PRIVATE uint64_t remaining;
+/* Directories created, whose mode is only set once they are filled */
+PRIVATE struct {
+	char *path;
+	mode_t mode;
+} *dirs;
+PRIVATE size_t ndirs, dirs_cap;
+
+int tree_init(const char *dir)
+{
+	if (mkdir(dir, 0777) && errno != EEXIST)
+		goto_trace(fail, "Cannot create the directory %s: %s", dir,
+				strerror(errno));
+	if ((root_fd = open(dir, O_RDONLY | O_DIRECTORY)) == -1)
+		goto_trace(fail, "Cannot open the directory %s: %s", dir,
+				strerror(errno));
+	hdr_len = ndirs = 0;
+	LOG("Writing the received tree to %s", dir);
+	return 0;
+
+fail:
+	return -1;
+}
+
+void tree_free()
+{
+	if (file_fd != -1)
+		close(file_fd);
+	if (root_fd != -1)
+		close(root_fd);
+	while (ndirs)
+		free(dirs[--ndirs].path);
+	free(dirs);
+	dirs = NULL;
+	dirs_cap = 0;
+	file_fd = root_fd = -1;
+}
+
+/* Whether path stays within the tree */
+PRIVATE int valid_path(const char *path)
+{
+	const char *p = path, *end;
+
+	if (*path == '/')
+		return 0;
+	do {
+		end = strchrnul(p, '/');
+		if (end == p || (end - p == 1 && p[0] == '.') ||
+				(end - p == 2 && p[0] == '.' && p[1] == '.'))
+			return 0;
+		p = end + 1;
+	} while (*end);
+	return 1;
+}
+
+PRIVATE int create_dir(const char *path, mode_t mode)
+{
+	struct stat st;
+
+	/* Keep it writable until it is filled */
+	if (mkdirat(root_fd, path, 0700) && (errno != EEXIST ||
+				fstatat(root_fd, path, &st, AT_SYMLINK_NOFOLLOW) ||
+				!S_ISDIR(st.st_mode)))
+		goto_trace(fail, "Cannot create the directory %s: %s", path,
+				strerror(errno));
+	if (ndirs == dirs_cap) {
+		dirs_cap = dirs_cap ? 2 * dirs_cap : 64;
+		if (!(dirs = realloc(dirs, dirs_cap * sizeof(*dirs))))
+			goto_errno(fail);
+	}
+	if (!(dirs[ndirs].path = strdup(path)))
+		goto_errno(fail);
+	dirs[ndirs++].mode = mode;
+	return 0;
+
+fail:
+	return -1;
+}
+
+PRIVATE int create_file(const char *path, mode_t mode)
+{
+	if ((file_fd = openat(root_fd, path, O_WRONLY | O_CREAT | O_TRUNC |
+					O_NOFOLLOW, 0600)) == -1 || fchmod(file_fd, mode))
+		goto_trace(fail, "Cannot create %s: %s", path, strerror(errno));
+	return 0;
+
+fail:
+	return -1;
+}
+
+PRIVATE int close_file()
+{
+	int err = close(file_fd);
+
+	file_fd = -1;
+	if (err)
+		goto_errno(fail);
+	return 0;
+
+fail:
+	return -1;
+}
+
+/* The header of the next entry is complete */
+PRIVATE int create_entry()
+{
+	const char *path = &hdr[EXT_TREE_HDRLEN];
+	mode_t mode = ext_get_u32(&hdr[1]) & 07777;
+
+	hdr[hdr_len] = '\0';
+	remaining = ext_get_u64(&hdr[5]);
+	if (strlen(path) != hdr_len - EXT_TREE_HDRLEN || !valid_path(path))
+		goto_trace(fail, "Invalid path in the tree");
+	switch (hdr[0]) {
+		case EXT_TREE_DIR:
+			if (remaining || create_dir(path, mode))
+				goto fail;
+			break;
+		case EXT_TREE_FILE:
+			if (create_file(path, mode) || (!remaining && close_file()))
+				goto fail;
+			break;
+		default:
+			goto_trace(fail, "Unknown entry type %u", hdr[0]);
+	}
+	DEBUG("Created %s", path);
+	return 0;
+
+fail:
+	return -1;
+}
+
+int tree_write(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	size_t n, need;
+
+	(void)fd;
+	while (len) {
+		if (file_fd != -1) {
+			n = remaining < len ? remaining : len;
+			if (write_all(file_fd, p, n))
+				goto_trace(fail, "Cannot write a file of the tree: %s",
+						strerror(errno));
+			if (!(remaining -= n) && close_file())
+				goto fail;
+		} else {
+			need = EXT_TREE_HDRLEN;
+			if (hdr_len >= need) {
+				if (!ext_get_u32(&hdr[13]) ||
+						ext_get_u32(&hdr[13]) >= PATH_MAX)
+					goto_trace(fail, "Invalid path length in the tree");
+				need += ext_get_u32(&hdr[13]);
+			}
+			n = need - hdr_len < len ? need - hdr_len : len;
+			memcpy(&hdr[hdr_len], p, n);
+			hdr_len += n;
+			if (hdr_len > EXT_TREE_HDRLEN && hdr_len == need) {
+				if (create_entry())
+					goto fail;
+				hdr_len = 0;
+			}
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+
+fail:
+	return -1;
+}
+
+int tree_finish()
+{
+	if (file_fd != -1 || hdr_len)
+		goto_trace(fail, "The tree ends in the middle of an entry");
+	/* Innermost directories first, as they may become read-only */
+	while (ndirs) {
+		if (fchmodat(root_fd, dirs[ndirs - 1].path, dirs[ndirs - 1].mode, 0))
+			goto_trace(fail, "Cannot set the mode of %s: %s",
+					dirs[ndirs - 1].path, strerror(errno));
+		free(dirs[--ndirs].path);
+	}
+	return 0;
+
+fail:
+	return -1;
+}
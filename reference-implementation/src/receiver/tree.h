@@ -0,0 +1,21 @@
+#ifndef __RECEIVER_TREE_H_
+#define __RECEIVER_TREE_H_
+
+#include <stddef.h>
+
+/* Recreate the directory tree sent by the sender (see EXT_TREE_HDRLEN) in
+ * dir. The entries are created as their headers are received, and the
+ * content of the files written as it comes. */
+int tree_init(const char *dir);
+void tree_free();
+
+/* output_writer adding the next len bytes of the stream to the tree, fd is
+ * ignored */
+int tree_write(int fd, const void *buf, size_t len);
+
+/* Check that the tree ended with a complete entry, and set the mode of its
+ * directories now that they are filled.
+ * @return: 0 on success, -1 on error */
+int tree_finish();
+
+#endif /* __RECEIVER_TREE_H_ */
@@ -0,0 +1,159 @@
+#include "compress.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "../common/macros.h"
+#include "../common/ext.h"
+
+/* Size of the input chunks that are compressed at once */
+#define ZCHUNK (32 * 1024)
+/* Output must be at least 1/16th smaller than the input to keep compressing */
+#define WORTH_IT(in, out) ((out) * 16 < (in) * 15)
+/* Raw bytes to send before trying to compress again (doubling each time) */
+#define MIN_BACKOFF (1 << 20)
+#define MAX_BACKOFF (64 << 20)
+
+
+struct compress {
+	z_stream zs;
+	char *zin; /* Input chunk */
+	char *zout; /* Compressed data waiting to be packetized */
+	size_t zout_len;
+	size_t zout_off;
+	/* Raw bytes to send before probing the compressibility of the input
+	 * again */
+	size_t raw_budget;
+	size_t backoff;
+};
+
+compress_t *compress_new(int level)
+{
+	compress_t *c;
+
+	if (!(c = calloc(1, sizeof(*c))))
+		goto_trace(fail, "Cannot allocate the compression stream");
+	/* Raw deflate, the framing is provided by TRTP itself */
+	if (deflateInit2(&c->zs, level, Z_DEFLATED, -MAX_WBITS, 8,
+				Z_DEFAULT_STRATEGY) != Z_OK)
+		goto_trace(fail_free, "Cannot initialize the deflate stream: %s",
+				c->zs.msg);
+	c->zin = malloc(ZCHUNK);
+	c->zout = malloc(deflateBound(&c->zs, ZCHUNK) + 16);
+	if (!c->zin || !c->zout)
+		goto_trace(fail_mem, "Cannot allocate the compression buffers");
+	c->backoff = MIN_BACKOFF;
+	return c;
+
+fail_mem:
+	compress_free(c);
+	return NULL;
+fail_free:
+	free(c);
+fail:
+	return NULL;
+}
+
+void compress_free(compress_t *c)
+{
+	deflateEnd(&c->zs);
+	free(c->zin);
+	free(c->zout);
+	free(c);
+}
+
+int compress_pending(const compress_t *c)
+{
+	return c->zout_off < c->zout_len;
+}
+
+/* Compress the next input chunk, of len bytes at data */
+PRIVATE int deflate_chunk(compress_t *c, const char *data, size_t len)
+{
+	c->zs.next_in = (Bytef*)data;
+	c->zs.avail_in = len;
+	c->zs.next_out = (Bytef*)c->zout;
+	c->zs.avail_out = deflateBound(&c->zs, ZCHUNK) + 16;
+	/* Flush to a byte boundary so that the receiver can write everything we
+	 * sent so far, and so that we can switch to raw packets at any time. */
+	if (deflate(&c->zs, Z_SYNC_FLUSH) != Z_OK || c->zs.avail_in)
+		goto_trace(fail, "Cannot compress the input: %s", c->zs.msg);
+	c->zout_len = (char*)c->zs.next_out - c->zout;
+	c->zout_off = 0;
+	if (WORTH_IT(len, c->zout_len)) {
+		c->backoff = MIN_BACKOFF;
+	} else {
+		LOG("Input does not compress [%lub -> %lub], sending the next %lub "
+				"raw", len, c->zout_len, c->backoff);
+		c->raw_budget = c->backoff;
+		if (c->backoff < MAX_BACKOFF)
+			c->backoff <<= 1;
+	}
+	return 0;
+
+fail:
+	return -1;
+}
+
+/* Account for len bytes sent raw */
+PRIVATE void spend_raw(compress_t *c, size_t len)
+{
+	c->raw_budget = len < c->raw_budget ? c->raw_budget - len : 0;
+}
+
+/* Copy up to len bytes of the compressed data to payload */
+PRIVATE ssize_t take_deflated(compress_t *c, char *payload, size_t len,
+		uint8_t *kind)
+{
+	*kind = EXT_KIND_DEFLATE;
+	if (len > c->zout_len - c->zout_off)
+		len = c->zout_len - c->zout_off;
+	memcpy(payload, c->zout + c->zout_off, len);
+	c->zout_off += len;
+	return len;
+}
+
+ssize_t compress_next(compress_t *c, input_reader rd, int fd, char *payload,
+		size_t len, uint8_t *kind)
+{
+	ssize_t rlen;
+
+	if (!compress_pending(c)) {
+		if (c->raw_budget) {
+			/* Compression is off, read straight into the payload */
+			*kind = EXT_KIND_RAW;
+			if ((rlen = rd(fd, payload, len)) > 0)
+				spend_raw(c, rlen);
+			return rlen;
+		}
+		if ((rlen = rd(fd, c->zin, ZCHUNK)) <= 0)
+			return rlen;
+		if (deflate_chunk(c, c->zin, rlen))
+			return -1;
+	}
+	return take_deflated(c, payload, len, kind);
+}
+
+ssize_t compress_next_buf(compress_t *c, const char *in, size_t inlen,
+		size_t *used, char *payload, size_t len, uint8_t *kind)
+{
+	*used = 0;
+	if (!compress_pending(c)) {
+		if (!inlen)
+			return 0;
+		if (c->raw_budget) {
+			*kind = EXT_KIND_RAW;
+			*used = len < inlen ? len : inlen;
+			memcpy(payload, in, *used);
+			spend_raw(c, *used);
+			return *used;
+		}
+		/* Deflate straight from the buffer of the caller */
+		*used = inlen < ZCHUNK ? inlen : ZCHUNK;
+		if (deflate_chunk(c, in, *used))
+			return -1;
+	}
+	return take_deflated(c, payload, len, kind);
+}
@@ -0,0 +1,33 @@
+#ifndef __COMPRESS_H_
+#define __COMPRESS_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Streaming deflate of the input, turned off while the data does not
+ * compress well enough to be worth the CPU time. */
+typedef struct compress compress_t;
+
+/* @return: a new stream compressing at the given zlib level, NULL on error */
+compress_t *compress_new(int level);
+void compress_free(compress_t *c);
+
+/* Whether some data has already been read and waits to be packetized */
+int compress_pending(const compress_t *c);
+
+/* How to read the input, e.g. read() */
+typedef ssize_t (*input_reader)(int fd, void *buf, size_t len);
+
+/* Fill payload with up to len bytes of the (possibly compressed) input,
+ * reading the input file if needed. kind is set to the EXT_KIND_* of the
+ * payload.
+ * @return: the length of the payload, 0 at EOF, -1 on error */
+ssize_t compress_next(compress_t *c, input_reader rd, int fd, char *payload,
+		size_t len, uint8_t *kind);
+/* Same as compress_next(), the input being the inlen bytes at in, of which
+ * used is set to the number consumed.
+ * @return: the length of the payload, 0 if inlen is, -1 on error */
+ssize_t compress_next_buf(compress_t *c, const char *in, size_t inlen,
+		size_t *used, char *payload, size_t len, uint8_t *kind);
+
+#endif /* __COMPRESS_H_ */
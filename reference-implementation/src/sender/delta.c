@@ -0,0 +1,362 @@
+#include "delta.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../common/macros.h"
+#include "../common/ext.h"
+#include "../common/checksum.h"
+
+/* Blocks of signatures answered to each request */
+#define SIGS_PER_REPLY (2 * EXT_SIGS_PER_REC)
+/* Input read ahead on top of two blocks */
+#define READAHEAD (64 * 1024)
+
+
+PRIVATE enum {
+	FETCH_INFO, /* Waiting for the size of the receiver's copy */
+	FETCH_SIGS, /* Fetching the signatures of its blocks */
+	MATCH, /* Encoding the input */
+} phase;
+
+/* Signatures of the receiver's copy */
+PRIVATE uint32_t block_size;
+PRIVATE uint32_t nblocks;
+PRIVATE uint32_t *weak;
+PRIVATE uint8_t (*strong)[EXT_STRONG_LEN];
+PRIVATE uint8_t *received;
+/* Whether we requested the info, and the next block to request */
+PRIVATE int info_requested;
+PRIVATE uint32_t next_req;
+/* Chained hash table of the weak checksums */
+PRIVATE int32_t *htab;
+PRIVATE int32_t *hnext;
+PRIVATE uint32_t hmask;
+/* Input window: [lit, pos) is pending literal data, [pos, pos + block_size)
+ * the block being matched */
+PRIVATE uint8_t *win;
+PRIVATE size_t win_cap, win_len, pos, lit;
+PRIVATE int eof;
+PRIVATE rsum_t sum;
+PRIVATE int sum_valid;
+/* Digest of the whole input */
+PRIVATE sha256_t digest;
+PRIVATE int digest_sent;
+
+int delta_init()
+{
+	phase = FETCH_INFO;
+	info_requested = 0;
+	nblocks = 0;
+	eof = sum_valid = digest_sent = 0;
+	win_len = pos = lit = 0;
+	sha256_init(&digest);
+	return 0;
+}
+
+void delta_free()
+{
+	free(weak);
+	free(strong);
+	free(received);
+	free(htab);
+	free(hnext);
+	free(win);
+	weak = NULL;
+	strong = NULL;
+	received = NULL;
+	htab = hnext = NULL;
+	win = NULL;
+}
+
+void delta_account(const void *data, size_t len)
+{
+	sha256_update(&digest, data, len);
+}
+
+int delta_fetching()
+{
+	return phase != MATCH;
+}
+
+/* Skip the blocks whose signatures we already have */
+PRIVATE void skip_received()
+{
+	while (next_req < nblocks && received[next_req])
+		++next_req;
+}
+
+int delta_ready(int idle)
+{
+	switch (phase) {
+		case FETCH_INFO:
+			/* Ask again if our request was acknowledged without answer */
+			return !info_requested || idle;
+		case FETCH_SIGS:
+			skip_received();
+			return next_req < nblocks || idle;
+		default:
+			return 1;
+	}
+}
+
+PRIVATE ssize_t sig_request(uint32_t first, char *payload, size_t len,
+		uint8_t *kind)
+{
+	char value[sizeof(uint32_t)];
+	size_t off = 0;
+
+	*kind = EXT_KIND_CTRL;
+	ext_put_u32(value, first);
+	ext_rec_put(payload, len, &off, EXT_REC_SIGREQ, value, sizeof(value));
+	LOG("Requesting the signatures of the blocks starting at %u", first);
+	return off;
+}
+
+PRIVATE int handle_siginfo(const char *value, uint8_t len)
+{
+	uint32_t i;
+
+	PRECONDITION(len == 2 * sizeof(uint32_t), -1);
+	if (phase != FETCH_INFO)
+		return 0;
+	block_size = ext_get_u32(value);
+	nblocks = ext_get_u32(value + sizeof(uint32_t));
+	PRECONDITION(block_size > 0 || !nblocks, -1);
+	LOG("The receiver has %u blocks of %u bytes", nblocks, block_size);
+	for (hmask = 1; hmask < 2 * nblocks; hmask <<= 1);
+	/* Keep the allocations valid for empty copies */
+	weak = calloc(nblocks + 1, sizeof(*weak));
+	strong = calloc(nblocks + 1, sizeof(*strong));
+	received = calloc(nblocks + 1, sizeof(*received));
+	htab = malloc(hmask * sizeof(*htab));
+	hnext = calloc(nblocks + 1, sizeof(*hnext));
+	win_cap = 2 * (size_t)block_size + READAHEAD;
+	win = malloc(win_cap);
+	if (!weak || !strong || !received || !htab || !hnext || !win)
+		goto_trace(fail, "Cannot allocate memory for %u signatures", nblocks);
+	for (i = 0; i < hmask; ++i)
+		htab[i] = -1;
+	hmask -= 1;
+	next_req = 0;
+	phase = FETCH_SIGS;
+	return 0;
+
+fail:
+	return -1;
+}
+
+PRIVATE int handle_sigs(const char *value, uint8_t len)
+{
+	uint32_t first, i;
+
+	PRECONDITION(len >= sizeof(uint32_t), -1);
+	PRECONDITION((len - sizeof(uint32_t)) % EXT_SIG_LEN == 0, -1);
+	if (phase != FETCH_SIGS)
+		return 0;
+	first = ext_get_u32(value);
+	value += sizeof(uint32_t);
+	len = (len - sizeof(uint32_t)) / EXT_SIG_LEN;
+	PRECONDITION(first <= nblocks && len <= nblocks - first, -1);
+	for (i = first; i < first + len; ++i, value += EXT_SIG_LEN) {
+		if (received[i])
+			continue;
+		weak[i] = ext_get_u32(value);
+		memcpy(strong[i], value + sizeof(uint32_t), EXT_STRONG_LEN);
+		received[i] = 1;
+		hnext[i] = htab[weak[i] & hmask];
+		htab[weak[i] & hmask] = i;
+	}
+	return 0;
+}
+
+int delta_handle_reply(uint8_t type, const char *value, uint8_t len)
+{
+	switch (type) {
+		case EXT_REC_SIGINFO:
+			return handle_siginfo(value, len);
+		case EXT_REC_SIGS:
+			return handle_sigs(value, len);
+		default:
+			return 0;
+	}
+}
+
+/* Find a block of the receiver matching the one at pos */
+PRIVATE int32_t lookup()
+{
+	uint8_t hash[SHA256_LEN];
+	uint32_t w = rsum_digest(&sum);
+	int hashed = 0;
+	sha256_t ctx;
+	int32_t i;
+
+	for (i = htab[w & hmask]; i != -1; i = hnext[i]) {
+		if (weak[i] != w)
+			continue;
+		if (!hashed) {
+			sha256_init(&ctx);
+			sha256_update(&ctx, &win[pos], block_size);
+			sha256_final(&ctx, hash);
+			hashed = 1;
+		}
+		if (!memcmp(strong[i], hash, EXT_STRONG_LEN))
+			return i;
+	}
+	return -1;
+}
+
+/* Make sure that a full block is available at pos, unless at EOF */
+PRIVATE int refill(input_reader rd, int fd)
+{
+	ssize_t rlen;
+
+	while (!eof && win_len - pos < block_size + 1) {
+		if (lit) {
+			memmove(win, &win[lit], win_len - lit);
+			win_len -= lit;
+			pos -= lit;
+			lit = 0;
+		}
+		if ((rlen = rd(fd, &win[win_len], win_cap - win_len)) == -1)
+			goto_errno(fail);
+		win_len += rlen;
+		eof = !rlen;
+	}
+	return 0;
+
+fail:
+	return -1;
+}
+
+PRIVATE ssize_t emit_literal(char *payload, size_t len, uint8_t *kind)
+{
+	if (len > pos - lit)
+		len = pos - lit;
+	memcpy(payload, &win[lit], len);
+	sha256_update(&digest, &win[lit], len);
+	lit += len;
+	*kind = EXT_KIND_RAW;
+	return len;
+}
+
+/* Emit references to the consecutive matching blocks starting at pos */
+PRIVATE ssize_t emit_copies(input_reader rd, int fd, int32_t idx,
+		char *payload, size_t len, uint8_t *kind)
+{
+	char value[2 * sizeof(uint32_t)];
+	uint32_t first = idx, count = 0;
+	size_t off = 0;
+
+	*kind = EXT_KIND_CTRL;
+	while (idx != -1) {
+		if (count && (uint32_t)idx != first + count) {
+			/* Not contiguous, flush the current reference */
+			ext_put_u32(value, first);
+			ext_put_u32(value + sizeof(uint32_t), count);
+			ext_rec_put(payload, len, &off, EXT_REC_COPY, value,
+					sizeof(value));
+			first = idx;
+			count = 0;
+			if (off + 2 + sizeof(value) > len)
+				break;
+		}
+		sha256_update(&digest, &win[pos], block_size);
+		pos += block_size;
+		lit = pos;
+		++count;
+		sum_valid = 0;
+		if (refill(rd, fd))
+			return -1;
+		if (win_len - pos < block_size)
+			break;
+		rsum_init(&sum, &win[pos], block_size);
+		sum_valid = 1;
+		idx = lookup();
+	}
+	if (count) {
+		ext_put_u32(value, first);
+		ext_put_u32(value + sizeof(uint32_t), count);
+		ext_rec_put(payload, len, &off, EXT_REC_COPY, value, sizeof(value));
+	}
+	return off;
+}
+
+PRIVATE ssize_t emit_digest(char *payload, size_t len, uint8_t *kind)
+{
+	uint8_t hash[SHA256_LEN];
+	size_t off = 0;
+
+	sha256_final(&digest, hash);
+	ext_rec_put(payload, len, &off, EXT_REC_DIGEST, hash, sizeof(hash));
+	digest_sent = 1;
+	*kind = EXT_KIND_CTRL;
+	return off;
+}
+
+PRIVATE ssize_t next_match(input_reader rd, int fd, char *payload, size_t len,
+		uint8_t *kind)
+{
+	int32_t idx;
+
+	for (;;) {
+		/* Send literal data as soon as it fills a packet */
+		if (pos - lit >= len)
+			return emit_literal(payload, len, kind);
+		if (refill(rd, fd))
+			return -1;
+		if (!nblocks || win_len - pos < block_size)
+			break;
+		if (!sum_valid) {
+			rsum_init(&sum, &win[pos], block_size);
+			sum_valid = 1;
+		}
+		if ((idx = lookup()) != -1) {
+			if (pos > lit)
+				return emit_literal(payload, len, kind);
+			return emit_copies(rd, fd, idx, payload, len, kind);
+		}
+		/* refill() guarantees that the next byte is available, if any */
+		if (win_len - pos > block_size)
+			rsum_roll(&sum, win[pos], win[pos + block_size]);
+		else
+			sum_valid = 0;
+		++pos;
+	}
+	/* Less than a block left, it can only be sent as is */
+	pos = win_len;
+	if (pos > lit)
+		return emit_literal(payload, len, kind);
+	if (!digest_sent)
+		return emit_digest(payload, len, kind);
+	return 0;
+}
+
+ssize_t delta_next(input_reader rd, int fd, char *payload, size_t len,
+		uint8_t *kind)
+{
+	switch (phase) {
+		case FETCH_INFO:
+			info_requested = 1;
+			return sig_request(0, payload, len, kind);
+		case FETCH_SIGS:
+			skip_received();
+			if (next_req >= nblocks) {
+				/* All our requests have been acknowledged, ask again for the
+				 * answers we missed */
+				next_req = 0;
+				skip_received();
+			}
+			if (next_req < nblocks) {
+				next_req += SIGS_PER_REPLY;
+				return sig_request(next_req - SIGS_PER_REPLY, payload, len,
+						kind);
+			}
+			LOG("Received all %u signatures", nblocks);
+			phase = MATCH;
+			/* Fallthrough */
+		default:
+			return next_match(rd, fd, payload, len, kind);
+	}
+}
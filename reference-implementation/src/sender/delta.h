@@ -0,0 +1,35 @@
+#ifndef __DELTA_H_
+#define __DELTA_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "compress.h"
+
+/* rsync-like delta encoding of the input against the copy of the receiver.
+ * The block signatures of the receiver are first fetched with control
+ * packets, their answers coming back in the ACK's. The input is then sent as
+ * literal data and references to the blocks of the receiver. */
+int delta_init();
+void delta_free();
+
+/* Account for input sent as is before the negotiation */
+void delta_account(const void *data, size_t len);
+
+/* Whether we are still fetching the signatures of the receiver */
+int delta_fetching();
+/* Whether the next packet can be queued, idle telling if all queued packets
+ * have been acknowledged */
+int delta_ready(int idle);
+
+/* Fill payload with up to len bytes of the next request, literal data or
+ * block references. kind is set to the EXT_KIND_* of the payload.
+ * @return: the length of the payload, 0 at EOF, -1 on error */
+ssize_t delta_next(input_reader rd, int fd, char *payload, size_t len,
+		uint8_t *kind);
+
+/* Process a control record received in an ACK.
+ * @return: 0 on success, -1 if malformed */
+int delta_handle_reply(uint8_t type, const char *value, uint8_t len);
+
+#endif /* __DELTA_H_ */
@@ -0,0 +1,431 @@
+#include "fanout.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+
+#include "../common/macros.h"
+#include "../common/ext.h"
+#include "compress.h"
+#include "sparse.h"
+
+#define MAX_RECEIVERS 64
+/* How often to check for dead receivers while the ring is full (ms) */
+#define REAP_INTERVAL 100
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_SEQ_CST)
+#define EXCHANGE(x, v) __atomic_exchange_n(&(x), (v), __ATOMIC_SEQ_CST)
+
+
+/* Memory shared by the reader and the receivers */
+typedef struct {
+	uint64_t produced; /* Chunks encoded so far */
+	int reader_waiting; /* Whether the reader waits for room in the ring */
+	struct {
+		uint64_t acked; /* Chunks the receiver acknowledged */
+		int hungry; /* Whether it waits for the next chunk */
+		int answered; /* Whether it answered our offer */
+		uint16_t features; /* Extensions it accepted */
+	} receivers[MAX_RECEIVERS];
+	pkt_t ring[]; /* fanout_depth slots */
+} shared_t;
+
+typedef struct {
+	char *host;
+	char *port;
+	pid_t pid; /* Process serving it, 0 once it exited */
+	int wake_fd; /* Readable when a chunk was encoded */
+} receiver_t;
+
+PRIVATE receiver_t receivers[MAX_RECEIVERS];
+PRIVATE unsigned int nreceivers;
+PRIVATE shared_t *shared;
+/* Readable when a receiver queued a chunk */
+PRIVATE int room_fd = -1;
+/* Receiver served by this process, -1 in the reader */
+PRIVATE int self = -1;
+/* Chunks queued by this process */
+PRIVATE uint64_t queued;
+/* Extensions the reader encodes the chunks with */
+PRIVATE uint16_t encoding = 0;
+/* Deflate stream of the reader, if compression was asked for */
+PRIVATE compress_t *compressor = NULL;
+
+PUBLIC unsigned int fanout_depth = FANOUT_DEPTH_DEFAULT;
+
+PRIVATE int add(const char *host, size_t hlen, const char *port)
+{
+	receiver_t *r = &receivers[nreceivers];
+
+	if (nreceivers == MAX_RECEIVERS)
+		goto_trace(fail, "Cannot send to more than %d receivers",
+				MAX_RECEIVERS);
+	if (!(r->host = strndup(host, hlen)) || !(r->port = strdup(port))) {
+		free(r->host);
+		goto_errno(fail);
+	}
+	r->wake_fd = -1;
+	++nreceivers;
+	return 0;
+
+fail:
+	return -1;
+}
+
+int fanout_add(const char *spec)
+{
+	const char *sep = strrchr(spec, ':');
+
+	if (!sep || sep == spec || !sep[1])
+		goto_trace(fail, "%s is not formatted as HOST:PORT", spec);
+	if (spec[0] == '[' && sep[-1] == ']')
+		return add(spec + 1, sep - spec - 2, sep + 1);
+	return add(spec, sep - spec, sep + 1);
+
+fail:
+	return -1;
+}
+
+unsigned int fanout_receivers()
+{
+	return nreceivers;
+}
+
+PRIVATE void wake(int fd)
+{
+	uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) == -1)
+		ERROR("Cannot wake up a process: %s", strerror(errno));
+}
+
+PRIVATE void drain(int fd)
+{
+	uint64_t count;
+
+	if (read(fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+		ERROR("Cannot clear an eventfd: %s", strerror(errno));
+}
+
+int fanout_attached()
+{
+	return self != -1;
+}
+
+int fanout_pending()
+{
+	if (LOAD(shared->produced) > queued)
+		return 1;
+	/* Ask the reader to wake us up, unless it encoded a chunk meanwhile */
+	STORE(shared->receivers[self].hungry, 1);
+	return LOAD(shared->produced) > queued;
+}
+
+int fanout_ready()
+{
+	drain(receivers[self].wake_fd);
+	return fanout_pending();
+}
+
+const char *fanout_next(pkt_t *pkt, size_t *len, uint8_t *kind)
+{
+	const pkt_t *slot = &shared->ring[queued++ % fanout_depth];
+
+	*len = ntohs(slot->length);
+	/* The reader leaves the kind of the chunk in its timestamp */
+	*kind = slot->ts;
+	if (*len)
+		memcpy(pkt->payload + *len, slot->payload + *len, PKT_FOOTERLEN);
+	return slot->payload;
+}
+
+void fanout_answered(uint16_t features)
+{
+	STORE(shared->receivers[self].features, features);
+	STORE(shared->receivers[self].answered, 1);
+	wake(room_fd);
+}
+
+void fanout_acked(unsigned int count)
+{
+	STORE(shared->receivers[self].acked,
+			shared->receivers[self].acked + count);
+	if (LOAD(shared->reader_waiting))
+		wake(room_fd);
+}
+
+/* Forget the receivers which are done */
+PRIVATE int reap(int options)
+{
+	unsigned int i;
+	pid_t pid;
+	int status, err = 0;
+
+	while ((pid = waitpid(-1, &status, options)) > 0) {
+		for (i = 0; i < nreceivers && receivers[i].pid != pid; ++i);
+		if (i == nreceivers)
+			continue;
+		receivers[i].pid = 0;
+		if (WIFEXITED(status) && !WEXITSTATUS(status)) {
+			LOG("Receiver [%s]:%s got the whole input", receivers[i].host,
+					receivers[i].port);
+		} else {
+			ERROR("Receiver [%s]:%s failed", receivers[i].host,
+					receivers[i].port);
+			err = -1;
+		}
+	}
+	return err;
+}
+
+/* Chunks encoded but not yet acknowledged by some live receiver */
+PRIVATE uint64_t backlog()
+{
+	uint64_t min = shared->produced, acked;
+	unsigned int i;
+
+	for (i = 0; i < nreceivers; ++i) {
+		if (!receivers[i].pid)
+			continue;
+		acked = LOAD(shared->receivers[i].acked);
+		if (acked < min)
+			min = acked;
+	}
+	return shared->produced - min;
+}
+
+/* Wait until the next chunk can be encoded without overwriting one that some
+ * receiver may still send */
+PRIVATE int wait_room(int *err)
+{
+	struct pollfd pfd = { .fd = room_fd, .events = POLLIN };
+	unsigned int i;
+
+	while (backlog() >= fanout_depth) {
+		STORE(shared->reader_waiting, 1);
+		/* A receiver may have acknowledged a chunk before seeing the
+		 * flag */
+		if (backlog() < fanout_depth)
+			break;
+		if (poll(&pfd, 1, REAP_INTERVAL) == -1 && errno != EINTR)
+			goto_errno(fail);
+		drain(room_fd);
+		*err |= reap(WNOHANG);
+	}
+	STORE(shared->reader_waiting, 0);
+	for (i = 0; i < nreceivers && !receivers[i].pid; ++i);
+	if (i == nreceivers)
+		goto_trace(fail, "No receiver is left");
+	return 0;
+
+fail:
+	return -1;
+}
+
+/* Wait for every live receiver to answer our offer, and keep the extensions
+ * out of wanted that they all accepted */
+PRIVATE int wait_answers(uint16_t wanted, int *err)
+{
+	struct pollfd pfd = { .fd = room_fd, .events = POLLIN };
+	unsigned int i;
+
+	for (;;) {
+		encoding = wanted;
+		for (i = 0; i < nreceivers; ++i) {
+			if (!receivers[i].pid)
+				continue;
+			if (!LOAD(shared->receivers[i].answered))
+				break;
+			encoding &= LOAD(shared->receivers[i].features);
+		}
+		if (i == nreceivers)
+			break;
+		if (poll(&pfd, 1, REAP_INTERVAL) == -1 && errno != EINTR)
+			goto_errno(fail);
+		drain(room_fd);
+		*err |= reap(WNOHANG);
+	}
+	LOG("Encoding the chunks with the extensions %#x", encoding);
+	return 0;
+
+fail:
+	return -1;
+}
+
+/* Fill payload with the next chunk of the input, as read_payload() in
+ * transmit.c */
+PRIVATE ssize_t read_chunk(int input, char *payload, uint8_t *kind)
+{
+	input_reader rd = read;
+	size_t len = 0;
+	int64_t hole;
+	char value[sizeof(uint64_t)];
+
+	*kind = EXT_KIND_RAW;
+	if (encoding & EXT_SPARSE) {
+		rd = sparse_read;
+		/* Holes can only be sent once the preceding data has been queued */
+		if (!((encoding & EXT_DEFLATE) && compress_pending(compressor))) {
+			if ((hole = sparse_skip(input)) < 0)
+				return -1;
+			if (hole) {
+				*kind = EXT_KIND_CTRL;
+				ext_put_u64(value, hole);
+				ext_rec_put(payload, MAX_PAYLOAD_SIZE, &len, EXT_REC_HOLE,
+						value, sizeof(value));
+				return len;
+			}
+		}
+	}
+	if (encoding & EXT_DEFLATE)
+		return compress_next(compressor, rd, input, payload,
+				MAX_PAYLOAD_SIZE, kind);
+	return rd(input, payload, MAX_PAYLOAD_SIZE);
+}
+
+/* Encode the next chunk of the input in the ring.
+ * @return: the length of its payload, -1 on error */
+PRIVATE ssize_t encode(int input)
+{
+	pkt_t *pkt = &shared->ring[shared->produced % fanout_depth];
+	ssize_t len;
+	uint8_t kind;
+	unsigned int i;
+
+	if ((len = read_chunk(input, pkt->payload, &kind)) == -1)
+		goto_errno(fail);
+	pkt->type = PTYPE_DATA;
+	pkt->tr = 0;
+	pkt->window = 0;
+	pkt->seq = shared->produced;
+	/* Each receiver sets its own, depending on what it negotiated */
+	pkt->ts = kind;
+	pkt->length = len;
+	pkt_encode_inline(pkt);
+	STORE(shared->produced, shared->produced + 1);
+	for (i = 0; i < nreceivers; ++i)
+		if (receivers[i].pid &&
+				EXCHANGE(shared->receivers[i].hungry, 0))
+			wake(receivers[i].wake_fd);
+	return len;
+
+fail:
+	return -1;
+}
+
+/* Start the process serving receiver i */
+PRIVATE int spawn(unsigned int i, fanout_transfer transfer)
+{
+	receiver_t *r = &receivers[i];
+	pid_t pid;
+
+	if ((r->wake_fd = eventfd(0, EFD_NONBLOCK)) == -1)
+		goto_errno(fail);
+	if ((pid = fork()) == -1)
+		goto_errno(fail);
+	if (!pid) {
+		self = i;
+		/* Nothing more to send without the reader */
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		exit(transfer(r->host, r->port, r->wake_fd) ? EXIT_FAILURE :
+				EXIT_SUCCESS);
+	}
+	LOG("Sending to [%s]:%s in process %d", r->host, r->port, pid);
+	r->pid = pid;
+	return 0;
+
+fail:
+	return -1;
+}
+
+int fanout_serve(const char *host, const char *port, int input,
+		const trtp_options_t *opts, fanout_transfer transfer)
+{
+	size_t shared_len = sizeof(*shared) + fanout_depth * sizeof(pkt_t);
+	uint16_t wanted = 0;
+	receiver_t first;
+	unsigned int i;
+	ssize_t len;
+	int err = -1;
+
+	/* The main receiver comes first */
+	if (add(host, strlen(host), port))
+		goto fail;
+	first = receivers[nreceivers - 1];
+	memmove(&receivers[1], receivers, (nreceivers - 1) * sizeof(*receivers));
+	receivers[0] = first;
+	if ((shared = mmap(NULL, shared_len, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		goto_errno(fail_free);
+	if ((room_fd = eventfd(0, EFD_NONBLOCK)) == -1)
+		goto_errno(fail_unmap);
+	if (opts->compress != TRTP_COMPRESS_OFF) {
+		if (!(compressor = compress_new(opts->compress)))
+			goto fail_room;
+		wanted |= EXT_DEFLATE;
+	}
+	if (opts->sparse) {
+		if (sparse_init(input))
+			goto fail_room;
+		wanted |= EXT_SPARSE;
+	}
+	for (i = 0; i < nreceivers; ++i) {
+		/* They all start waiting for the first chunk */
+		shared->receivers[i].hungry = 1;
+		if (spawn(i, transfer))
+			goto fail_kill;
+	}
+	err = 0;
+	do {
+		if (wait_room(&err) || (len = encode(input)) == -1)
+			goto fail_kill;
+		/* The first chunk carries the offer, the others depend on the
+		 * answers */
+		if (shared->produced == 1 && len && wanted &&
+				wait_answers(wanted, &err))
+			goto fail_kill;
+	} while (len);
+	LOG("Encoded the whole input in %lu chunks", shared->produced);
+	err |= reap(0);
+	goto out;
+
+fail_kill:
+	for (i = 0; i < nreceivers; ++i)
+		if (receivers[i].pid)
+			kill(receivers[i].pid, SIGTERM);
+	reap(0);
+	err = -1;
+out:
+	for (i = 0; i < nreceivers; ++i)
+		if (receivers[i].wake_fd != -1)
+			close(receivers[i].wake_fd);
+fail_room:
+	if (wanted & EXT_DEFLATE) {
+		compress_free(compressor);
+		compressor = NULL;
+	}
+	if (wanted & EXT_SPARSE)
+		sparse_free();
+	close(room_fd);
+fail_unmap:
+	munmap(shared, shared_len);
+fail_free:
+	for (i = 0; i < nreceivers; ++i) {
+		free(receivers[i].host);
+		free(receivers[i].port);
+	}
+	nreceivers = 0;
+	return err;
+
+fail:
+	return -1;
+}
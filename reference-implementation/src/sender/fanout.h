@@ -0,0 +1,64 @@
+#ifndef __FANOUT_H_
+#define __FANOUT_H_
+
+#include <sys/types.h>
+
+#include "../common/packet_interface.h"
+#include "../lib/trtp.h"
+
+/* Sending the same input to many receivers. The calling process reads the
+ * input, and encodes each chunk once in a ring shared with one process per
+ * receiver. Each of those sends the encoded payloads straight from the ring,
+ * with its own socket, header, window, acknowledgements and retransmissions.
+ * A chunk leaves the ring once every receiver has acknowledged it, so the
+ * slowest one paces the reader.
+ * The chunks after the first are compressed or sparse if all the receivers
+ * accepted it, the other extensions only depend on each connection.
+ * With the main receiver alone, this pipelines the transfer: a slow input only
+ * holds the reader back, while the process of the connection keeps handling
+ * the acknowledgements and timers with the chunks encoded ahead. */
+
+#define FANOUT_DEPTH_DEFAULT 1024
+#define FANOUT_DEPTH_MAX (1 << 16)
+/* Chunks the reader may encode ahead of the acknowledgements of the slowest
+ * receiver, which also bounds its window */
+extern unsigned int fanout_depth;
+
+/* Add a receiver, formatted as HOST:PORT or [HOST]:PORT.
+ * @return: 0 on success, -1 on error */
+int fanout_add(const char *spec);
+/* Number of receivers added */
+unsigned int fanout_receivers();
+
+/* Send the input read from the given fd to one receiver, over a socket, in
+ * the process serving it.
+ * @return: 0 on success */
+typedef int (*fanout_transfer)(const char *host, const char *port, int input);
+
+/* Send the content of input to every receiver, including the one at
+ * host:port, encoding it with the compression and sparse options of opts.
+ * transfer is called in the process of each receiver with an fd which is
+ * readable when new chunks are encoded, to pass to transmit().
+ * @return: 0 if every receiver got the whole input, -1 otherwise */
+int fanout_serve(const char *host, const char *port, int input,
+		const trtp_options_t *opts, fanout_transfer transfer);
+
+/* Whether the chunks of this process come from the ring */
+int fanout_attached();
+/* Whether an encoded chunk waits to be queued */
+int fanout_pending();
+/* Clear the fd given to transfer.
+ * @return: whether an encoded chunk waits to be queued */
+int fanout_ready();
+/* Queue the next encoded chunk, whose payload stays in the ring until
+ * fanout_acked(): copy its CRC2 to pkt, right after the payload length, as
+ * pkt_encode_external() leaves it, and set len and kind to the length and
+ * EXT_KIND_* of its payload.
+ * @return: its payload, of length 0 for the end of the input */
+const char *fanout_next(pkt_t *pkt, size_t *len, uint8_t *kind);
+/* Tell the reader the extensions the receiver accepted, or 0 */
+void fanout_answered(uint16_t features);
+/* Release the count oldest chunks queued, which the receiver acknowledged */
+void fanout_acked(unsigned int count);
+
+#endif /* __FANOUT_H_ */
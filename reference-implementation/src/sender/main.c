@@ -3,12 +3,18 @@
 #include <unistd.h>
 #include <errno.h>
 #include <getopt.h>
+#include <zlib.h>
 
 #include "transmit.h"
+#include "mux.h"
+#include "fanout.h"
+#include "stripe.h"
+#include "range.h"
+
+#include "../lib/trtp.h"
 
 #include "../common/macros.h"
-#include "../common/net.h"
-#include "../common/pktbuf.h"
+#include "../common/ext.h"
 
 PRIVATE void usage(const char* argv)
 {
@@ -16,23 +22,89 @@ PRIVATE void usage(const char* argv)
 		"Where OPTIONS are:\n"
 		"\t--buf, -b, [BUFSIZE] Limit the send buffer to [BUFSIZE] slots.\n"
 		"\t--filename, -f, [FILE] Send the content of [FILE], otherwise, send "
-		"the content of stdin.\n", argv);
+		"the content of stdin.\n"
+		"\t--compress, -z Compress the data if the receiver supports it.\n"
+		"\t--fast, -Z Same as --compress, favoring speed over ratio.\n"
+		"\t--sparse, -S Do not send the zero-filled regions of the input.\n"
+		"\t--delta, -d Only send the differences with the copy of the "
+		"receiver.\n"
+		"\t--resume, -r Only send what the receiver is missing if it was "
+		"interrupted during a previous transfer.\n"
+		"\t--cache, -c, [FILE] Remember the round-trip time and window of "
+		"the path to the receiver in [FILE], to start faster next time.\n"
+		"\t--pull, -p Let the receiver pace the transfer.\n"
+		"\t--ecn, -e Slow down as soon as the network signals congestion "
+		"with ECN.\n"
+		"\t--coalesce, -C, [USEC] Wait up to [USEC] microseconds for small "
+		"writes to a piped input to fill a packet (default: %d, 0 sends them "
+		"right away).\n"
+		"\t--mux, -m, [FILE[:WEIGHT]] Also send [FILE] over the connection, "
+		"sharing it with the other files in proportion to [WEIGHT] (default: "
+		"1). Can be repeated.\n"
+		"\t--tree, -t, [DIR] Send the files and directories under [DIR] "
+		"instead of the input.\n"
+		"\t--network, -N Always send packets, even to a receiver on the same "
+		"host, instead of passing the input through shared memory.\n"
+		"\t--map, -M Send a regular input straight from the page cache. It "
+		"must not be truncated or rewritten during the transfer.\n"
+		"\t--fanout, -F, [HOST:PORT] Also send the input to [HOST:PORT], "
+		"reading and encoding it once for all receivers. Can be repeated.\n"
+		"\t--parallel, -P, [N] Stripe the input over [N] connections to the "
+		"receiver, each from its own port.\n"
+		"\t--offset, -o, [OFFSET] Only send the file given with --filename "
+		"from byte [OFFSET] on.\n"
+		"\t--length, -l, [LENGTH] Only send [LENGTH] bytes of the file given "
+		"with --filename.\n"
+		"\t--queue, -Q, [CHUNKS] Read and encode the input in a process of its "
+		"own, up to [CHUNKS] chunks ahead of the sends (default with "
+		"--fanout: %d).\n",
+		argv, COALESCE_DEFAULT, FANOUT_DEPTH_DEFAULT);
     exit(EXIT_SUCCESS);
 }
 
 PRIVATE struct option long_opts[] = {
     {"filename", required_argument, 0, 'f'},
     {"buf", required_argument, 0, 'b'},
+    {"compress", no_argument, 0, 'z'},
+    {"fast", no_argument, 0, 'Z'},
+    {"sparse", no_argument, 0, 'S'},
+    {"delta", no_argument, 0, 'd'},
+    {"resume", no_argument, 0, 'r'},
+    {"cache", required_argument, 0, 'c'},
+    {"pull", no_argument, 0, 'p'},
+    {"ecn", no_argument, 0, 'e'},
+    {"coalesce", required_argument, 0, 'C'},
+    {"mux", required_argument, 0, 'm'},
+    {"tree", required_argument, 0, 't'},
+    {"network", no_argument, 0, 'N'},
+    {"map", no_argument, 0, 'M'},
+    {"fanout", required_argument, 0, 'F'},
+    {"parallel", required_argument, 0, 'P'},
+    {"offset", required_argument, 0, 'o'},
+    {"length", required_argument, 0, 'l'},
+    {"queue", required_argument, 0, 'Q'},
     {0, 0, 0, 0}
 };
 
+/* Options of the transfers */
+PRIVATE trtp_options_t options = TRTP_OPTIONS_INIT;
+/* Connections the input is striped over */
+PRIVATE unsigned int stripe_count = 1;
+/* Whether the input is read and encoded ahead in a process of its own */
+PRIVATE int pipelined = 0;
+/* Whether to only send a range of the input, up to its end if its length
+ * is 0 */
+PRIVATE int ranged = 0;
+PRIVATE unsigned long long range_offset = 0, range_length = 0;
+
 PRIVATE int parse_options(int argc, char** argv, FILE **f,
-        char **host, char **port, const char *fmask, int *buf_size)
+        char **host, char **port, const char *fmask)
 {
     int c, option_index;
     option_index = 0;
     while (1) {
-        c = getopt_long(argc, argv, "f:b:", long_opts, &option_index);
+        c = getopt_long(argc, argv, "f:b:zZSdrc:peC:m:t:NMF:P:o:l:Q:",
+                long_opts, &option_index);
         if (c == -1)
             break;
         switch (c) {
@@ -46,8 +118,67 @@ PRIVATE int parse_options(int argc, char** argv, FILE **f,
                 LOG("Sending the content of %s\n", optarg);
                 break;
 			case 'b':
-				*buf_size = atoi(optarg);
-				LOG("Setting send buffer size to %u", *buf_size);
+				options.window = atoi(optarg);
+				LOG("Setting send buffer size to %u", options.window);
+				break;
+			case 'z':
+				options.compress = Z_DEFAULT_COMPRESSION;
+				break;
+			case 'Z':
+				options.compress = Z_BEST_SPEED;
+				break;
+			case 'S':
+				options.sparse = 1;
+				break;
+			case 'd':
+				delta_input = 1;
+				break;
+			case 'r':
+				resume_input = 1;
+				break;
+			case 'c':
+				options.path_cache = optarg;
+				break;
+			case 'p':
+				options.pull = 1;
+				break;
+			case 'e':
+				options.ecn = 1;
+				break;
+			case 'C':
+				coalesce_delay = atol(optarg);
+				break;
+			case 'm':
+				if (mux_add(optarg))
+					return EINVAL;
+				break;
+			case 't':
+				tree_root = optarg;
+				break;
+			case 'N':
+				options.local = 0;
+				break;
+			case 'M':
+				options.mapped = 1;
+				break;
+			case 'F':
+				if (fanout_add(optarg))
+					return EINVAL;
+				break;
+			case 'P':
+				stripe_count = atoi(optarg);
+				break;
+			case 'o':
+				range_offset = atoll(optarg);
+				ranged = 1;
+				break;
+			case 'l':
+				range_length = atoll(optarg);
+				ranged = 1;
+				break;
+			case 'Q':
+				fanout_depth = atoi(optarg);
+				pipelined = 1;
 				break;
             default:
                 usage(argv[0]);
@@ -60,38 +191,80 @@ PRIVATE int parse_options(int argc, char** argv, FILE **f,
 		*port = argv[optind + 1];
 	}
 
+    if (mux_streams() && (options.compress != TRTP_COMPRESS_OFF ||
+                options.sparse || delta_input || resume_input)) {
+        ERROR("Multiplexed streams are sent as is, they cannot be compressed,"
+                " sparse, delta-encoded or resumed");
+        return EINVAL;
+    }
+    if (tree_root && (*f != stdin || options.sparse || delta_input ||
+                resume_input || mux_streams())) {
+        ERROR("A tree is sent on its own, it cannot be sparse, delta-encoded,"
+                " resumed or sent with other files");
+        return EINVAL;
+    }
+    if ((fanout_receivers() || pipelined) && (delta_input || resume_input ||
+                mux_streams() || tree_root)) {
+        ERROR("Queued and fanned out chunks are encoded ahead by the reader,"
+                " they cannot be delta-encoded, resumed, sent with other files"
+                " or a tree");
+        return EINVAL;
+    }
+    if (!fanout_depth || fanout_depth > FANOUT_DEPTH_MAX) {
+        ERROR("The input can be encoded 1 to %d chunks ahead",
+                FANOUT_DEPTH_MAX);
+        return EINVAL;
+    }
+    if (!stripe_count || stripe_count > EXT_MAX_STRIPES) {
+        ERROR("The input can be striped over 1 to %d connections",
+                EXT_MAX_STRIPES);
+        return EINVAL;
+    }
+    if (stripe_count > 1 && (delta_input || resume_input || mux_streams() ||
+                tree_root || fanout_receivers() || pipelined)) {
+        ERROR("Each stripe is sent on its own, the input cannot be"
+                " delta-encoded, resumed, sent with other files, a tree or"
+                " fanned out");
+        return EINVAL;
+    }
+    if (ranged && (*f == stdin || options.sparse ||
+                delta_input || resume_input || mux_streams() || tree_root ||
+                fanout_receivers() || pipelined || stripe_count > 1)) {
+        ERROR("Ranges are read from the file given with --filename on their"
+                " own, they cannot be sparse, delta-encoded, resumed, sent"
+                " with other files, fanned out or striped");
+        return EINVAL;
+    }
+    if (ranged && range_init(fileno(*f), range_offset, range_length))
+        return EINVAL;
     return 0;
 }
 
+/* Send the content of input to the receiver at host:port */
+PRIVATE int transfer(const char *host, const char *port, int input)
+{
+    return trtp_send_fd(host, port, &options, input);
+}
+
 int main(int argc, char** argv)
 {
-    pktbuf_t *buf;
     char *host = "::1", *port = "1341";
     int err = -ENOMEM;
     FILE *in = stdin;
-	int buf_size = 32;
 
-    if ((err = parse_options(argc, argv, &in, &host, &port, "r", &buf_size)))
+    if ((err = parse_options(argc, argv, &in, &host, &port, "r")))
         goto exit;
 
-    if (!(buf = pktbuf_new(buf_size)))
-        goto_trace(err_options, "Failed to allocate buffer");
-
-    if ((err = net_open_socket(host, port, &connect)) != NET_OK)
-        goto_trace(err_buffer, "Failed to resolve receiver address");
+    /* A single receiver is simply fanned out to, the reader running ahead */
+    if (fanout_receivers() || pipelined)
+        err = fanout_serve(host, port, fileno(in), &options, &transfer);
+    else if (stripe_count > 1)
+        err = stripe_serve(host, port, fileno(in), stripe_count, &transfer);
+    else
+        err = transfer(host, port, fileno(in));
 
-    if ((err = transmit(fileno(in), buf)))
-        trace("A transmission error occured");
-
-    net_close_socket();
-
-err_buffer:
-    pktbuf_free(buf);
-err_options:
     if (in != stdin)
         fclose(in);
 exit:
     return err;
 }
-
-
@@ -0,0 +1,87 @@
+#include "mapped.h"
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../common/macros.h"
+
+/* How far ahead of the chunks the pages are read, and how often */
+#define READ_AHEAD (2 << 20)
+#define ADVISE_STEP (1 << 20)
+
+
+PRIVATE char *map_base = NULL;
+/* Size of the mapping, next byte to take, and where to read ahead from */
+PRIVATE size_t map_len, map_pos, map_advised;
+
+int mapped_init(int fd)
+{
+	struct stat st;
+	off_t start;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+			(start = lseek(fd, 0, SEEK_CUR)) == -1 || start >= st.st_size)
+		return -1;
+	/* Mappings start on a page, the offset of the input rarely does */
+	if ((map_base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) ==
+			MAP_FAILED) {
+		map_base = NULL;
+		goto_trace(fail, "Cannot map the input, reading it instead: %s",
+				strerror(errno));
+	}
+	map_len = st.st_size;
+	map_pos = map_advised = start;
+	if (madvise(map_base, map_len, MADV_SEQUENTIAL))
+		ERROR("Cannot advise the kernel of the accesses to the input: %s",
+				strerror(errno));
+	LOG("Sending the input from its mapping [%lub]", map_len - map_pos);
+	return 0;
+
+fail:
+	return -1;
+}
+
+int mapped_active()
+{
+	return map_base != NULL;
+}
+
+off_t mapped_offset()
+{
+	return map_pos;
+}
+
+void mapped_free()
+{
+	if (map_base)
+		munmap(map_base, map_len);
+	map_base = NULL;
+}
+
+/* Have the pages past map_pos read in the background */
+PRIVATE void read_ahead()
+{
+	size_t page = sysconf(_SC_PAGESIZE), start, len;
+
+	start = map_pos & ~(page - 1);
+	if (start + READ_AHEAD > map_len)
+		len = map_len - start;
+	else
+		len = READ_AHEAD;
+	madvise(map_base + start, len, MADV_WILLNEED);
+	map_advised = map_pos + ADVISE_STEP;
+}
+
+const char *mapped_next(size_t len, size_t *got)
+{
+	const char *chunk = map_base + map_pos;
+
+	if (map_pos >= map_advised)
+		read_ahead();
+	if (len > map_len - map_pos)
+		len = map_len - map_pos;
+	map_pos += len;
+	*got = len;
+	return chunk;
+}
@@ -0,0 +1,33 @@
+#ifndef __MAPPED_H_
+#define __MAPPED_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Sending a regular input straight from its pages in the page cache. The
+ * chunks point into a read-only mapping of the input instead of being copied
+ * into the send buffer, and are gathered with their header when sent. The
+ * pages are read ahead of the chunks being queued, so that the disk keeps
+ * ahead of the window.
+ * Only the size of the input when it is mapped is sent, and truncating it
+ * during the transfer kills the sender with SIGBUS, as for any mapping. The
+ * payload of a chunk is only checksummed when queued, so that rewriting the
+ * input during the transfer makes its retransmissions look corrupted, and
+ * the transfer stall. Mapping the input is thus left to the user. */
+
+/* Map the input from its current offset on.
+ * @return: 0 on success, -1 if it cannot be mapped and must be read instead */
+int mapped_init(int fd);
+/* Whether the input is mapped */
+int mapped_active();
+/* Offset of the input following the last chunk taken, to read the rest of it
+ * from there */
+off_t mapped_offset();
+void mapped_free();
+
+/* Take the next chunk of at most len bytes.
+ * @return: the start of the chunk, its length being stored in *got, 0 at the
+ *         end of the input */
+const char *mapped_next(size_t len, size_t *got);
+
+#endif /* __MAPPED_H_ */
@@ -0,0 +1,211 @@
+#include "mux.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "../common/macros.h"
+#include "../common/ext.h"
+#include "../common/packet_interface.h"
+
+/* Bytes a stream of weight 1 may send in each round */
+#define QUANTUM MAX_PAYLOAD_SIZE
+#define MAX_WEIGHT 255
+
+
+typedef struct {
+	int fd;
+	char *path;
+	const char *name; /* Name of the file on the receiver */
+	unsigned int weight;
+	long deficit; /* Bytes it may still send in this round */
+	int opened; /* Whether the receiver knows its name */
+	int ready; /* Whether it can be read without blocking */
+	int ended; /* Whether its end was announced */
+} stream_t;
+
+PRIVATE stream_t streams[EXT_MAX_STREAMS];
+PRIVATE unsigned int nstreams = 1;
+/* Streams which are not complete */
+PRIVATE unsigned int active;
+/* Stream being served in the current round */
+PRIVATE unsigned int current;
+/* Whether the end of the transfer was sent */
+PRIVATE int finished;
+
+int mux_add(const char *spec)
+{
+	stream_t *s = &streams[nstreams];
+	const char *sep = strrchr(spec, ':');
+	char *path, *end;
+
+	if (nstreams == EXT_MAX_STREAMS)
+		goto_trace(fail, "Cannot send more than %d streams",
+				EXT_MAX_STREAMS - 1);
+	s->weight = 1;
+	if (sep && sep[1]) {
+		s->weight = strtoul(sep + 1, &end, 10);
+		/* The colon is part of the file name */
+		if (*end)
+			sep = NULL;
+		else if (!s->weight || s->weight > MAX_WEIGHT)
+			goto_trace(fail, "The weight of %s must be between 1 and %d",
+					spec, MAX_WEIGHT);
+	} else
+		sep = NULL;
+	if (!(path = strndup(spec, sep ? (size_t)(sep - spec) : strlen(spec))))
+		goto_errno(fail);
+	/* The receiver only gets the base name, in a record */
+	s->name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	if (!*s->name || !strcmp(s->name, ".") || !strcmp(s->name, "..") ||
+			strlen(s->name) > 255) {
+		ERROR("Cannot name the stream of %s", path);
+		goto fail_path;
+	}
+	if ((s->fd = open(path, O_RDONLY)) == -1) {
+		ERROR("Cannot read the content of %s: %s", path, strerror(errno));
+		goto fail_path;
+	}
+	LOG("Sending the content of %s as stream %u [weight: %u]", path,
+			nstreams, s->weight);
+	s->path = path;
+	++nstreams;
+	return 0;
+
+fail_path:
+	free(path);
+fail:
+	return -1;
+}
+
+unsigned int mux_streams()
+{
+	return nstreams - 1;
+}
+
+void mux_free()
+{
+	unsigned int i;
+
+	/* The main input belongs to the caller */
+	for (i = 1; i < nstreams; ++i) {
+		if (!streams[i].ended)
+			close(streams[i].fd);
+		free(streams[i].path);
+	}
+	nstreams = 1;
+}
+
+void mux_start(int fd)
+{
+	streams[0].fd = fd;
+	streams[0].weight = 1;
+	streams[0].opened = 1;
+	streams[0].deficit = QUANTUM;
+	active = nstreams;
+	current = 0;
+	finished = 0;
+}
+
+int mux_pollfds(struct pollfd *pfds)
+{
+	unsigned int i;
+	int n = 0;
+
+	for (i = 0; i < nstreams; ++i) {
+		if (streams[i].ended)
+			continue;
+		pfds[n].fd = streams[i].fd;
+		pfds[n].events = POLLIN;
+		pfds[n++].revents = 0;
+	}
+	return n;
+}
+
+int mux_polled(const struct pollfd *pfds, int n)
+{
+	unsigned int i;
+	int ready = 0;
+
+	if (!n)
+		return 0;
+	for (i = 0; i < nstreams; ++i) {
+		if (streams[i].ended)
+			continue;
+		if (pfds++->revents & (POLLIN | POLLERR | POLLHUP))
+			streams[i].ready = 1;
+		ready |= streams[i].ready;
+	}
+	return ready;
+}
+
+int mux_pending()
+{
+	return !active && !finished;
+}
+
+/* Deficit round robin over the readable streams */
+PRIVATE stream_t *schedule()
+{
+	unsigned int i;
+	stream_t *s;
+
+	for (i = 0; i < nstreams && !streams[i].ready; ++i);
+	if (i == nstreams)
+		return NULL;
+	for (;;) {
+		s = &streams[current];
+		if (s->ready && s->deficit > 0)
+			return s;
+		/* Streams with nothing to send do not save up for later */
+		if (!s->ready)
+			s->deficit = 0;
+		current = (current + 1) % nstreams;
+		streams[current].deficit += QUANTUM * streams[current].weight;
+	}
+}
+
+ssize_t mux_next(char *payload, size_t len, uint8_t *kind, uint8_t *stream)
+{
+	size_t off = 0;
+	ssize_t rlen;
+	stream_t *s;
+
+	*kind = EXT_KIND_CTRL;
+	*stream = 0;
+	if (!active) {
+		finished = 1;
+		return 0;
+	}
+	if (!(s = schedule())) {
+		errno = EAGAIN;
+		return -1;
+	}
+	*stream = s - streams;
+	if (!s->opened) {
+		LOG("Opening stream %u to %s", *stream, s->name);
+		ext_rec_put(payload, MAX_PAYLOAD_SIZE, &off, EXT_REC_OPEN, s->name,
+				strlen(s->name));
+		s->opened = 1;
+		s->deficit -= off;
+		return off;
+	}
+	if ((rlen = read(s->fd, payload, len)) == -1)
+		return -1;
+	/* Wait for it to be polled again */
+	s->ready = 0;
+	if (rlen) {
+		*kind = EXT_KIND_RAW;
+		s->deficit -= rlen;
+		return rlen;
+	}
+	LOG("Stream %u is complete", *stream);
+	ext_rec_put(payload, MAX_PAYLOAD_SIZE, &off, EXT_REC_END, "", 0);
+	if (*stream)
+		close(s->fd);
+	s->ended = 1;
+	s->deficit = 0;
+	--active;
+	return off;
+}
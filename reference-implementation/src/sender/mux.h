@@ -0,0 +1,38 @@
+#ifndef __MUX_H_
+#define __MUX_H_
+
+#include <stdint.h>
+#include <poll.h>
+#include <sys/types.h>
+
+/* Files sent as separate streams next to the main input, which is stream 0.
+ * The readable streams share the connection by deficit round robin, each
+ * getting a share of the packets proportional to its weight. */
+
+/* Add a stream reading spec, formatted as FILE[:WEIGHT].
+ * @return: 0 on success, -1 on error */
+int mux_add(const char *spec);
+/* Number of streams added besides the main input */
+unsigned int mux_streams();
+void mux_free();
+
+/* Start scheduling the streams, the main input being read from fd */
+void mux_start(int fd);
+
+/* Fill pfds with the inputs to poll.
+ * @return: the number of pollfd's used, at most EXT_MAX_STREAMS */
+int mux_pollfds(struct pollfd *pfds);
+/* Process the result of polling the n pollfd's given by mux_pollfds().
+ * @return: whether some stream can be read */
+int mux_polled(const struct pollfd *pfds, int n);
+/* Whether every stream is complete, and the transfer has yet to end */
+int mux_pending();
+
+/* Fill payload, of MAX_PAYLOAD_SIZE bytes, with up to len bytes of the next
+ * scheduled stream, or with a record opening or ending it. kind is set to the
+ * EXT_KIND_* of the payload and stream to its stream.
+ * @return: the length of the payload, 0 once all streams are complete, -1 on
+ * error */
+ssize_t mux_next(char *payload, size_t len, uint8_t *kind, uint8_t *stream);
+
+#endif /* __MUX_H_ */
@@ -0,0 +1,341 @@
+#include "path.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "../common/macros.h"
+#include "../common/packet_interface.h"
+
+/* Retransmission timer bounds, in ms */
+#define INITIAL_RTO 4000
+#define MIN_RTO 250
+#define MAX_RTO 60000
+/* Smallest congestion window a cached path starts with */
+#define INITIAL_WINDOW 4
+/* Cached windows are not reused on paths losing more packets, in per mille */
+#define MAX_SEED_LOSS 100
+/* Per-packet overhead on the wire, IPv6 and UDP headers included */
+#define PKT_OVERHEAD (PKT_HEADERLEN + PKT_FOOTERLEN + 48)
+/* Smallest payload we shrink to under corruption */
+#define MIN_PAYLOAD_SIZE 64
+/* Halve the corruption statistics every so many bytes sent, to follow the
+ * changes of the path */
+#define CORRUPTION_WINDOW (1 << 20)
+/* Cache entries older than this are ignored, in s */
+#define CACHE_TTL (7 * 24 * 3600)
+#define MAX_CACHE_ENTRIES 256
+
+
+PRIVATE uint64_t now_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void path_init(path_t *path)
+{
+	memset(path->sent_at, 0, sizeof(path->sent_at));
+	path->have_rtt = path->alive = path->seeded = 0;
+	path->in_recovery = path->adaptive = 0;
+	/* Without a cache entry, the window of the receiver and the fixed timer
+	 * rule, as in plain TRTP, until the path loses packets */
+	path->rto = INITIAL_RTO;
+	path->cwnd = MAX_WINDOW_SIZE;
+	path->ssthresh = MAX_WINDOW_SIZE;
+	path->cwnd_acc = 0;
+	path->sent_count = path->resent_count = 0;
+	path->recent_bytes = path->recent_drops = 0;
+}
+
+PRIVATE void update_rto(path_t *path)
+{
+	path->rto = (path->srtt + 4 * path->rttvar) / 1000;
+	if (path->rto < MIN_RTO)
+		path->rto = MIN_RTO;
+	else if (path->rto > MAX_RTO)
+		path->rto = MAX_RTO;
+}
+
+/* The receiver is alive, start with what we know about the path */
+PRIVATE void apply_seed(path_t *path)
+{
+	if (!path->seeded)
+		return;
+	path->srtt = path->seed.srtt;
+	/* Do not trust the cached variation to be as low as it was */
+	path->rttvar = path->seed.rttvar > path->seed.srtt / 4 ?
+		path->seed.rttvar : path->seed.srtt / 4;
+	path->have_rtt = path->adaptive = 1;
+	update_rto(path);
+	/* Lossy paths ramp up again from a small window */
+	path->cwnd = INITIAL_WINDOW;
+	if (path->seed.loss <= MAX_SEED_LOSS && path->seed.window > path->cwnd) {
+		path->cwnd = path->seed.window > MAX_WINDOW_SIZE ?
+			MAX_WINDOW_SIZE : path->seed.window;
+		path->ssthresh = path->cwnd;
+	}
+	LOG("Using the cached path parameters [rtt: %uus, rto: %dms, window: %u]",
+			path->seed.srtt, path->rto, path->cwnd);
+}
+
+PRIVATE void rtt_sample(path_t *path, uint64_t r)
+{
+	uint64_t delta;
+
+	if (!path->have_rtt) {
+		path->srtt = r;
+		path->rttvar = r / 2;
+		path->have_rtt = 1;
+	} else {
+		delta = path->srtt > r ? path->srtt - r : r - path->srtt;
+		path->rttvar = (3 * path->rttvar + delta) / 4;
+		path->srtt = (7 * path->srtt + r) / 8;
+	}
+	/* Only cached for the next transfers otherwise */
+	if (path->adaptive)
+		update_rto(path);
+}
+
+void path_sent(path_t *path, uint8_t seq, size_t len)
+{
+	path->sent_at[seq] = now_us();
+	++path->sent_count;
+	path->recent_bytes += len + PKT_OVERHEAD;
+	if (path->recent_bytes > CORRUPTION_WINDOW) {
+		path->recent_bytes /= 2;
+		path->recent_drops /= 2;
+	}
+}
+
+void path_resent(path_t *path, uint8_t seq)
+{
+	/* Karn's algorithm: we cannot tell which copy will be acknowledged */
+	path->sent_at[seq] = 0;
+	++path->resent_count;
+}
+
+void path_acked(path_t *path, uint8_t seq, unsigned int count)
+{
+	if (!path->alive) {
+		path->alive = 1;
+		apply_seed(path);
+	}
+	if (path->sent_at[seq])
+		rtt_sample(path, now_us() - path->sent_at[seq]);
+	if (path->in_recovery && (int8_t)(seq - path->recover) >= 0)
+		path->in_recovery = 0;
+	if (path->cwnd < path->ssthresh) {
+		path->cwnd += count;
+	} else {
+		for (path->cwnd_acc += count; path->cwnd_acc >= path->cwnd;
+				++path->cwnd)
+			path->cwnd_acc -= path->cwnd;
+	}
+	if (path->cwnd > MAX_WINDOW_SIZE)
+		path->cwnd = MAX_WINDOW_SIZE;
+}
+
+void path_lost(path_t *path, uint8_t last, int timeout)
+{
+	if (timeout) {
+		if (path->adaptive)
+			path->rto = path->rto * 2 > MAX_RTO ? MAX_RTO : path->rto * 2;
+	} else if (path->in_recovery) {
+		/* Only react once per window */
+		return;
+	}
+	if (!path->in_recovery)
+		path->ssthresh = path->cwnd / 2 > 2 ? path->cwnd / 2 : 2;
+	path->cwnd = timeout ? 1 : path->ssthresh;
+	path->cwnd_acc = 0;
+	path->in_recovery = 1;
+	path->recover = last;
+	DEBUG("Reduced the congestion window to %u", path->cwnd);
+}
+
+void path_dropped(path_t *path)
+{
+	++path->recent_drops;
+}
+
+int path_rto(const path_t *path)
+{
+	return path->rto;
+}
+
+unsigned int path_window(const path_t *path)
+{
+	return path->cwnd;
+}
+
+PRIVATE uint64_t isqrt(uint64_t v)
+{
+	uint64_t r = 0, b = 1ULL << 62;
+
+	while (b > v)
+		b >>= 2;
+	for (; b; b >>= 2) {
+		if (v >= r + b) {
+			v -= r + b;
+			r = (r >> 1) + b;
+		} else {
+			r >>= 1;
+		}
+	}
+	return r;
+}
+
+size_t path_payload_size(const path_t *path)
+{
+	uint64_t wire;
+
+	if (!path->recent_drops)
+		return MAX_PAYLOAD_SIZE;
+	/* With a per-byte corruption rate e, packets of w bytes on the wire get
+	 * through with a probability of (1 - e)^w ~ exp(-e.w), so the goodput is
+	 * proportional to (w - PKT_OVERHEAD) / w * exp(-e.w). It peaks when
+	 * w.(w - PKT_OVERHEAD) = PKT_OVERHEAD / e. */
+	wire = (PKT_OVERHEAD + isqrt(PKT_OVERHEAD * PKT_OVERHEAD + 4 *
+				PKT_OVERHEAD * path->recent_bytes / path->recent_drops)) / 2;
+	if (wire < PKT_OVERHEAD + MIN_PAYLOAD_SIZE)
+		return MIN_PAYLOAD_SIZE;
+	if (wire > PKT_OVERHEAD + MAX_PAYLOAD_SIZE)
+		return MAX_PAYLOAD_SIZE;
+	return wire - PKT_OVERHEAD;
+}
+
+/* Numeric address of the peer of fd */
+PRIVATE int peer_addr(int fd, char *addr)
+{
+	struct sockaddr_in6 sa;
+	socklen_t len = sizeof(sa);
+
+	if (getpeername(fd, (struct sockaddr*)&sa, &len) ||
+			!inet_ntop(AF_INET6, &sa.sin6_addr, addr, INET6_ADDRSTRLEN))
+		return -1;
+	return 0;
+}
+
+/* Read the valid entries of the cache file, up to MAX_CACHE_ENTRIES */
+PRIVATE int read_cache(const char *file, path_cache_entry_t *entries)
+{
+	char line[256];
+	long now = time(NULL);
+	path_cache_entry_t *e;
+	int count = 0;
+	FILE *f;
+
+	if (!(f = fopen(file, "r")))
+		return errno == ENOENT ? 0 : -1;
+	while (count < MAX_CACHE_ENTRIES && fgets(line, sizeof(line), f)) {
+		e = &entries[count];
+		if (line[0] == '#' || sscanf(line, "%45s %u %u %u %u %ld", e->addr,
+					&e->srtt, &e->rttvar, &e->loss, &e->window,
+					&e->updated) != 6)
+			continue;
+		if (now - e->updated < CACHE_TTL)
+			++count;
+	}
+	fclose(f);
+	return count;
+}
+
+int path_load(path_t *path, const char *file, int fd)
+{
+	path_cache_entry_t *entries;
+	char addr[INET6_ADDRSTRLEN];
+	int count, i;
+
+	if (peer_addr(fd, addr))
+		goto_errno(fail);
+	if (!(entries = malloc(MAX_CACHE_ENTRIES * sizeof(*entries))))
+		goto_trace(fail, "Cannot allocate the path cache");
+	if ((count = read_cache(file, entries)) == -1)
+		goto_errno(fail_entries);
+	for (i = 0; i < count; ++i) {
+		if (strcmp(entries[i].addr, addr))
+			continue;
+		path->seed = entries[i];
+		path->seeded = 1;
+		LOG("Found cached parameters for [%s]", addr);
+	}
+	free(entries);
+	return 0;
+
+fail_entries:
+	free(entries);
+fail:
+	return -1;
+}
+
+int path_save(const path_t *path, const char *file, int fd)
+{
+	path_cache_entry_t *entries, *e = NULL;
+	char addr[INET6_ADDRSTRLEN], *tmp = NULL;
+	unsigned int loss;
+	int count, i, oldest = 0;
+	FILE *f;
+
+	if (!path->have_rtt)
+		return 0;
+	if (peer_addr(fd, addr))
+		goto_errno(fail);
+	if (!(entries = malloc(MAX_CACHE_ENTRIES * sizeof(*entries))))
+		goto_trace(fail, "Cannot allocate the path cache");
+	if ((count = read_cache(file, entries)) == -1)
+		goto_errno(fail_entries);
+	for (i = 0; i < count; ++i) {
+		if (!strcmp(entries[i].addr, addr))
+			e = &entries[i];
+		if (entries[i].updated < entries[oldest].updated)
+			oldest = i;
+	}
+	/* Replace the oldest entry if the cache is full */
+	if (!e)
+		e = &entries[count < MAX_CACHE_ENTRIES ? count++ : oldest];
+	loss = path->sent_count ?
+		path->resent_count * 1000 / path->sent_count : 0;
+	strcpy(e->addr, addr);
+	e->loss = path->seeded ? (path->seed.loss + loss) / 2 : loss;
+	e->srtt = path->srtt;
+	e->rttvar = path->rttvar;
+	e->window = path->cwnd < path->ssthresh ? path->cwnd : path->ssthresh;
+	e->updated = time(NULL);
+	/* Atomically replace the previous cache */
+	if (!(tmp = malloc(strlen(file) + sizeof(".XXXXXX"))))
+		goto_trace(fail_entries, "Cannot allocate the path cache name");
+	sprintf(tmp, "%s.XXXXXX", file);
+	if ((i = mkstemp(tmp)) == -1 || !(f = fdopen(i, "w"))) {
+		if (i != -1) {
+			close(i);
+			unlink(tmp);
+		}
+		goto_errno(fail_entries);
+	}
+	fprintf(f, "# address srtt(us) rttvar(us) loss(per mille) window "
+			"updated\n");
+	for (i = 0; i < count; ++i)
+		fprintf(f, "%s %u %u %u %u %ld\n", entries[i].addr, entries[i].srtt,
+				entries[i].rttvar, entries[i].loss, entries[i].window,
+				entries[i].updated);
+	if (fclose(f) || rename(tmp, file)) {
+		unlink(tmp);
+		goto_errno(fail_entries);
+	}
+	free(tmp);
+	free(entries);
+	return 0;
+
+fail_entries:
+	free(tmp);
+	free(entries);
+fail:
+	return -1;
+}
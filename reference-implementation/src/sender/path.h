@@ -0,0 +1,79 @@
+#ifndef __PATH_H_
+#define __PATH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+typedef struct {
+	char addr[INET6_ADDRSTRLEN];
+	unsigned int srtt; /* us */
+	unsigned int rttvar; /* us */
+	unsigned int loss; /* per mille */
+	unsigned int window;
+	long updated;
+} path_cache_entry_t;
+
+/* Parameters of the path towards the receiver: round-trip time estimation,
+ * retransmission timer, congestion window and payload size. They can be
+ * cached across transfers, so that new ones towards the same receiver start
+ * with them instead of conservative defaults. */
+typedef struct {
+	/* Send time of the in-flight packets, in us, 0 if sent more than once */
+	uint64_t sent_at[256];
+	/* Smoothed round-trip time and its variation, in us */
+	uint64_t srtt, rttvar;
+	int have_rtt;
+	int rto;
+	/* Whether the retransmission timer follows the round-trip time, which it
+	 * only does on the paths found in the cache */
+	int adaptive;
+	/* Congestion window, slow start threshold, and the progress of
+	 * congestion avoidance towards the next increase */
+	unsigned int cwnd, ssthresh, cwnd_acc;
+	/* Whether we reduced the window for a loss, until recover is
+	 * acknowledged */
+	int in_recovery;
+	uint8_t recover;
+	/* Whether the receiver answered yet */
+	int alive;
+	/* Packets sent, and sent again */
+	unsigned long sent_count, resent_count;
+	/* Recent bytes sent, and packets dropped among them */
+	uint64_t recent_bytes, recent_drops;
+	/* Cached parameters, if any */
+	path_cache_entry_t seed;
+	int seeded;
+} path_t;
+
+void path_init(path_t *path);
+
+/* Load the parameters cached in file for the peer of the connected socket fd.
+ * They only take effect once the receiver answered our first packet.
+ * @return: 0 on success, -1 if the cache could not be read */
+int path_load(path_t *path, const char *file, int fd);
+/* Update the entry of the peer of fd in the cache file.
+ * @return: 0 on success, -1 on error */
+int path_save(const path_t *path, const char *file, int fd);
+
+/* Packet seq, of len bytes of payload, has been sent for the first time, or
+ * sent again */
+void path_sent(path_t *path, uint8_t seq, size_t len);
+void path_resent(path_t *path, uint8_t seq);
+/* count packets have been acknowledged, up to and including seq */
+void path_acked(path_t *path, uint8_t seq, unsigned int count);
+/* A packet has been lost or marked as congestion experienced, the
+ * retransmission timer expired if timeout, last being the last sent packet */
+void path_lost(path_t *path, uint8_t last, int timeout);
+/* A packet was corrupted on the way, or vanished without the receiver
+ * telling us about congestion */
+void path_dropped(path_t *path);
+
+/* Current retransmission timeout, in ms */
+int path_rto(const path_t *path);
+/* Number of packets we can have in flight */
+unsigned int path_window(const path_t *path);
+/* Payload size maximizing the goodput given the corruption rate of the path */
+size_t path_payload_size(const path_t *path);
+
+#endif /* __PATH_H_ */
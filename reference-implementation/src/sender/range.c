@@ -0,0 +1,54 @@
+#include "range.h"
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../common/macros.h"
+
+/* Next byte of the range to read, and the one following it */
+PRIVATE uint64_t range_pos, range_end;
+PRIVATE int range_set = 0;
+
+int range_init(int fd, uint64_t offset, uint64_t length)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+		goto_trace(fail, "Only ranges of regular files can be sent");
+	if (offset > (uint64_t)st.st_size)
+		goto_trace(fail, "The range starts %lub past the end of the input",
+				offset - st.st_size);
+	range_pos = offset;
+	/* Up to the end of the input by default */
+	range_end = length && length < (uint64_t)st.st_size - offset ?
+		offset + length : (uint64_t)st.st_size;
+	range_set = 1;
+	LOG("Sending the range [%lu, %lu[ of the input", range_pos, range_end);
+	return 0;
+
+fail:
+	return -1;
+}
+
+int range_active()
+{
+	return range_set;
+}
+
+uint64_t range_left()
+{
+	return range_end - range_pos;
+}
+
+ssize_t range_read(int fd, void *buf, size_t len)
+{
+	ssize_t n;
+
+	if (len > range_end - range_pos)
+		len = range_end - range_pos;
+	if (!len)
+		return 0;
+	if ((n = pread(fd, buf, len, range_pos)) > 0)
+		range_pos += n;
+	return n;
+}
@@ -0,0 +1,21 @@
+#ifndef __RANGE_H_
+#define __RANGE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Sending a byte range of the input file, read with pread() from its start,
+ * so that several senders can each send their own range of the same file */
+
+/* Only send length bytes of the input, or all of them if 0, from offset on.
+ * @return: 0 on success, -1 if the input is not a regular file */
+int range_init(int fd, uint64_t offset, uint64_t length);
+/* Whether only a range of the input is sent */
+int range_active();
+/* Bytes of the range left to read */
+uint64_t range_left();
+
+/* input_reader returning the next bytes of the range, 0 at its end */
+ssize_t range_read(int fd, void *buf, size_t len);
+
+#endif /* __RANGE_H_ */
@@ -0,0 +1,51 @@
+#include "resume.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../common/macros.h"
+#include "../common/checksum.h"
+
+#define READ_CHUNK (256 * 1024)
+
+
+int resume_possible(int fd)
+{
+	struct stat st;
+
+	return !fstat(fd, &st) && S_ISREG(st.st_mode);
+}
+
+int resume_verify(int fd, uint64_t offset, const char *digest)
+{
+	static char buf[READ_CHUNK];
+	uint8_t hash[SHA256_LEN];
+	uint64_t pos = 0;
+	sha256_t ctx;
+	ssize_t len;
+
+	sha256_init(&ctx);
+	while (pos < offset) {
+		len = offset - pos < sizeof(buf) ? offset - pos : sizeof(buf);
+		if ((len = pread(fd, buf, len, pos)) == -1)
+			goto_errno(fail);
+		if (!len) {
+			LOG("The receiver has more data than the input");
+			return 0;
+		}
+		sha256_update(&ctx, buf, len);
+		pos += len;
+	}
+	sha256_final(&ctx, hash);
+	if (memcmp(hash, digest, SHA256_LEN)) {
+		LOG("The data of the receiver differs from the input");
+		return 0;
+	}
+	if (lseek(fd, offset, SEEK_SET) == -1)
+		goto_errno(fail);
+	return 1;
+
+fail:
+	return -1;
+}
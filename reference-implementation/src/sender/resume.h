@@ -0,0 +1,14 @@
+#ifndef __RESUME_H_
+#define __RESUME_H_
+
+#include <stdint.h>
+
+/* Whether the input can be resumed at some offset */
+int resume_possible(int fd);
+
+/* Check that the first offset bytes of the input match the SHA-256 digest
+ * of what the receiver has, and move the input past them.
+ * @return: 1 if they match, 0 if not, -1 on error */
+int resume_verify(int fd, uint64_t offset, const char *digest);
+
+#endif /* __RESUME_H_ */
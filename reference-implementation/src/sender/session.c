@@ -0,0 +1,107 @@
+#include "../lib/trtp.h"
+#include "../lib/conn.h"
+
+#include "transmit.h"
+
+#include <unistd.h>
+
+#include "../common/macros.h"
+#include "../common/net.h"
+
+PRIVATE const trtp_options_t defaults = TRTP_OPTIONS_INIT;
+
+int trtp_send_fd(const char *host, const char *port,
+		const trtp_options_t *opts, int input)
+{
+	transmit_t *tx;
+	int sock, err;
+
+	if ((err = net_open_socket(host, port, &connect, &sock)) != NET_OK)
+		goto_trace(exit, "Failed to resolve receiver address");
+
+	if (!(tx = transmit_new(sock, input, opts))) {
+		close(sock);
+		err = -ENOMEM;
+		goto_trace(exit, "Failed to start the transfer");
+	}
+
+	if ((err = transmit(tx)))
+		trace("A transmission error occured");
+
+	transmit_free(tx);
+exit:
+	return err;
+}
+
+/* The sending side of a trtp_t */
+
+PRIVATE ssize_t tx_send(void *side, const void *buf, size_t len)
+{
+	return transmit_write(side, buf, len);
+}
+
+PRIVATE void tx_shutdown(void *side)
+{
+	transmit_shutdown(side);
+}
+
+PRIVATE int tx_fd(const void *side)
+{
+	return ((const transmit_t*)side)->sock;
+}
+
+PRIVATE void tx_socket(void *side)
+{
+	transmit_socket(side);
+}
+
+PRIVATE void tx_timeout(void *side)
+{
+	transmit_timeout(side);
+}
+
+PRIVATE int tx_deadline(const void *side)
+{
+	return transmit_deadline(side);
+}
+
+PRIVATE int tx_result(const void *side)
+{
+	return transmit_result(side);
+}
+
+PRIVATE void tx_free(void *side)
+{
+	transmit_free(side);
+}
+
+PRIVATE const conn_ops_t tx_ops = {
+	.send = tx_send,
+	.shutdown = tx_shutdown,
+	.fd = tx_fd,
+	.socket = tx_socket,
+	.timeout = tx_timeout,
+	.deadline = tx_deadline,
+	.result = tx_result,
+	.free = tx_free
+};
+
+trtp_t *trtp_connect(const char *host, const char *port,
+		const trtp_options_t *opts)
+{
+	transmit_t *tx;
+	int sock;
+
+	if (!opts)
+		opts = &defaults;
+	if (net_open_socket(host, port, &connect, &sock) != NET_OK)
+		goto_trace(fail, "Failed to resolve receiver address");
+	if (!(tx = transmit_new(sock, -1, opts))) {
+		close(sock);
+		goto fail;
+	}
+	return conn_new(&tx_ops, tx);
+
+fail:
+	return NULL;
+}
@@ -0,0 +1,132 @@
+#include "sparse.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../common/macros.h"
+#include "../common/packet_interface.h"
+
+/* Only regions of at least a full payload are worth a hole */
+#define SPARSE_BLOCK MAX_PAYLOAD_SIZE
+/* How much of the input we inspect at once */
+#define SPARSE_CHUNK (64 * 1024)
+/* Largest hole announced at once */
+#define MAX_HOLE (1LL << 40)
+
+
+PRIVATE const char zeroes[SPARSE_BLOCK];
+/* Input read ahead to look for zeroes */
+PRIVATE char *stash;
+PRIVATE size_t stash_len = 0;
+PRIVATE size_t stash_off = 0;
+/* Whether the input supports SEEK_DATA, and reading it never blocks */
+PRIVATE int seekable;
+
+int sparse_init(int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st))
+		goto_errno(fail);
+	seekable = S_ISREG(st.st_mode);
+	if (!(stash = malloc(SPARSE_CHUNK)))
+		goto_trace(fail, "Cannot allocate the sparse input buffer");
+	stash_len = stash_off = 0;
+	return 0;
+
+fail:
+	return -1;
+}
+
+void sparse_free()
+{
+	free(stash);
+	stash = NULL;
+}
+
+PRIVATE int is_zero_block(const char *buf)
+{
+	return !memcmp(buf, zeroes, SPARSE_BLOCK);
+}
+
+/* Length of the hole in the file at the current offset, skipping it */
+PRIVATE int64_t skip_file_hole(int fd)
+{
+	off_t pos, data;
+	struct stat st;
+
+	if ((pos = lseek(fd, 0, SEEK_CUR)) == -1)
+		return 0;
+	if ((data = lseek(fd, pos, SEEK_DATA)) == -1) {
+		/* ENXIO: there is no data left, the hole spans up to EOF */
+		if (errno != ENXIO || fstat(fd, &st))
+			return 0;
+		data = st.st_size;
+		if (lseek(fd, data, SEEK_SET) == -1)
+			goto_errno(fail);
+	}
+	return data - pos;
+
+fail:
+	return -1;
+}
+
+int64_t sparse_skip(int fd)
+{
+	int64_t hole = 0;
+	ssize_t rlen;
+
+	while (hole < MAX_HOLE) {
+		if (stash_off == stash_len) {
+			/* Let the filesystem tell us where the holes are, if it can */
+			if (seekable && (rlen = skip_file_hole(fd))) {
+				if (rlen < 0)
+					goto fail;
+				hole += rlen;
+				continue;
+			}
+			if ((rlen = read(fd, stash, SPARSE_CHUNK)) == -1)
+				goto_errno(fail);
+			stash_len = rlen;
+			stash_off = 0;
+			if (!rlen)
+				break;
+		}
+		while (stash_len - stash_off >= SPARSE_BLOCK &&
+				is_zero_block(&stash[stash_off])) {
+			stash_off += SPARSE_BLOCK;
+			hole += SPARSE_BLOCK;
+		}
+		/* Stop at the first data, and avoid blocking on pipes */
+		if (stash_off != stash_len || !seekable)
+			break;
+	}
+	return hole;
+
+fail:
+	return -1;
+}
+
+ssize_t sparse_read(int fd, void *buf, size_t len)
+{
+	size_t n = 0, block;
+
+	if (stash_off == stash_len)
+		return read(fd, buf, len);
+	/* Serve the data read ahead, up to the next zero-filled block */
+	while (n < len && stash_off + n < stash_len) {
+		block = stash_len - stash_off - n;
+		if (block > SPARSE_BLOCK)
+			block = SPARSE_BLOCK;
+		if (n && block == SPARSE_BLOCK && is_zero_block(&stash[stash_off + n]))
+			break;
+		n += block;
+	}
+	if (n > len)
+		n = len;
+	memcpy(buf, &stash[stash_off], n);
+	stash_off += n;
+	return n;
+}
@@ -0,0 +1,19 @@
+#ifndef __SPARSE_H_
+#define __SPARSE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Detection of the zero-filled regions of the input, which are sent as holes
+ * instead of data. */
+int sparse_init(int fd);
+void sparse_free();
+
+/* Skip the zero-filled region starting at the current input position.
+ * @return: its length, 0 if the input continues with data, -1 on error */
+int64_t sparse_skip(int fd);
+
+/* read() the input, stopping before the next zero-filled region */
+ssize_t sparse_read(int fd, void *buf, size_t len);
+
+#endif /* __SPARSE_H_ */
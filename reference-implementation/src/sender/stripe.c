@@ -0,0 +1,183 @@
+#include "stripe.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/random.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#include "../common/macros.h"
+#include "../common/ext.h"
+
+/* Bytes of the input in each block */
+#define BLOCK_SIZE (256 << 10)
+/* Room of the pipe of a stripe, letting it run ahead of the slowest one */
+#define PIPE_SIZE (1 << 20)
+
+
+typedef struct {
+	pid_t pid; /* Process sending it, 0 once it exited */
+	int fd; /* Write end of its pipe */
+} stripe_t;
+
+PRIVATE stripe_t stripes[EXT_MAX_STRIPES];
+PRIVATE unsigned int nstripes;
+/* Stripe sent by this process, -1 in the reader */
+PRIVATE int stripe_self = -1;
+
+int stripe_attached()
+{
+	return stripe_self != -1;
+}
+
+PRIVATE int write_full(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	for (; len; buf += n, len -= n)
+		if ((n = write(fd, buf, len)) == -1)
+			return -1;
+	return 0;
+}
+
+/* Copy up to len bytes of input to fd, moving the pages of the input to the
+ * pipe when the kernel can.
+ * @return: the number of bytes copied, less only at the end of the input,
+ *         -1 on error */
+PRIVATE ssize_t copy_block(int input, int fd, size_t len)
+{
+	static int can_splice = 1;
+	static char buf[BLOCK_SIZE];
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = -1;
+		if (can_splice && (n = splice(input, NULL, fd, NULL, len - done,
+						SPLICE_F_MOVE)) == -1) {
+			if (errno != EINVAL)
+				return -1;
+			/* The input is neither a file nor a pipe */
+			can_splice = 0;
+		}
+		if (n == -1) {
+			if ((n = read(input, buf, len - done)) == -1 ||
+					write_full(fd, buf, n))
+				return -1;
+		}
+		if (!n)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+/* Start the process sending stripe i, reading it from the pipe fds */
+PRIVATE int start_stripe(const char *host, const char *port, unsigned int i,
+		const int *fds, stripe_transfer transfer)
+{
+	unsigned int j;
+	pid_t pid;
+
+	if ((pid = fork()) == -1)
+		goto_errno(fail);
+	if (!pid) {
+		stripe_self = i;
+		/* The stripes must see the end of their pipe */
+		close(fds[1]);
+		for (j = 0; j < i; ++j)
+			close(stripes[j].fd);
+		/* Nothing more to send without the reader */
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		exit(transfer(host, port, fds[0]) ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+	LOG("Sending stripe %u in process %d", i, pid);
+	stripes[i].pid = pid;
+	return 0;
+
+fail:
+	return -1;
+}
+
+/* Wait for the processes of the stripes to exit */
+PRIVATE int wait_stripes()
+{
+	unsigned int i;
+	int status, err = 0;
+
+	for (i = 0; i < nstripes; ++i) {
+		if (!stripes[i].pid)
+			continue;
+		while (waitpid(stripes[i].pid, &status, 0) == -1 && errno == EINTR);
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			ERROR("Stripe %u failed", i);
+			err = -1;
+		}
+		stripes[i].pid = 0;
+	}
+	return err;
+}
+
+int stripe_serve(const char *host, const char *port, int input,
+		unsigned int count, stripe_transfer transfer)
+{
+	char hdr[EXT_STRIPE_HDRLEN];
+	uint64_t token, block;
+	unsigned int i;
+	ssize_t len;
+	int fds[2];
+
+	if (getrandom(&token, sizeof(token), 0) != sizeof(token))
+		goto_errno(fail);
+	/* A stripe giving up must not kill us */
+	signal(SIGPIPE, SIG_IGN);
+	for (nstripes = 0; nstripes < count; ++nstripes) {
+		if (pipe2(fds, O_CLOEXEC))
+			goto_errno(fail_close);
+		/* The default room is a quarter of a block */
+		fcntl(fds[1], F_SETPIPE_SZ, PIPE_SIZE);
+		if (start_stripe(host, port, nstripes, fds, transfer)) {
+			close(fds[0]);
+			close(fds[1]);
+			goto fail_close;
+		}
+		close(fds[0]);
+		stripes[nstripes].fd = fds[1];
+	}
+	ext_put_u32(hdr, EXT_STRIPE_MAGIC);
+	ext_put_u64(hdr + 4, token);
+	hdr[14] = count >> 8;
+	hdr[15] = count;
+	ext_put_u32(hdr + 16, BLOCK_SIZE);
+	for (i = 0; i < count; ++i) {
+		hdr[12] = i >> 8;
+		hdr[13] = i;
+		if (write_full(stripes[i].fd, hdr, sizeof(hdr)))
+			goto_trace(fail_close, "Cannot start stripe %u: %s", i,
+					strerror(errno));
+	}
+	block = 0;
+	do {
+		i = block++ % count;
+		if ((len = copy_block(input, stripes[i].fd, BLOCK_SIZE)) == -1)
+			goto_trace(fail_close, "Cannot pass block %lu to stripe %u: %s",
+					block - 1, i, strerror(errno));
+	} while (len == BLOCK_SIZE);
+	LOG("Dealt the whole input in %lu blocks", block - !len);
+	for (i = 0; i < nstripes; ++i)
+		close(stripes[i].fd);
+	return wait_stripes();
+
+fail_close:
+	for (i = 0; i < nstripes; ++i) {
+		close(stripes[i].fd);
+		if (stripes[i].pid)
+			kill(stripes[i].pid, SIGTERM);
+	}
+	wait_stripes();
+fail:
+	return -1;
+}
@@ -0,0 +1,27 @@
+#ifndef __STRIPE_H_
+#define __STRIPE_H_
+
+/* Striping the input over several connections to the same receiver, each
+ * from its own port, so that the network can route them along different
+ * paths. The calling process deals the blocks of the input in turn to one
+ * process per connection, through a pipe. Each of those sends its stripe
+ * with its own socket, window, acknowledgements and retransmissions, the
+ * stripe starting with the header telling the receiver where its blocks go
+ * (see ext.h). */
+
+/* Send the input read from the given fd to the receiver, over a socket, in
+ * the process of a stripe.
+ * @return: 0 on success */
+typedef int (*stripe_transfer)(const char *host, const char *port, int input);
+
+/* Send the content of input to the receiver at host:port over count
+ * connections. transfer is called in the process of each of them with the
+ * read end of the pipe carrying its stripe.
+ * @return: 0 if every stripe went through, -1 otherwise */
+int stripe_serve(const char *host, const char *port, int input,
+		unsigned int count, stripe_transfer transfer);
+
+/* Whether this process sends one stripe of the input */
+int stripe_attached();
+
+#endif /* __STRIPE_H_ */
@@ -4,84 +4,326 @@
 #include <poll.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
 
 #include "../common/macros.h"
 #include "../common/packet_interface.h"
 #include "../common/pktbuf.h"
 #include "../common/net.h"
+#include "../common/ext.h"
+#include "../common/checksum.h"
+#include "compress.h"
+#include "sparse.h"
+#include "delta.h"
+#include "resume.h"
+#include "path.h"
+#include "mux.h"
+#include "tree.h"
+#include "fanout.h"
+#include "stripe.h"
+#include "range.h"
+#include "mapped.h"
+#include "../common/shm.h"
 
 
 #define MAX_DUP_ACK 3
 #define RETRANSMISSION_DELAY 4000
 #define MAX_RETRANSMISSION 5
+/* Give up after this long without news from the receiver, in ms */
+#define MAX_STALL (MAX_RETRANSMISSION * RETRANSMISSION_DELAY)
+/* Attempts to close the connection, which is only a courtesy */
+#define MAX_CLOSE_RETRY 3
+/* Slots of the send buffer by default */
+#define DEFAULT_WINDOW 32
 
 
-PRIVATE int input_fd; /* Input file */
-PRIVATE pktbuf_t *send_buf; /* buffer storing all packets */
-PRIVATE uint8_t last_ack = 0; /* Last received ack*/
-PRIVATE uint8_t last_win = 1; /* Last received window */
-PRIVATE uint8_t last_sent = -1; /* Last sent packet */
-PRIVATE uint8_t last_chunk_read = -1; /* Last chunk seqnum of the input file */
-PRIVATE uint8_t dup_ack = 0; /* Number of duplicate ACK's */
-/* Number of successive Retransmission timer expiration */
-PRIVATE int retry_count = 0;
-PRIVATE ssize_t last_in_read = -1;
+PUBLIC int delta_input = 0;
+PUBLIC int resume_input = 0;
+PUBLIC long coalesce_delay = COALESCE_DEFAULT;
+PUBLIC const char *tree_root = NULL;
 
 
-PRIVATE int process_nack(uint8_t nack)
+PRIVATE uint64_t monotonic_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* (Re)start the retransmission timer, or the one of the close */
+PRIVATE void timer_restart(transmit_t *tx)
+{
+	tx->timer_at = monotonic_us() + path_rto(&tx->path) * 1000ULL;
+}
+
+/* The transfer cannot go on */
+PRIVATE void abort_transfer(transmit_t *tx)
+{
+	tx->state = TRANSMIT_FAILED;
+	tx->timer_at = 0;
+}
+
+/* Send a chunk of the buffer, gathering its payload if it is mapped */
+PRIVATE net_status_t send_chunk(transmit_t *tx, const pkt_t *pkt)
+{
+	if (tx->mapped_chunks[pkt->seq])
+		return net_send_external(tx->sock, pkt, tx->mapped_chunks[pkt->seq]);
+	return net_send(tx->sock, pkt);
+}
+
+PRIVATE int process_nack(transmit_t *tx, uint8_t nack, int corrupt)
 {
   LOG("Received a NACK for seq #%u; retransmit packet", nack);
-  int max_iter = pktbuf_used(send_buf);
+  int max_iter = pktbuf_used(tx->send_buf);
   pkt_t *pkt;
   for (int i = 0; i < max_iter; i++) {
-    pkt = pktbuf_at(send_buf, i);
-    if (pkt->seq == nack)
-      return (net_send(pkt) != NET_OK);
+    pkt = pktbuf_at(tx->send_buf, i);
+    if (pkt->seq == nack) {
+      /* Truncation happens when the path is congested, corruption does
+       * not tell anything about it */
+      if (corrupt)
+        path_dropped(&tx->path);
+      else
+        path_lost(&tx->path, tx->last_sent, 0);
+      path_resent(&tx->path, nack);
+      return (send_chunk(tx, pkt) != NET_OK);
+    }
   }
   LOG("Cannot found packet #%u for retransmission...", nack);
   return 0;
 }
 
 
-PRIVATE int process_ack(uint8_t ack)
+PRIVATE int process_ack(transmit_t *tx, uint8_t ack)
 {
-    LOG("Ack'ing %u packets [#%u -> #%u]", (uint8_t)(ack - last_ack),
-			last_ack, ack);
-    while (last_ack != ack) {
+    LOG("Ack'ing %u packets [#%u -> #%u]", (uint8_t)(ack - tx->last_ack),
+			tx->last_ack, ack);
+	path_acked(&tx->path, ack - 1, (uint8_t)(ack - tx->last_ack));
+	/* The other receivers may still send the chunks of the ring */
+	if (fanout_attached())
+		fanout_acked((uint8_t)(ack - tx->last_ack));
+    while (tx->last_ack != ack) {
         /* Dequeue all ACK'ed packets */
-        pktbuf_dequeue(send_buf);
-        last_ack += 1;
+        pktbuf_dequeue(tx->send_buf);
+        tx->last_ack += 1;
     }
-    dup_ack = 0;
+    tx->dup_ack = 0;
     return 0;
 }
 
-PRIVATE int process_dup_ack(uint8_t ack)
+PRIVATE int process_dup_ack(transmit_t *tx, uint8_t ack)
 {
-    ++dup_ack;
-    LOG("Duplicate ACK #%u [%d/%d]", ack, dup_ack, MAX_DUP_ACK);
-    if (dup_ack == MAX_DUP_ACK) {
-        dup_ack = 0;
+    ++tx->dup_ack;
+    LOG("Duplicate ACK #%u [%d/%d]", ack, tx->dup_ack, MAX_DUP_ACK);
+    if (tx->dup_ack == MAX_DUP_ACK) {
+        tx->dup_ack = 0;
         LOG("Fast retransmission for #%u", ack);
-		return net_send(pktbuf_first(send_buf)) != NET_OK;
+		path_lost(&tx->path, tx->last_sent, 0);
+		path_dropped(&tx->path);
+		path_resent(&tx->path, ack);
+		return send_chunk(tx, pktbuf_first(tx->send_buf)) != NET_OK;
     }
     return 0;
 }
 
-PRIVATE int handle_socket_read()
+/* Send the writes to the input as they come */
+PRIVATE void coalesce_stop(transmit_t *tx)
+{
+	if (tx->coalesce_fd != -1)
+		close(tx->coalesce_fd);
+	tx->coalesce_fd = -1;
+	tx->coalesce_input = 0;
+	tx->coalesce_since = 0;
+}
+
+/* Start coalescing the small writes to the input.
+ * @return: 0 on success, -1 on error */
+PRIVATE int coalesce_start(transmit_t *tx)
+{
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLET };
+
+	/* The input stays readable while we wait, poll() alone would keep
+	 * waking us up */
+	if ((tx->coalesce_fd = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+			epoll_ctl(tx->coalesce_fd, EPOLL_CTL_ADD, tx->input_fd, &ev))
+		goto_errno(fail);
+	tx->coalesce_input = 1;
+	return 0;
+
+fail:
+	coalesce_stop(tx);
+	return -1;
+}
+
+/* The first chunk has been acknowledged, check if our offer was accepted */
+PRIVATE void handle_ext_answer(transmit_t *tx, uint32_t ts)
+{
+	tx->ext_negotiating = 0;
+	if (!EXT_IS_ACCEPT(ts)) {
+		LOG("The receiver does not support extensions, using plain TRTP");
+		if (fanout_attached())
+			fanout_answered(0);
+		return;
+	}
+	tx->ext_enabled = 1;
+	tx->ext_features = EXT_FEATURES(ts) & tx->ext_offer;
+	/* Delta transfers send their literal data as is */
+	if (tx->ext_features & EXT_DELTA)
+		tx->ext_features &= ~(EXT_DEFLATE | EXT_SPARSE);
+	/* Only mark our packets if the receiver watches the marks */
+	if ((tx->ext_features & EXT_ECN) && net_ecn_mark(tx->sock) != NET_OK)
+		tx->ext_features &= ~EXT_ECN;
+	if (tx->ext_features & EXT_MUX) {
+		mux_start(tx->input_fd);
+		/* The streams are interleaved as they come instead */
+		coalesce_stop(tx);
+		/* An empty main input does not end the transfer anymore */
+		if (!tx->last_in_read)
+			tx->last_in_read = -1;
+	}
+	if (tx->ext_features & EXT_SIZE)
+		tx->size_pending = 1;
+	if (tx->ext_features & EXT_SHM) {
+		if (shm_create(tx->shm_rec))
+			tx->ext_features &= ~EXT_SHM;
+		else
+			tx->shm_state = SHM_ANNOUNCE;
+	}
+	LOG("Negotiated extensions: %#x [offered: %#x]", tx->ext_features,
+			tx->ext_offer);
+	if (fanout_attached())
+		fanout_answered(tx->ext_features);
+}
+
+/* React to the packets the network marked since the last ACK, before it
+ * starts dropping them */
+PRIVATE void handle_ce(transmit_t *tx, uint8_t flags)
+{
+	uint8_t count = EXT_ACK_CE_COUNT(flags);
+	uint8_t marked = (count - tx->ce_echoed) & 0x7;
+
+	if (!marked)
+		return;
+	/* Follow the count of the receiver whatever the jump. More than 4 marks
+	 * look like a reordered ACK, but only as long as the count did not wrap
+	 * around, and the window is only reduced once per round-trip anyway */
+	tx->ce_echoed = count;
+	DEBUG("The receiver saw %u more congestion marks", marked);
+	path_lost(&tx->path, tx->last_sent, 0);
+}
+
+/* The receiver has part of the input from a previous transfer */
+PRIVATE int handle_resume(transmit_t *tx, const ext_rec_t *rec)
+{
+	uint64_t offset;
+	int err;
+
+	if (!(tx->ext_features & EXT_RESUME) || tx->resume_answered)
+		return 0;
+	PRECONDITION(rec->len == sizeof(uint64_t) + SHA256_LEN, -1);
+	tx->resume_answered = 1;
+	offset = ext_get_u64(rec->value);
+	if ((err = resume_verify(tx->input_fd, offset,
+					rec->value + sizeof(uint64_t))) == -1)
+		return -1;
+	if (!err) {
+		/* Send everything again */
+		if (lseek(tx->input_fd, 0, SEEK_SET) == -1)
+			return -1;
+		offset = 0;
+	}
+	LOG("Resuming the transfer at %lub", offset);
+	tx->resume_at = offset;
+	return 0;
+}
+
+/* How to read the main input */
+PRIVATE input_reader input_read()
+{
+	if (tree_root)
+		return tree_read;
+	return range_active() ? range_read : read;
+}
+
+/* Pass the rest of the input through the ring the receiver attached to */
+PRIVATE int shm_switch(transmit_t *tx)
+{
+	int err;
+
+	/* Read on from the last chunk taken, the mapping staying for the chunks
+	 * already queued */
+	if (mapped_active() &&
+			lseek(tx->input_fd, mapped_offset(), SEEK_SET) == -1)
+		return -1;
+	err = shm_send(input_read(), tx->input_fd);
+
+	shm_free();
+	tx->shm_state = SHM_DONE;
+	/* The next read gets the end of the input */
+	return err;
+}
+
+/* The receiver answered our announce of the ring */
+PRIVATE int handle_shm(transmit_t *tx, const ext_rec_t *rec)
+{
+	if (tx->shm_state != SHM_WAITING)
+		return 0;
+	PRECONDITION(rec->len == 1, -1);
+	if (rec->value[0])
+		return shm_switch(tx);
+	LOG("The receiver cannot use shared memory, sending packets");
+	shm_free();
+	tx->shm_state = SHM_OFF;
+	return 0;
+}
+
+/* Process the control records sent back by the receiver.
+ * @return: 0 on success, -1 to drop the ACK, 1 if the transfer failed */
+PRIVATE int handle_ack_payload(transmit_t *tx, const pkt_t *pkt)
 {
+	ext_rec_t rec;
+	size_t off = 0;
 	int err;
+
+	if (!tx->ext_enabled) {
+		ERROR("Dropping ACK #%u with an unexpected payload", pkt->seq);
+		return -1;
+	}
+	while ((err = ext_rec_next(pkt->payload, pkt->length, &off, &rec)) > 0) {
+		if (rec.type == EXT_REC_RESUME) {
+			if (handle_resume(tx, &rec))
+				break;
+		} else if (rec.type == EXT_REC_SHM) {
+			if (handle_shm(tx, &rec))
+				return 1;
+		} else if ((tx->ext_features & EXT_DELTA) &&
+				delta_handle_reply(rec.type, rec.value, rec.len))
+			break;
+	}
+	if (err)
+		ERROR("Malformed control record in ACK #%u", pkt->seq);
+	return 0;
+}
+
+PRIVATE int handle_socket_read(transmit_t *tx)
+{
+	int err, update = 0;
 	uint8_t win;
 	pkt_t pkt;
 
 	/* The link is alive, remember it */
-	retry_count = 0;
+	tx->stalled = 0;
   /* Compute the window size, to discard old ACK's that have been delayed,
   * except the last one seen (as the corresponding data segment might
   * have been lost). */
-  win = last_sent - last_ack + 1;
+  win = tx->last_sent - tx->last_ack + 1;
   /* Restrict the reception to a valid ACK or NACK */
-  if ((err = net_recv_pkt(&pkt, last_ack, win)) != NET_OK)
+  if ((err = net_recv_pkt(tx->sock, &pkt, tx->last_ack, win, NULL)) !=
+		  NET_OK)
     /* Propagate error if I/O related, ignore if dropped */
     return err == NET_ERROR;
   /* Sanity check*/
@@ -91,60 +333,398 @@ PRIVATE int handle_socket_read()
     /* Do not propagate the error */
     return 0;
   }
-	if (pkt.ts != PKT_TIMESTAMP) {
+	if (tx->ext_negotiating && pkt.type == PTYPE_ACK &&
+			pkt.seq != tx->last_ack) {
+		handle_ext_answer(tx, pkt.ts);
+		/* The other streams would have nowhere to go */
+		if ((tx->ext_offer & EXT_MUX) && !(tx->ext_features & EXT_MUX)) {
+			ERROR("The receiver does not accept multiplexed streams");
+			return 1;
+		}
+		/* Nor would the other stripes */
+		if ((tx->ext_offer & EXT_STRIPE) &&
+				!(tx->ext_features & EXT_STRIPE)) {
+			ERROR("The receiver does not accept striped transfers");
+			return 1;
+		}
+	} else if (!tx->ext_offer && pkt.ts != PKT_TIMESTAMP) {
 		ERROR("The receiver is corrupting the timestamp! [expected: %u,"
 				" received: %u]", PKT_TIMESTAMP, pkt.ts);
 	}
-	if (last_win != pkt.window) {
-		LOG("Updating receive window: %u -> %u", last_win, pkt.window);
-		last_win = pkt.window;
+	if ((tx->ext_features & EXT_ECN) && !EXT_IS_ACCEPT(pkt.ts))
+		handle_ce(tx, EXT_TS_FLAGS(pkt.ts));
+	/* Credits only ever increase */
+	if ((tx->ext_features & EXT_PULL) && !EXT_IS_ACCEPT(pkt.ts) &&
+			(EXT_TS_FLAGS(pkt.ts) & EXT_ACK_PULL) &&
+			EXT_TS_CLOCK(pkt.ts) != tx->pull_limit &&
+			EXT_TS_CLOCK(EXT_TS_CLOCK(pkt.ts) - tx->pull_limit) < 0x800000) {
+		tx->pull_limit = EXT_TS_CLOCK(pkt.ts);
+		update = 1;
+	}
+	if (tx->last_win != pkt.window) {
+		LOG("Updating receive window: %u -> %u", tx->last_win, pkt.window);
+		tx->last_win = pkt.window;
+		update = 1;
+	}
+	if (pkt.length) {
+		if ((err = handle_ack_payload(tx, &pkt)))
+			return err > 0;
+		/* Replies are not duplicates hinting at a loss */
+		if (pkt.type == PTYPE_ACK && pkt.seq == tx->last_ack)
+			return 0;
 	}
   /* Process the NACK */
   if (pkt.type == PTYPE_NACK)
-    return process_nack(pkt.seq);
+    return process_nack(tx, pkt.seq, tx->ext_enabled &&
+		!EXT_IS_ACCEPT(pkt.ts) && (EXT_TS_FLAGS(pkt.ts) & EXT_ACK_CORRUPT));
+	/* Neither are the updates of the window, sent as the receiver makes
+	 * room for more packets */
+	if (tx->last_ack == pkt.seq && update)
+		return 0;
 	/* Process the ACK */
-  return (last_ack == pkt.seq) ?
-		process_dup_ack(pkt.seq) : process_ack(pkt.seq);
+  return (tx->last_ack == pkt.seq) ?
+		process_dup_ack(tx, pkt.seq) : process_ack(tx, pkt.seq);
+}
+
+/* Whether some input has already been read and waits to be queued */
+PRIVATE int input_pending(const transmit_t *tx)
+{
+	/* Past the first chunk, the timestamps depend on the answer to our
+	 * offer */
+	if (fanout_attached())
+		return !(tx->ext_negotiating && tx->last_chunk_read == 0) &&
+			fanout_pending();
+	/* The end of the transfer follows the end of the last stream */
+	if (tx->ext_features & EXT_MUX)
+		return mux_pending();
+	/* Signature requests do not depend on the input, unless it was empty */
+	if ((tx->ext_features & EXT_DELTA) && delta_fetching())
+		return tx->last_in_read != 0 &&
+			delta_ready(pktbuf_empty(tx->send_buf));
+	return (tx->ext_features & EXT_DEFLATE) && compress_pending(tx->compress);
+}
+
+/* Bytes of the regular input left to send */
+PRIVATE uint64_t input_left(const transmit_t *tx)
+{
+	struct stat st;
+	off_t pos;
+
+	if (range_active())
+		return range_left();
+	pos = mapped_active() ? mapped_offset() :
+		lseek(tx->input_fd, 0, SEEK_CUR);
+	if (pos == -1 || fstat(tx->input_fd, &st) || st.st_size < pos)
+		return 0;
+	return st.st_size - pos;
+}
+
+/* Fill the payload of the next chunk */
+PRIVATE ssize_t read_payload(transmit_t *tx, pkt_t *pkt, uint8_t *kind,
+		uint8_t *stream)
+{
+	input_reader rd = input_read();
+	/* Shrink the packets when the path corrupts too many of them */
+	size_t size = path_payload_size(&tx->path);
+	size_t len = 0;
+	int64_t hole;
+	char value[sizeof(uint64_t)];
+
+	*kind = EXT_KIND_RAW;
+	*stream = 0;
+	if (tx->ext_features & EXT_MUX)
+		return mux_next(pkt->payload, size, kind, stream);
+	/* Tell the receiver where the input continues before anything else */
+	if (tx->resume_at != -1) {
+		*kind = EXT_KIND_CTRL;
+		ext_put_u64(value, tx->resume_at);
+		ext_rec_put(pkt->payload, sizeof(pkt->payload), &len, EXT_REC_RESUME,
+				value, sizeof(value));
+		tx->resume_at = -1;
+		return len;
+	}
+	/* So that it can reserve the space of the output */
+	if (tx->size_pending) {
+		*kind = EXT_KIND_CTRL;
+		ext_put_u64(value, input_left(tx));
+		ext_rec_put(pkt->payload, sizeof(pkt->payload), &len, EXT_REC_SIZE,
+				value, sizeof(value));
+		tx->size_pending = 0;
+		return len;
+	}
+	/* Then where to find the rest of it */
+	if (tx->shm_state == SHM_ANNOUNCE) {
+		*kind = EXT_KIND_CTRL;
+		ext_rec_put(pkt->payload, sizeof(pkt->payload), &len, EXT_REC_SHM,
+				tx->shm_rec, SHM_RECLEN);
+		tx->shm_state = SHM_WAITING;
+		return len;
+	}
+	if (tx->ext_features & EXT_SPARSE) {
+		rd = sparse_read;
+		/* Holes can only be sent once the preceding data has been queued */
+		if (!input_pending(tx)) {
+			if ((hole = sparse_skip(tx->input_fd)) < 0)
+				return -1;
+			if (hole) {
+				LOG("Sending a hole of %ldb", hole);
+				*kind = EXT_KIND_CTRL;
+				ext_put_u64(value, hole);
+				ext_rec_put(pkt->payload, sizeof(pkt->payload), &len,
+						EXT_REC_HOLE, value, sizeof(value));
+				return len;
+			}
+		}
+	}
+	if (tx->ext_features & EXT_DELTA)
+		return delta_next(rd, tx->input_fd, pkt->payload, size, kind);
+	if (tx->ext_features & EXT_DEFLATE)
+		return compress_next(tx->compress, rd, tx->input_fd, pkt->payload,
+				size, kind);
+	/* The rest of the input went through the ring */
+	if (mapped_active() && tx->shm_state != SHM_DONE) {
+		tx->mapped_chunks[pkt->seq] = mapped_next(size, &len);
+		return len;
+	}
+	if ((len = rd(tx->input_fd, pkt->payload, size)) == (size_t)-1)
+		return -1;
+	/* The first chunk is sent before knowing if delta encoding is used */
+	if (delta_input && tx->ext_negotiating)
+		delta_account(pkt->payload, len);
+	return len;
+}
+
+PRIVATE uint32_t data_timestamp(const transmit_t *tx, uint8_t kind,
+		uint8_t stream)
+{
+	if (tx->ext_enabled)
+		return EXT_DATA_TS(kind, stream, 0);
+	/* The first chunk carries our offer */
+	if (tx->ext_offer && tx->last_chunk_read == 0 && tx->ext_negotiating)
+		return EXT_OFFER(tx->ext_offer);
+	return PKT_TIMESTAMP;
 }
 
-PRIVATE int handle_input_read()
+/* Window of a packet seq of stream, see EXT_MUX */
+PRIVATE uint8_t stream_distance(transmit_t *tx, uint8_t seq, uint8_t stream)
 {
+	uint8_t distance = seq - tx->stream_last[stream];
+
+	if (!tx->ext_enabled || !(tx->ext_features & EXT_MUX))
+		return 0;
+	if (!(tx->stream_seen & (1ULL << stream)) || distance > MAX_WINDOW_SIZE)
+		distance = 0;
+	tx->stream_seen |= 1ULL << stream;
+	tx->stream_last[stream] = seq;
+	return distance;
+}
+
+/* Take the slot of the next chunk in the buffer */
+PRIVATE pkt_t *next_chunk(transmit_t *tx)
+{
+	pkt_t *pkt;
+
 	/* Get the next sequence number */
-	++last_chunk_read;
+	++tx->last_chunk_read;
 	/* Get its slot in the buffer */
-	pkt_t *pkt = pktbuf_enqueue(send_buf);
-	/* Fill the packet */
+	pkt = pktbuf_enqueue(tx->send_buf);
 	pkt->type = PTYPE_DATA;
 	pkt->window = 0;
-	pkt->seq = last_chunk_read;
-	pkt->ts = PKT_TIMESTAMP;
-	if ((last_in_read = read(input_fd, pkt->payload, sizeof(pkt->payload)))
-			== -1) {
+	pkt->seq = tx->last_chunk_read;
+	tx->mapped_chunks[pkt->seq] = NULL;
+	return pkt;
+}
+
+/* Complete the chunk pkt, whose payload of len bytes is of the given kind and
+ * belongs to stream, and encode it */
+PRIVATE void queue_chunk(transmit_t *tx, pkt_t *pkt, size_t len,
+		uint8_t kind, uint8_t stream)
+{
+	tx->last_in_read = len;
+	pkt->ts = data_timestamp(tx, kind, stream);
+	pkt->window = stream_distance(tx, pkt->seq, stream);
+	pkt->length = len;
+	LOG("Queued chunk #%u [%db]", pkt->seq, pkt->length);
+	if (fanout_attached())
+		pkt_encode_header(pkt);
+	else if (tx->mapped_chunks[pkt->seq])
+		pkt_encode_external(pkt, tx->mapped_chunks[pkt->seq]);
+	else
+		pkt_encode_inline(pkt);
+}
+
+PRIVATE int handle_input_read(transmit_t *tx)
+{
+	pkt_t *pkt = next_chunk(tx);
+	uint8_t kind, stream = 0;
+	ssize_t len;
+	size_t got;
+
+	/* The reader already encoded its payload */
+	if (fanout_attached()) {
+		tx->mapped_chunks[pkt->seq] = fanout_next(pkt, &got, &kind);
+		len = got;
+	} else if ((len = read_payload(tx, pkt, &kind, &stream)) == -1) {
 		perror("Cannot read input stream");
+		tx->last_in_read = -1;
 		return -1;
 	}
-	pkt->length = last_in_read;
-	LOG("Queued chunk #%u [%db]", pkt->seq, pkt->length);
-	pkt_encode_inline(pkt);
+	queue_chunk(tx, pkt, len, kind, stream);
 	return 0;
 }
 
+/* Queue the next chunk of the data given by transmit_write(), from the len
+ * bytes at buf, of which used is set to the number consumed. Without any,
+ * the compressed data pending goes first, then the end of the data.
+ * @return: 0 on success, -1 on error */
+PRIVATE int write_chunk(transmit_t *tx, const char *buf, size_t len,
+		size_t *used)
+{
+	pkt_t *pkt = next_chunk(tx);
+	size_t size = path_payload_size(&tx->path);
+	uint8_t kind = EXT_KIND_RAW;
+	ssize_t plen;
+
+	if (tx->ext_features & EXT_DEFLATE) {
+		if ((plen = compress_next_buf(tx->compress, buf, len, used,
+						pkt->payload, size, &kind)) == -1)
+			return -1;
+	} else {
+		plen = *used = len < size ? len : size;
+		memcpy(pkt->payload, buf, plen);
+	}
+	queue_chunk(tx, pkt, plen, kind, 0);
+	return 0;
+}
+
+/* Whether the readable input is worth a chunk: either it fills a payload, or
+ * we waited long enough for the writer to add to it */
+PRIVATE int input_ready(transmit_t *tx)
+{
+	struct epoll_event ev;
+	int avail;
+	uint64_t now;
+
+	if (fanout_attached())
+		return fanout_ready();
+	if (!tx->coalesce_input)
+		return 1;
+	/* Clear the edge before looking at the input, to catch the next write */
+	while (epoll_wait(tx->coalesce_fd, &ev, 1, 0) > 0);
+	/* Nothing to read means EOF */
+	if (ioctl(tx->input_fd, FIONREAD, &avail) == -1 || !avail ||
+			(size_t)avail >= path_payload_size(&tx->path)) {
+		tx->coalesce_since = 0;
+		return 1;
+	}
+	now = monotonic_us();
+	if (!tx->coalesce_since)
+		tx->coalesce_since = now;
+	if (now - tx->coalesce_since < (uint64_t)coalesce_delay)
+		return 0;
+	tx->coalesce_since = 0;
+	return 1;
+}
+
+/* How long to wait for an event before a timer expires, or before flushing
+ * the coalesced input, stored in ts.
+ * @return: ts, NULL to wait for as long as it takes */
+PRIVATE struct timespec *poll_timeout(const transmit_t *tx,
+		struct timespec *ts)
+{
+	uint64_t at = tx->timer_at, now = monotonic_us(), wait;
+
+	if (tx->coalesce_since &&
+			(!at || tx->coalesce_since + coalesce_delay < at))
+		at = tx->coalesce_since + coalesce_delay;
+	if (!at)
+		return NULL;
+	wait = at > now ? at - now : 0;
+	ts->tv_sec = wait / 1000000;
+	ts->tv_nsec = wait % 1000000 * 1000;
+	return ts;
+}
+
+/* Fill pfds with the inputs to poll, returning their number */
+PRIVATE int input_pollfds(const transmit_t *tx, struct pollfd *pfds)
+{
+	if (tx->ext_features & EXT_MUX)
+		return mux_pollfds(pfds);
+	/* Only wake up for the writes adding to what we wait on */
+	pfds->fd = tx->coalesce_since ? tx->coalesce_fd : tx->input_fd;
+	pfds->events = POLLIN;
+	return 1;
+}
+
+/* Whether some of the n polled inputs can be read */
+PRIVATE int input_polled(const transmit_t *tx, const struct pollfd *pfds,
+		int n)
+{
+	if (tx->ext_features & EXT_MUX)
+		return mux_polled(pfds, n);
+	return n && (pfds->revents & (POLLIN | POLLERR | POLLHUP));
+}
+
+/* Whether we can queue more chunks from the input */
+PRIVATE int can_read_input(const transmit_t *tx)
+{
+	/* Do not read past the first chunk before knowing how to encode data */
+	return tx->last_in_read != 0 && !pktbuf_full(tx->send_buf) &&
+		!tx->ext_negotiating &&
+		!((tx->ext_features & EXT_DELTA) && delta_fetching()) &&
+		tx->shm_state != SHM_WAITING;
+}
+
+/* Whether transmit_write() can queue a chunk. As with an input file, the
+ * first one goes before the answer to our offer. */
+PRIVATE int can_write(const transmit_t *tx)
+{
+	if (tx->ext_negotiating)
+		return tx->last_chunk_read == (uint8_t)-1;
+	return can_read_input(tx);
+}
+
+/* Send the next chunk of the buffer for the first time */
+PRIVATE int send_next(transmit_t *tx)
+{
+	pkt_t *pkt;
+
+	++tx->last_sent;
+	pkt = pktbuf_slotfor_seq(tx->send_buf, tx->last_sent);
+	path_sent(&tx->path, tx->last_sent, ntohs(pkt->length));
+	++tx->pull_sent;
+	return send_chunk(tx, pkt) != NET_OK;
+}
+
 /* The retransmission timer has expired, perform a go-back-n */
-PRIVATE int handle_retransmission()
+PRIVATE int handle_retransmission(transmit_t *tx)
 {
 	uint8_t sseq;
 
-	++retry_count;
-	if (retry_count > MAX_RETRANSMISSION)
+	/* The receiver attached to the ring, but its answer got lost */
+	if (tx->shm_state == SHM_WAITING && shm_attached())
+		return shm_switch(tx);
+	tx->stalled += path_rto(&tx->path);
+	if (tx->stalled > MAX_STALL)
 		goto_trace(bail, "Too many consecutive retransmission timeouts, "
 				"aborting transfer");
+	/* Nothing is in flight as the receiver closed its window, and the update
+	 * reopening it may have been lost: probe it with the next chunk, which
+	 * it answers with its current window */
+	if ((uint8_t)(tx->last_sent + 1) == tx->last_ack) {
+		LOG("Probing the window of the receiver with #%u",
+				(uint8_t)(tx->last_sent + 1));
+		return send_next(tx);
+	}
+	path_lost(&tx->path, tx->last_sent, 1);
 
     LOG("Retransmission timer expired, sending window [%u->%u]",
-			last_ack, last_sent);
-	for (sseq = last_ack; sseq != last_sent + 1; ++sseq) {
-		pkt_t *pkt = pktbuf_slotfor_seq(send_buf, sseq);
+			tx->last_ack, tx->last_sent);
+	for (sseq = tx->last_ack; sseq != (uint8_t)(tx->last_sent + 1); ++sseq) {
+		pkt_t *pkt = pktbuf_slotfor_seq(tx->send_buf, sseq);
 		LOG("Resending %u", pkt->seq);
-        if(net_send(pkt) != NET_OK)
+		path_resent(&tx->path, sseq);
+        if(send_chunk(tx, pkt) != NET_OK)
 			goto bail;
 	}
     /* /1* Send all unack'ed packets *1/ */
@@ -153,91 +733,389 @@ PRIVATE int handle_retransmission()
     /*     if(net_send(pkt) != NET_OK) */
 			/* goto bail; */
     /* } */
-    dup_ack = 0;
+    tx->dup_ack = 0;
 	return 0;
 
 bail:
 	return -1;
 }
 
-PRIVATE int can_send()
+PRIVATE int can_send(const transmit_t *tx)
 {
-	return !pktbuf_empty(send_buf) &&
-		(uint8_t)(last_sent + 1 - last_ack) < last_win;
+	unsigned int win = path_window(&tx->path);
+
+	/* The receiver paces us, only send what it pulled */
+	if (tx->ext_features & EXT_PULL) {
+		win = tx->last_win;
+		if (EXT_TS_CLOCK(tx->pull_limit - tx->pull_sent - 1) >= 0x800000)
+			return 0;
+	}
+	/* Respect both the receiver's window and the path's capacity */
+	if (win > tx->last_win)
+		win = tx->last_win;
+	return !pktbuf_empty(tx->send_buf) &&
+		(uint8_t)(tx->last_sent + 1 - tx->last_ack) < win;
 }
 
-PRIVATE int do_send_sbuf()
+PRIVATE int do_send_sbuf(transmit_t *tx)
 {
-	pkt_t *pkt;
-
-	while (last_sent != last_chunk_read && can_send()) {
-		++last_sent;
-		pkt = pktbuf_slotfor_seq(send_buf, last_sent);
-		if (net_send(pkt))
+	while (tx->last_sent != tx->last_chunk_read && can_send(tx)) {
+		if (send_next(tx))
 			return -1;
+		/* Time the first packet sent after an idle period */
+		if (!tx->timer_at)
+			timer_restart(tx);
 	}
 	return 0;
 }
 
-int transmit(int input_file, pktbuf_t *buffer)
+/* The close is over, whether the receiver answered or not */
+PRIVATE void close_done(transmit_t *tx)
+{
+	tx->state = TRANSMIT_DONE;
+	tx->timer_at = 0;
+	if (tx->opts.path_cache && path_save(&tx->path, tx->opts.path_cache,
+				tx->sock))
+		ERROR("Cannot update the path cache %s: %s", tx->opts.path_cache,
+				strerror(errno));
+}
+
+/* Tell the receiver that its last ACK made it, so that it can exit right
+ * away instead of lingering. Receivers not aware of it simply acknowledge
+ * the EOF chunk again. */
+PRIVATE void close_send(transmit_t *tx)
 {
-	int err, pfds_count;
-	struct pollfd pfds[2];
-#define poll_file pfds[0]
-#define poll_socket pfds[1]
+	pkt_t pkt = { .type = PTYPE_DATA, .length = 0 };
 
-	input_fd = input_file;
-	send_buf = buffer;
-	if (!pktbuf_empty(send_buf))
-		printf("not empty\n");
+	pkt.seq = tx->last_chunk_read + 1;
+	pkt.ts = data_timestamp(tx, EXT_KIND_RAW, 0);
+	pkt_encode_inline(&pkt);
+	if (tx->close_retry++ == MAX_CLOSE_RETRY ||
+			net_send(tx->sock, &pkt) != NET_OK)
+		close_done(tx);
+	else
+		timer_restart(tx);
+}
 
-	poll_file.fd = input_fd;
-	poll_file.events = POLLIN;
-	poll_socket.fd = net_fd;
-	poll_socket.events = POLLIN;
-	pfds_count = 2;
-	do {
-        err = poll(&pfds[sizeof(pfds) / sizeof(struct pollfd) - pfds_count],
-				pfds_count, RETRANSMISSION_DELAY);
-        if (err == -1)
-            goto_errno(fail);
-        else if (err > 0) {
-			/* We first check the socket, to update the window to the latest
-			 * received */
-            if ((poll_socket.revents & (POLLIN | POLLERR | POLLHUP)) &&
-					handle_socket_read())
-                goto_trace(fail, "Cannot process the socket anymore");
-			/* We read a chunk from the input file and encode it right away. */
-            if ((poll_file.revents & (POLLIN | POLLERR | POLLHUP)) &&
-					handle_input_read())
-				goto fail;
-			/* Try to send data if possible.
-			 * We do not care if the socket is blocking when writing, as it is
-			 * the only way to make progress in the connection. */
-			if (do_send_sbuf())
-				goto_trace(fail, "Cannot send new segments");
-			/* Check wether we should poll the file again or not */
-			if (last_in_read != 0 && !pktbuf_full(send_buf)) {
-				/* Poll all fd's */
-				pfds_count = 2;
-			} else {
-				/* Only poll the socket fd */
-				pfds_count = 1;
-				poll_file.revents = 0;
-			}
-			/* We optimistically always poll the socket (i.e. to handle
-			 * unexpected acks */
+/* Process an answer to the close */
+PRIVATE void handle_close_read(transmit_t *tx)
+{
+	pkt_t ack;
+	int err;
+
+	/* An error means that the receiver is already gone */
+	if ((err = net_recv_pkt(tx->sock, &ack, tx->last_chunk_read + 1, 1,
+					NULL)) == NET_ERROR) {
+		close_done(tx);
+	} else if (err == NET_OK && ack.type == PTYPE_ACK) {
+		LOG("Connection closed");
+		close_done(tx);
+	}
+}
+
+/* Queue the input we have already read, if any, then the end of the data
+ * given by transmit_write() once all of it is.
+ * @return: 0 on success, -1 on error */
+PRIVATE int queue_pending(transmit_t *tx)
+{
+	size_t used;
+
+	while (input_pending(tx) && !pktbuf_full(tx->send_buf))
+		if (tx->input_fd != -1 ? handle_input_read(tx) :
+				write_chunk(tx, NULL, 0, &used))
+			return -1;
+	if (tx->input_fd == -1 && tx->shutdown && can_write(tx) &&
+			!input_pending(tx))
+		return write_chunk(tx, NULL, 0, &used);
+	return 0;
+}
+
+/* Queue and send what we can, then close the connection once all the data
+ * went through */
+PRIVATE void make_progress(transmit_t *tx)
+{
+	if (tx->state != TRANSMIT_RUNNING)
+		return;
+	if (queue_pending(tx))
+		goto fail;
+	/* Try to send data if possible.
+	 * We do not care if the socket is blocking when writing, as it is
+	 * the only way to make progress in the connection. */
+	if (do_send_sbuf(tx))
+		goto_trace(fail, "Cannot send new segments");
+	if (tx->last_in_read == 0 && pktbuf_empty(tx->send_buf)) {
+		LOG("Transfert completed");
+		tx->state = TRANSMIT_CLOSING;
+		close_send(tx);
+	}
+	return;
+
+fail:
+	abort_transfer(tx);
+}
+
+transmit_t *transmit_new(int sock, int input, const trtp_options_t *opts)
+{
+	transmit_t *tx;
+	struct stat st;
+
+	if (!(tx = calloc(1, sizeof(*tx))))
+		goto_trace(fail, "Cannot allocate the transfer");
+	tx->sock = sock;
+	tx->input_fd = input;
+	tx->opts = *opts;
+	tx->state = TRANSMIT_RUNNING;
+	tx->last_win = 1;
+	tx->last_sent = -1;
+	tx->last_chunk_read = -1;
+	tx->last_in_read = -1;
+	tx->resume_at = -1;
+	tx->pull_limit = EXT_PULL_INITIAL;
+	tx->coalesce_fd = -1;
+	tx->shm_state = SHM_OFF;
+	if (!(tx->send_buf = pktbuf_new(opts->window ? opts->window :
+					DEFAULT_WINDOW)))
+		goto_trace(fail_free, "Failed to allocate buffer");
+	/* The reader of the fanout compresses and skips the holes of its input
+	 * itself */
+	if (opts->compress != TRTP_COMPRESS_OFF) {
+		if (!fanout_attached() &&
+				!(tx->compress = compress_new(opts->compress)))
+			goto fail_free;
+		tx->ext_offer |= EXT_DEFLATE;
+	}
+	if (delta_input) {
+		if (delta_init())
+			goto fail_free;
+		tx->ext_offer |= EXT_DELTA;
+	}
+	/* The other options of the library only apply to an input file */
+	if (opts->sparse && input != -1) {
+		if (!fanout_attached() && sparse_init(input))
+			goto fail_free;
+		tx->ext_offer |= EXT_SPARSE;
+	}
+	if (opts->pull)
+		tx->ext_offer |= EXT_PULL;
+	if (opts->ecn)
+		tx->ext_offer |= EXT_ECN;
+	if (mux_streams())
+		tx->ext_offer |= EXT_MUX;
+	if (tree_root) {
+		if (tree_init(tree_root))
+			goto fail_free;
+		tx->ext_offer |= EXT_TREE;
+	}
+	if (stripe_attached())
+		tx->ext_offer |= EXT_STRIPE;
+	/* The data would not be transformed as requested in shared memory */
+	if (opts->local && input != -1 && !(tx->ext_offer & (EXT_DEFLATE |
+					EXT_SPARSE | EXT_DELTA | EXT_MUX)) &&
+			!fanout_attached() && net_peer_is_local(sock))
+		tx->ext_offer |= EXT_SHM;
+	/* Holes and references are not written, the output cannot be planned */
+	if (!(tx->ext_offer & (EXT_SPARSE | EXT_DELTA | EXT_MUX | EXT_TREE |
+					EXT_STRIPE)) && !resume_input && !fanout_attached() &&
+			input != -1 && !fstat(input, &st) && S_ISREG(st.st_mode))
+		tx->ext_offer |= EXT_SIZE;
+	if (resume_input) {
+		if (resume_possible(input))
+			tx->ext_offer |= EXT_RESUME;
+		else
+			ERROR("Only regular files can be resumed, sending all the input");
+	}
+	/* Only the data sent as is can be taken from the page cache */
+	if (opts->mapped && input != -1 && !(tx->ext_offer & (EXT_DEFLATE |
+					EXT_SPARSE | EXT_DELTA | EXT_MUX | EXT_TREE)) &&
+			!resume_input && !range_active() && !fanout_attached())
+		mapped_init(input);
+	tx->ext_negotiating = tx->ext_offer != 0;
+	if (!tx->ext_negotiating && fanout_attached())
+		fanout_answered(0);
+	if (coalesce_delay > 0 && !tree_root && input != -1 &&
+			!fstat(input, &st) &&
+			(S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode)) &&
+			coalesce_start(tx))
+		ERROR("Cannot watch the input, sending small writes right away");
+	path_init(&tx->path);
+	if (opts->path_cache && path_load(&tx->path, opts->path_cache, sock))
+		ERROR("Cannot read the path cache %s: %s", opts->path_cache,
+				strerror(errno));
+	return tx;
+
+fail_free:
+	/* The socket stays with the caller */
+	tx->sock = -1;
+	transmit_free(tx);
+fail:
+	return NULL;
+}
+
+void transmit_free(transmit_t *tx)
+{
+	if (tx->compress)
+		compress_free(tx->compress);
+	if ((tx->ext_offer & EXT_SPARSE) && !fanout_attached())
+		sparse_free();
+	if (tx->ext_offer & EXT_DELTA)
+		delta_free();
+	if (tx->ext_offer & EXT_MUX)
+		mux_free();
+	if (tx->ext_offer & EXT_TREE)
+		tree_free();
+	if (tx->ext_offer & EXT_SHM)
+		shm_free();
+	coalesce_stop(tx);
+	mapped_free();
+	if (tx->send_buf)
+		pktbuf_free(tx->send_buf);
+	if (tx->sock != -1)
+		close(tx->sock);
+	free(tx);
+}
+
+void transmit_socket(transmit_t *tx)
+{
+	struct pollfd pfd = { .fd = tx->sock, .events = POLLIN };
+
+	/* Process all the packets waiting, to update the window to the latest
+	 * received */
+	while (transmit_result(tx) == TRTP_RUNNING && poll(&pfd, 1, 0) > 0) {
+		if (tx->state == TRANSMIT_CLOSING) {
+			handle_close_read(tx);
+		} else if (handle_socket_read(tx)) {
+			ERROR("Cannot process the socket anymore");
+			abort_transfer(tx);
+		} else if (pktbuf_empty(tx->send_buf)) {
+			tx->timer_at = 0;
 		} else {
-			/* Retransmission timeout expiration */
-			if (!pktbuf_empty(send_buf) && handle_retransmission())
-				goto fail;
+			timer_restart(tx);
 		}
-    } while (last_in_read != 0 || !pktbuf_empty(send_buf));
-	/* Keep looping until we reach EOF on input and the send buf is empty */
-	LOG("Transfert completed");
+	}
+	make_progress(tx);
+}
 
-    return 0;
+ssize_t transmit_write(transmit_t *tx, const char *buf, size_t len)
+{
+	size_t used, queued = 0;
+
+	PRECONDITION(tx->input_fd == -1 && !tx->shutdown, -1);
+	make_progress(tx);
+	while (tx->state == TRANSMIT_RUNNING && queued < len &&
+			can_write(tx)) {
+		if (write_chunk(tx, buf + queued, len - queued, &used))
+			goto_trace(fail, "Cannot compress the data");
+		queued += used;
+		make_progress(tx);
+	}
+	if (tx->state == TRANSMIT_FAILED) {
+		errno = ECONNABORTED;
+		return -1;
+	}
+	if (!queued && len) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return queued;
 
 fail:
-    return -ECONNABORTED;
+	abort_transfer(tx);
+	errno = ECONNABORTED;
+	return -1;
+}
+
+void transmit_shutdown(transmit_t *tx)
+{
+	tx->shutdown = 1;
+	make_progress(tx);
+}
+
+void transmit_timeout(transmit_t *tx)
+{
+	if (!tx->timer_at || monotonic_us() < tx->timer_at)
+		return;
+	if (tx->state == TRANSMIT_CLOSING) {
+		close_send(tx);
+		return;
+	}
+	/* Everything sent was acknowledged meanwhile */
+	if (pktbuf_empty(tx->send_buf)) {
+		tx->timer_at = 0;
+		return;
+	}
+	if (handle_retransmission(tx)) {
+		abort_transfer(tx);
+		return;
+	}
+	timer_restart(tx);
+	make_progress(tx);
+}
+
+int transmit_deadline(const transmit_t *tx)
+{
+	uint64_t now = monotonic_us();
+
+	if (!tx->timer_at)
+		return -1;
+	/* Rounded up, not to wake up right before it */
+	return tx->timer_at > now ? (tx->timer_at - now + 999) / 1000 : 0;
+}
+
+int transmit_result(const transmit_t *tx)
+{
+	switch (tx->state) {
+		case TRANSMIT_DONE:
+			return 0;
+		case TRANSMIT_FAILED:
+			return -1;
+		default:
+			return TRTP_RUNNING;
+	}
+}
+
+int transmit(transmit_t *tx)
+{
+	int pfds_count;
+	struct pollfd pfds[1 + EXT_MAX_STREAMS];
+	struct timespec ts;
+#define poll_socket pfds[0]
+#define poll_inputs (&pfds[1])
+
+	poll_socket.fd = tx->sock;
+	poll_socket.events = POLLIN;
+	/* The first chunk is read before knowing how to encode the rest */
+	pfds_count = 1 + input_pollfds(tx, poll_inputs);
+	make_progress(tx);
+	while (transmit_result(tx) == TRTP_RUNNING) {
+		if (ppoll(pfds, pfds_count, poll_timeout(tx, &ts), NULL) == -1) {
+			if (errno == EINTR)
+				continue;
+			ERROR("Cannot wait for the transfer: %s", strerror(errno));
+			abort_transfer(tx);
+			break;
+		}
+		/* We first check the socket, to update the window to the latest
+		 * received */
+		if (poll_socket.revents & (POLLIN | POLLERR | POLLHUP))
+			transmit_socket(tx);
+		/* We read a chunk from the input file and encode it right away,
+		 * unless we wait for more of it. */
+		if (tx->state == TRANSMIT_RUNNING && (tx->coalesce_since ||
+					input_polled(tx, poll_inputs, pfds_count - 1)) &&
+				input_ready(tx)) {
+			if (handle_input_read(tx))
+				abort_transfer(tx);
+			make_progress(tx);
+		}
+		transmit_timeout(tx);
+		/* Check wether we should poll the file again or not, including
+		 * while waiting for more of it. We optimistically always poll the
+		 * socket (i.e. to handle unexpected acks) */
+		pfds_count = 1;
+		if (tx->state == TRANSMIT_RUNNING && can_read_input(tx))
+			pfds_count += input_pollfds(tx, poll_inputs);
+	}
+	return transmit_result(tx) ? -ECONNABORTED : 0;
+#undef poll_socket
+#undef poll_inputs
 }
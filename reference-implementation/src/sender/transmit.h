@@ -1,9 +1,134 @@
 #ifndef __TRANSMIT_H_
 #define __TRANSMIT_H_
 
+#include <stdint.h>
+#include <sys/types.h>
+
 #include "../common/pktbuf.h"
+#include "../common/ext.h"
+#include "../common/shm.h"
+#include "../lib/trtp.h"
+#include "compress.h"
+#include "path.h"
+
+#define COALESCE_DEFAULT 1000
+
+/* Options of the sender binary, which only apply to the transfers of an
+ * input file and keep their state in the modules implementing them */
+
+/* Whether to only send the differences with the receiver's copy */
+extern int delta_input;
+/* Whether to let the receiver resume an interrupted transfer */
+extern int resume_input;
+/* How long to wait for small writes to a piped input to fill a payload, in
+ * us, 0 to send them right away */
+extern long coalesce_delay;
+/* Directory whose tree is sent instead of the input, or NULL */
+extern const char *tree_root;
+
+/* Progress of a connection */
+typedef enum {
+	TRANSMIT_RUNNING,
+	TRANSMIT_CLOSING, /* All the data was acknowledged, closing */
+	TRANSMIT_DONE,
+	TRANSMIT_FAILED
+} transmit_state_t;
+
+/* State of the transfer towards one receiver. The data either comes from an
+ * input file, or is given by transmit_write(). */
+typedef struct transmit {
+	int sock; /* Socket connected to the receiver */
+	int input_fd; /* Input file, or -1 */
+	trtp_options_t opts;
+	transmit_state_t state;
+	pktbuf_t *send_buf; /* buffer storing all packets */
+	path_t path;
+	compress_t *compress; /* Deflate stream of the input, or NULL */
+	/* When the retransmission timer, or the one of the close, expires, in
+	 * us, 0 if it is stopped */
+	uint64_t timer_at;
+	/* Attempts to close the connection */
+	int close_retry;
+	/* Whether the end of the data given by transmit_write() was marked */
+	int shutdown;
+	uint8_t last_ack; /* Last received ack*/
+	uint8_t last_win; /* Last received window */
+	uint8_t last_sent; /* Last sent packet */
+	uint8_t last_chunk_read; /* Last chunk seqnum of the input file */
+	uint8_t dup_ack; /* Number of duplicate ACK's */
+	/* Time spent retransmitting since we last heard from the receiver, in
+	 * ms */
+	int stalled;
+	ssize_t last_in_read;
+	/* Extensions requested by the options */
+	uint16_t ext_offer;
+	/* Extensions accepted by the receiver */
+	uint16_t ext_features;
+	/* Whether DATA timestamps follow the extended layout */
+	int ext_enabled;
+	/* Whether we are waiting for the answer to our offer */
+	int ext_negotiating;
+	/* Offset to announce to the receiver the input resumes from, or -1 */
+	int64_t resume_at;
+	/* Whether the receiver told us where it could resume */
+	int resume_answered;
+	/* Whether the receiver has yet to learn how much of the input is left */
+	int size_pending;
+	/* Packets the receiver pulled, and packets we sent, modulo 2^24 */
+	uint32_t pull_limit;
+	uint32_t pull_sent;
+	/* Last packet sent for each stream, and the streams that sent one */
+	uint8_t stream_last[EXT_MAX_STREAMS];
+	uint64_t stream_seen;
+	/* Congestion marks echoed by the receiver, modulo 8 */
+	uint8_t ce_echoed;
+	/* Whether small writes to the input are coalesced, and since when we
+	 * have been waiting for more, in us, or 0 */
+	int coalesce_input;
+	uint64_t coalesce_since;
+	/* Edge-triggered watch of the input, readable once more of it arrives,
+	 * or -1 */
+	int coalesce_fd;
+	/* Progress of the switch to shared memory */
+	enum {
+		SHM_OFF,
+		/* The ring is created, the receiver has yet to know it */
+		SHM_ANNOUNCE,
+		SHM_WAITING, /* The receiver has yet to attach to it */
+		SHM_DONE /* All the input went through it */
+	} shm_state;
+	/* Record announcing the ring */
+	char shm_rec[SHM_RECLEN];
+	/* Payloads of the chunks left in the mapping of the input or in the ring
+	 * of the fanout, by seqnum, or NULL when they are in their slot */
+	const char *mapped_chunks[256];
+} transmit_t;
+
+/* Start a transfer over the socket sock, connected to the receiver, of the
+ * content of input, or of the data given by transmit_write() if -1. The
+ * transfer owns the socket from then on, and closes it when freed.
+ * @return: the transfer, NULL on error */
+transmit_t *transmit_new(int sock, int input, const trtp_options_t *opts);
+void transmit_free(transmit_t *tx);
+
+/* Process the packets waiting on the socket, then send what we can */
+void transmit_socket(transmit_t *tx);
+/* Queue up to len bytes of buf, then send what we can.
+ * @return: the number of bytes queued, -1 with errno EAGAIN if the send
+ *         buffer is full, or ECONNABORTED if the transfer failed */
+ssize_t transmit_write(transmit_t *tx, const char *buf, size_t len);
+/* Queue the end of the data given by transmit_write() */
+void transmit_shutdown(transmit_t *tx);
+/* Fire the timers which expired */
+void transmit_timeout(transmit_t *tx);
+/* Time left until the next timer expires, in ms, -1 if none is running */
+int transmit_deadline(const transmit_t *tx);
+/* @return: TRTP_RUNNING while the transfer goes on, 0 if all the data went
+ *          through, -1 otherwise */
+int transmit_result(const transmit_t *tx);
 
-/* Transmit the content of a file, buffered, over an opened socket */
-int transmit(int input, pktbuf_t *buffer);
+/* Transmit the content of the input file of tx, waiting for its events.
+ * @return: 0 on success */
+int transmit(transmit_t *tx);
 
 #endif
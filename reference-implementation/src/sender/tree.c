@@ -0,0 +1,230 @@
+#include "tree.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "../common/macros.h"
+#include "../common/ext.h"
+
+/* Entries opened ahead of the one being sent */
+#define READAHEAD 32
+/* Nested directories being walked */
+#define MAX_DEPTH 64
+
+
+typedef struct {
+	char *path;
+	int fd; /* Content of files, -1 for directories */
+	uint8_t type;
+	uint32_t mode;
+	uint64_t size;
+} entry_t;
+
+/* Directories being walked, and the length of their path */
+PRIVATE DIR *dirs[MAX_DEPTH];
+PRIVATE size_t dir_len[MAX_DEPTH];
+PRIVATE int depth;
+/* Path of the innermost one */
+PRIVATE char prefix[PATH_MAX];
+/* Entries to send, the first one being sent */
+PRIVATE entry_t queue[READAHEAD];
+PRIVATE unsigned int qhead, qlen;
+/* Header of the first entry, and how much of it and of its content was
+ * sent */
+PRIVATE char hdr[EXT_TREE_HDRLEN + PATH_MAX];
+PRIVATE size_t hdr_len, hdr_off;
+PRIVATE uint64_t sent;
+PRIVATE int started;
+
+int tree_init(const char *root)
+{
+	depth = qhead = qlen = started = 0;
+	if (!(dirs[0] = opendir(root)))
+		goto_trace(fail, "Cannot open the directory %s: %s", root,
+				strerror(errno));
+	dir_len[0] = 0;
+	depth = 1;
+	LOG("Sending the tree of %s", root);
+	return 0;
+
+fail:
+	return -1;
+}
+
+PRIVATE void release(entry_t *e)
+{
+	if (e->fd != -1)
+		close(e->fd);
+	free(e->path);
+}
+
+void tree_free()
+{
+	for (; depth > 0; --depth)
+		closedir(dirs[depth - 1]);
+	for (; qlen; --qlen, qhead = (qhead + 1) % READAHEAD)
+		release(&queue[qhead]);
+}
+
+/* Enter the directory name of the innermost one */
+PRIVATE int push_dir(const char *name, size_t len)
+{
+	int fd;
+
+	if (depth == MAX_DEPTH)
+		goto_trace(fail, "%s is nested too deeply", prefix);
+	if ((fd = openat(dirfd(dirs[depth - 1]), name,
+					O_RDONLY | O_DIRECTORY)) == -1 ||
+			!(dirs[depth] = fdopendir(fd))) {
+		ERROR("Cannot open the directory %s: %s", prefix, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		goto fail;
+	}
+	dir_len[depth++] = len;
+	return 0;
+
+fail:
+	return -1;
+}
+
+/* Find the next entry of the tree, depth first.
+ * @return: 1 if e was filled, 0 at the end of the tree, -1 on error */
+PRIVATE int walk(entry_t *e)
+{
+	struct dirent *de;
+	struct stat st;
+	size_t len;
+
+	while (depth) {
+		errno = 0;
+		if (!(de = readdir(dirs[depth - 1]))) {
+			if (errno)
+				goto_errno(fail);
+			closedir(dirs[--depth]);
+			continue;
+		}
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		len = dir_len[depth - 1];
+		prefix[len] = '\0';
+		if (len + !!len + strlen(de->d_name) >= sizeof(prefix))
+			goto_trace(fail, "The path of %s/%s is too long", prefix,
+					de->d_name);
+		len += sprintf(&prefix[len], "%s%s", len ? "/" : "", de->d_name);
+		if (fstatat(dirfd(dirs[depth - 1]), de->d_name, &st,
+					AT_SYMLINK_NOFOLLOW))
+			goto_trace(fail, "Cannot stat %s: %s", prefix, strerror(errno));
+		e->path = NULL;
+		e->fd = -1;
+		e->mode = st.st_mode & 07777;
+		e->size = 0;
+		if (S_ISDIR(st.st_mode)) {
+			e->type = EXT_TREE_DIR;
+			if (push_dir(de->d_name, len))
+				goto fail;
+		} else if (S_ISREG(st.st_mode)) {
+			e->type = EXT_TREE_FILE;
+			e->size = st.st_size;
+			if ((e->fd = openat(dirfd(dirs[depth - 1]), de->d_name,
+							O_RDONLY)) == -1)
+				goto_trace(fail, "Cannot read %s: %s", prefix,
+						strerror(errno));
+			/* Start reading it while the previous ones are sent */
+			posix_fadvise(e->fd, 0, 0, POSIX_FADV_WILLNEED);
+		} else {
+			LOG("Skipping %s, which is neither a file nor a directory",
+					prefix);
+			continue;
+		}
+		if (!(e->path = strdup(prefix))) {
+			release(e);
+			goto_errno(fail);
+		}
+		return 1;
+	}
+	return 0;
+
+fail:
+	return -1;
+}
+
+/* Open the next entries, up to READAHEAD of them */
+PRIVATE int fill_queue()
+{
+	int err;
+
+	while (qlen < READAHEAD) {
+		if ((err = walk(&queue[(qhead + qlen) % READAHEAD])) <= 0)
+			return err;
+		++qlen;
+	}
+	return 0;
+}
+
+PRIVATE void put_header(const entry_t *e)
+{
+	size_t len = strlen(e->path);
+
+	hdr[0] = e->type;
+	ext_put_u32(&hdr[1], e->mode);
+	ext_put_u64(&hdr[5], e->size);
+	ext_put_u32(&hdr[13], len);
+	memcpy(&hdr[EXT_TREE_HDRLEN], e->path, len);
+	hdr_len = EXT_TREE_HDRLEN + len;
+	hdr_off = 0;
+	sent = 0;
+	started = 1;
+}
+
+ssize_t tree_read(int fd, void *buf, size_t len)
+{
+	entry_t *e = &queue[qhead];
+	char *p = buf;
+	size_t n;
+	ssize_t rlen;
+
+	(void)fd;
+	while (len) {
+		if (!started) {
+			if (fill_queue())
+				return -1;
+			if (!qlen)
+				break;
+			put_header(e);
+		}
+		if (hdr_off < hdr_len) {
+			n = hdr_len - hdr_off < len ? hdr_len - hdr_off : len;
+			memcpy(p, &hdr[hdr_off], n);
+			hdr_off += n;
+		} else if (sent < e->size) {
+			n = e->size - sent < len ? e->size - sent : len;
+			if ((rlen = read(e->fd, p, n)) == -1)
+				return -1;
+			/* The receiver expects as much as announced */
+			if (!rlen) {
+				ERROR("%s shrank while being sent, padding it with zeroes",
+						e->path);
+				memset(p, 0, n);
+			} else
+				n = rlen;
+			sent += n;
+		} else {
+			release(e);
+			qhead = (qhead + 1) % READAHEAD;
+			--qlen;
+			e = &queue[qhead];
+			started = 0;
+			continue;
+		}
+		p += n;
+		len -= n;
+	}
+	return p - (char*)buf;
+}
@@ -0,0 +1,16 @@
+#ifndef __TREE_H_
+#define __TREE_H_
+
+#include <sys/types.h>
+
+/* Serialization of a directory tree as a stream of entries, see
+ * EXT_TREE_HDRLEN. The files coming next are opened ahead of time, and the
+ * kernel asked to read them in the background, so that the many small files
+ * of a tree do not each stall the transfer on their first read. */
+int tree_init(const char *root);
+void tree_free();
+
+/* input_reader serializing the tree, fd is ignored */
+ssize_t tree_read(int fd, void *buf, size_t len);
+
+#endif /* __TREE_H_ */
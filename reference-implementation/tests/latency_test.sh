@@ -0,0 +1,49 @@
+#!/bin/bash
+# Stream a line per second from a sender to a receiver writing to a pipe, and
+# check that the lines reach the end of the pipe as they are sent, instead of
+# waiting for the output buffer of the receiver to fill
+
+THISDIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+OUTFILE="output_file"
+# Tuneable params
+SENDER="${SENDER:-$THISDIR/../sender}"
+RECVER="${RECVER:-$THISDIR/../receiver}"
+LINES="${LINES:-4}"
+PORT="${PORT:-1341}"
+
+
+echo "Test parameters: lines=$LINES"
+
+# Stream the lines with the sender options $1, checking what came out
+# @return: 0 if the lines arrived in time
+function stream() {
+    local count
+
+    rm -f "$OUTFILE"
+    "$RECVER" :: $PORT 2> receiver.log | cat > "$OUTFILE" &
+    sleep .1
+    for (( i = 0; i < LINES; i++ )); do
+        echo "line $i"
+        sleep 1
+    done | "$SENDER" $1 ::1 $PORT 2> sender.log &
+    # Every line was sent half a second ago, but the input is still open
+    sleep $((LINES - 1)).5
+    count=$(wc -l < "$OUTFILE")
+    wait
+    # Leave some room for a slow machine
+    if [ $count -lt $((LINES - 1)) ] ||
+            [ "$(wc -l < "$OUTFILE")" -ne $LINES ]; then
+        echo "Only $count lines out of $LINES arrived in time [$1]"
+        cat sender.log receiver.log
+        return 1
+    fi
+    return 0
+}
+
+# Through packets, and through shared memory
+if ! stream -N || ! stream; then
+    exit 1
+else
+    echo "Success!"
+    exit 0
+fi
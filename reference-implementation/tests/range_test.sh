@@ -0,0 +1,56 @@
+#!/bin/bash
+# Split a file into byte ranges, sent by as many sender/receiver pairs at once,
+# all receivers writing to the same output with -o
+
+THISDIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+INFILE="input_file"
+OUTFILE="output_file"
+# Tuneable params
+SENDER="${SENDER:-$THISDIR/../sender}"
+RECVER="${RECVER:-$THISDIR/../receiver}"
+INFILESRC="${INFILESRC:-/dev/urandom}"
+INFILESIZ="${INFILESIZ:-1000000}"
+RANGES="${RANGES:-3}"
+PORT="${PORT:-1341}"
+# Bytes past the ranges, which the receivers must leave alone
+TAILSIZ=4096
+
+
+echo "Test parameters: size=$INFILESIZ ranges=$RANGES"
+
+rm -f "$INFILE" "$OUTFILE"
+head -c "$INFILESIZ" "$INFILESRC" > "$INFILE"
+head -c $((INFILESIZ + TAILSIZ)) /dev/zero | tr '\0' 'x' > "$OUTFILE"
+
+length=$(( (INFILESIZ + RANGES - 1) / RANGES ))
+pids=()
+for (( i = 0; i < RANGES; i++ )); do
+    offset=$((i * length))
+    "$RECVER" -f "$OUTFILE" -o $offset :: $((PORT + i)) 2> "receiver.$i.log" &
+    pids+=($!)
+done
+
+sleep .1
+
+status=0
+for (( i = 0; i < RANGES; i++ )); do
+    offset=$((i * length))
+    # The last range is clamped to the end of the input
+    "$SENDER" -N -f "$INFILE" -o $offset -l $length ::1 $((PORT + i)) \
+        2> "sender.$i.log" &
+    pids+=($!)
+done
+
+for pid in "${pids[@]}"; do
+    wait $pid || status=1
+done
+
+if [ $status -ne 0 ] || ! cmp --silent -n "$INFILESIZ" "$INFILE" "$OUTFILE" ||
+        [ "$(tail -c $TAILSIZ "$OUTFILE" | tr -d x)" != "" ]; then
+    echo "The ranges were not written at their offset"
+    cat sender.*.log receiver.*.log
+    exit 1
+else
+    echo "Success!"
+    exit 0
+fi
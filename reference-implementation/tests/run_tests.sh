@@ -33,5 +33,21 @@ function test_whitebox() {
     make
 }
 
+function test_ranges() {
+    "$THISDIR/range_test.sh"
+}
+
+function test_latency() {
+    "$THISDIR/latency_test.sh"
+}
+
+function test_serve() {
+    "$THISDIR/serve_test.sh"
+    WORKERS=4 SENDERS=16 "$THISDIR/serve_test.sh"
+}
+
 test_whitebox
 test_blackbox
+test_ranges
+test_latency
+test_serve
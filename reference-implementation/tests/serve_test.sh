@@ -0,0 +1,83 @@
+#!/bin/bash
+# Start many senders at once towards a single receiver serving them all, and
+# check that each input was received whole, without any sender waiting for
+# its first packet to be sent again, and that the senders were spread over the
+# shards of the receiver
+
+THISDIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+INFILE="input_file"
+OUTDIR="output_dir"
+# Tuneable params
+SENDER="${SENDER:-$THISDIR/../sender}"
+RECVER="${RECVER:-$THISDIR/../receiver}"
+INFILESRC="${INFILESRC:-/dev/urandom}"
+INFILESIZ="${INFILESIZ:-500000}"
+SENDERS="${SENDERS:-8}"
+WORKERS="${WORKERS:-1}"
+PORT="${PORT:-1341}"
+# The retransmission timer of a first packet, in s
+MAXTIME="${MAXTIME:-4}"
+
+
+echo "Test parameters: size=$INFILESIZ senders=$SENDERS workers=$WORKERS"
+
+rm -rf "$OUTDIR" "$INFILE".* sender.*.log
+mkdir "$OUTDIR"
+for (( i = 0; i < SENDERS; i++ )); do
+    head -c "$INFILESIZ" "$INFILESRC" > "$INFILE.$i"
+done
+
+"$RECVER" -s "$OUTDIR/%n" -w $WORKERS :: $PORT 2> receiver.log &
+rpid=$!
+sleep .1
+
+status=0
+pids=()
+start=$(date +%s%N)
+for (( i = 0; i < SENDERS; i++ )); do
+    "$SENDER" -N -f "$INFILE.$i" ::1 $PORT 2> "sender.$i.log" &
+    pids+=($!)
+done
+for pid in "${pids[@]}"; do
+    wait $pid || status=1
+done
+elapsed=$(( ($(date +%s%N) - start) / 1000000 ))
+# The transfers are over once their sender is
+sleep .1
+kill $rpid
+wait $rpid 2> /dev/null
+
+# Each input became one of the outputs
+received=0
+for (( i = 0; i < SENDERS; i++ )); do
+    for out in "$OUTDIR"/*; do
+        if cmp --silent "$INFILE.$i" "$out"; then
+            received=$((received + 1))
+            break
+        fi
+    done
+done
+# Transfer n was served by shard (n - 1) % WORKERS
+shards=$(for out in "$OUTDIR"/*; do
+    echo $(( ($(basename "$out") - 1) % WORKERS ))
+done | sort -u | wc -l)
+
+if [ $status -ne 0 ] || [ $received -ne $SENDERS ] ||
+        [ "$(ls "$OUTDIR" | wc -l)" -ne $SENDERS ]; then
+    echo "Only $received inputs out of $SENDERS were received"
+    cat sender.*.log receiver.log
+    exit 1
+elif [ $elapsed -ge $((MAXTIME * 1000)) ]; then
+    echo "The senders took ${elapsed}ms, some first packet was lost"
+    cat sender.*.log receiver.log
+    exit 1
+# All of them reaching the same shard is as likely as WORKERS^(1 - SENDERS)
+elif [ $WORKERS -gt 1 ] && [ $shards -eq 1 ]; then
+    echo "All the senders were served by the same shard"
+    cat receiver.log
+    exit 1
+else
+    echo "Received $SENDERS inputs via $shards/$WORKERS shards in ${elapsed}ms"
+    echo "Success!"
+    exit 0
+fi
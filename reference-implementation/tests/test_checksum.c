@@ -0,0 +1,71 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/common/macros.h"
+#include "../src/common/checksum.h"
+#include "test_checksum.h"
+
+
+int test_checksum_init()
+{
+	return 0;
+}
+
+int test_checksum_cleanup()
+{
+	return 0;
+}
+
+static void test_sha256()
+{
+	static const uint8_t abc[SHA256_LEN] = {
+		0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde,
+		0x5d, 0xae, 0x22, 0x23, 0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c,
+		0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad,
+	};
+	uint8_t digest[SHA256_LEN], split[SHA256_LEN];
+	char buf[1000];
+	sha256_t ctx;
+	size_t i;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, "abc", 3);
+	sha256_final(&ctx, digest);
+	CU_ASSERT(!memcmp(digest, abc, SHA256_LEN));
+	/* The digest does not depend on how the data is split */
+	for (i = 0; i < sizeof(buf); ++i)
+		buf[i] = i * 7;
+	sha256_init(&ctx);
+	sha256_update(&ctx, buf, sizeof(buf));
+	sha256_final(&ctx, digest);
+	sha256_init(&ctx);
+	for (i = 0; i < sizeof(buf); i += 61)
+		sha256_update(&ctx, &buf[i], i + 61 < sizeof(buf) ? 61 :
+				sizeof(buf) - i);
+	sha256_final(&ctx, split);
+	CU_ASSERT(!memcmp(digest, split, SHA256_LEN));
+}
+
+static void test_rolling_sum()
+{
+	uint8_t buf[300];
+	rsum_t sum, ref;
+	size_t i;
+
+	for (i = 0; i < sizeof(buf); ++i)
+		buf[i] = rand();
+	rsum_init(&sum, buf, 64);
+	for (i = 1; i + 64 <= sizeof(buf); ++i) {
+		rsum_roll(&sum, buf[i - 1], buf[i + 63]);
+		rsum_init(&ref, &buf[i], 64);
+		CU_ASSERT(rsum_digest(&sum) == rsum_digest(&ref));
+	}
+}
+
+
+CU_TestInfo test_checksum[] = {
+	{"test_sha256", test_sha256},
+	{"test_rolling_sum", test_rolling_sum},
+	CU_TEST_INFO_NULL,
+};
+CU_pTestInfo test_checksum_list() { return test_checksum; }
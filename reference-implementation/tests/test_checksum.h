@@ -0,0 +1,11 @@
+#ifndef __TEST_CHECKSUM_H__
+#define __TEST_CHECKSUM_H__
+
+#include <CUnit/CUnit.h>
+
+
+int test_checksum_init();
+int test_checksum_cleanup();
+CU_pTestInfo test_checksum_list();
+
+#endif
@@ -7,6 +7,9 @@
 #include "../src/common/macros.h"
 #include "test_pktbuf.h"
 #include "test_oob_receive.h"
+#include "test_ext.h"
+#include "test_checksum.h"
+#include "test_output.h"
 
 static void noop() {  }
 
@@ -22,6 +25,12 @@ int main(int argc, char **argv)
 		  noop, noop, test_pktbuf_list() },
 	  { "test_oob_handling", test_oob_init, test_oob_cleanup,
 		  noop, noop, test_oob_list() },
+	  { "test_ext", test_ext_init, test_ext_cleanup,
+		  noop, noop, test_ext_list() },
+	  { "test_checksum", test_checksum_init, test_checksum_cleanup,
+		  noop, noop, test_checksum_list() },
+	  { "test_output", test_output_init, test_output_cleanup,
+		  noop, noop, test_output_list() },
 	  CU_SUITE_INFO_NULL,
 	};
 	if (CU_register_suites(suites))
@@ -0,0 +1,733 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <zlib.h>
+
+#include "../src/common/macros.h"
+#include "../src/common/ext.h"
+#include "../src/common/packet_interface.h"
+#include "../src/common/shm.h"
+#include "../src/common/net.h"
+#include "../src/common/checksum.h"
+#include "../src/receiver/mux.h"
+#include "../src/receiver/tree.h"
+#include "../src/receiver/output.h"
+#include "../src/receiver/decompress.h"
+#include "../src/receiver/stripe.h"
+#include "../src/receiver/sparse.h"
+#include "../src/receiver/checkpoint.h"
+#include "../src/receiver/pull.h"
+#include "test_ext.h"
+
+/* Internals of checkpoint.c */
+typedef struct {
+	uint64_t offset;
+	sha256_t digest;
+} ckpt_t;
+void ckpt_encode(const ckpt_t *ckpt, char *buf);
+int ckpt_decode(ckpt_t *ckpt, const char *buf, size_t len);
+#define CKPT_LEN 124
+/* Internals of net.c */
+void hand_over(int fd, int handoff, const struct sockaddr *addr,
+		socklen_t addrlen);
+
+int test_ext_init()
+{
+	return 0;
+}
+
+int test_ext_cleanup()
+{
+	return 0;
+}
+
+static void test_timestamps()
+{
+	uint32_t ts = EXT_DATA_TS(EXT_KIND_CTRL, 5, 0x1234567), low;
+	unsigned int offers = 0;
+
+	CU_ASSERT(EXT_TS_KIND(ts) == EXT_KIND_CTRL);
+	CU_ASSERT(EXT_TS_STREAM(ts) == 5);
+	CU_ASSERT(EXT_TS_CLOCK(ts) == 0x234567);
+	/* Negotiation timestamps cannot be mistaken for extended ones */
+	CU_ASSERT(EXT_TS_KIND(EXT_OFFER(0xffff)) == 3);
+	CU_ASSERT(EXT_IS_OFFER(EXT_OFFER(EXT_SPARSE)));
+	CU_ASSERT(EXT_FEATURES(EXT_OFFER(EXT_SPARSE)) == EXT_SPARSE);
+	CU_ASSERT(!EXT_IS_ACCEPT(EXT_ACK_TS(0xff, 0xffffff)));
+	CU_ASSERT(EXT_IS_ACCEPT(EXT_ACCEPT(0)));
+	CU_ASSERT(!EXT_IS_ACCEPT(EXT_ACK_TS(EXT_ACK_PULL | EXT_ACK_CE(7) |
+					EXT_ACK_CORRUPT, 0)));
+	CU_ASSERT(EXT_ACK_CE_COUNT(EXT_ACK_CE(9) | EXT_ACK_CORRUPT) == 1);
+	CU_ASSERT(EXT_IS_OFFER(EXT_OFFER(EXT_SUPPORTED)));
+	CU_ASSERT(EXT_FEATURES(EXT_ACCEPT(EXT_SUPPORTED)) == EXT_SUPPORTED);
+	/* Plain timestamps starting with the magic are rarely taken for offers */
+	for (low = 0; low <= 0xffff; ++low)
+		offers += EXT_IS_OFFER(EXT_OFFER_MAGIC << 16 | low);
+	CU_ASSERT(offers == EXT_FEATURE_MASK + 1);
+	CU_ASSERT(!EXT_IS_OFFER(EXT_OFFER(EXT_SPARSE) ^ 1 << 11));
+	CU_ASSERT(!EXT_IS_ACCEPT(EXT_ACCEPT(EXT_SPARSE) ^ EXT_DEFLATE));
+}
+
+static void test_corrupted_payload()
+{
+	pkt_t pkt = {
+		.type = PTYPE_DATA,
+		.seq = 42,
+		.length = 4,
+		.payload = "data",
+	};
+	char buf[sizeof(pkt)], copy[sizeof(pkt)];
+	size_t len = sizeof(buf);
+	pkt_t decoded;
+
+	CU_ASSERT(pkt_encode(&pkt, buf, &len) == PKT_OK);
+	/* Only the payload is corrupted, the header can be trusted */
+	memcpy(copy, buf, len);
+	copy[PKT_HEADERLEN + 1] ^= 0x10;
+	CU_ASSERT(pkt_decode(copy, len, &decoded) == E_CRC2);
+	CU_ASSERT(decoded.seq == 42);
+	/* A corrupted header cannot be told apart from any other packet */
+	memcpy(copy, buf, len);
+	copy[5] ^= 0x10;
+	CU_ASSERT(pkt_decode(copy, len, &decoded) == E_CRC);
+}
+
+static void test_records()
+{
+	char buf[24], value[sizeof(uint64_t)];
+	size_t off = 0;
+	ext_rec_t rec;
+
+	ext_put_u64(value, 1ULL << 40 | 42);
+	CU_ASSERT(ext_get_u64(value) == (1ULL << 40 | 42));
+	CU_ASSERT(!ext_rec_put(buf, sizeof(buf), &off, EXT_REC_HOLE, value,
+				sizeof(value)));
+	CU_ASSERT(off == 2 + sizeof(value));
+	CU_ASSERT(!ext_rec_put(buf, sizeof(buf), &off, 7, "abc", 3));
+	/* Does not fit */
+	CU_ASSERT(ext_rec_put(buf, sizeof(buf), &off, 7, value, sizeof(value)));
+
+	size_t len = off;
+	off = 0;
+	CU_ASSERT(ext_rec_next(buf, len, &off, &rec) == 1);
+	CU_ASSERT(rec.type == EXT_REC_HOLE && rec.len == sizeof(value));
+	CU_ASSERT(ext_get_u64(rec.value) == (1ULL << 40 | 42));
+	CU_ASSERT(ext_rec_next(buf, len, &off, &rec) == 1);
+	CU_ASSERT(rec.type == 7 && rec.len == 3 && !memcmp(rec.value, "abc", 3));
+	CU_ASSERT(ext_rec_next(buf, len, &off, &rec) == 0);
+	/* Truncated record */
+	off = 0;
+	CU_ASSERT(ext_rec_next(buf, 5, &off, &rec) == -1);
+}
+
+static void test_streams()
+{
+	char dir[] = "/tmp/test_mux.XXXXXX", path[sizeof(dir) + 8];
+
+	CU_ASSERT_FATAL(mkdtemp(dir) != NULL);
+	CU_ASSERT_FATAL(!mux_init(dir));
+	CU_ASSERT(!mux_open(1, "out", 3));
+	CU_ASSERT(mux_fd(1) != -1);
+	CU_ASSERT(mux_open(1, "other", 5));
+	/* Stream 0 is the main output */
+	CU_ASSERT(mux_open(0, "main", 4));
+	/* Files can only be created in the directory */
+	CU_ASSERT(mux_open(2, "../out", 6));
+	CU_ASSERT(mux_open(2, "a/b", 3));
+	CU_ASSERT(mux_open(2, "..", 2));
+	CU_ASSERT(mux_open(2, "a\0b", 3));
+	CU_ASSERT(mux_open(2, "", 0));
+	CU_ASSERT(mux_fd(2) == -1);
+	CU_ASSERT(!mux_close(1));
+	CU_ASSERT(mux_fd(1) == -1);
+	CU_ASSERT(mux_close(1));
+	mux_free();
+	sprintf(path, "%s/out", dir);
+	CU_ASSERT(!unlink(path));
+	CU_ASSERT(!rmdir(dir));
+}
+
+/* Append the entry of path to buf, at *off */
+static void put_entry(char *buf, size_t *off, uint8_t type, const char *path,
+		const char *content)
+{
+	size_t len = content ? strlen(content) : 0;
+
+	buf[*off] = type;
+	ext_put_u32(&buf[*off + 1], 0750);
+	ext_put_u64(&buf[*off + 5], len);
+	ext_put_u32(&buf[*off + 13], strlen(path));
+	*off += EXT_TREE_HDRLEN;
+	memcpy(&buf[*off], path, strlen(path));
+	*off += strlen(path);
+	memcpy(&buf[*off], content, len);
+	*off += len;
+}
+
+static void test_tree()
+{
+	char dir[] = "/tmp/test_tree.XXXXXX", path[sizeof(dir) + 16], buf[256];
+	size_t len = 0, i;
+	FILE *f;
+
+	CU_ASSERT_FATAL(mkdtemp(dir) != NULL);
+	CU_ASSERT_FATAL(!tree_init(dir));
+	put_entry(buf, &len, EXT_TREE_DIR, "a", NULL);
+	put_entry(buf, &len, EXT_TREE_FILE, "a/b", "content");
+	put_entry(buf, &len, EXT_TREE_FILE, "c", "");
+	/* Entries can be split anywhere */
+	for (i = 0; i < len; ++i)
+		CU_ASSERT(!tree_write(-1, &buf[i], 1));
+	CU_ASSERT(!tree_finish());
+	sprintf(path, "%s/a/b", dir);
+	CU_ASSERT_FATAL((f = fopen(path, "r")) != NULL);
+	CU_ASSERT(fread(buf, 1, sizeof(buf), f) == 7 && !memcmp(buf, "content", 7));
+	fclose(f);
+	/* Unfinished entries are detected */
+	len = 0;
+	put_entry(buf, &len, EXT_TREE_FILE, "c", "data");
+	CU_ASSERT(!tree_write(-1, buf, len - 1));
+	CU_ASSERT(tree_finish());
+	tree_free();
+	/* Nothing can be written outside of the tree */
+	CU_ASSERT_FATAL(!tree_init(dir));
+	len = 0;
+	put_entry(buf, &len, EXT_TREE_FILE, "../c", "");
+	CU_ASSERT(tree_write(-1, buf, len));
+	tree_free();
+	CU_ASSERT_FATAL(!tree_init(dir));
+	len = 0;
+	put_entry(buf, &len, EXT_TREE_FILE, "/c", "");
+	CU_ASSERT(tree_write(-1, buf, len));
+	tree_free();
+	CU_ASSERT(!unlink(path));
+	sprintf(path, "%s/c", dir);
+	CU_ASSERT(!unlink(path));
+	sprintf(path, "%s/a", dir);
+	CU_ASSERT(!rmdir(path));
+	CU_ASSERT(!rmdir(dir));
+}
+
+static void test_shm()
+{
+	char in[] = "/tmp/test_shm.XXXXXX", out[] = "/tmp/test_shm.XXXXXX";
+	char rec[SHM_RECLEN], bad[SHM_RECLEN], buf[100000], got[sizeof(buf)];
+	int infd, outfd, status;
+	size_t i;
+	pid_t pid;
+
+	for (i = 0; i < sizeof(buf); ++i)
+		buf[i] = i * 7;
+	CU_ASSERT_FATAL((infd = mkstemp(in)) != -1);
+	CU_ASSERT_FATAL((outfd = mkstemp(out)) != -1);
+	CU_ASSERT_FATAL(write(infd, buf, sizeof(buf)) == sizeof(buf));
+	CU_ASSERT_FATAL(lseek(infd, 0, SEEK_SET) == 0);
+	CU_ASSERT_FATAL(!shm_create(rec));
+	CU_ASSERT(!shm_attached());
+	/* Only the announced memory can be attached to */
+	memcpy(bad, rec, sizeof(bad));
+	bad[SHM_RECLEN - 1] ^= 1;
+	CU_ASSERT_FATAL((pid = fork()) != -1);
+	if (!pid)
+		exit(!shm_attach(bad, sizeof(bad)) ? 1 :
+				shm_attach(rec, sizeof(rec)) ||
+				shm_receive(write_all, outfd) ? 2 : 0);
+	CU_ASSERT(!shm_send(read, infd));
+	CU_ASSERT(shm_attached());
+	shm_free();
+	CU_ASSERT(waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+			!WEXITSTATUS(status));
+	CU_ASSERT(pread(outfd, got, sizeof(got), 0) == sizeof(got) &&
+			!memcmp(buf, got, sizeof(buf)));
+	close(infd);
+	close(outfd);
+	unlink(in);
+	unlink(out);
+}
+
+static void test_decompress()
+{
+	char out[] = "/tmp/test_inflate.XXXXXX";
+	static char buf[200000], zbuf[sizeof(buf)], got[sizeof(buf)];
+	size_t i, zlen, len, n;
+	const char *data;
+	decompress_t *d;
+	ssize_t r;
+	z_stream zs;
+	int fd;
+
+	for (i = 0; i < sizeof(buf); ++i)
+		buf[i] = "TRTP"[i / 3 % 4] + i / 1000;
+	memset(&zs, 0, sizeof(zs));
+	CU_ASSERT_FATAL(deflateInit2(&zs, 6, Z_DEFLATED, -MAX_WBITS, 8,
+				Z_DEFAULT_STRATEGY) == Z_OK);
+	zs.next_in = (Bytef*)buf;
+	zs.avail_in = sizeof(buf);
+	zs.next_out = (Bytef*)zbuf;
+	zs.avail_out = sizeof(zbuf);
+	CU_ASSERT_FATAL(deflate(&zs, Z_SYNC_FLUSH) == Z_OK && !zs.avail_in);
+	zlen = sizeof(zbuf) - zs.avail_out;
+	deflateEnd(&zs);
+	CU_ASSERT_FATAL((fd = mkstemp(out)) != -1);
+	CU_ASSERT_FATAL((d = decompress_new()));
+	/* The stream is split in payloads of any size */
+	for (i = 0; i < zlen; i += 512)
+		CU_ASSERT_FATAL(!decompress_write(d, write_all, fd, zbuf + i,
+					zlen - i < 512 ? zlen - i : 512));
+	CU_ASSERT(pread(fd, got, sizeof(got), 0) == sizeof(got) &&
+			!memcmp(buf, got, sizeof(buf)));
+	decompress_free(d);
+	/* Or read back in pieces smaller than what a payload inflates to */
+	CU_ASSERT_FATAL((d = decompress_new()));
+	memset(got, 0, sizeof(got));
+	for (i = 0, n = 0; i < zlen; i += 512) {
+		data = zbuf + i;
+		len = zlen - i < 512 ? zlen - i : 512;
+		do {
+			CU_ASSERT_FATAL((r = decompress_read(d, &data, &len, got + n,
+							sizeof(got) - n < 1000 ? sizeof(got) - n : 1000))
+					!= -1);
+			n += r;
+		} while (r > 0 && n < sizeof(got));
+	}
+	CU_ASSERT(n == sizeof(got) && !memcmp(buf, got, sizeof(buf)));
+	/* Garbage is not written out */
+	memset(zbuf, 0xff, 64);
+	CU_ASSERT(decompress_write(d, write_all, fd, zbuf, 64));
+	decompress_free(d);
+	close(fd);
+	unlink(out);
+}
+
+/* Senders of the stripes, the first ones sending stripe 0 and 1, the others
+ * no valid stripe */
+#define STRIPE_SENDERS 5
+#define STRIPE_BLOCK 1000
+#define STRIPE_INPUT (4 * STRIPE_BLOCK + 300)
+static uint16_t stripe_ports[STRIPE_SENDERS];
+static char stripe_input[STRIPE_INPUT];
+
+/* UDP socket bound to [::1], on an ephemeral port */
+static int loopback_socket(uint16_t *port)
+{
+	struct sockaddr_in6 sa = {
+		.sin6_family = AF_INET6,
+		.sin6_addr = IN6ADDR_LOOPBACK_INIT,
+	};
+	socklen_t len = sizeof(sa);
+	int fd;
+
+	if ((fd = socket(AF_INET6, SOCK_DGRAM, 0)) == -1)
+		return -1;
+	if (bind(fd, (struct sockaddr*)&sa, sizeof(sa)) ||
+			getsockname(fd, (struct sockaddr*)&sa, &len)) {
+		close(fd);
+		return -1;
+	}
+	*port = ntohs(sa.sin6_port);
+	return fd;
+}
+
+/* Send len bytes of buf from fd to sa
+ * @return: 1 if they were sent */
+static int send_to(int fd, const char *buf, size_t len,
+		const struct sockaddr_in6 *sa)
+{
+	return sendto(fd, buf, len, 0, (const struct sockaddr*)sa,
+			sizeof(*sa)) == (ssize_t)len;
+}
+
+static void test_handoff()
+{
+	char bufs[2][PKT_MAX_LEN];
+	size_t lens[2] = {sizeof(bufs[0]), sizeof(bufs[1])};
+	struct sockaddr_in6 sa = {
+		.sin6_family = AF_INET6,
+		.sin6_addr = IN6ADDR_LOOPBACK_INIT,
+	}, peers[2], from;
+	socklen_t fromlen;
+	int lfd, socks[2], pair[2], i;
+	uint16_t port;
+	pkt_t pkt = {
+		.type = PTYPE_DATA,
+		.seq = 0,
+		.length = 4,
+		.payload = "peer",
+	}, got;
+
+	CU_ASSERT_FATAL((lfd = loopback_socket(&port)) != -1);
+	sa.sin6_port = htons(port);
+	CU_ASSERT_FATAL(!socketpair(AF_UNIX, SOCK_DGRAM, 0, pair));
+	CU_ASSERT_FATAL(fcntl(pair[0], F_SETFL, O_NONBLOCK) != -1);
+	for (i = 0; i < 2; ++i) {
+		CU_ASSERT_FATAL((socks[i] = loopback_socket(&port)) != -1);
+		peers[i] = sa;
+		peers[i].sin6_port = htons(port);
+		pkt.seq = i;
+		CU_ASSERT_FATAL(pkt_encode(&pkt, bufs[i], &lens[i]) == PKT_OK);
+	}
+	/* The accepted peer sends its first packet again, around the one of
+	 * the other */
+	CU_ASSERT(send_to(socks[0], bufs[0], lens[0], &sa));
+	CU_ASSERT(send_to(socks[1], bufs[1], lens[1], &sa));
+	CU_ASSERT(send_to(socks[0], bufs[0], lens[0], &sa));
+	usleep(10000);
+	hand_over(lfd, pair[1], (struct sockaddr*)&peers[0], sizeof(peers[0]));
+	fromlen = sizeof(from);
+	CU_ASSERT(net_recv_handoff(pair[0], &got, (struct sockaddr*)&from,
+				&fromlen) == NET_OK);
+	CU_ASSERT(fromlen == sizeof(peers[1]) &&
+			!memcmp(&from, &peers[1], sizeof(peers[1])));
+	CU_ASSERT(pkt_get_seqnum(&got) == 1 && pkt_get_length(&got) == 4 &&
+			!memcmp(pkt_get_payload(&got), "peer", 4));
+	fromlen = sizeof(from);
+	CU_ASSERT(net_recv_handoff(pair[0], &got, (struct sockaddr*)&from,
+				&fromlen) == NET_ERROR);
+	/* Without anywhere to send them, all are dropped */
+	CU_ASSERT(send_to(socks[1], bufs[1], lens[1], &sa));
+	usleep(10000);
+	hand_over(lfd, -1, (struct sockaddr*)&peers[0], sizeof(peers[0]));
+	CU_ASSERT(recv(lfd, bufs[0], sizeof(bufs[0]), MSG_DONTWAIT) == -1);
+	for (i = 0; i < 2; ++i) {
+		close(socks[i]);
+		close(pair[i]);
+	}
+	close(lfd);
+}
+
+static void put_stripe_header(char *hdr, uint32_t magic, unsigned int index,
+		unsigned int count, uint32_t block)
+{
+	ext_put_u32(hdr, magic);
+	ext_put_u64(hdr + 4, 42);
+	hdr[12] = index >> 8;
+	hdr[13] = index;
+	hdr[14] = count >> 8;
+	hdr[15] = count;
+	ext_put_u32(hdr + 16, block);
+}
+
+/* stripe_transfer writing the stripe of the sender sock is connected to */
+static int send_stripe(int sock, const pkt_t *first, int fd)
+{
+	struct sockaddr_in6 sa;
+	socklen_t len = sizeof(sa);
+	char hdr[EXT_STRIPE_HDRLEN];
+	unsigned int i, block;
+
+	(void)first;
+	if (getpeername(sock, (struct sockaddr*)&sa, &len))
+		return -1;
+	for (i = 0; i < STRIPE_SENDERS; ++i)
+		if (stripe_ports[i] == ntohs(sa.sin6_port))
+			break;
+	switch (i) {
+		case 0:
+		case 1:
+			put_stripe_header(hdr, EXT_STRIPE_MAGIC, i, 2, STRIPE_BLOCK);
+			break;
+		case 2:
+			put_stripe_header(hdr, EXT_STRIPE_MAGIC + 1, 0, 2, STRIPE_BLOCK);
+			break;
+		case 3:
+			put_stripe_header(hdr, EXT_STRIPE_MAGIC, 2, 2, STRIPE_BLOCK);
+			break;
+		default:
+			put_stripe_header(hdr, EXT_STRIPE_MAGIC, 1, 2, 0);
+			break;
+	}
+	if (write_all(fd, hdr, sizeof(hdr)))
+		return -1;
+	if (i > 1)
+		/* Whatever follows is not taken for the input */
+		return write_all(fd, stripe_input, STRIPE_INPUT);
+	/* The blocks are dealt to the stripes in turn */
+	for (block = i; block * STRIPE_BLOCK < STRIPE_INPUT; block += 2)
+		if (write_all(fd, stripe_input + block * STRIPE_BLOCK,
+					STRIPE_INPUT - block * STRIPE_BLOCK < STRIPE_BLOCK ?
+					STRIPE_INPUT - block * STRIPE_BLOCK : STRIPE_BLOCK))
+			return -1;
+	return 0;
+}
+
+static void test_stripes()
+{
+	char out[] = "/tmp/test_stripes.XXXXXX", port[8];
+	char buf[PKT_MAX_LEN], got[STRIPE_INPUT + 1];
+	int socks[STRIPE_SENDERS], outfd, lfd, i, tries;
+	struct sockaddr_in6 sa = {
+		.sin6_family = AF_INET6,
+		.sin6_addr = IN6ADDR_LOOPBACK_INIT,
+	};
+	pkt_t pkt = {
+		.type = PTYPE_DATA,
+		.seq = 0,
+		.length = 4,
+		.payload = "data",
+	};
+	size_t len = sizeof(buf);
+	uint16_t lport;
+	pid_t pid;
+
+	for (i = 0; i < STRIPE_INPUT; ++i)
+		stripe_input[i] = rand();
+	for (i = 0; i < STRIPE_SENDERS; ++i)
+		CU_ASSERT_FATAL((socks[i] = loopback_socket(&stripe_ports[i])) != -1);
+	CU_ASSERT_FATAL((lfd = loopback_socket(&lport)) != -1);
+	close(lfd);
+	sprintf(port, "%u", lport);
+	sa.sin6_port = htons(lport);
+	CU_ASSERT_FATAL(pkt_encode(&pkt, buf, &len) == PKT_OK);
+	CU_ASSERT_FATAL((outfd = mkstemp(out)) != -1);
+	/* The senders keep sending their first packet until answered */
+	CU_ASSERT_FATAL((pid = fork()) != -1);
+	if (!pid) {
+		for (tries = 0; tries < 100; ++tries) {
+			for (i = 0; i < STRIPE_SENDERS; ++i)
+				sendto(socks[i], buf, len, 0, (struct sockaddr*)&sa,
+						sizeof(sa));
+			usleep(50000);
+		}
+		_exit(0);
+	}
+	CU_ASSERT(!stripe_receive("::1", port, outfd, send_stripe));
+	CU_ASSERT(!stripe_attached());
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	CU_ASSERT(pread(outfd, got, sizeof(got), 0) == STRIPE_INPUT &&
+			!memcmp(got, stripe_input, STRIPE_INPUT));
+	for (i = 0; i < STRIPE_SENDERS; ++i)
+		close(socks[i]);
+	close(outfd);
+	unlink(out);
+}
+
+
+static void test_sparse_hole()
+{
+	char path[] = "/tmp/test_sparse_hole.XXXXXX";
+	static char buf[300000], got[sizeof(buf) + 1];
+	struct stat st;
+	int fd, fds[2];
+	size_t i;
+
+	memset(buf, 0, sizeof(buf));
+	for (i = 0; i < 1000; ++i)
+		buf[i] = buf[200000 + i] = rand() | 1;
+	/* Holes in the middle and at the end of a file, over what it held */
+	CU_ASSERT_FATAL((fd = mkstemp(path)) != -1);
+	memset(got, 'x', sizeof(got));
+	CU_ASSERT(write(fd, got, 250000) == 250000 && !lseek(fd, 0, SEEK_SET));
+	CU_ASSERT(!write_all(fd, buf, 1000));
+	CU_ASSERT(!sparse_write_hole(fd, 199000));
+	CU_ASSERT(!write_all(fd, buf + 200000, 1000));
+	CU_ASSERT(!sparse_write_hole(fd, sizeof(buf) - 201000));
+	CU_ASSERT(!sparse_finish(fd));
+	CU_ASSERT(!fstat(fd, &st) && st.st_size == 300000);
+	CU_ASSERT(pread(fd, got, sizeof(got), 0) == sizeof(buf) &&
+			!memcmp(buf, got, sizeof(buf)));
+	/* The zeroes were not written, unless holes cannot be punched */
+	CU_ASSERT(lseek(fd, 4096, SEEK_DATA) >= 196608 ||
+			lseek(fd, 0, SEEK_HOLE) == st.st_size);
+	close(fd);
+	unlink(path);
+	/* Pipes are written the zeroes */
+	CU_ASSERT_FATAL(!pipe(fds));
+	CU_ASSERT(!write_all(fds[1], buf, 1000));
+	CU_ASSERT(!sparse_write_hole(fds[1], 10000));
+	CU_ASSERT(!sparse_finish(fds[1]));
+	close(fds[1]);
+	CU_ASSERT(read(fds[0], got, sizeof(got)) == 11000 &&
+			!memcmp(buf, got, 11000));
+	close(fds[0]);
+}
+
+/* Check that the checkpoint of the output out announces its first len bytes
+ * of data */
+static void check_resume(const char *out, int fd, const char *data,
+		size_t len)
+{
+	char got[64], expected[64], digest[sizeof(uint64_t) + SHA256_LEN];
+	size_t got_len = 0, expected_len = 0;
+	sha256_t ctx;
+
+	CU_ASSERT_FATAL(!checkpoint_load(out, fd));
+	CU_ASSERT(checkpoint_offset() == len);
+	sha256_init(&ctx);
+	sha256_update(&ctx, data, len);
+	ext_put_u64(digest, len);
+	sha256_final(&ctx, (uint8_t*)&digest[sizeof(uint64_t)]);
+	CU_ASSERT(!ext_rec_put(expected, sizeof(expected), &expected_len,
+				EXT_REC_RESUME, digest, sizeof(digest)));
+	CU_ASSERT(!checkpoint_reply(got, sizeof(got), &got_len));
+	CU_ASSERT(got_len == expected_len && !memcmp(got, expected, got_len));
+}
+
+static void test_checkpoint()
+{
+	char out[] = "/tmp/test_checkpoint.XXXXXX", ckpt[64];
+	static char data[100000], buf[CKPT_LEN + 1];
+	uint8_t digest[SHA256_LEN], expected[SHA256_LEN];
+	ckpt_t in, back;
+	struct {
+		uint64_t magic;
+		uint64_t offset;
+		sha256_t digest;
+	} raw;
+	size_t i;
+	int fd, cfd;
+
+	for (i = 0; i < sizeof(data); ++i)
+		data[i] = rand();
+	/* Each field survives, whatever the state of the hash */
+	for (i = 0; i < 130; i += 63) {
+		memset(&in, 0x5a, sizeof(in));
+		sha256_init(&in.digest);
+		sha256_update(&in.digest, data, 1000 + i);
+		in.offset = 1000 + i;
+		ckpt_encode(&in, buf);
+		CU_ASSERT(!memcmp(buf, "TRTPCKPT", 8));
+		CU_ASSERT_FATAL(!ckpt_decode(&back, buf, CKPT_LEN));
+		CU_ASSERT(back.offset == in.offset);
+		CU_ASSERT(!memcmp(back.digest.h, in.digest.h, sizeof(in.digest.h)));
+		CU_ASSERT(back.digest.len == in.digest.len);
+		sha256_final(&in.digest, expected);
+		sha256_final(&back.digest, digest);
+		CU_ASSERT(!memcmp(digest, expected, SHA256_LEN));
+	}
+	/* Truncated, inconsistent or other checkpoints are rejected */
+	CU_ASSERT(ckpt_decode(&back, buf, CKPT_LEN - 1));
+	CU_ASSERT(ckpt_decode(&back, buf, CKPT_LEN + 1));
+	buf[12 + 7] ^= 1;
+	CU_ASSERT(ckpt_decode(&back, buf, CKPT_LEN));
+	buf[12 + 7] ^= 1;
+	buf[11] = 3;
+	CU_ASSERT(ckpt_decode(&back, buf, CKPT_LEN));
+	buf[11] = 2;
+	buf[7] = '1';
+	CU_ASSERT(ckpt_decode(&back, buf, CKPT_LEN));
+
+	/* Round trip through the checkpoint file of an output */
+	CU_ASSERT_FATAL((fd = mkstemp(out)) != -1);
+	sprintf(ckpt, "%s.ckpt", out);
+	check_resume(out, fd, data, 0);
+	CU_ASSERT(!checkpoint_resume(fd, 0));
+	CU_ASSERT(write(fd, data, 60001) == 60001);
+	checkpoint_update(data, 60001);
+	CU_ASSERT(!checkpoint_save(fd, 1));
+	checkpoint_free();
+	check_resume(out, fd, data, 60001);
+	/* Resuming drops what was written after the checkpoint */
+	CU_ASSERT(write(fd, data + 60001, 5) == 5);
+	CU_ASSERT(!checkpoint_resume(fd, 60001));
+	CU_ASSERT(lseek(fd, 0, SEEK_CUR) == 60001);
+	CU_ASSERT(write(fd, data + 60001, 39999) == 39999);
+	checkpoint_update(data + 60001, 39999);
+	CU_ASSERT(!checkpoint_save(fd, 1));
+	checkpoint_free();
+	check_resume(out, fd, data, sizeof(data));
+	CU_ASSERT(!checkpoint_finish(fd));
+	CU_ASSERT(access(ckpt, F_OK) == -1);
+	checkpoint_free();
+	/* Checkpoints dumped raw by the first receivers are ignored */
+	raw.magic = 0x54525450434b5031ULL;
+	raw.offset = 1000;
+	sha256_init(&raw.digest);
+	sha256_update(&raw.digest, data, 1000);
+	CU_ASSERT_FATAL((cfd = open(ckpt, O_WRONLY | O_CREAT, 0644)) != -1);
+	CU_ASSERT(write(cfd, &raw, sizeof(raw)) == sizeof(raw));
+	close(cfd);
+	check_resume(out, fd, data, 0);
+	checkpoint_free();
+	unlink(ckpt);
+	close(fd);
+	unlink(out);
+}
+
+static void test_pull()
+{
+	pull_t p, other;
+	unsigned int i;
+
+	/* One more packet pulled for each one written out, plus one for each
+	 * target packets written */
+	CU_ASSERT(!pull_share(0, 0));
+	pull_init(&p, 10);
+	CU_ASSERT(pull_credit(&p) == EXT_PULL_INITIAL);
+	for (i = 1; i <= 8; ++i) {
+		pull_drained(&p, 1);
+		CU_ASSERT(pull_credit(&p) == i + (i < 8 ? 8 : 9));
+	}
+	pull_drained(&p, 9);
+	CU_ASSERT(pull_credit(&p) == 17 + 10);
+	/* Up to the maximum */
+	pull_drained(&p, 100);
+	CU_ASSERT(pull_credit(&p) == 117 + 10);
+	/* Truncations shrink the target, but never take credits back */
+	pull_truncated(&p);
+	pull_drained(&p, 2);
+	CU_ASSERT(pull_credit(&p) == 127);
+	pull_drained(&p, 3);
+	CU_ASSERT(pull_credit(&p) == 122 + 6);
+	pull_truncated(&p);
+	pull_truncated(&p);
+	pull_truncated(&p);
+	pull_drained(&p, 1);
+	CU_ASSERT(pull_credit(&p) == 128);
+
+	/* The transfers of the host share a budget of 12 packets */
+	CU_ASSERT_FATAL(!pull_share(12, 2));
+	pull_join(1);
+	pull_init(&other, 31);
+	pull_join(0);
+	pull_init(&p, 31);
+	/* The first ones are pulled whatever the budget */
+	CU_ASSERT(pull_credit(&p) == EXT_PULL_INITIAL);
+	pull_drained(&p, 8);
+	CU_ASSERT(pull_credit(&p) == 8 + 4);
+	/* Others make room */
+	pull_leave(1);
+	CU_ASSERT(pull_credit(&p) == 8 + 9);
+	pull_drained(&p, 9);
+	CU_ASSERT(pull_credit(&p) == 17 + 10);
+	pull_drained(&p, 20);
+	CU_ASSERT(pull_credit(&p) == 27 + 12);
+	/* The transfers keep at least one packet in flight, whatever the
+	 * others hold */
+	CU_ASSERT_FATAL(!pull_share(8, 2));
+	pull_join(1);
+	pull_init(&other, 31);
+	pull_join(0);
+	pull_init(&p, 31);
+	pull_drained(&p, 8);
+	CU_ASSERT(pull_credit(&p) == 9);
+	pull_drained(&p, 1);
+	CU_ASSERT(pull_credit(&p) == 10);
+	pull_leave(0);
+	pull_leave(1);
+	CU_ASSERT(pull_credit(&p) == 9 + 9);
+	CU_ASSERT(!pull_share(0, 0));
+}
+
+CU_TestInfo test_ext[] = {
+	{"test_timestamps", test_timestamps},
+	{"test_records", test_records},
+	{"test_corrupted_payload", test_corrupted_payload},
+	{"test_streams", test_streams},
+	{"test_tree", test_tree},
+	{"test_shm", test_shm},
+	{"test_decompress", test_decompress},
+	{"test_handoff", test_handoff},
+	{"test_stripes", test_stripes},
+	{"test_sparse_hole", test_sparse_hole},
+	{"test_checkpoint", test_checkpoint},
+	{"test_pull", test_pull},
+	CU_TEST_INFO_NULL,
+};
+CU_pTestInfo test_ext_list() { return test_ext; }
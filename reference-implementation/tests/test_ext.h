@@ -0,0 +1,11 @@
+#ifndef __TEST_EXT_H__
+#define __TEST_EXT_H__
+
+#include <CUnit/CUnit.h>
+
+
+int test_ext_init();
+int test_ext_cleanup();
+CU_pTestInfo test_ext_list();
+
+#endif
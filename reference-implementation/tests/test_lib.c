@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "../src/lib/trtp.h"
+#include "test_lib.h"
+
+
+int test_lib_init()
+{
+	return 0;
+}
+
+int test_lib_cleanup()
+{
+	return 0;
+}
+
+/* Find a free UDP port on [::1] */
+static int free_port(char *port)
+{
+	struct sockaddr_in6 sa = {
+		.sin6_family = AF_INET6,
+		.sin6_addr = IN6ADDR_LOOPBACK_INIT,
+	};
+	socklen_t len = sizeof(sa);
+	int fd;
+
+	if ((fd = socket(AF_INET6, SOCK_DGRAM, 0)) == -1)
+		return -1;
+	if (bind(fd, (struct sockaddr*)&sa, sizeof(sa)) ||
+			getsockname(fd, (struct sockaddr*)&sa, &len)) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	sprintf(port, "%u", ntohs(sa.sin6_port));
+	return 0;
+}
+
+static long elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* Wait for the events of both connections, up to their earliest deadline,
+ * then step those whose socket is readable or whose deadline passed */
+static void step(trtp_t *tx, trtp_t *rx)
+{
+	struct pollfd pfds[2] = {
+		{ .fd = trtp_fd(tx), .events = POLLIN },
+		{ .fd = trtp_fd(rx), .events = POLLIN },
+	};
+	int timeout = 1000, i;
+	trtp_t *conns[2] = { tx, rx };
+
+	for (i = 0; i < 2; ++i)
+		if (trtp_deadline(conns[i]) != -1 &&
+				trtp_deadline(conns[i]) < timeout)
+			timeout = trtp_deadline(conns[i]);
+	CU_ASSERT_FATAL(poll(pfds, 2, timeout) != -1);
+	for (i = 0; i < 2; ++i)
+		if (pfds[i].revents || !trtp_deadline(conns[i]))
+			trtp_timeout(conns[i]);
+}
+
+/* Run a transfer of buf between two connections, through a single event
+ * loop, as a program embedding both sides would */
+static void transfer(const char *buf, size_t len, const trtp_options_t *opts)
+{
+	char port[8], *got = malloc(len + 1);
+	size_t sent = 0, received = 0;
+	struct timespec start;
+	trtp_t *rx, *tx;
+	int eof = 0, shut = 0;
+	ssize_t n;
+
+	CU_ASSERT_FATAL(got != NULL);
+	CU_ASSERT_FATAL(!free_port(port));
+	CU_ASSERT_FATAL((rx = trtp_accept("::1", port, opts)) != NULL);
+	CU_ASSERT_FATAL((tx = trtp_connect("::1", port, opts)) != NULL);
+	/* Connections only do what they are for */
+	CU_ASSERT(trtp_recv(tx, got, len) == -1 && errno == EBADF);
+	CU_ASSERT(trtp_send(rx, buf, len) == -1 && errno == EBADF);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while ((!eof || trtp_result(tx) == TRTP_RUNNING) &&
+			elapsed_ms(&start) < 30000) {
+		if (sent < len) {
+			n = trtp_send(tx, buf + sent, len - sent);
+			CU_ASSERT_FATAL(n >= 0 || errno == EAGAIN);
+			if (n > 0)
+				sent += n;
+		}
+		if (sent == len && !shut) {
+			CU_ASSERT(!trtp_shutdown(tx));
+			shut = 1;
+		}
+		while (!eof && (n = trtp_recv(rx, got + received,
+						len + 1 - received)) >= 0) {
+			received += n;
+			eof = !n;
+		}
+		CU_ASSERT_FATAL(eof || errno == EAGAIN);
+		step(tx, rx);
+	}
+	CU_ASSERT(eof && sent == len);
+	CU_ASSERT(received == len && !memcmp(buf, got, len));
+	CU_ASSERT(trtp_result(tx) == 0);
+	CU_ASSERT(trtp_close(tx) == 0);
+	CU_ASSERT(trtp_close(rx) == 0);
+	free(got);
+}
+
+static void test_transfer()
+{
+	trtp_options_t opts = TRTP_OPTIONS_INIT;
+	size_t i, len = 3 << 20;
+	char *buf = malloc(len);
+
+	CU_ASSERT_FATAL(buf != NULL);
+	for (i = 0; i < len; ++i)
+		buf[i] = rand();
+	transfer(buf, len, &opts);
+	transfer(buf, 0, &opts);
+	/* Paced by the receiver */
+	opts.pull = 1;
+	opts.ecn = 1;
+	transfer(buf, len, &opts);
+	/* Text compressing well, inflated as it is read */
+	for (i = 0; i < len; ++i)
+		buf[i] = "abcdefgh"[i / 100 % 8];
+	opts = (trtp_options_t)TRTP_OPTIONS_INIT;
+	opts.compress = 6;
+	transfer(buf, len, &opts);
+	free(buf);
+}
+
+/* Each connection only asks to be woken up when its timers need it */
+static void test_deadline()
+{
+	char port[8], got[100], buf[100] = "deadline";
+	struct pollfd pfd = { .events = POLLIN };
+	trtp_t *rx, *tx;
+	int deadline;
+
+	CU_ASSERT_FATAL(!free_port(port));
+	CU_ASSERT_FATAL((rx = trtp_accept("::1", port, NULL)) != NULL);
+	/* Waiting for a sender for as long as it takes */
+	CU_ASSERT(trtp_deadline(rx) == -1);
+	CU_ASSERT_FATAL((tx = trtp_connect("::1", port, NULL)) != NULL);
+	CU_ASSERT(trtp_deadline(tx) == -1);
+	/* Sending starts the retransmission timer */
+	CU_ASSERT(trtp_send(tx, buf, sizeof(buf)) == sizeof(buf));
+	deadline = trtp_deadline(tx);
+	CU_ASSERT(deadline > 0 && deadline <= 4000);
+	/* Its socket wakes up the receiver once the data arrives */
+	pfd.fd = trtp_fd(rx);
+	CU_ASSERT(poll(&pfd, 1, 1000) == 1);
+	CU_ASSERT(trtp_recv(rx, got, sizeof(got)) == sizeof(got) &&
+			!memcmp(buf, got, sizeof(got)));
+	/* Then the receiver gives up on a silent sender after a while */
+	deadline = trtp_deadline(rx);
+	CU_ASSERT(deadline > 4000 && deadline <= 10000);
+	/* Closing them before the end of the data aborts the transfer */
+	CU_ASSERT(trtp_close(tx) == -1);
+	CU_ASSERT(trtp_close(rx) == -1);
+}
+
+static void test_abort()
+{
+	trtp_options_t opts = TRTP_OPTIONS_INIT;
+	struct timespec start;
+	char port[8];
+	trtp_t *rx;
+
+	CU_ASSERT_FATAL(!free_port(port));
+	/* Nobody sends anything, closing it early aborts the transfer */
+	CU_ASSERT_FATAL((rx = trtp_accept("::1", port, &opts)) != NULL);
+	CU_ASSERT(trtp_result(rx) == TRTP_RUNNING);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	CU_ASSERT(trtp_close(rx) == -1);
+	CU_ASSERT(elapsed_ms(&start) < 1000);
+}
+
+
+CU_TestInfo test_lib[] = {
+	{"test_transfer", test_transfer},
+	{"test_deadline", test_deadline},
+	{"test_abort", test_abort},
+	CU_TEST_INFO_NULL,
+};
+CU_pTestInfo test_lib_list() { return test_lib; }
@@ -0,0 +1,11 @@
+#ifndef __TEST_LIB_H__
+#define __TEST_LIB_H__
+
+#include <CUnit/CUnit.h>
+
+
+int test_lib_init();
+int test_lib_cleanup();
+CU_pTestInfo test_lib_list();
+
+#endif
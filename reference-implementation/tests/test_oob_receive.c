@@ -1,19 +1,37 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 #include "../src/common/macros.h"
+#include "../src/common/pktbuf.h"
+#include "../src/common/ext.h"
 #include "../src/receiver/receive.h"
+#include "../src/receiver/mux.h"
+#include "../src/receiver/pull.h"
+#include "../src/receiver/output.h"
 #include "test_oob_receive.h"
 
 /* Forward declaration of the private members of receiver.c that we want to
  * test */
-extern uint32_t oos_mask;
-extern uint8_t expected_seq;
-unsigned int window_size();
+unsigned int window_size(const receive_t *rx);
+int process_incoming_pkt(receive_t *rx, pkt_t *pkt, unsigned int win);
+int do_empty_rbuf(receive_t *rx);
+
+/* Transfer fed by hand, without any socket */
+static receive_t rx;
 
 
 int test_oob_init()
 {
+	memset(&rx, 0, sizeof(rx));
+	rx.sock = -1;
+	rx.out_fd = -1;
+	rx.max_window = MAX_WINDOW_SIZE;
+	rx.last_written_len = -1;
+	rx.out_writer = output_write;
 	return 0;
 }
 
@@ -24,15 +42,137 @@ int test_oob_cleanup()
 
 static void test_window_size()
 {
-	oos_mask = 2546; /* i.e there are no packets in slot 1 */
-	CU_ASSERT(window_size() == max_window);
-	oos_mask = 0b1011111;
-	CU_ASSERT(window_size() == max_window - 5);
+	rx.oos_mask = 2546; /* i.e there are no packets in slot 1 */
+	CU_ASSERT(window_size(&rx) == rx.max_window);
+	rx.oos_mask = 0b1011111;
+	CU_ASSERT(window_size(&rx) == rx.max_window - 5);
+}
+
+/* Receive #seq in the slot of the expected packet, as do_receive_data() */
+static void receive_seq(uint8_t seq)
+{
+	pkt_t *pkt = pktbuf_slotfor_seq(rx.recv_buf, rx.expected_seq);
+
+	pkt->seq = seq;
+	pkt->length = 1;
+	pkt->payload[0] = seq;
+	CU_ASSERT(!process_incoming_pkt(&rx, pkt, window_size(&rx)));
+}
+
+static void test_in_order_buffered()
+{
+	CU_ASSERT_FATAL((rx.recv_buf = pktbuf_new(32)) != NULL);
+	rx.oos_mask = 0;
+	rx.expected_seq = 0;
+	/* The output blocks, #0 and #1 stay in the buffer */
+	receive_seq(0);
+	CU_ASSERT(rx.expected_seq == 1 && rx.oos_mask == 0b1);
+	receive_seq(1);
+	CU_ASSERT(rx.expected_seq == 2 && rx.oos_mask == 0b11);
+	/* #4 is stored after them, the gap is relative to #2 */
+	receive_seq(4);
+	CU_ASSERT(rx.expected_seq == 2 && rx.oos_mask == 0b10011);
+	CU_ASSERT(pktbuf_slotfor_seq(rx.recv_buf, 4)->payload[0] == 4);
+	receive_seq(2);
+	CU_ASSERT(rx.expected_seq == 3 && rx.oos_mask == 0b10111);
+	/* #3 fills the gap, up to #4 */
+	receive_seq(3);
+	CU_ASSERT(rx.expected_seq == 5 && rx.oos_mask == 0b11111);
+	CU_ASSERT(window_size(&rx) == rx.max_window - 5);
+	pktbuf_free(rx.recv_buf);
+	rx.recv_buf = NULL;
+	rx.oos_mask = 0;
+	rx.expected_seq = 0;
+}
+
+
+/* Receive #seq of stream, whose previous packet was distance packets
+ * earlier */
+static void receive_stream(uint8_t seq, uint8_t stream, uint8_t distance)
+{
+	pkt_t *pkt = pktbuf_slotfor_seq(rx.recv_buf, rx.expected_seq);
+
+	pkt->type = PTYPE_DATA;
+	pkt->seq = seq;
+	pkt->window = distance;
+	pkt->ts = EXT_DATA_TS(EXT_KIND_RAW, stream, 0);
+	pkt->length = 1;
+	pkt->payload[0] = 'a' + seq;
+	CU_ASSERT(!process_incoming_pkt(&rx, pkt, window_size(&rx)));
+}
+
+/* Check that the file at path holds the string data */
+static void check_file(const char *path, const char *data)
+{
+	char buf[16] = { 0 };
+	FILE *f;
+
+	CU_ASSERT_FATAL((f = fopen(path, "r")) != NULL);
+	CU_ASSERT(fread(buf, 1, sizeof(buf) - 1, f) == strlen(data));
+	CU_ASSERT(!strcmp(buf, data));
+	fclose(f);
+}
+
+static void test_streams_ahead()
+{
+	char dir[] = "/tmp/test_ahead.XXXXXX";
+	char out[sizeof(dir) + 8], a[sizeof(dir) + 8], b[sizeof(dir) + 8];
+
+	CU_ASSERT_FATAL(mkdtemp(dir) != NULL);
+	sprintf(out, "%s/out", dir);
+	sprintf(a, "%s/a", dir);
+	sprintf(b, "%s/b", dir);
+	CU_ASSERT_FATAL((rx.out_fd = open(out, O_WRONLY | O_CREAT, 0644)) != -1);
+	CU_ASSERT_FATAL(!mux_init(dir));
+	CU_ASSERT_FATAL(!mux_open(1, "a", 1) && !mux_open(2, "b", 1));
+	CU_ASSERT_FATAL((rx.recv_buf = pktbuf_new(32)) != NULL);
+	rx.ext_features = EXT_MUX | EXT_PULL;
+	rx.ext_confirmed = 1;
+	pull_init(&rx.pull, rx.max_window);
+	/* #0 of stream 1 is missing */
+	receive_stream(1, 2, 0);
+	receive_stream(2, 1, 2);
+	receive_stream(3, 2, 2);
+	receive_stream(4, 0, 0);
+	CU_ASSERT(!do_empty_rbuf(&rx));
+	/* The other streams are written, and pulled for, nonetheless */
+	check_file(a, "");
+	check_file(b, "bd");
+	check_file(out, "e");
+	CU_ASSERT(rx.oos_mask == 0b11110 && rx.early_mask == 0b11010);
+	CU_ASSERT(pull_credit(&rx.pull) == 3 + EXT_PULL_INITIAL);
+	/* Until the missing packet arrives, and the rest of its stream with it */
+	receive_stream(0, 1, 0);
+	CU_ASSERT(!do_empty_rbuf(&rx));
+	check_file(a, "ac");
+	check_file(b, "bd");
+	check_file(out, "e");
+	CU_ASSERT(!rx.oos_mask && !rx.early_mask && rx.expected_seq == 5);
+	CU_ASSERT(pull_credit(&rx.pull) == 5 + EXT_PULL_INITIAL);
+	/* The end of the transfer stays in order */
+	receive_stream(6, 0, 2);
+	pktbuf_slotfor_seq(rx.recv_buf, 6)->length = 0;
+	CU_ASSERT(!do_empty_rbuf(&rx));
+	CU_ASSERT(rx.oos_mask == 0b10 && !rx.early_mask);
+
+	rx.ext_features = 0;
+	rx.ext_confirmed = 0;
+	pktbuf_free(rx.recv_buf);
+	rx.recv_buf = NULL;
+	rx.oos_mask = 0;
+	rx.expected_seq = 0;
+	mux_free();
+	close(rx.out_fd);
+	rx.out_fd = -1;
+	CU_ASSERT(!unlink(out) && !unlink(a) && !unlink(b));
+	CU_ASSERT(!rmdir(dir));
 }
 
 
 CU_TestInfo test_oob[] = {
 	{"test_window_size", test_window_size},
+	{"test_in_order_buffered", test_in_order_buffered},
+	{"test_streams_ahead", test_streams_ahead},
 	CU_TEST_INFO_NULL,
 };
 CU_pTestInfo test_oob_list() { return test_oob; }
@@ -0,0 +1,422 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "../src/common/macros.h"
+#include "../src/common/ext.h"
+#include "../src/common/net.h"
+#include "../src/common/packet_interface.h"
+#include "../src/receiver/output.h"
+#include "../src/receiver/stage.h"
+#include "../src/receiver/prealloc.h"
+#include "../src/receiver/session.h"
+#include "test_output.h"
+
+
+int test_output_init()
+{
+	return 0;
+}
+
+int test_output_cleanup()
+{
+	return 0;
+}
+
+/* Fork a process copying what is read from the pipe fds to the file out,
+ * until its end
+ * @return: its pid */
+static pid_t copy_to(int fds[2], int out)
+{
+	char buf[4096];
+	ssize_t n;
+	pid_t pid;
+
+	if ((pid = fork()))
+		return pid;
+	close(fds[1]);
+	while ((n = read(fds[0], buf, sizeof(buf))) > 0)
+		if (write_all(out, buf, n))
+			_exit(EXIT_FAILURE);
+	_exit(n ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/* Wait for the process pid, which must succeed */
+static int wait_ok(pid_t pid)
+{
+	int status;
+
+	return waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+		!WEXITSTATUS(status);
+}
+
+static void test_stage()
+{
+	char out[] = "/tmp/test_stage.XXXXXX";
+	static char buf[300000], got[sizeof(buf) + 1];
+	struct pollfd pfd;
+	size_t i, len, n;
+	int fds[2], fd;
+	pid_t pid;
+
+	for (i = 0; i < sizeof(buf); ++i)
+		buf[i] = rand();
+	CU_ASSERT_FATAL((fd = mkstemp(out)) != -1);
+	CU_ASSERT_FATAL(!pipe(fds));
+	fcntl(fds[1], F_SETPIPE_SZ, 4096);
+	stage_size = 8192;
+	CU_ASSERT_FATAL(!stage_start(fds[1]));
+	CU_ASSERT(stage_active());
+	/* Nobody reads the output, the ring fills up behind it */
+	for (len = 0; stage_room() && len < sizeof(buf); len += 512)
+		CU_ASSERT_FATAL(!stage_write(fds[1], buf + len, 512));
+	CU_ASSERT(len >= stage_size && len < sizeof(buf));
+	pfd.fd = stage_fd();
+	pfd.events = POLLIN;
+	CU_ASSERT(poll(&pfd, 1, 100) == 0);
+	/* Until it is read */
+	CU_ASSERT_FATAL(read(fds[0], got, 4096) == 4096);
+	CU_ASSERT(poll(&pfd, 1, 1000) == 1);
+	CU_ASSERT(stage_room());
+	/* The rest wraps around the ring, in pieces that do not divide it */
+	CU_ASSERT_FATAL((pid = copy_to(fds, fd)) != -1);
+	close(fds[0]);
+	for (; len < sizeof(buf); len += n) {
+		n = sizeof(buf) - len < 777 ? sizeof(buf) - len : 777;
+		CU_ASSERT_FATAL(!stage_write(fds[1], buf + len, n));
+	}
+	CU_ASSERT(!stage_finish());
+	CU_ASSERT(!stage_active());
+	close(fds[1]);
+	CU_ASSERT(wait_ok(pid));
+	CU_ASSERT(pread(fd, got + 4096, sizeof(got) - 4096, 0) ==
+			sizeof(buf) - 4096);
+	CU_ASSERT(!memcmp(buf, got, sizeof(buf)));
+	stage_free();
+	stage_size = 0;
+	close(fd);
+	unlink(out);
+}
+
+/* Size of the file fd */
+static off_t file_size(int fd)
+{
+	struct stat st;
+
+	return fstat(fd, &st) ? -1 : st.st_size;
+}
+
+static void test_batch()
+{
+	char out[] = "/tmp/test_batch.XXXXXX", other[] = "/tmp/test_batch.XXXXXX";
+	static char buf[100000], got[sizeof(buf) + 1];
+	int fd, ofd;
+	size_t len;
+
+	for (len = 0; len < sizeof(buf); ++len)
+		buf[len] = rand();
+	CU_ASSERT_FATAL((fd = mkstemp(out)) != -1);
+	CU_ASSERT_FATAL((ofd = mkstemp(other)) != -1);
+	batch_size = 8192;
+	CU_ASSERT_FATAL(!output_open(fd));
+	/* Nothing is written until the buffer is full */
+	for (len = 0; len < 8100; len += 100)
+		CU_ASSERT(!output_write(fd, buf + len, 100));
+	CU_ASSERT(file_size(fd) == 0);
+	CU_ASSERT(!output_write(fd, buf + len, 100));
+	len += 100;
+	CU_ASSERT(file_size(fd) == 8192);
+	/* Or another file is written to */
+	CU_ASSERT(!output_write(ofd, "x", 1));
+	CU_ASSERT(file_size(fd) == (off_t)len && file_size(ofd) == 1);
+	/* Large writes go straight out */
+	CU_ASSERT(!output_write(fd, buf + len, 20000));
+	len += 20000;
+	CU_ASSERT(file_size(fd) == (off_t)len);
+	for (; len < sizeof(buf) - 1000; len += 1000)
+		CU_ASSERT(!output_write(fd, buf + len, 1000));
+	CU_ASSERT(!output_flush(fd));
+	CU_ASSERT(file_size(fd) == (off_t)len);
+	CU_ASSERT(!output_write(fd, buf + len, sizeof(buf) - len));
+	CU_ASSERT(!output_finish(fd));
+	CU_ASSERT(pread(fd, got, sizeof(got), 0) == sizeof(buf) &&
+			!memcmp(buf, got, sizeof(buf)));
+	output_free();
+	batch_size = BATCH_DEFAULT;
+	close(fd);
+	close(ofd);
+	unlink(out);
+	unlink(other);
+}
+
+static void test_direct()
+{
+	char out[] = "/tmp/test_direct.XXXXXX";
+	static char buf[3 * 8192 + 100], got[sizeof(buf) + 1];
+	size_t len;
+	int fd, fds[2];
+
+	for (len = 0; len < sizeof(buf); ++len)
+		buf[len] = rand();
+	CU_ASSERT_FATAL((fd = mkstemp(out)) != -1);
+	batch_size = 8000;
+	direct_output = 1;
+	/* Whether the file supports O_DIRECT or not, and whatever the size of
+	 * the writes, the whole data goes through */
+	CU_ASSERT_FATAL(!output_open(fd));
+	CU_ASSERT(batch_size == 8192);
+	for (len = 0; len < sizeof(buf); len += 100)
+		CU_ASSERT(!output_write(fd, buf + len,
+					sizeof(buf) - len < 100 ? sizeof(buf) - len : 100));
+	CU_ASSERT(!output_finish(fd));
+	/* The partial block at the end went through the page cache */
+	CU_ASSERT(!(fcntl(fd, F_GETFL) & O_DIRECT));
+	CU_ASSERT(pread(fd, got, sizeof(got), 0) == sizeof(buf) &&
+			!memcmp(buf, got, sizeof(buf)));
+	output_free();
+	close(fd);
+	unlink(out);
+	/* Pipes are left alone, their reader gets every byte */
+	CU_ASSERT_FATAL(!pipe(fds));
+	CU_ASSERT_FATAL(!output_open(fds[1]));
+	CU_ASSERT(!(fcntl(fds[1], F_GETFL) & O_DIRECT));
+	for (len = 0; len < 300; len += 100)
+		CU_ASSERT(!output_write(fds[1], buf + len, 100));
+	CU_ASSERT(!output_finish(fds[1]));
+	close(fds[1]);
+	CU_ASSERT(read(fds[0], got, 50) == 50);
+	CU_ASSERT(read(fds[0], got + 50, sizeof(got) - 50) == 250);
+	CU_ASSERT(!memcmp(buf, got, 300));
+	close(fds[0]);
+	output_free();
+	batch_size = BATCH_DEFAULT;
+	direct_output = 0;
+}
+
+static void test_idle()
+{
+	char out[] = "/tmp/test_idle.XXXXXX";
+	static char buf[8192 + 100], got[sizeof(buf) + 1];
+	size_t len;
+	int fd;
+
+	for (len = 0; len < sizeof(buf); ++len)
+		buf[len] = rand();
+	CU_ASSERT_FATAL((fd = mkstemp(out)) != -1);
+	CU_ASSERT_FATAL(!output_open(fd));
+	CU_ASSERT(!output_pending());
+	CU_ASSERT(!output_write(fd, buf, 100));
+	CU_ASSERT(output_pending() && lseek(fd, 0, SEEK_END) == 0);
+	/* The data is written out long before the buffer fills */
+	CU_ASSERT(!output_idle(fd));
+	CU_ASSERT(!output_pending());
+	CU_ASSERT(pread(fd, got, sizeof(got), 0) == 100 && !memcmp(buf, got, 100));
+	CU_ASSERT(!output_finish(fd));
+	output_free();
+	CU_ASSERT(!ftruncate(fd, 0) && !lseek(fd, 0, SEEK_SET));
+	direct_output = 1;
+	CU_ASSERT_FATAL(!output_open(fd));
+	CU_ASSERT(!output_write(fd, buf, sizeof(buf)));
+	CU_ASSERT(!output_idle(fd));
+	/* O_DIRECT outputs keep the partial block for later */
+	if (fcntl(fd, F_GETFL) & O_DIRECT) {
+		CU_ASSERT(lseek(fd, 0, SEEK_END) == 8192 && !output_pending());
+	} else {
+		CU_ASSERT(lseek(fd, 0, SEEK_END) == sizeof(buf));
+	}
+	CU_ASSERT(!output_finish(fd));
+	CU_ASSERT(pread(fd, got, sizeof(got), 0) == sizeof(buf) &&
+			!memcmp(buf, got, sizeof(buf)));
+	output_free();
+	direct_output = 0;
+	close(fd);
+	unlink(out);
+}
+
+static void test_pipe()
+{
+	char out[] = "/tmp/test_pipe.XXXXXX";
+	static char buf[300000], got[sizeof(buf) + 1];
+	size_t len, n;
+	int fds[2], fd;
+	pid_t pid;
+
+	for (len = 0; len < sizeof(buf); ++len)
+		buf[len] = rand();
+	CU_ASSERT_FATAL((fd = mkstemp(out)) != -1);
+	CU_ASSERT_FATAL(!pipe(fds));
+	batch_size = 8192;
+	CU_ASSERT_FATAL(!output_open(fds[1]));
+	for (len = 0; len < 8192; len += 512)
+		CU_ASSERT(!output_write(fds[1], buf + len, 512));
+	/* Gathering more data does not change what the pipe was written */
+	CU_ASSERT(!output_write(fds[1], buf + len, 4000));
+	len += 4000;
+	CU_ASSERT_FATAL(read(fds[0], got, sizeof(got)) == 8192);
+	CU_ASSERT(!memcmp(buf, got, 8192));
+	/* Partial batches, and more data than the pipe holds at once */
+	CU_ASSERT(!output_flush(fds[1]));
+	CU_ASSERT_FATAL((pid = copy_to(fds, fd)) != -1);
+	close(fds[0]);
+	for (; len < sizeof(buf); len += n) {
+		n = sizeof(buf) - len < 777 ? sizeof(buf) - len : 777;
+		CU_ASSERT_FATAL(!output_write(fds[1], buf + len, n));
+	}
+	CU_ASSERT(!output_finish(fds[1]));
+	output_free();
+	batch_size = BATCH_DEFAULT;
+	close(fds[1]);
+	CU_ASSERT(wait_ok(pid));
+	CU_ASSERT(pread(fd, got + 8192, sizeof(got) - 8192, 0) ==
+			sizeof(buf) - 8192);
+	CU_ASSERT(!memcmp(buf, got, sizeof(buf)));
+	close(fd);
+	unlink(out);
+}
+
+/* Write len bytes of buf with prealloc_write(), by pieces of 1000 */
+static int prealloc_all(int fd, const char *buf, size_t len)
+{
+	size_t off, n;
+
+	for (off = 0; off < len; off += n) {
+		n = len - off < 1000 ? len - off : 1000;
+		if (prealloc_write(fd, buf + off, n))
+			return -1;
+	}
+	return 0;
+}
+
+static void test_prealloc()
+{
+	char out[] = "/tmp/test_prealloc.XXXXXX";
+	static char buf[100000], got[sizeof(buf) + 1];
+	size_t i;
+	int fd;
+
+	for (i = 0; i < sizeof(buf); ++i)
+		buf[i] = rand();
+	CU_ASSERT_FATAL((fd = mkstemp(out)) != -1);
+	batch_size = 0;
+	map_output = 1;
+	/* The output is mapped from its offset on, its data is there at once */
+	CU_ASSERT_FATAL(write(fd, buf, 100) == 100);
+	CU_ASSERT_FATAL(!prealloc_start(fd, sizeof(buf) - 100));
+	CU_ASSERT(file_size(fd) == sizeof(buf));
+	CU_ASSERT(!prealloc_all(fd, buf + 100, 50000));
+	CU_ASSERT(pread(fd, got, 50100, 0) == 50100 && !memcmp(buf, got, 50100));
+	CU_ASSERT(!prealloc_all(fd, buf + 50100, sizeof(buf) - 50100));
+	CU_ASSERT(!prealloc_finish(fd));
+	CU_ASSERT(lseek(fd, 0, SEEK_CUR) == sizeof(buf));
+	CU_ASSERT(pread(fd, got, sizeof(got), 0) == sizeof(buf) &&
+			!memcmp(buf, got, sizeof(buf)));
+	prealloc_free();
+	/* Data past the announced size is written after the mapping */
+	CU_ASSERT_FATAL(!ftruncate(fd, 0) && !lseek(fd, 0, SEEK_SET));
+	CU_ASSERT_FATAL(!prealloc_start(fd, 30000));
+	CU_ASSERT(!prealloc_all(fd, buf, 45500));
+	CU_ASSERT(!prealloc_finish(fd));
+	CU_ASSERT(pread(fd, got, sizeof(got), 0) == 45500 &&
+			!memcmp(buf, got, 45500));
+	prealloc_free();
+	/* And space announced but not filled is released */
+	CU_ASSERT_FATAL(!ftruncate(fd, 0) && !lseek(fd, 0, SEEK_SET));
+	CU_ASSERT_FATAL(!prealloc_start(fd, sizeof(buf)));
+	CU_ASSERT(!prealloc_all(fd, buf, 12345));
+	CU_ASSERT(!prealloc_finish(fd));
+	CU_ASSERT(file_size(fd) == 12345);
+	prealloc_free();
+	map_output = 0;
+	batch_size = BATCH_DEFAULT;
+	close(fd);
+	unlink(out);
+}
+
+/* Send a DATA packet to the peer of fd */
+static int send_pkt(int fd, uint8_t seq, uint32_t ts, const char *payload,
+		size_t len)
+{
+	pkt_t pkt = {
+		.type = PTYPE_DATA,
+		.seq = seq,
+		.length = len,
+		.ts = ts,
+	};
+	char buf[PKT_MAX_LEN];
+	size_t buf_len = sizeof(buf);
+
+	memcpy(pkt.payload, payload, len);
+	if (pkt_encode(&pkt, buf, &buf_len) != PKT_OK)
+		return -1;
+	return send(fd, buf, buf_len, 0) == (ssize_t)buf_len ? 0 : -1;
+}
+
+static void test_prealloc_abort()
+{
+	char out[] = "/tmp/test_abort.XXXXXX", port[8];
+	char buf[5 * 512], rec[16], value[sizeof(uint64_t)], got[sizeof(buf) + 1];
+	const trtp_options_t opts = TRTP_OPTIONS_INIT;
+	struct sockaddr_in6 sa = {
+		.sin6_family = AF_INET6,
+		.sin6_addr = IN6ADDR_LOOPBACK_INIT,
+	};
+	socklen_t len = sizeof(sa);
+	size_t i, off = 0;
+	int fd, sock, rsock;
+
+	for (i = 0; i < sizeof(buf); ++i)
+		buf[i] = rand();
+	CU_ASSERT_FATAL((fd = mkstemp(out)) != -1);
+	/* Find a free port for the receiver */
+	CU_ASSERT_FATAL((sock = socket(AF_INET6, SOCK_DGRAM, 0)) != -1);
+	CU_ASSERT_FATAL(!bind(sock, (struct sockaddr*)&sa, sizeof(sa)) &&
+			!getsockname(sock, (struct sockaddr*)&sa, &len));
+	close(sock);
+	sprintf(port, "%u", ntohs(sa.sin6_port));
+	CU_ASSERT_FATAL(net_open_socket("::1", port, &bind, &rsock) == NET_OK);
+	CU_ASSERT_FATAL((sock = socket(AF_INET6, SOCK_DGRAM, 0)) != -1);
+	CU_ASSERT_FATAL(!connect(sock, (struct sockaddr*)&sa, sizeof(sa)));
+	/* A sender announcing 1MB, which aborts after 2560b with a record the
+	 * receiver does not expect */
+	CU_ASSERT(!send_pkt(sock, 0, EXT_OFFER(EXT_SIZE), buf, 512));
+	ext_put_u64(value, 1 << 20);
+	CU_ASSERT(!ext_rec_put(rec, sizeof(rec), &off, EXT_REC_SIZE, value,
+				sizeof(value)));
+	CU_ASSERT(!send_pkt(sock, 1, EXT_DATA_TS(EXT_KIND_CTRL, 0, 0), rec, off));
+	for (i = 1; i < 5; ++i)
+		CU_ASSERT(!send_pkt(sock, i + 1, EXT_DATA_TS(EXT_KIND_RAW, 0, 0),
+					buf + i * 512, 512));
+	off = 0;
+	CU_ASSERT(!ext_rec_put(rec, sizeof(rec), &off, EXT_REC_HOLE, value,
+				sizeof(value)));
+	CU_ASSERT(!send_pkt(sock, 6, EXT_DATA_TS(EXT_KIND_CTRL, 0, 0), rec, off));
+	map_output = 1;
+	CU_ASSERT(session_receive(rsock, NULL, &opts, fd) == -ECONNABORTED);
+	/* The output ends with the data received */
+	CU_ASSERT(file_size(fd) == sizeof(buf));
+	CU_ASSERT(pread(fd, got, sizeof(got), 0) == sizeof(buf) &&
+			!memcmp(buf, got, sizeof(buf)));
+	map_output = 0;
+	close(sock);
+	close(fd);
+	unlink(out);
+}
+
+
+CU_TestInfo test_output[] = {
+	{"test_stage", test_stage},
+	{"test_batch", test_batch},
+	{"test_direct", test_direct},
+	{"test_idle", test_idle},
+	{"test_pipe", test_pipe},
+	{"test_prealloc", test_prealloc},
+	{"test_prealloc_abort", test_prealloc_abort},
+	CU_TEST_INFO_NULL,
+};
+CU_pTestInfo test_output_list() { return test_output; }
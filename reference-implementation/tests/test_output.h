@@ -0,0 +1,11 @@
+#ifndef __TEST_OUTPUT_H__
+#define __TEST_OUTPUT_H__
+
+#include <CUnit/CUnit.h>
+
+
+int test_output_init();
+int test_output_cleanup();
+CU_pTestInfo test_output_list();
+
+#endif
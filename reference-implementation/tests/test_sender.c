@@ -0,0 +1,967 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <zlib.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "../src/common/macros.h"
+#include "../src/common/ext.h"
+#include "../src/common/checksum.h"
+#include "../src/common/net.h"
+#include "../src/common/packet_interface.h"
+#include "../src/common/pktbuf.h"
+#include "../src/sender/compress.h"
+#include "../src/sender/delta.h"
+#include "../src/sender/fanout.h"
+#include "../src/sender/path.h"
+#include "../src/sender/range.h"
+#include "../src/sender/sparse.h"
+#include "../src/sender/transmit.h"
+#include "test_sender.h"
+
+/* Internals of transmit.c */
+void handle_ce(transmit_t *tx, uint8_t flags);
+int coalesce_start(transmit_t *tx);
+void coalesce_stop(transmit_t *tx);
+int input_ready(transmit_t *tx);
+struct timespec *poll_timeout(const transmit_t *tx, struct timespec *ts);
+int input_pollfds(const transmit_t *tx, struct pollfd *pfds);
+void timer_restart(transmit_t *tx);
+void close_send(transmit_t *tx);
+int can_send(const transmit_t *tx);
+uint8_t stream_distance(transmit_t *tx, uint8_t seq, uint8_t stream);
+
+int test_sender_init()
+{
+	return 0;
+}
+
+int test_sender_cleanup()
+{
+	return 0;
+}
+
+/* Create a temporary file holding len bytes of buf, positioned at its start */
+static int temp_input(char *path, const char *buf, size_t len)
+{
+	int fd;
+
+	if ((fd = mkstemp(path)) == -1)
+		return -1;
+	if (write(fd, buf, len) != (ssize_t)len || lseek(fd, 0, SEEK_SET)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Transfer of the data given by transmit_write() over sock, whose internals
+ * the tests drive */
+static transmit_t *new_transfer(int sock)
+{
+	trtp_options_t opts = TRTP_OPTIONS_INIT;
+
+	return transmit_new(sock, -1, &opts);
+}
+
+static void test_compress()
+{
+	char path[] = "/tmp/test_compress.XXXXXX";
+	static char buf[300000], got[sizeof(buf)];
+	char payload[512], out[4096];
+	size_t i, len = 0, sent = 0, deflated = 0;
+	compress_t *c;
+	uint8_t kind;
+	ssize_t rlen;
+	z_stream zs;
+	int fd;
+
+	/* Text compressing well, then noise which does not */
+	for (i = 0; i < sizeof(buf); ++i)
+		buf[i] = i < sizeof(buf) / 2 ? "abcdefgh"[i / 100 % 8] : rand();
+	CU_ASSERT_FATAL((fd = temp_input(path, buf, sizeof(buf))) != -1);
+	memset(&zs, 0, sizeof(zs));
+	CU_ASSERT_FATAL(inflateInit2(&zs, -MAX_WBITS) == Z_OK);
+	CU_ASSERT_FATAL((c = compress_new(6)) != NULL);
+	while ((rlen = compress_next(c, read, fd, payload, sizeof(payload),
+					&kind)) > 0) {
+		sent += rlen;
+		if (kind == EXT_KIND_RAW) {
+			CU_ASSERT_FATAL(len + rlen <= sizeof(got));
+			memcpy(got + len, payload, rlen);
+			len += rlen;
+			continue;
+		}
+		CU_ASSERT_FATAL(kind == EXT_KIND_DEFLATE);
+		deflated += rlen;
+		zs.next_in = (Bytef*)payload;
+		zs.avail_in = rlen;
+		do {
+			zs.next_out = (Bytef*)out;
+			zs.avail_out = sizeof(out);
+			CU_ASSERT_FATAL(inflate(&zs, Z_SYNC_FLUSH) != Z_DATA_ERROR);
+			CU_ASSERT_FATAL(len + sizeof(out) - zs.avail_out <= sizeof(got));
+			memcpy(got + len, out, sizeof(out) - zs.avail_out);
+			len += sizeof(out) - zs.avail_out;
+		} while (zs.avail_out == 0);
+	}
+	CU_ASSERT(rlen == 0);
+	CU_ASSERT(!compress_pending(c));
+	CU_ASSERT(len == sizeof(buf) && !memcmp(buf, got, sizeof(buf)));
+	/* The text went deflated, the noise mostly raw */
+	CU_ASSERT(deflated > 0 && deflated < sizeof(buf) / 4);
+	CU_ASSERT(sent < sizeof(buf) * 3 / 4);
+	compress_free(c);
+	inflateEnd(&zs);
+	close(fd);
+	unlink(path);
+}
+
+/* Feed delta_handle_reply() with the signatures of the n blocks of basis */
+static void reply_sigs(const uint8_t *basis, uint32_t block, uint32_t n)
+{
+	char value[255], *sig;
+	uint8_t hash[SHA256_LEN];
+	sha256_t ctx;
+	rsum_t sum;
+	uint32_t i;
+
+	ext_put_u32(value, block);
+	ext_put_u32(value + sizeof(uint32_t), n);
+	CU_ASSERT(!delta_handle_reply(EXT_REC_SIGINFO, value,
+				2 * sizeof(uint32_t)));
+	ext_put_u32(value, 0);
+	for (i = 0, sig = value + sizeof(uint32_t); i < n; ++i) {
+		rsum_init(&sum, basis + i * block, block);
+		ext_put_u32(sig, rsum_digest(&sum));
+		sha256_init(&ctx);
+		sha256_update(&ctx, basis + i * block, block);
+		sha256_final(&ctx, hash);
+		memcpy(sig + sizeof(uint32_t), hash, EXT_STRONG_LEN);
+		sig += EXT_SIG_LEN;
+	}
+	CU_ASSERT(!delta_handle_reply(EXT_REC_SIGS, value, sig - value));
+}
+
+static void test_delta()
+{
+	enum { BLOCK = 64, NBLOCKS = 8 };
+	char path[] = "/tmp/test_delta.XXXXXX";
+	uint8_t basis[BLOCK * NBLOCKS], input[1024], got[sizeof(input)];
+	uint8_t hash[SHA256_LEN];
+	char payload[512];
+	size_t i, len = 0, in_len = 0, literal = 0, copies = 0, off;
+	uint32_t expected[][2] = { {0, 4}, {5, 2}, {2, 1} };
+	int fd, digest = 0;
+	sha256_t ctx;
+	ext_rec_t rec;
+	uint8_t kind;
+	ssize_t rlen;
+
+	for (i = 0; i < sizeof(basis); ++i)
+		basis[i] = rand();
+	/* Blocks 0-3, 10 new bytes, blocks 5-6 and 2, and a partial block */
+	memcpy(input, basis, 4 * BLOCK);
+	in_len = 4 * BLOCK;
+	for (i = 0; i < 10; ++i)
+		input[in_len++] = rand();
+	memcpy(input + in_len, basis + 5 * BLOCK, 2 * BLOCK);
+	in_len += 2 * BLOCK;
+	memcpy(input + in_len, basis + 2 * BLOCK, BLOCK);
+	in_len += BLOCK;
+	memcpy(input + in_len, basis + 7 * BLOCK, 30);
+	in_len += 30;
+	CU_ASSERT_FATAL((fd = temp_input(path, (char*)input, in_len)) != -1);
+
+	CU_ASSERT_FATAL(!delta_init());
+	CU_ASSERT(delta_fetching() && delta_ready(0));
+	CU_ASSERT(delta_next(read, fd, payload, sizeof(payload), &kind) > 0);
+	CU_ASSERT(kind == EXT_KIND_CTRL && payload[0] == EXT_REC_SIGREQ);
+	/* Nothing else to do until the receiver answered */
+	CU_ASSERT(!delta_ready(0));
+	reply_sigs(basis, BLOCK, NBLOCKS);
+	while ((rlen = delta_next(read, fd, payload, sizeof(payload), &kind))
+			> 0) {
+		if (kind == EXT_KIND_RAW) {
+			CU_ASSERT_FATAL(len + rlen <= sizeof(got));
+			memcpy(got + len, payload, rlen);
+			len += rlen;
+			literal += rlen;
+			continue;
+		}
+		CU_ASSERT_FATAL(kind == EXT_KIND_CTRL);
+		off = 0;
+		while (ext_rec_next(payload, rlen, &off, &rec) == 1) {
+			if (rec.type == EXT_REC_COPY) {
+				uint32_t first = ext_get_u32(rec.value);
+				uint32_t count = ext_get_u32(rec.value + sizeof(uint32_t));
+
+				CU_ASSERT_FATAL(copies < 3);
+				CU_ASSERT(first == expected[copies][0] &&
+						count == expected[copies][1]);
+				CU_ASSERT_FATAL(len + count * BLOCK <= sizeof(got));
+				memcpy(got + len, basis + first * BLOCK, count * BLOCK);
+				len += count * BLOCK;
+				++copies;
+			} else if (rec.type == EXT_REC_DIGEST) {
+				sha256_init(&ctx);
+				sha256_update(&ctx, input, in_len);
+				sha256_final(&ctx, hash);
+				CU_ASSERT(rec.len == SHA256_LEN &&
+						!memcmp(rec.value, hash, SHA256_LEN));
+				digest = 1;
+			}
+		}
+	}
+	CU_ASSERT(rlen == 0 && !delta_fetching());
+	CU_ASSERT(copies == 3 && digest);
+	/* Only the bytes the receiver does not have are sent */
+	CU_ASSERT(literal == 40);
+	CU_ASSERT(len == in_len && !memcmp(got, input, in_len));
+	delta_free();
+	close(fd);
+	unlink(path);
+}
+
+/* Socket connected to [::1], whose path parameters are cached */
+static int loopback_socket()
+{
+	struct sockaddr_in6 sa = {
+		.sin6_family = AF_INET6,
+		.sin6_port = htons(9),
+		.sin6_addr = IN6ADDR_LOOPBACK_INIT,
+	};
+	int fd;
+
+	if ((fd = socket(AF_INET6, SOCK_DGRAM, 0)) == -1)
+		return -1;
+	if (connect(fd, (struct sockaddr*)&sa, sizeof(sa))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Start over with the parameters cached in file for [::1], if any, once the
+ * receiver answered */
+static void load_path(path_t *path, const char *file, int fd,
+		const char *cache)
+{
+	FILE *f;
+
+	CU_ASSERT_FATAL((f = fopen(file, "w")) != NULL);
+	fputs(cache, f);
+	fclose(f);
+	path_init(path);
+	CU_ASSERT(!path_load(path, file, fd));
+	path_acked(path, 0, 1);
+}
+
+static void test_path_cache()
+{
+	char file[] = "/tmp/test_path.XXXXXX", line[256], addr[64];
+	char cache[256];
+	unsigned int srtt, rttvar, loss, window, entries = 0, found = 0;
+	long now = time(NULL), updated;
+	static path_t path;
+	int sock, i;
+	FILE *f;
+
+	CU_ASSERT_FATAL((sock = loopback_socket()) != -1);
+	CU_ASSERT_FATAL((i = mkstemp(file)) != -1);
+	close(i);
+	/* Nothing known about the path: the window of the receiver and the
+	 * fixed timer of plain TRTP rule */
+	sprintf(cache, "# header\n::2 400000 1000 0 20 %ld\n", now);
+	load_path(&path, file, sock, cache);
+	CU_ASSERT(path_window(&path) == MAX_WINDOW_SIZE &&
+			path_rto(&path) == 4000);
+	path_sent(&path, 1, 512);
+	path_acked(&path, 1, 1);
+	path_lost(&path, 1, 1);
+	CU_ASSERT(path_window(&path) == 1 && path_rto(&path) == 4000);
+	/* Fresh entries seed the window and the timer, with a variation of at
+	 * least a quarter of the round-trip time */
+	sprintf(cache, "::1 400000 1000 10 20 %ld\n", now - 100);
+	load_path(&path, file, sock, cache);
+	CU_ASSERT(path_window(&path) == 20 && path_rto(&path) == 800);
+	/* Whose timer backs off */
+	path_lost(&path, 0, 1);
+	CU_ASSERT(path_window(&path) == 1 && path_rto(&path) == 1600);
+	/* But not the window of lossy paths */
+	sprintf(cache, "::1 400000 1000 500 20 %ld\n", now - 100);
+	load_path(&path, file, sock, cache);
+	CU_ASSERT(path_window(&path) == 5 && path_rto(&path) == 800);
+	/* Stale entries are ignored */
+	sprintf(cache, "::1 400000 1000 0 20 %ld\n", now - 8 * 24 * 3600);
+	load_path(&path, file, sock, cache);
+	CU_ASSERT(path_window(&path) == MAX_WINDOW_SIZE &&
+			path_rto(&path) == 4000);
+
+	sprintf(cache, "# header\n::1 400000 1000 0 20 %ld\nbad line\n"
+			"::2 10000 1000 0 20 %ld\n::3 10000 1000 0 20 %ld\n", now - 100,
+			now, now - 8 * 24 * 3600);
+	load_path(&path, file, sock, cache);
+	/* Saving keeps the other fresh entries and drops the stale ones */
+	CU_ASSERT_FATAL(!path_save(&path, file, sock));
+	CU_ASSERT_FATAL((f = fopen(file, "r")) != NULL);
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#')
+			continue;
+		CU_ASSERT_FATAL(sscanf(line, "%63s %u %u %u %u %ld", addr, &srtt,
+					&rttvar, &loss, &window, &updated) == 6);
+		CU_ASSERT(now - updated < 7 * 24 * 3600);
+		++entries;
+		if (strcmp(addr, "::1"))
+			continue;
+		/* What we know now about the path */
+		CU_ASSERT(srtt == 400000 && rttvar == 100000 && updated >= now);
+		++found;
+	}
+	fclose(f);
+	CU_ASSERT(entries == 2 && found == 1);
+
+	/* The oldest entry makes room in a full cache */
+	CU_ASSERT_FATAL((f = fopen(file, "w")) != NULL);
+	for (i = 0; i < 256; ++i)
+		fprintf(f, "::2:%x 10000 1000 0 20 %ld\n", i,
+				now - 1000 + (i + 7) % 256);
+	fclose(f);
+	CU_ASSERT_FATAL(!path_save(&path, file, sock));
+	CU_ASSERT_FATAL((f = fopen(file, "r")) != NULL);
+	entries = found = 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || sscanf(line, "%63s", addr) != 1)
+			continue;
+		++entries;
+		found += !strcmp(addr, "::1");
+		/* Entry 249 was updated first */
+		CU_ASSERT(strcmp(addr, "::2:f9"));
+	}
+	fclose(f);
+	CU_ASSERT(entries == 256 && found == 1);
+	close(sock);
+	unlink(file);
+}
+
+static void test_payload_size()
+{
+	static path_t path;
+	size_t size;
+	int i;
+
+	path_init(&path);
+	/* Full payloads unless packets get corrupted */
+	for (i = 0; i < 1000; ++i)
+		path_sent(&path, i, 512);
+	CU_ASSERT(path_payload_size(&path) == 512);
+	for (i = 0; i < 300; ++i)
+		path_dropped(&path);
+	size = path_payload_size(&path);
+	CU_ASSERT(size > 64 && size < 512);
+	/* Smaller ones the more they do */
+	for (i = 0; i < 300; ++i)
+		path_dropped(&path);
+	CU_ASSERT(path_payload_size(&path) < size);
+	for (i = 0; i < 100000; ++i)
+		path_dropped(&path);
+	CU_ASSERT(path_payload_size(&path) == 64);
+	/* And back to full ones once they stop */
+	for (i = 0; i < 100000; ++i)
+		path_sent(&path, i, 64);
+	CU_ASSERT(path_payload_size(&path) == 512);
+}
+
+static void test_range()
+{
+	char path[] = "/tmp/test_range.XXXXXX";
+	char buf[10000], got[sizeof(buf)];
+	size_t i, len;
+	ssize_t n;
+	int fd, pfd[2];
+
+	for (i = 0; i < sizeof(buf); ++i)
+		buf[i] = rand();
+	CU_ASSERT_FATAL((fd = temp_input(path, buf, sizeof(buf))) != -1);
+	/* Only regular files, and ranges starting within them */
+	CU_ASSERT_FATAL(!pipe(pfd));
+	CU_ASSERT(range_init(pfd[0], 0, 0));
+	close(pfd[0]);
+	close(pfd[1]);
+	CU_ASSERT(range_init(fd, sizeof(buf) + 1, 0));
+	CU_ASSERT(!range_init(fd, sizeof(buf), 0));
+	CU_ASSERT(range_left() == 0 && range_read(fd, got, sizeof(got)) == 0);
+	/* The range is read wherever the file offset is */
+	CU_ASSERT(!range_init(fd, 3000, 2000));
+	CU_ASSERT(range_active() && range_left() == 2000);
+	for (len = 0; (n = range_read(fd, got + len, 300)) > 0; len += n)
+		CU_ASSERT(range_left() == 2000 - len - n);
+	CU_ASSERT(n == 0 && len == 2000 && !memcmp(got, buf + 3000, 2000));
+	CU_ASSERT(lseek(fd, 0, SEEK_CUR) == 0);
+	/* Ranges past the end of the input are clamped to it, and run up to it
+	 * by default */
+	CU_ASSERT(!range_init(fd, 9000, 5000));
+	CU_ASSERT(range_left() == 1000);
+	CU_ASSERT(range_read(fd, got, sizeof(got)) == 1000 &&
+			!memcmp(got, buf + 9000, 1000));
+	CU_ASSERT(!range_init(fd, 4000, 0));
+	CU_ASSERT(range_left() == 6000);
+	close(fd);
+	unlink(path);
+}
+
+/* Send the input fd as the sender does with -S, rebuilding it in got.
+ * @return: its length, with the bytes sent as holes in *holes */
+static size_t sparse_send(int fd, char *got, size_t len, size_t *holes)
+{
+	size_t off = 0;
+	int64_t hole;
+	ssize_t n;
+
+	*holes = 0;
+	CU_ASSERT_FATAL(!sparse_init(fd));
+	for (;;) {
+		CU_ASSERT_FATAL((hole = sparse_skip(fd)) >= 0);
+		CU_ASSERT_FATAL(off + hole <= len);
+		memset(got + off, 0, hole);
+		off += hole;
+		*holes += hole;
+		/* A hole makes a packet of its own */
+		if (hole)
+			continue;
+		CU_ASSERT_FATAL((n = sparse_read(fd, got + off,
+						len - off < 512 ? len - off : 512)) >= 0);
+		if (!n)
+			break;
+		/* Data never starts with a zero-filled block */
+		CU_ASSERT(n < 512 || memcmp(got + off, (char[512]){ 0 }, 512));
+		off += n;
+	}
+	sparse_free();
+	return off;
+}
+
+static void test_sparse()
+{
+	char path[] = "/tmp/test_sparse.XXXXXX";
+	static char buf[(1 << 20) + 8192], got[sizeof(buf) + 1];
+	size_t i, len, holes;
+	int fd, fds[2];
+	pid_t pid;
+
+	/* Data, a hole of the file, zeroes written out, data, and a hole up to
+	 * the end of the file */
+	memset(buf, 0, sizeof(buf));
+	for (i = 0; i < 1000; ++i)
+		buf[i] = rand() | 1;
+	for (i = 600000; i < 603000; ++i)
+		buf[i] = rand() | 1;
+	for (i = 700000; i < 700100; ++i)
+		buf[i] = rand() | 1;
+	CU_ASSERT_FATAL((fd = mkstemp(path)) != -1);
+	CU_ASSERT(pwrite(fd, buf, 1000, 0) == 1000);
+	CU_ASSERT(pwrite(fd, buf + 600000, 100100, 600000) == 100100);
+	CU_ASSERT(!ftruncate(fd, sizeof(buf)));
+	len = sparse_send(fd, got, sizeof(got), &holes);
+	CU_ASSERT(len == sizeof(buf) && !memcmp(buf, got, sizeof(buf)));
+	/* Most of the zeroes went as holes, whether the filesystem told where
+	 * they were or not */
+	CU_ASSERT(holes > sizeof(buf) - 110000);
+	/* A pipe is inspected for zeroes as it comes */
+	CU_ASSERT_FATAL(!pipe(fds));
+	CU_ASSERT_FATAL((pid = fork()) != -1);
+	if (!pid) {
+		close(fds[0]);
+		_exit(write(fds[1], buf, sizeof(buf)) == sizeof(buf) ?
+				EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	close(fds[1]);
+	len = sparse_send(fds[0], got, sizeof(got), &holes);
+	CU_ASSERT(len == sizeof(buf) && !memcmp(buf, got, sizeof(buf)));
+	CU_ASSERT(holes > sizeof(buf) - 110000);
+	close(fds[0]);
+	waitpid(pid, NULL, 0);
+	close(fd);
+	unlink(path);
+}
+
+static void test_ce()
+{
+	unsigned int i, window;
+	transmit_t *tx;
+	uint32_t ts;
+
+	/* The count of marks survives the ACK timestamps, modulo 8 */
+	for (i = 0; i < 20; ++i) {
+		ts = EXT_ACK_TS(EXT_ACK_PULL | EXT_ACK_CE(i) | EXT_ACK_CORRUPT,
+				0xabcdef);
+		CU_ASSERT(EXT_ACK_CE_COUNT(EXT_TS_FLAGS(ts)) == i % 8);
+		CU_ASSERT(EXT_TS_CLOCK(ts) == 0xabcdef);
+	}
+	CU_ASSERT_FATAL((tx = new_transfer(-1)) != NULL);
+	path_acked(&tx->path, 0, 20);
+	window = path_window(&tx->path);
+	tx->last_sent = 10;
+	/* Nothing new */
+	handle_ce(tx, EXT_ACK_CE(0) | EXT_ACK_PULL);
+	CU_ASSERT(path_window(&tx->path) == window && tx->ce_echoed == 0);
+	/* One more mark halves the window */
+	handle_ce(tx, EXT_ACK_CE(1));
+	CU_ASSERT(path_window(&tx->path) == window / 2 && tx->ce_echoed == 1);
+	window = path_window(&tx->path);
+	/* Large jumps resync the count, once per round-trip */
+	handle_ce(tx, EXT_ACK_CE(7));
+	CU_ASSERT(path_window(&tx->path) == window && tx->ce_echoed == 7);
+	path_acked(&tx->path, 10, 1);
+	window = path_window(&tx->path);
+	handle_ce(tx, EXT_ACK_CE(7));
+	CU_ASSERT(path_window(&tx->path) == window);
+	tx->last_sent = 20;
+	handle_ce(tx, EXT_ACK_CE(4));
+	CU_ASSERT(path_window(&tx->path) == window / 2 && tx->ce_echoed == 4);
+	transmit_free(tx);
+}
+
+static void test_coalesce()
+{
+	char buf[1024] = { 0 };
+	struct pollfd pfd;
+	struct timespec ts;
+	long delay = coalesce_delay, wait;
+	transmit_t *tx;
+	int pfds[2];
+
+	CU_ASSERT_FATAL(!pipe(pfds));
+	CU_ASSERT_FATAL((tx = new_transfer(-1)) != NULL);
+	tx->input_fd = pfds[0];
+	coalesce_delay = 10000000;
+	CU_ASSERT_FATAL(!coalesce_start(tx));
+	/* A small write waits for more */
+	CU_ASSERT(write(pfds[1], buf, 10) == 10);
+	CU_ASSERT(!input_ready(tx) && tx->coalesce_since);
+	CU_ASSERT_FATAL(poll_timeout(tx, &ts) == &ts);
+	CU_ASSERT(ts.tv_sec <= 10 && ts.tv_sec >= 9);
+	/* The input is still polled, but only wakes us up once it grows */
+	CU_ASSERT(input_pollfds(tx, &pfd) == 1 && pfd.fd != tx->input_fd);
+	CU_ASSERT(!poll(&pfd, 1, 0));
+	CU_ASSERT(write(pfds[1], buf, 10) == 10);
+	CU_ASSERT(poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN));
+	CU_ASSERT(!input_ready(tx) && !poll(&pfd, 1, 0));
+	/* Until a payload is readable */
+	CU_ASSERT(write(pfds[1], buf, MAX_PAYLOAD_SIZE) == MAX_PAYLOAD_SIZE);
+	CU_ASSERT(poll(&pfd, 1, 0) == 1);
+	CU_ASSERT(input_ready(tx) && !tx->coalesce_since);
+	CU_ASSERT(input_pollfds(tx, &pfd) == 1 && pfd.fd == tx->input_fd);
+	CU_ASSERT(read(pfds[0], buf, sizeof(buf)) == MAX_PAYLOAD_SIZE + 20);
+	/* Or we waited long enough */
+	coalesce_delay = 1000;
+	CU_ASSERT(write(pfds[1], buf, 10) == 10);
+	CU_ASSERT(!input_ready(tx));
+	CU_ASSERT_FATAL(poll_timeout(tx, &ts) == &ts);
+	CU_ASSERT(!ts.tv_sec && ts.tv_nsec <= 1000000);
+	usleep(2000);
+	CU_ASSERT_FATAL(poll_timeout(tx, &ts) == &ts);
+	CU_ASSERT(!ts.tv_sec && !ts.tv_nsec);
+	CU_ASSERT(input_ready(tx) && !tx->coalesce_since);
+	/* Otherwise the timer is the retransmission one, if running */
+	CU_ASSERT(!poll_timeout(tx, &ts));
+	timer_restart(tx);
+	CU_ASSERT_FATAL(poll_timeout(tx, &ts) == &ts);
+	wait = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	CU_ASSERT(wait <= path_rto(&tx->path) && wait > path_rto(&tx->path) - 10);
+	coalesce_stop(tx);
+	coalesce_delay = delay;
+	tx->input_fd = -1;
+	transmit_free(tx);
+	close(pfds[0]);
+	close(pfds[1]);
+}
+
+static long elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* Play a receiver on the connected socket fd, only acknowledging the
+ * answer-th close #seq of the sender (none if 0), until it stays silent for
+ * wait ms.
+ * @return: the pid of the receiver, exiting with the count of closes */
+static pid_t close_peer(int fd, uint8_t seq, int answer, int wait)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	pkt_t pkt, ack = { .type = PTYPE_ACK, .window = 1, .length = 0 };
+	int closes = 0;
+	pid_t pid;
+
+	if ((pid = fork()))
+		return pid;
+	while (poll(&pfd, 1, wait) == 1) {
+		if (net_recv_pkt(fd, &pkt, seq, 0, NULL) != NET_OK ||
+				pkt.type != PTYPE_DATA || pkt.length)
+			_exit(255);
+		if (++closes != answer)
+			continue;
+		ack.seq = pkt.seq + 1;
+		ack.ts = pkt.ts;
+		pkt_encode_inline(&ack);
+		net_send(fd, &ack);
+	}
+	_exit(closes);
+}
+
+/* Close tx as transmit() would, stepping it until it is over
+ * @return: how long the close took, in ms */
+static long close_transfer(transmit_t *tx)
+{
+	struct pollfd pfd = { .fd = tx->sock, .events = POLLIN };
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	tx->state = TRANSMIT_CLOSING;
+	tx->close_retry = 0;
+	close_send(tx);
+	while (transmit_result(tx) == TRTP_RUNNING) {
+		CU_ASSERT_FATAL(poll(&pfd, 1, transmit_deadline(tx)) != -1);
+		if (pfd.revents)
+			transmit_socket(tx);
+		transmit_timeout(tx);
+	}
+	CU_ASSERT(transmit_result(tx) == 0);
+	return elapsed_ms(&start);
+}
+
+/* Close tx, towards a receiver on fd answering as close_peer()
+ * @return: the count of closes the receiver got, the close taking elapsed ms
+ */
+static int close_with(transmit_t *tx, int fd, int answer, long *elapsed)
+{
+	int status;
+	pid_t pid;
+
+	CU_ASSERT_FATAL((pid = close_peer(fd, tx->last_chunk_read + 1, answer,
+					2 * path_rto(&tx->path))) > 0);
+	*elapsed = close_transfer(tx);
+	CU_ASSERT_FATAL(waitpid(pid, &status, 0) == pid && WIFEXITED(status));
+	return WEXITSTATUS(status);
+}
+
+static void test_close()
+{
+	struct sockaddr_in6 sa = {
+		.sin6_family = AF_INET6,
+		.sin6_addr = IN6ADDR_LOOPBACK_INIT,
+	};
+	socklen_t len = sizeof(sa);
+	char file[] = "/tmp/test_close.XXXXXX", cache[128];
+	transmit_t *tx;
+	int peer, sock, rto;
+	long elapsed;
+
+	CU_ASSERT_FATAL((peer = socket(AF_INET6, SOCK_DGRAM, 0)) != -1);
+	CU_ASSERT_FATAL((sock = socket(AF_INET6, SOCK_DGRAM, 0)) != -1);
+	CU_ASSERT_FATAL(!bind(peer, (struct sockaddr*)&sa, len));
+	CU_ASSERT_FATAL(!getsockname(peer, (struct sockaddr*)&sa, &len));
+	CU_ASSERT_FATAL(!connect(sock, (struct sockaddr*)&sa, len));
+	CU_ASSERT_FATAL(!getsockname(sock, (struct sockaddr*)&sa, &len));
+	CU_ASSERT_FATAL(!connect(peer, (struct sockaddr*)&sa, len));
+	CU_ASSERT_FATAL((tx = new_transfer(sock)) != NULL);
+	/* Retry as early as possible */
+	CU_ASSERT_FATAL((rto = mkstemp(file)) != -1);
+	close(rto);
+	sprintf(cache, "::1 1000 100 0 20 %ld\n", (long)time(NULL));
+	load_path(&tx->path, file, sock, cache);
+	unlink(file);
+	rto = path_rto(&tx->path);
+	CU_ASSERT(rto < 1000);
+	/* The close following the last chunk is acknowledged right away */
+	tx->last_chunk_read = 41;
+	CU_ASSERT(close_with(tx, peer, 1, &elapsed) == 1);
+	CU_ASSERT(elapsed < rto);
+	/* Or once sent again, the first one getting lost */
+	CU_ASSERT(close_with(tx, peer, 2, &elapsed) == 2);
+	CU_ASSERT(elapsed >= rto && elapsed < 2 * rto);
+	/* A silent receiver is given up on after a few tries */
+	CU_ASSERT(close_with(tx, peer, 0, &elapsed) == 3);
+	CU_ASSERT(elapsed >= 3 * rto);
+	/* And one that is already gone right away */
+	close(peer);
+	CU_ASSERT(close_transfer(tx) < rto);
+	transmit_free(tx);
+}
+
+static void test_send_external()
+{
+	static const size_t lengths[] = { 0, 1, 300, MAX_PAYLOAD_SIZE };
+	char payload[MAX_PAYLOAD_SIZE], inline_wire[PKT_MAX_LEN + 1];
+	char external_wire[PKT_MAX_LEN + 1];
+	pkt_t inline_pkt, external_pkt;
+	ssize_t inline_len, external_len;
+	unsigned int i;
+	int fds[2];
+
+	CU_ASSERT_FATAL(!socketpair(AF_UNIX, SOCK_DGRAM, 0, fds));
+	for (i = 0; i < sizeof(payload); ++i)
+		payload[i] = i * 7 + 3;
+	for (i = 0; i < sizeof(lengths) / sizeof(*lengths); ++i) {
+		memset(&inline_pkt, 0, sizeof(inline_pkt));
+		inline_pkt.type = PTYPE_DATA;
+		inline_pkt.window = 12;
+		inline_pkt.seq = 200 + i;
+		inline_pkt.ts = 0xdeadbeef;
+		inline_pkt.length = lengths[i];
+		memcpy(inline_pkt.payload, payload, lengths[i]);
+		/* Whatever lies in the packet must not leak on the wire */
+		memcpy(&external_pkt, &inline_pkt, sizeof(inline_pkt));
+		memset(external_pkt.payload, 0xaa, sizeof(external_pkt.payload));
+		CU_ASSERT(pkt_encode_inline(&inline_pkt) == PKT_OK);
+		CU_ASSERT(pkt_encode_external(&external_pkt, payload) == PKT_OK);
+		/* The gathered packet is the one encoded inline, byte for byte */
+		CU_ASSERT(net_send(fds[0], &inline_pkt) == NET_OK);
+		inline_len = recv(fds[1], inline_wire, sizeof(inline_wire), 0);
+		CU_ASSERT(net_send_external(fds[0], &external_pkt, payload) ==
+				NET_OK);
+		external_len = recv(fds[1], external_wire, sizeof(external_wire), 0);
+		CU_ASSERT(inline_len == (ssize_t)(lengths[i] ? PKT_HEADERLEN +
+					lengths[i] + PKT_FOOTERLEN : PKT_HEADERLEN));
+		CU_ASSERT(external_len == inline_len);
+		CU_ASSERT(!memcmp(inline_wire, external_wire, inline_len));
+	}
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static void test_pull_credit()
+{
+	transmit_t *tx;
+
+	CU_ASSERT_FATAL((tx = new_transfer(-1)) != NULL);
+	CU_ASSERT_FATAL(pktbuf_enqueue(tx->send_buf) != NULL);
+	tx->ext_features = EXT_PULL;
+	tx->last_win = MAX_WINDOW_SIZE;
+	/* Nothing in flight */
+	tx->last_ack = 7;
+	tx->last_sent = 6;
+	/* Only what was pulled is sent, whatever the window */
+	tx->pull_limit = EXT_PULL_INITIAL;
+	tx->pull_sent = EXT_PULL_INITIAL - 1;
+	CU_ASSERT(can_send(tx));
+	++tx->pull_sent;
+	CU_ASSERT(!can_send(tx));
+	/* The 24 bits of credit carried in the ACK's wrap around */
+	tx->pull_sent = 0xfffffe;
+	tx->pull_limit = 0xffffff;
+	CU_ASSERT(can_send(tx));
+	tx->pull_limit = 3;
+	CU_ASSERT(can_send(tx));
+	tx->pull_sent = 0x1000002;
+	CU_ASSERT(can_send(tx));
+	++tx->pull_sent;
+	CU_ASSERT(!can_send(tx));
+	/* The credits of a stalled receiver are never mistaken for plenty */
+	tx->pull_sent = 0x1800002;
+	CU_ASSERT(!can_send(tx));
+	/* Nor the receive window ignored */
+	tx->pull_sent = 0;
+	tx->pull_limit = 100;
+	tx->last_win = 1;
+	CU_ASSERT(can_send(tx));
+	++tx->last_sent;
+	CU_ASSERT(!can_send(tx));
+	transmit_free(tx);
+}
+
+static void test_stream_distance()
+{
+	transmit_t *tx;
+
+	CU_ASSERT_FATAL((tx = new_transfer(-1)) != NULL);
+	/* Only multiplexed streams tell where their previous packet is */
+	CU_ASSERT(!stream_distance(tx, 3, 0));
+	tx->ext_enabled = 1;
+	tx->ext_features = EXT_MUX;
+	CU_ASSERT(!stream_distance(tx, 1, 0));
+	CU_ASSERT(!stream_distance(tx, 2, 5));
+	CU_ASSERT(stream_distance(tx, 3, 0) == 2);
+	CU_ASSERT(stream_distance(tx, 4, 5) == 2);
+	CU_ASSERT(stream_distance(tx, 5, 5) == 1);
+	CU_ASSERT(stream_distance(tx, 3 + MAX_WINDOW_SIZE, 0) == MAX_WINDOW_SIZE);
+	/* Beyond the window of the receiver, it does not matter */
+	CU_ASSERT(!stream_distance(tx, 6 + MAX_WINDOW_SIZE, 5));
+	/* Across the wraparound of the sequence numbers */
+	CU_ASSERT(!stream_distance(tx, 254, 5));
+	CU_ASSERT(stream_distance(tx, 2, 5) == 4);
+	transmit_free(tx);
+}
+
+#define FANOUT_CHUNKS 40
+/* Chunks the receivers hold before acknowledging them, and the depth of the
+ * ring */
+#define FANOUT_HELD 4
+
+/* Write the payload of a chunk to out, inflating it with zs if need be
+ * @return: 0 on success */
+static int fanout_write(int out, z_stream *zs, uint8_t kind,
+		const char *payload, size_t len)
+{
+	char buf[4096];
+	size_t n;
+
+	if (kind == EXT_KIND_RAW)
+		return write(out, payload, len) != (ssize_t)len;
+	zs->next_in = (Bytef*)payload;
+	zs->avail_in = len;
+	do {
+		zs->next_out = (Bytef*)buf;
+		zs->avail_out = sizeof(buf);
+		if (inflate(zs, Z_SYNC_FLUSH) == Z_DATA_ERROR)
+			return -1;
+		n = sizeof(buf) - zs->avail_out;
+		if (write(out, buf, n) != (ssize_t)n)
+			return -1;
+	} while (!zs->avail_out);
+	return 0;
+}
+
+/* Answer the offer with the extensions in port, then queue the chunks of the
+ * ring FANOUT_HELD at a time, checking that they stay put until acknowledged,
+ * and write them to the file named host
+ * @return: 0 if they did */
+static int fanout_peer(const char *host, const char *port, int wake)
+{
+	struct pollfd pfd = { .fd = wake, .events = POLLIN };
+	static char copy[FANOUT_HELD][MAX_PAYLOAD_SIZE];
+	uint16_t features = atoi(port);
+	const char *held[FANOUT_HELD];
+	size_t lens[FANOUT_HELD];
+	uint8_t kinds[FANOUT_HELD];
+	unsigned int n, i, chunks = 0;
+	uint32_t crc2;
+	int out, eof = 0;
+	z_stream zs;
+	pkt_t pkt;
+
+	memset(&zs, 0, sizeof(zs));
+	if ((out = open(host, O_WRONLY | O_TRUNC)) == -1 ||
+			inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+		return -1;
+	fanout_answered(features);
+	while (!eof) {
+		for (n = 0; n < FANOUT_HELD && !eof; ++n, ++chunks) {
+			while (!fanout_pending())
+				if (poll(&pfd, 1, 1000) != 1)
+					return -1;
+				else
+					fanout_ready();
+			held[n] = fanout_next(&pkt, &lens[n], &kinds[n]);
+			memcpy(&crc2, pkt.payload + lens[n], sizeof(crc2));
+			/* The CRC2 describes the payload in the ring */
+			if (lens[n] && ntohl(crc2) !=
+					crc32(0, (const Bytef*)held[n], lens[n]))
+				return -1;
+			eof = !lens[n];
+			/* Only the chunks after the first are compressed, and not
+			 * sparse as some receiver did not accept it */
+			if (kinds[n] != (chunks && !eof && (features & EXT_DEFLATE) ?
+						EXT_KIND_DEFLATE : EXT_KIND_RAW))
+				return -1;
+			memcpy(copy[n], held[n], lens[n]);
+		}
+		/* Leave the reader time to encode over them */
+		usleep(10000);
+		for (i = 0; i < n; ++i)
+			if (memcmp(held[i], copy[i], lens[i]) ||
+					fanout_write(out, &zs, kinds[i], held[i], lens[i]))
+				return -1;
+		fanout_acked(n);
+	}
+	inflateEnd(&zs);
+	close(out);
+	return 0;
+}
+
+/* Send buf to three receivers answering the offer of the reader with the
+ * extensions in answers, and check what each of them got */
+static void fanout_run(const char *buf, size_t len,
+		const trtp_options_t *opts, const uint16_t *answers)
+{
+	char in[] = "/tmp/test_fanout.XXXXXX";
+	char outs[3][32], spec[48], port[8];
+	static char got[FANOUT_CHUNKS * MAX_PAYLOAD_SIZE + 1];
+	size_t i;
+	int fd, out;
+
+	CU_ASSERT_FATAL((fd = temp_input(in, buf, len)) != -1);
+	for (i = 0; i < 3; ++i) {
+		strcpy(outs[i], "/tmp/test_fanout_out.XXXXXX");
+		CU_ASSERT_FATAL((out = mkstemp(outs[i])) != -1);
+		close(out);
+		sprintf(spec, "%s:%u", outs[i], answers[i]);
+		if (i)
+			CU_ASSERT_FATAL(!fanout_add(spec));
+	}
+	sprintf(port, "%u", answers[0]);
+	fanout_depth = FANOUT_HELD;
+	fflush(NULL);
+	CU_ASSERT(!fanout_serve(outs[0], port, fd, opts, &fanout_peer));
+	fanout_depth = FANOUT_DEPTH_DEFAULT;
+	for (i = 0; i < 3; ++i) {
+		CU_ASSERT_FATAL((out = open(outs[i], O_RDONLY)) != -1);
+		CU_ASSERT(read(out, got, sizeof(got)) == (ssize_t)len &&
+				!memcmp(got, buf, len));
+		close(out);
+		unlink(outs[i]);
+	}
+	close(fd);
+	unlink(in);
+}
+
+static void test_fanout()
+{
+	static char buf[FANOUT_CHUNKS * MAX_PAYLOAD_SIZE - 100];
+	trtp_options_t opts = TRTP_OPTIONS_INIT;
+	uint16_t answers[3] = { 0, 0, 0 };
+	size_t i;
+
+	/* Every chunk is encoded once, and sent from the ring by each of the
+	 * receivers */
+	for (i = 0; i < sizeof(buf); ++i)
+		buf[i] = rand();
+	fanout_run(buf, sizeof(buf), &opts, answers);
+	/* Text around zeroes, which all the receivers get compressed, but none
+	 * sparse, as one of them did not accept it */
+	for (i = 0; i < sizeof(buf); ++i)
+		buf[i] = i / 4096 == 2 ? 0 : "abcdefgh"[i / 100 % 8];
+	opts.compress = 6;
+	opts.sparse = 1;
+	answers[0] = answers[2] = EXT_DEFLATE | EXT_SPARSE;
+	answers[1] = EXT_DEFLATE;
+	fanout_run(buf, sizeof(buf), &opts, answers);
+}
+
+CU_TestInfo test_sender[] = {
+	{"test_compress", test_compress},
+	{"test_delta", test_delta},
+	{"test_path_cache", test_path_cache},
+	{"test_payload_size", test_payload_size},
+	{"test_range", test_range},
+	{"test_sparse", test_sparse},
+	{"test_ce", test_ce},
+	{"test_coalesce", test_coalesce},
+	{"test_close", test_close},
+	{"test_send_external", test_send_external},
+	{"test_pull_credit", test_pull_credit},
+	{"test_stream_distance", test_stream_distance},
+	{"test_fanout", test_fanout},
+	CU_TEST_INFO_NULL,
+};
+CU_pTestInfo test_sender_list() { return test_sender; }
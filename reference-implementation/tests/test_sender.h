@@ -0,0 +1,11 @@
+#ifndef __TEST_SENDER_H__
+#define __TEST_SENDER_H__
+
+#include <CUnit/CUnit.h>
+
+
+int test_sender_init();
+int test_sender_cleanup();
+CU_pTestInfo test_sender_list();
+
+#endif